@@ -7,23 +7,124 @@
 #include "SocketUtils.h"
 #include "Platform.h"
 #include "PlatformFlash.h"
+#include "SeqLockUtils.h"
+#include "MICOSerialScheduler.h"
 
 #include <stdio.h>
 
 #define ha_log(M, ...) custom_log("HA Command", M, ##__VA_ARGS__)
 #define ha_log_trace() custom_log_trace("HA Command")
 
+/* A status report is sent once network state has been quiet for this long,
+   but never later than HA_STATUS_REPORT_MAX_HOLDOFF after the first change */
+#define HA_STATUS_REPORT_DEBOUNCE       100
+#define HA_STATUS_REPORT_MAX_HOLDOFF    500
+
+/* Signal strength has no change notification, so the cached status is
+   re-read from the Wi-Fi driver at least this often */
+#define HA_STATUS_MAX_STALENESS         3000
+
+#define HA_OTA_RECV_CHUNK_LEN           1024
+
+/* Command handler flags */
+#define HA_CMD_INLINE                   0
+#define HA_CMD_DEFERRED                 (1<<0)  /* Run on the default worker, reply on completion */
+
+typedef struct _ha_cmd_request {
+  mxchip_cmd_head_t *frame;         /* Header, data and checksum */
+  int               frameLen;
+  int               socketFd;       /* Source socket, -1 if the frame came from UART */
+  uint16_t          replyPort;      /* Loopback port of the source socket thread */
+  mico_Context_t    *context;
+} ha_cmd_request_t;
+
+/* Execute a command, the return value is handed to the reply builder */
+typedef OSStatus (*ha_cmd_handler_t)(ha_cmd_request_t *inRequest);
+
+/* Build the reply frame in outReply, return its length or 0 if nothing should be sent */
+typedef int (*ha_reply_builder_t)(ha_cmd_request_t *inRequest, OSStatus inResult, uint8_t *outReply, int inReplyLen);
+
+typedef struct _ha_cmd_entry {
+  uint16_t            cmd;
+  uint8_t             flags;
+  uint16_t            maxDataLen;
+  ha_cmd_handler_t    handler;
+  ha_reply_builder_t  replyBuilder;
+} ha_cmd_entry_t;
+
+typedef struct _ha_cmd_job {
+  const ha_cmd_entry_t  *entry;
+  ha_cmd_request_t      request;
+  uint8_t               frame[1];
+} ha_cmd_job_t;
+
 //static u32 running_state = 0;
 static u32 network_state = 0;
 static mico_mutex_t _mutex;
+static mico_Context_t *_status_context = NULL;
+
+/* Cached reply of CMD_GET_STATUS, published through _status_lock and
+   rebuilt only when one of its sources changes */
+static mxchip_state_t   _status_snapshot;
+static seqlock_t        _status_lock;
 
 static int _recved_uart_loopback_fd = -1;
+static int _reply_loopback_fd = -1;
 
 static uint16_t _calc_sum(void *data, uint32_t len);
-static OSStatus _ota_process(uint8_t *inBuf, int inBufLen, int *inSocketFd, mico_Context_t * const inContext);
-static mico_thread_t    _report_status_thread_handler = NULL;
-static mico_semaphore_t _report_status_sem = NULL;
-static void _report_status_thread(void *inContext);
+
+/* Write a frame to the MCU through the serial scheduler */
+static OSStatus _uart_send(int inClient, mico_serial_class_t inClass, uint8_t *inBuf, int inLen)
+{
+  OSStatus err;
+
+  err = MICOSerialSchedulerSend(inClient, inClass, inBuf, inLen);
+  if(err == kNotInitializedErr)
+    err = PlatformUartSend(inBuf, inLen);
+  return err;
+}
+
+/* Status report debouncing, protected by _mutex */
+static mico_timed_event_t _report_status_event;
+static bool             _report_pending = false;
+static uint32_t         _report_first_change;
+static uint32_t         _report_last_change;
+static u32              _reported_state = 0xFFFFFFFF;
+static OSStatus _report_status_event_handler(void *inContext);
+
+static mico_timed_event_t _refresh_signal_event;
+static OSStatus _refresh_signal_event_handler(void *inContext);
+
+static OSStatus _cmd_worker_event_handler(void *arg);
+
+static OSStatus _ota_receive(ha_cmd_request_t *inRequest);
+static OSStatus _ota_commit(ha_cmd_request_t *inRequest);
+static OSStatus _net2com(ha_cmd_request_t *inRequest);
+static OSStatus _com2net(ha_cmd_request_t *inRequest);
+static OSStatus _get_status_cmd(ha_cmd_request_t *inRequest);
+static OSStatus _control(ha_cmd_request_t *inRequest);
+
+static int _build_ack_reply(ha_cmd_request_t *inRequest, OSStatus inResult, uint8_t *outReply, int inReplyLen);
+static int _build_status_reply(ha_cmd_request_t *inRequest, OSStatus inResult, uint8_t *outReply, int inReplyLen);
+static int _build_control_reply(ha_cmd_request_t *inRequest, OSStatus inResult, uint8_t *outReply, int inReplyLen);
+
+/* Commands received from TCP connections */
+static const ha_cmd_entry_t _wlanCommandTable[] = {
+  { CMD_OTA,        HA_CMD_INLINE,   wlanBufferLen - 10,     _ota_receive,     NULL },
+  { CMD_NET2COM,    HA_CMD_INLINE,   wlanBufferLen - 10,     _net2com,         NULL },
+};
+
+/* Commands received from UART */
+static const ha_cmd_entry_t _uartCommandTable[] = {
+  { CMD_COM2NET,    HA_CMD_INLINE,   UartRecvBufferLen - 10, _com2net,         NULL },
+  { CMD_GET_STATUS, HA_CMD_INLINE,   0,                      _get_status_cmd,  _build_status_reply },
+  { CMD_CONTROL,    HA_CMD_DEFERRED, 1,                      _control,         _build_control_reply },
+};
+
+/* The image is streamed to flash on the socket thread, verification and
+   boot table update are deferred */
+static const ha_cmd_entry_t _otaCommitEntry =
+  { CMD_OTA,        HA_CMD_DEFERRED, sizeof(ota_upgrate_t) - 1, _ota_commit, _build_ack_reply };
 
 void haNotify_WifiStatusHandler(int event, mico_Context_t * const inContext)
 {
@@ -52,36 +153,72 @@ int is_network_state(int state)
 }
 
 
-/* Get system status */
-static void _get_status(mxchip_state_t *cmd, mico_Context_t * const inContext)
+/* Rebuild the status snapshot and publish it if anything changed, inNetPara
+   and the signal strength are optional sources. Caller holds _mutex. */
+static bool _refresh_status(mico_Context_t * const inContext, net_para_st *inNetPara, bool inReadSignal)
 {
   ha_log_trace();
 
-  u16 cksum;
+  mxchip_state_t cmd;
   sta_ap_state_t ap_state;
+  current_mico_status_t micoStatus;
 
-  cmd->flag = 0x00BB;
-  cmd->cmd = 0x8008;
-  cmd->cmd_status = 0;
-  cmd->datalen = sizeof(mxchip_state_t) - 10;
+  MICOGetStatus(inContext, &micoStatus);
+  memcpy(&cmd, &_status_snapshot, sizeof(mxchip_state_t));
+  cmd.flag = 0x00BB;
+  cmd.cmd = 0x8008;
+  cmd.cmd_status = 0;
+  cmd.datalen = sizeof(mxchip_state_t) - 10;
 
-  cmd->status.uap_state = is_network_state(UAP_START);
-  cmd->status.sta_state = is_network_state(STA_CONNECT);
+  cmd.status.uap_state = is_network_state(UAP_START);
+  cmd.status.sta_state = is_network_state(STA_CONNECT);
   if (is_network_state(STA_CONNECT) == 1)
-    cmd->status.tcp_client = is_network_state(REMOTE_CONNECT) + 1;
+    cmd.status.tcp_client = is_network_state(REMOTE_CONNECT) + 1;
   else
-    cmd->status.tcp_client = 0;
+    cmd.status.tcp_client = 0;
 
-  CheckNetLink(&ap_state);
-  cmd->status.signal = ap_state.wifi_strength;
-  strncpy(cmd->status.ip, inContext->micoStatus.localIp, maxIpLen);
-  strncpy(cmd->status.mask, inContext->micoStatus.netMask, maxIpLen);
-  strncpy(cmd->status.gw, inContext->micoStatus.gateWay, maxIpLen);
-  strncpy(cmd->status.dns, inContext->micoStatus.dnsServer, maxIpLen);
-  strncpy(cmd->status.mac, inContext->micoStatus.mac, 18);
+  if (inReadSignal == true){
+    CheckNetLink(&ap_state);
+    cmd.status.signal = ap_state.wifi_strength;
+  }
 
-  cksum = _calc_sum(cmd, sizeof(mxchip_state_t) - 2);
-  cmd->cksum = cksum;
+  if (inNetPara != NULL){
+    strncpy(cmd.status.ip, inNetPara->ip, maxIpLen);
+    strncpy(cmd.status.mask, inNetPara->mask, maxIpLen);
+    strncpy(cmd.status.gw, inNetPara->gate, maxIpLen);
+    strncpy(cmd.status.dns, inNetPara->dns, maxIpLen);
+  }else{
+    strncpy(cmd.status.ip, micoStatus.localIp, maxIpLen);
+    strncpy(cmd.status.mask, micoStatus.netMask, maxIpLen);
+    strncpy(cmd.status.gw, micoStatus.gateWay, maxIpLen);
+    strncpy(cmd.status.dns, micoStatus.dnsServer, maxIpLen);
+  }
+  strncpy(cmd.status.mac, micoStatus.mac, 18);
+
+  if (_status_snapshot.flag == 0x00BB && memcmp(&cmd.status, &_status_snapshot.status, sizeof(current_state_t)) == 0)
+    return false;
+
+  cmd.cksum = _calc_sum(&cmd, sizeof(mxchip_state_t) - 2);
+
+  seqlock_write_begin(&_status_lock);
+  memcpy(&_status_snapshot, &cmd, sizeof(mxchip_state_t));
+  seqlock_write_end(&_status_lock);
+  return true;
+}
+
+/* Get system status */
+static void _get_status(mxchip_state_t *cmd, mico_Context_t * const inContext)
+{
+  (void)inContext;
+  seqlock_read_copy(&_status_lock, cmd, &_status_snapshot, sizeof(mxchip_state_t));
+}
+
+void haNotify_DHCPCompleteHandler(net_para_st *pnet, mico_Context_t * const inContext)
+{
+  ha_log_trace();
+  mico_rtos_lock_mutex(&_mutex);
+  _refresh_status(inContext, pnet, false);
+  mico_rtos_unlock_mutex(&_mutex);
 }
 
 
@@ -95,92 +232,288 @@ void set_network_state(int state, int on)
   else {
     network_state &= ~state;
     if (state == STA_CONNECT)
-      network_state &= ~REMOTE_CONNECT;
+      network_state &= ~(REMOTE_CONNECT | REMOTE_FAILOVER);
   }
-  
+
+  if (_status_context != NULL)
+    _refresh_status(_status_context, NULL, false);
+
   if ((state == STA_CONNECT) || (state == REMOTE_CONNECT)){
-    mico_rtos_set_semaphore(&_report_status_sem);
-  }  
+    _report_last_change = mico_get_time();
+    if (_report_pending == false && _status_context != NULL){
+      _report_pending = true;
+      _report_first_change = _report_last_change;
+      mico_rtos_send_delayed_event(&_report_status_event, MICO_DEFAULT_WORKER_THREAD, _report_status_event_handler, HA_STATUS_REPORT_DEBOUNCE, _status_context);
+    }
+  }
   mico_rtos_unlock_mutex(&_mutex);
 }
 
 
+/* On timeout the backlog is dropped as well: datagrams the loopback lost
+   are never counted as sent, and would otherwise hold every later packet */
+static bool _backlogged(uart_backlog_t *inBacklog, int inLen, bool inResync)
+{
+  if((int32_t)(inBacklog->queued - inBacklog->sent) + inLen <= UART_BACKLOG_LIMIT)
+    return false;
+  if(inResync)
+    inBacklog->queued = inBacklog->sent;
+  return true;
+}
+
+static bool _any_backlogged(int inLen, mico_Context_t * const inContext, bool inResync)
+{
+  current_app_status_t *status = &inContext->appStatus;
+  bool behind = false;
+  int i;
+
+  for(i = 0; i < MAX_Local_Client_Num; i++){
+    if(status->loopBack_PortList[i] != 0 && _backlogged(&status->loopBack_Backlog[i], inLen, inResync))
+      behind = true;
+  }
+  if((is_network_state(REMOTE_CONNECT) == 1 || is_network_state(REMOTE_FAILOVER) == 1) && _backlogged(&status->remoteBacklog, inLen, inResync))
+    behind = true;
+  return behind;
+}
+
+/* Hold the UART thread while a socket thread is behind. The RX ring fills
+   up meanwhile and, with flow control on, RTS stops the MCU. */
+static void _wait_for_room(int inLen, mico_Context_t * const inContext)
+{
+  uint32_t waited = 0;
+
+  while(UART_BACKLOG_MAX_WAIT == 0 || waited < UART_BACKLOG_MAX_WAIT){
+    if(_any_backlogged(inLen, inContext, false) == false)
+      return;
+    mico_thread_msleep(UART_BACKLOG_POLL);
+    waited += UART_BACKLOG_POLL;
+  }
+  _any_backlogged(inLen, inContext, true);
+}
+
 OSStatus haProtocolInit(mico_Context_t * const inContext)
 {
   ha_log_trace();
   OSStatus err = kUnknownErr;
   struct sockaddr_t addr;
+  mico_serial_scheduler_config_t schedulerConfig;
 
 
   mico_rtos_init_mutex(&_mutex);
-  mico_rtos_init_semaphore(&_report_status_sem, 1);
+  memset(&inContext->appStatus.remoteBacklog, 0x0, sizeof(uart_backlog_t));
+
+  schedulerConfig.uartRate = SERIAL_UART_RATE;
+  schedulerConfig.uartBurst = SERIAL_UART_BURST;
+  schedulerConfig.clientRate = SERIAL_CLIENT_RATE_DOWN;
+  schedulerConfig.clientBurst = SERIAL_CLIENT_BURST;
+  schedulerConfig.quantum = SERIAL_DRR_QUANTUM;
+  schedulerConfig.clientQueueLen = SERIAL_CLIENT_QUEUE_LEN;
+  err = MICOSerialSchedulerInit(&schedulerConfig);
+  if(err != kNoErr)
+    ha_log("Serial scheduler not started, err = %d", err);
+
+  seqlock_init(&_status_lock);
+  _status_context = inContext;
+  mico_rtos_lock_mutex(&_mutex);
+  _refresh_status(inContext, NULL, false);
+  mico_rtos_unlock_mutex(&_mutex);
 
   _recved_uart_loopback_fd = socket(AF_INET, SOCK_DGRM, IPPROTO_UDP);
   addr.s_ip = IPADDR_LOOPBACK;
   addr.s_port = RECVED_UART_DATA_LOOPBACK_PORT;
   bind(_recved_uart_loopback_fd, &addr, sizeof(addr));
-  
-  err = mico_rtos_create_thread(&_report_status_thread_handler, MICO_APPLICATION_PRIORITY, "Report", _report_status_thread, 0x500, (void*)inContext );
-  require_noerr_action( err, exit, ha_log("ERROR: Unable to start the status report thread.") );
+
+  /* Replies of deferred commands are routed back through the loopback port of
+     the socket thread, so only that thread ever writes to its socket */
+  _reply_loopback_fd = socket(AF_INET, SOCK_DGRM, IPPROTO_UDP);
+  require_action(IsValidSocket( _reply_loopback_fd ), exit, err = kNoResourcesErr);
+
+  err = mico_rtos_register_timed_event(&_refresh_signal_event, MICO_DEFAULT_WORKER_THREAD, _refresh_signal_event_handler, HA_STATUS_MAX_STALENESS, (void*)inContext );
+  require_noerr_action( err, exit, ha_log("ERROR: Unable to start the signal refresh event.") );
 
   /* Regisist notifications */
-  err = MICOAddNotification( mico_notify_WIFI_STATUS_CHANGED, (void *)haNotify_WifiStatusHandler );
-  require_noerr( err, exit ); 
+  err = MICOAddNotificationWithPriority( mico_notify_WIFI_STATUS_CHANGED, (void *)haNotify_WifiStatusHandler, MICO_NOTIFY_DEFAULT_PRIORITY, MICO_NOTIFY_DEFERRED );
+  require_noerr( err, exit );
+  err = MICOAddNotificationWithPriority( mico_notify_DHCP_COMPLETED, (void *)haNotify_DHCPCompleteHandler, MICO_NOTIFY_DEFAULT_PRIORITY, MICO_NOTIFY_DEFERRED );
+  require_noerr( err, exit );
 exit:
   return err;
 }
 
-void _report_status_thread(void *inContext)
+/* Absorb the burst of changes that follows a link transition, then report
+   the state to the MCU if it differs from the last report */
+static OSStatus _report_status_event_handler(void *inContext)
 {
   mxchip_state_t cmd;
+  uint32_t now, quiet, held;
 
-  while(1){
-    mico_rtos_get_semaphore(&_report_status_sem, MICO_WAIT_FOREVER);
-    _get_status(&cmd, inContext);
-    PlatformUartSend((uint8_t *)&cmd, sizeof(mxchip_state_t));
+  mico_rtos_lock_mutex(&_mutex);
+  now = mico_get_time();
+  quiet = now - _report_last_change;
+  held = now - _report_first_change;
+  if(quiet < HA_STATUS_REPORT_DEBOUNCE && held < HA_STATUS_REPORT_MAX_HOLDOFF){
+    mico_rtos_send_delayed_event(&_report_status_event, MICO_DEFAULT_WORKER_THREAD, _report_status_event_handler,
+                                 Min(HA_STATUS_REPORT_DEBOUNCE - quiet, HA_STATUS_REPORT_MAX_HOLDOFF - held), inContext);
+    mico_rtos_unlock_mutex(&_mutex);
+    return kNoErr;
+  }
+  _report_pending = false;
+
+  if(network_state == _reported_state){
+    mico_rtos_unlock_mutex(&_mutex);
+    return kNoErr;
   }
+  _reported_state = network_state;
+  _refresh_status(inContext, NULL, is_network_state(STA_CONNECT) == 1);
+  mico_rtos_unlock_mutex(&_mutex);
+
+  _get_status(&cmd, inContext);
+  _uart_send(MICO_SERIAL_LOCAL_CLIENT, MICO_SERIAL_CONTROL, (uint8_t *)&cmd, sizeof(mxchip_state_t));
+  return kNoErr;
 }
 
-OSStatus haWlanCommandProcess(unsigned char *inBuf, int *inBufLen, int inSocketFd, mico_Context_t * const inContext)
+static OSStatus _refresh_signal_event_handler(void *inContext)
+{
+  if(is_network_state(STA_CONNECT) == 1){
+    mico_rtos_lock_mutex(&_mutex);
+    _refresh_status(inContext, NULL, true);
+    mico_rtos_unlock_mutex(&_mutex);
+  }
+  return kNoErr;
+}
+
+static const ha_cmd_entry_t *_find_command(const ha_cmd_entry_t *inTable, int inTableSize, uint16_t inCmd)
+{
+  int i;
+
+  for(i = 0; i < inTableSize; i++){
+    if(inTable[i].cmd == inCmd)
+      return &inTable[i];
+  }
+  return NULL;
+}
+
+static void _send_reply(ha_cmd_request_t *inRequest, uint8_t *inReply, int inReplyLen)
+{
+  struct sockaddr_t addr;
+
+  if(inReplyLen <= 0)
+    return;
+
+  /* Replies are control traffic, they go out ahead of queued bulk data */
+  if(inRequest->socketFd == -1){
+    _uart_send(MICO_SERIAL_LOCAL_CLIENT, MICO_SERIAL_CONTROL, inReply, inReplyLen);
+  }else if(mico_rtos_is_current_thread(&MICO_DEFAULT_WORKER_THREAD->thread) == false){
+    SocketSend(inRequest->socketFd, inReply, inReplyLen);
+  }else if(inRequest->replyPort != 0){
+    addr.s_ip = IPADDR_LOOPBACK;
+    addr.s_port = inRequest->replyPort;
+    sendto(_reply_loopback_fd, inReply, inReplyLen, 0, &addr, sizeof(addr));
+  }
+}
+
+static void _complete_command(const ha_cmd_entry_t *inEntry, ha_cmd_request_t *inRequest, OSStatus inResult)
+{
+  uint8_t reply[sizeof(mxchip_state_t)];
+  int replyLen;
+
+  if(inEntry->replyBuilder == NULL)
+    return;
+  replyLen = inEntry->replyBuilder(inRequest, inResult, reply, sizeof(reply));
+  _send_reply(inRequest, reply, replyLen);
+}
+
+/* Copy the frame and hand it to the default worker, the source buffer can be
+   reused as soon as this returns */
+static OSStatus _defer_command(const ha_cmd_entry_t *inEntry, ha_cmd_request_t *inRequest)
+{
+  OSStatus err = kNoErr;
+  ha_cmd_job_t *job = NULL;
+  int copyLen;
+
+  copyLen = inRequest->frameLen;
+  if(copyLen > inEntry->maxDataLen + 10)
+    copyLen = inEntry->maxDataLen + 10;
+
+  job = malloc(sizeof(ha_cmd_job_t) + copyLen);
+  require_action(job, exit, err = kNoMemoryErr);
+
+  job->entry = inEntry;
+  job->request = *inRequest;
+  memcpy(job->frame, inRequest->frame, copyLen);
+  job->request.frame = (mxchip_cmd_head_t *)job->frame;
+  job->request.frameLen = copyLen;
+
+  err = mico_rtos_send_asynchronous_event(MICO_DEFAULT_WORKER_THREAD, _cmd_worker_event_handler, job);
+  require_noerr(err, exit);
+
+exit:
+  if(err != kNoErr){
+    ha_log("Command %d not deferred, err = %d", inRequest->frame->cmd, err);
+    if(job) free(job);
+    _complete_command(inEntry, inRequest, err);
+  }
+  return err;
+}
+
+static OSStatus _dispatch_command(const ha_cmd_entry_t *inEntry, ha_cmd_request_t *inRequest)
+{
+  OSStatus err;
+
+  if(inRequest->frame->datalen > inEntry->maxDataLen){
+    _complete_command(inEntry, inRequest, kSizeErr);
+    return kSizeErr;
+  }
+
+  if(inEntry->flags & HA_CMD_DEFERRED)
+    return _defer_command(inEntry, inRequest);
+
+  err = inEntry->handler(inRequest);
+  _complete_command(inEntry, inRequest, err);
+  return err;
+}
+
+static OSStatus _cmd_worker_event_handler(void *arg)
+{
+  ha_cmd_job_t *job = arg;
+  OSStatus err;
+
+  err = job->entry->handler(&job->request);
+  _complete_command(job->entry, &job->request, err);
+  free(job);
+  return kNoErr;
+}
+
+OSStatus haWlanCommandProcess(unsigned char *inBuf, int *inBufLen, int inSocketFd, uint16_t inLoopBackPort, mico_Context_t * const inContext)
 {
   ha_log_trace();
   OSStatus err = kUnknownErr;
-  mxchip_cmd_head_t *p_reply;
-  uint16_t cmd;
-  uint16_t cmdLen;
+  const ha_cmd_entry_t *entry;
+  ha_cmd_request_t request;
+  int cmdLen;
   int idx;
 
   for(idx = 0; idx < *inBufLen; idx += cmdLen){
-    if((uint16_t)(*inBufLen - idx) < HA_CMD_HEAD_SIZE) goto needsMoreData;
+    if(*inBufLen - idx < HA_CMD_HEAD_SIZE) goto needsMoreData;
     require_action(inBuf[idx] == CONTROL_FLAG, exit, err = kFormatErr);
     require_action(inBuf[idx+1] == 0x0, exit, err = kFormatErr);
     cmdLen  = inBuf[idx+6] + (inBuf[idx+7]<<8) + HA_CMD_HEAD_SIZE + 2;
+    entry = _find_command(_wlanCommandTable, sizeof(_wlanCommandTable)/sizeof(ha_cmd_entry_t), inBuf[idx+2] + (inBuf[idx+3]<<8));
+    /* A frame that can never fit in the receive buffer would stall the connection */
+    require_action(cmdLen <= wlanBufferLen, exit, err = kSizeErr);
     if(cmdLen > *inBufLen - idx) goto needsMoreData;
     err = check_sum(inBuf+idx+HA_CMD_HEAD_SIZE, cmdLen);
     require_noerr(err, exit);
 
-    p_reply = (mxchip_cmd_head_t *)(inBuf+idx);
-    p_reply->cmd_status = CMD_OK;
-    cmd = p_reply->cmd;
-    p_reply->cmd |= 0x8000;
-    switch (cmd) {
-      case CMD_READ_VERSION:
-      case CMD_READ_CONFIG:
-      case CMD_WRITE_CONFIG:
-      case CMD_SCAN:
-        break;
-
-      case CMD_OTA:
-        err = _ota_process(inBuf+idx, cmdLen, &inSocketFd, inContext);
-        break;
-
-      case CMD_NET2COM:
-        err = PlatformUartSend(inBuf+idx, cmdLen);
-        break;
-
-      default:
-        break;
-    }
+    if(entry == NULL)
+      continue;
+
+    request.frame = (mxchip_cmd_head_t *)(inBuf+idx);
+    request.frameLen = cmdLen;
+    request.socketFd = inSocketFd;
+    request.replyPort = inLoopBackPort;
+    request.context = inContext;
+    _dispatch_command(entry, &request);
   }
 
 needsMoreData:
@@ -194,183 +527,259 @@ exit:
   return err;
 }
 
+OSStatus haUartCommandProcess(uint8_t *inBuf, int inLen, mico_Context_t * const inContext)
+{
+  ha_log_trace();
+  const ha_cmd_entry_t *entry;
+  ha_cmd_request_t request;
+
+  request.frame = (mxchip_cmd_head_t *)inBuf;
+  request.frameLen = inLen;
+  request.socketFd = -1;
+  request.replyPort = 0;
+  request.context = inContext;
+
+  entry = _find_command(_uartCommandTable, sizeof(_uartCommandTable)/sizeof(ha_cmd_entry_t), request.frame->cmd);
+  if(entry == NULL)
+    return kNoErr;
+
+  return _dispatch_command(entry, &request);
+}
+
+static int _build_ack_reply(ha_cmd_request_t *inRequest, OSStatus inResult, uint8_t *outReply, int inReplyLen)
+{
+  mxchip_cmd_head_t *ack = (mxchip_cmd_head_t *)outReply;
+  uint16_t cksum;
+
+  if(inReplyLen < HA_CMD_HEAD_SIZE + 2)
+    return 0;
+
+  ack->flag = inRequest->frame->flag;
+  ack->cmd = inRequest->frame->cmd | 0x8000;
+  ack->cmd_status = (inResult == kNoErr)? CMD_OK : CMD_FAIL;
+  ack->datalen = 0;
+  cksum = _calc_sum(outReply, HA_CMD_HEAD_SIZE);
+  outReply[HA_CMD_HEAD_SIZE] = cksum & 0x00ff;
+  outReply[HA_CMD_HEAD_SIZE+1] = (cksum & 0x0ff00) >> 8;
+  return HA_CMD_HEAD_SIZE + 2;
+}
+
+/* Existing MCU firmware expects status 1 in every control reply */
+static int _build_control_reply(ha_cmd_request_t *inRequest, OSStatus inResult, uint8_t *outReply, int inReplyLen)
+{
+  int len = _build_ack_reply(inRequest, inResult, outReply, inReplyLen);
+  mxchip_cmd_head_t *ack = (mxchip_cmd_head_t *)outReply;
+  uint16_t cksum;
+
+  if(len == 0)
+    return 0;
+  ack->cmd_status = 1;
+  cksum = _calc_sum(outReply, HA_CMD_HEAD_SIZE);
+  outReply[HA_CMD_HEAD_SIZE] = cksum & 0x00ff;
+  outReply[HA_CMD_HEAD_SIZE+1] = (cksum & 0x0ff00) >> 8;
+  return len;
+}
 
-OSStatus _ota_process(uint8_t *inBuf, int inBufLen, int *inSocketFd, mico_Context_t * const inContext)
+static int _build_status_reply(ha_cmd_request_t *inRequest, OSStatus inResult, uint8_t *outReply, int inReplyLen)
+{
+  (void)inResult;
+  if(inReplyLen < sizeof(mxchip_state_t))
+    return 0;
+  _get_status((mxchip_state_t *)outReply, inRequest->context);
+  return sizeof(mxchip_state_t);
+}
+
+OSStatus _get_status_cmd(ha_cmd_request_t *inRequest)
+{
+  (void)inRequest;
+  return kNoErr;
+}
+
+OSStatus _net2com(ha_cmd_request_t *inRequest)
+{
+  inRequest->frame->cmd |= 0x8000;
+  inRequest->frame->cmd_status = CMD_OK;
+  /* Queued per client, so one busy client cannot keep the others off the UART */
+  return _uart_send(inRequest->socketFd == -1 ? MICO_SERIAL_LOCAL_CLIENT : inRequest->socketFd, MICO_SERIAL_BULK,
+                    (uint8_t *)inRequest->frame, inRequest->frameLen);
+}
+
+OSStatus _com2net(ha_cmd_request_t *inRequest)
+{
+  mico_Context_t *inContext = inRequest->context;
+  struct sockaddr_t addr;
+  int i;
+
+  inRequest->frame->cmd |= 0x8000;
+  addr.s_ip = IPADDR_LOOPBACK;
+  _wait_for_room(inRequest->frameLen, inContext);
+
+  for(i=0; i < MAX_Local_Client_Num; i++) {
+    if( inContext->appStatus.loopBack_PortList[i] != 0 ){
+      addr.s_port = inContext->appStatus.loopBack_PortList[i];
+      inContext->appStatus.loopBack_Backlog[i].queued += inRequest->frameLen;
+      sendto(_recved_uart_loopback_fd, inRequest->frame, inRequest->frameLen, 0, &addr, sizeof(addr));
+    }
+  }
+
+  if(is_network_state(REMOTE_CONNECT)==1 || is_network_state(REMOTE_FAILOVER)==1){
+    addr.s_port = REMOTE_TCP_CLIENT_LOOPBACK_PORT;
+    inContext->appStatus.remoteBacklog.queued += inRequest->frameLen;
+    sendto(_recved_uart_loopback_fd, inRequest->frame, inRequest->frameLen, 0, &addr, sizeof(addr));
+  }else{
+    /* Kept until the remote server is reachable again */
+    remoteTcpClientStore((uint8_t *)inRequest->frame, inRequest->frameLen);
+  }
+  return kNoErr;
+}
+
+OSStatus _control(ha_cmd_request_t *inRequest)
+{
+  OSStatus err = kNoErr;
+  mico_Context_t *inContext = inRequest->context;
+
+  require_action(inRequest->frame->datalen == 1, exit, err = kParamErr);
+
+  switch(inRequest->frame->data[0]) {
+  case 1:
+    inContext->micoStatus.sys_state = eState_Software_Reset;
+    require_action(inContext->micoStatus.sys_state_change_sem, exit, err = kNotInitializedErr);
+    mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
+    break;
+  case 2:
+    err = MICORestoreDefault(inContext);
+    require_noerr(err, exit);
+    inContext->micoStatus.sys_state = eState_Software_Reset;
+    require_action(inContext->micoStatus.sys_state_change_sem, exit, err = kNotInitializedErr);
+    mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
+    break;
+  case 3:
+    inContext->micoStatus.sys_state = eState_Wlan_Powerdown;
+    require_action(inContext->micoStatus.sys_state_change_sem, exit, err = kNotInitializedErr);
+    mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
+    break;
+  case 5:
+    err = OpenEasylink2(120);
+    break;
+  default:
+    err = kUnsupportedErr;
+    break;
+  }
+
+exit:
+  return err;
+}
+
+/* Stream the image into the update area, this has to run on the thread that
+   owns the socket */
+OSStatus _ota_receive(ha_cmd_request_t *inRequest)
 {
   OSStatus err = kNoErr;
-  mxchip_cmd_head_t *p_control_cmd;
   ota_upgrate_t *p_upgrade;
-  uint8_t * p_bin;
+  uint8_t *p_bin = NULL;
   int bin_len, total_len, head_len;
   uint32_t flash_addr = UPDATE_START_ADDRESS;
-  uint8_t md5_ret[16];
-  mxchip_cmd_head_t cmd_ack;
   fd_set readfds;
   struct timeval_t t;
-  md5_context ctx;
 
-  memset(&cmd_ack, 0, sizeof(cmd_ack));
-  cmd_ack.cmd_status = CMD_FAIL;
-  p_control_cmd = (mxchip_cmd_head_t *)inBuf;
-  cmd_ack.flag = p_control_cmd->flag;
-  cmd_ack.cmd = p_control_cmd->cmd | 0x8000;
   head_len = sizeof(mxchip_cmd_head_t) + sizeof(ota_upgrate_t) - 2;
-  if (inBufLen < head_len){
-    goto CMD_REPLY;
-  }
+  require_action(inRequest->frameLen >= head_len, reply, err = kSizeErr);
+
   PlatformFlashInitialize();
-  p_upgrade = (ota_upgrate_t*)(p_control_cmd->data);
+  p_upgrade = (ota_upgrate_t*)(inRequest->frame->data);
 
-  p_bin = p_upgrade->data;
   total_len = p_upgrade->len;
-  bin_len = inBufLen - head_len;
+  require_action(p_upgrade->len <= MICO_OTA_MAX_LEN, reply, err = kSizeErr);
+  bin_len = inRequest->frameLen - head_len;
   total_len -= bin_len;
 
   if (bin_len>0)
-    PlatformFlashWrite(&flash_addr, (uint32_t *)p_bin, bin_len);
+    PlatformFlashWrite(&flash_addr, (uint32_t *)p_upgrade->data, bin_len);
+
+  p_bin = malloc(HA_OTA_RECV_CHUNK_LEN);
+  require_action(p_bin, reply, err = kNoMemoryErr);
 
   while (total_len>0) {
     FD_ZERO(&readfds);
     t.tv_sec = 10;
     t.tv_usec = 0;
-    FD_SET(*inSocketFd, &readfds);
+    FD_SET(inRequest->socketFd, &readfds);
     select(1, &readfds, NULL, NULL, &t);
 
-    if (FD_ISSET(*inSocketFd, &readfds)) {
-      bin_len = recv(*inSocketFd, (char*)p_bin, 1024, 0);
-      require_action(bin_len >= 0, exit, err = kConnectionErr);
+    if (FD_ISSET(inRequest->socketFd, &readfds)) {
+      bin_len = recv(inRequest->socketFd, (char*)p_bin, (total_len < HA_OTA_RECV_CHUNK_LEN)? total_len : HA_OTA_RECV_CHUNK_LEN, 0);
+      require_action(bin_len > 0, exit, err = kConnectionErr);
       PlatformFlashWrite(&flash_addr, (uint32_t *)p_bin, bin_len);
       total_len-=bin_len;
     }
   }
+  free(p_bin);
+
+  /* Checksum over the whole image and the flash table update take long enough
+     to stall this connection, the worker replies once they are done */
+  return _defer_command(&_otaCommitEntry, inRequest);
+
+reply:
+  if(p_bin) free(p_bin);
+  _complete_command(&_otaCommitEntry, inRequest, err);
+  return err;
 
+exit:
+  if(p_bin) free(p_bin);
+  SocketClose(&inRequest->socketFd);
+  inRequest->context->micoStatus.sys_state = eState_Software_Reset;
+  mico_rtos_set_semaphore(&inRequest->context->micoStatus.sys_state_change_sem);
+  return err;
+}
+
+OSStatus _ota_commit(ha_cmd_request_t *inRequest)
+{
+  OSStatus err = kNoErr;
+  mico_Context_t *inContext = inRequest->context;
+  ota_upgrate_t *p_upgrade = (ota_upgrate_t*)(inRequest->frame->data);
+  uint8_t md5_ret[16];
+  md5_context ctx;
 
   md5_starts( &ctx );
-  md5_update( &ctx, (u8 *)UPDATE_START_ADDRESS, flash_addr - UPDATE_START_ADDRESS);
+  md5_update( &ctx, (u8 *)UPDATE_START_ADDRESS, p_upgrade->len);
   md5_finish( &ctx, md5_ret );
 
   if(memcmp(md5_ret, p_upgrade->md5, 16) != 0) {
     PlatformFlashFinalize();
-    goto CMD_REPLY;
+    err = kChecksumErr;
+    goto exit;
   }
 
+  mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   memset(&inContext->flashContentInRam.bootTable, 0, sizeof(boot_table_t));
-  inContext->flashContentInRam.bootTable.length = flash_addr - UPDATE_START_ADDRESS;
+  inContext->flashContentInRam.bootTable.length = p_upgrade->len;
   inContext->flashContentInRam.bootTable.start_address = UPDATE_START_ADDRESS;
   inContext->flashContentInRam.bootTable.type = 'A';
   inContext->flashContentInRam.bootTable.upgrade_type = 'U';
-  MICOUpdateConfiguration(inContext);
-  cmd_ack.cmd_status = CMD_OK;
-  
-CMD_REPLY:
-  err =  SocketSend( *inSocketFd, (u8 *)&cmd_ack, sizeof(cmd_ack) + 1 + cmd_ack.datalen );
-  require_noerr(err, exit);
-  return kNoErr;
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
+  err = MICOUpdateConfiguration(inContext);
+  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
 
 exit:
-  SocketClose(inSocketFd);
-  inContext->micoStatus.sys_state = eState_Software_Reset;
-  mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
   return err;
 }
 
-OSStatus haUartCommandProcess(uint8_t *inBuf, int inLen, mico_Context_t * const inContext)
-{
-  ha_log_trace();
-  OSStatus err = kNoErr;
-  int i, control;
-  mxchip_cmd_head_t *cmd_header;
-  uint16_t cksum;
-    struct sockaddr_t addr;
-
-
-
-  cmd_header = (mxchip_cmd_head_t *)inBuf;
-
-  switch(cmd_header->cmd) {
-    case CMD_COM2NET:
-        cmd_header->cmd |= 0x8000;
-
-        addr.s_ip = IPADDR_LOOPBACK;
-
-
-        for(i=0; i < MAX_Local_Client_Num; i++) {
-          if( inContext->appStatus.loopBack_PortList[i] != 0 ){
-            addr.s_port = inContext->appStatus.loopBack_PortList[i];
-            sendto(_recved_uart_loopback_fd, inBuf, inLen, 0, &addr, sizeof(addr));
-          }
-        }
-
-        if(is_network_state(REMOTE_CONNECT)==1){
-          addr.s_ip = IPADDR_LOOPBACK;
-          addr.s_port = REMOTE_TCP_CLIENT_LOOPBACK_PORT;
-          sendto(_recved_uart_loopback_fd, inBuf, inLen, 0, &addr, sizeof(addr));
-        }
-        
-        break;
-        
-    case CMD_GET_STATUS:
-        _get_status((mxchip_state_t*)inBuf, inContext);
-        err = PlatformUartSend(inBuf, sizeof(mxchip_state_t));
-
-        break;
-    case CMD_CONTROL:
-        if (cmd_header->datalen != 1)
-            break;
-        control = inBuf[8];
-        switch(control) {
-        case 1: 
-            inContext->micoStatus.sys_state = eState_Software_Reset;
-            require(inContext->micoStatus.sys_state_change_sem, exit);
-            mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
-            break;
-        case 2:
-            MICORestoreDefault(inContext);
-            inContext->micoStatus.sys_state = eState_Software_Reset;
-            require(inContext->micoStatus.sys_state_change_sem, exit);
-            mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
-            break;
-        case 3:
-            inContext->micoStatus.sys_state = eState_Wlan_Powerdown;
-            require(inContext->micoStatus.sys_state_change_sem, exit);
-            mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
-            break;
-        case 5: 
-            OpenEasylink2(120);
-            break;
-        default:
-            break;
-        }
-        cmd_header->cmd |= 0x8000;
-        cmd_header->cmd_status = 1;
-        cmd_header->datalen = 0;
-        cksum = _calc_sum(inBuf, 8);
-        inBuf[8] = cksum & 0x00ff;
-        inBuf[9] = (cksum & 0x0ff00) >> 8;
-        err = PlatformUartSend(inBuf, 10);
-        break;
-    default:
-        break;
-    }
-exit:
-    return err;
-}
-
 
-OSStatus check_sum(void *inData, uint32_t inLen)  
+OSStatus check_sum(void *inData, uint32_t inLen)
 {
   ha_log_trace();
 
   uint16_t *sum;
   uint8_t *p = (u8 *)inData;
 
-  return kNoErr; 
+  return kNoErr;
   // TODO: real cksum
   p += inLen - 2;
 
   sum = (u16 *)p;
 
-  if (_calc_sum(inData, inLen - 2) != *sum) {  // check sum error    
+  if (_calc_sum(inData, inLen - 2) != *sum) {  // check sum error
     return kChecksumErr;
   }
   return kNoErr;
@@ -396,7 +805,3 @@ uint16_t _calc_sum(void *inData, uint32_t inLen)
 
   return ~cksum;
 }
-
-
-
-
@@ -29,6 +29,7 @@ enum {
   STA_CONNECT = 1<<0,
   UAP_START = 1<<2,       //Deprecated in MICO, Nerver setup a Soft AP under MICO system
   REMOTE_CONNECT = 1<<3,
+  REMOTE_FAILOVER = 1<<4, //Remote link lost, UART data is still queued until another server takes over
 };
 
 typedef struct _mxchip_cmd_head {
@@ -70,7 +71,7 @@ typedef struct _mxchip_state_ {
 
 OSStatus haProtocolInit(mico_Context_t * const inContext);
 int is_network_state(int state);
-OSStatus haWlanCommandProcess(unsigned char *inBuf, int *inBufLen, int inSocketFd, mico_Context_t * const inContext);
+OSStatus haWlanCommandProcess(unsigned char *inBuf, int *inBufLen, int inSocketFd, uint16_t inLoopBackPort, mico_Context_t * const inContext);
 OSStatus haUartCommandProcess(uint8_t *inBuf, int inLen, mico_Context_t * const inContext);
 OSStatus check_sum(void *inData, uint32_t inLen);  
 
@@ -4,6 +4,9 @@
 #include "HaProtocol.h"
 #include "SocketUtils.h"
 #include "PlatformUart.h"
+#include "MICOSerialScheduler.h"
+#include "TokenBucketUtils.h"
+#include "BufferPoolUtils.h"
 
 #define server_log(M, ...) custom_log("TCP SERVER", M, ##__VA_ARGS__)
 #define server_log_trace() custom_log_trace("TCP SERVER")
@@ -75,29 +78,40 @@ void localTcpClient_thread(void *inFd)
 {
   OSStatus err;
   int i;
-  int indexForPortTable;
+  int indexForPortTable = -1;
   int clientFd = *(int *)inFd;
   int currentRecved = 0;
   int clientLoopBackFd = -1;
+  int clientControlFd = -1;
   uint8_t *inDataBuffer = NULL;
   uint8_t *outDataBuffer = NULL;
   int len;
   struct sockaddr_t addr;
   fd_set readfds;
   struct timeval_t t;
-
-  inDataBuffer = malloc(wlanBufferLen);
+  socket_coalesce_config_t coalesceConfig;
+  socket_coalesce_t coalesce;
+  token_bucket_t upBucket;
+  int32_t wait;
+  uint32_t upWait;
+  bool recvPaused;
+
+  memset(&coalesce, 0x0, sizeof(coalesce));
+  token_bucket_init(&upBucket, SERIAL_CLIENT_RATE_UP, SERIAL_CLIENT_BURST, mico_get_time());
+  inDataBuffer = buffer_pool_alloc(BUFFER_POOL_SOCKET, wlanBufferLen);
   require_action(inDataBuffer, exit, err = kNoMemoryErr);
-  outDataBuffer = malloc(wlanBufferLen);
+  outDataBuffer = buffer_pool_alloc(BUFFER_POOL_SOCKET, wlanBufferLen);
   require_action(outDataBuffer, exit, err = kNoMemoryErr);
 
   for(i=0; i < MAX_Local_Client_Num; i++) {
     if( Context->appStatus.loopBack_PortList[i] == 0 ){
+      Context->appStatus.loopBack_Backlog[i].sent = Context->appStatus.loopBack_Backlog[i].queued;
       Context->appStatus.loopBack_PortList[i] = loopBackPortTable[clientFd];
       indexForPortTable = i;
       break;
     }
   }
+  require_action(indexForPortTable >= 0, exit, err = kNoResourcesErr);
 
   /*Loopback fd, recv data from other thread */
   clientLoopBackFd = socket( AF_INET, SOCK_DGRM, IPPROTO_UDP );
@@ -107,21 +121,57 @@ void localTcpClient_thread(void *inFd)
   err = bind( clientLoopBackFd, &addr, sizeof(addr) );
   require_noerr( err, exit );
 
-  t.tv_sec = 4;
-  t.tv_usec = 0;
+  /*Control loopback fd, replies that must not wait behind bulk data */
+  clientControlFd = socket( AF_INET, SOCK_DGRM, IPPROTO_UDP );
+  require_action(IsValidSocket( clientControlFd ), exit, err = kNoResourcesErr );
+  addr.s_port = Context->appStatus.loopBack_PortList[indexForPortTable] + CONTROL_LOOPBACK_PORT_OFFSET;
+  err = bind( clientControlFd, &addr, sizeof(addr) );
+  require_noerr( err, exit );
+
+  coalesceConfig.maxLatency_ms = Context->flashContentInRam.appConfig.coalesceLatency;
+  coalesceConfig.maxBytes = Context->flashContentInRam.appConfig.coalesceBytes;
+  coalesceConfig.maxWrite = wlanBufferLen;
+  coalesceConfig.flushOnFrame = Context->flashContentInRam.appConfig.coalesceFlushOnFrame;
+  if(SocketCoalesceInit(&coalesce, &coalesceConfig) != kNoErr)
+    server_log("Write coalescing disabled");
   
   while(1){
+    /* UART data is left on the loopback port while this client is over its rate */
+    upWait = token_bucket_delay(&upBucket, mico_get_time());
+    wait = SocketCoalescePoll(&coalesce, clientFd);
+    if(upWait && (wait < 0 || upWait < (uint32_t)wait))
+      wait = upWait;
+    /* Leave data in the TCP window while this client's UART queue is full */
+    recvPaused = MICOSerialSchedulerQueued(clientFd) + wlanBufferLen > SERIAL_CLIENT_QUEUE_LEN;
+    if(recvPaused && (wait < 0 || wait > UART_BACKLOG_POLL))
+      wait = UART_BACKLOG_POLL;
+    t.tv_sec = (wait < 0) ? 4 : wait / 1000;
+    t.tv_usec = (wait < 0) ? 0 : (wait % 1000) * 1000;
 
     FD_ZERO(&readfds);
-    FD_SET(clientFd, &readfds); 
-    FD_SET(clientLoopBackFd, &readfds); 
+    if(recvPaused == false)
+      FD_SET(clientFd, &readfds); 
+    FD_SET(clientControlFd, &readfds); 
+    if(upWait == 0)
+      FD_SET(clientLoopBackFd, &readfds); 
 
     select(1, &readfds, NULL, NULL, &t);
 
+    /*Control data goes out ahead of anything coalesced or rate limited*/
+    if (FD_ISSET( clientControlFd, &readfds )) {
+      len = recv( clientControlFd, outDataBuffer, wlanBufferLen, 0 );
+      if(len > 0)
+        SocketSend( clientFd, outDataBuffer, len );
+    }
+
     /*recv UART data using loopback fd*/
     if (FD_ISSET( clientLoopBackFd, &readfds )) {
       len = recv( clientLoopBackFd, outDataBuffer, wlanBufferLen, 0 );
-      SocketSend( clientFd, outDataBuffer, len );
+      if(len > 0){
+        token_bucket_consume(&upBucket, len);
+        Context->appStatus.loopBack_Backlog[indexForPortTable].sent += len;
+        SocketCoalesceWrite( &coalesce, clientFd, outDataBuffer, len, true );
+      }
     }
 
     /*Read data from tcp clients and process these data using HA protocol */ 
@@ -129,18 +179,25 @@ void localTcpClient_thread(void *inFd)
       len = recv(clientFd, inDataBuffer+currentRecved, wlanBufferLen-currentRecved, 0);
       require_action_quiet(len>0, exit, err = kConnectionErr);
       currentRecved += len;    
-      haWlanCommandProcess(inDataBuffer, &currentRecved, clientFd, Context);
+      /* Replies must not overtake UART data that is still queued */
+      SocketCoalesceFlush(&coalesce, clientFd);
+      haWlanCommandProcess(inDataBuffer, &currentRecved, clientFd, Context->appStatus.loopBack_PortList[indexForPortTable] + CONTROL_LOOPBACK_PORT_OFFSET, Context);
     }
   }
 
 exit:
     server_log("Exit: Client exit with err = %d", err);
-    Context->appStatus.loopBack_PortList[indexForPortTable] = 0;
+    if(indexForPortTable >= 0)
+      Context->appStatus.loopBack_PortList[indexForPortTable] = 0;
     if(clientLoopBackFd != -1)
       SocketClose(&clientLoopBackFd);
+    if(clientControlFd != -1)
+      SocketClose(&clientControlFd);
+    MICOSerialSchedulerClose(clientFd);
     SocketClose(&clientFd);
-    if(inDataBuffer) free(inDataBuffer);
-    if(outDataBuffer) free(outDataBuffer);
+    SocketCoalesceDeinit(&coalesce);
+    buffer_pool_release(inDataBuffer);
+    buffer_pool_release(outDataBuffer);
     mico_rtos_delete_thread(NULL);
     return;
 }
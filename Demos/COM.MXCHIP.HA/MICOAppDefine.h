@@ -16,14 +16,52 @@
 #define LOCAL_PORT              8080
 
 /*User provided configurations*/
-#define CONFIGURATION_VERSION         0x0000030 // if changed default configuration, add this num
+#define CONFIGURATION_VERSION         0x0000034 // if changed default configuration, add this num
 #define MAX_Local_Client_Num          8
 #define DEAFULT_REMOTE_SERVER         "192.168.2.254"
+#define MAX_BACKUP_REMOTE_SERVER_NUM  2
 #define DEFAULT_REMOTE_SERVER_PORT    8080
 
 #define LOCAL_TCP_SERVER_LOOPBACK_PORT     1000
 #define REMOTE_TCP_CLIENT_LOOPBACK_PORT    1002
 #define RECVED_UART_DATA_LOOPBACK_PORT     1003
+/*Each socket thread also listens for control data on its port plus this offset*/
+#define CONTROL_LOOPBACK_PORT_OFFSET       100
+
+/*UART data kept while the remote server is unreachable*/
+#define REMOTE_STORE_RAM_SIZE              4096
+#define REMOTE_STORE_OVERFLOW              MICO_SF_DROP_OLDEST
+/*1 moves the oldest records to flash, OTA images must then fit in
+  STORE_FORWARD_OTA_MAX_LEN*/
+#define REMOTE_STORE_FLASH_SPILL           0
+
+/*UART to TCP write coalescing*/
+#define DEFAULT_COALESCE_LATENCY           10
+#define DEFAULT_COALESCE_BYTES             512
+#define MAX_COALESCE_BYTES                 1460
+
+/*Serial bridge traffic shaping, rates in bytes per second, 0 for no limit*/
+#define SERIAL_UART_RATE                   0
+#define SERIAL_UART_BURST                  1024
+#define SERIAL_CLIENT_RATE_DOWN            0       //TCP to UART, each client
+#define SERIAL_CLIENT_RATE_UP              0       //UART to TCP, each client
+#define SERIAL_CLIENT_BURST                2048
+#define SERIAL_DRR_QUANTUM                 256
+#define SERIAL_CLIENT_QUEUE_LEN            2048
+
+/*End to end flow control*/
+#define UART_BACKLOG_LIMIT                 2048    //UART bytes a socket thread may have pending
+#define UART_BACKLOG_POLL                  10
+#define UART_BACKLOG_MAX_WAIT              10000   //A socket thread this slow is skipped, 0 waits forever
+#define UART_RECONFIG_FLUSH_TIME           1000    //Queued writes go out at the old settings for this long
+
+/*Backup remote server, tried when the preferred one fails*/
+typedef struct
+{
+  char              domain[64];       //Empty if unused
+  int               port;
+  uint8_t           weight;           //Relative preference, 0 disables the server
+} remote_server_t;
 
 /*Application's configuration stores in flash*/
 typedef struct
@@ -36,24 +74,43 @@ typedef struct
   bool              remoteServerEnable;
   char              remoteServerDomain[64];
   int               remoteServerPort;
+  uint8_t           remoteServerWeight;
+  remote_server_t   backupRemoteServers[MAX_BACKUP_REMOTE_SERVER_NUM];
 
   /*IO settings*/
   uint32_t          USART_BaudRate;
+  uint8_t           USART_Parity;       //uart_parity_t
+  uint8_t           USART_StopBits;     //1 or 2
+  bool              USART_FlowControl;  //RTS/CTS
+
+  /*UART to TCP forwarding*/
+  uint32_t          coalesceLatency;    //ms, 0 sends every UART packet at once
+  uint32_t          coalesceBytes;
+  bool              coalesceFlushOnFrame;
 } application_config_t;
 
 
 #define wlanBufferLen       1024
 #define UartRecvBufferLen   1024
 
+/*UART data sent to a socket thread's loopback port, each counter has one writer*/
+typedef struct _uart_backlog_t {
+  volatile uint32_t queued;           //By the UART thread
+  volatile uint32_t sent;             //By the socket thread, once written to its socket
+} uart_backlog_t;
+
 /*Running status*/
 typedef struct _current_app_status_t {
   /*Local clients port list*/
   uint32_t          loopBack_PortList[MAX_Local_Client_Num];
+  uart_backlog_t    loopBack_Backlog[MAX_Local_Client_Num];
+  uart_backlog_t    remoteBacklog;
 } current_app_status_t;
 
 
 void localTcpServer_thread(void *inContext);
 void remoteTcpClient_thread(void *inContext);
+OSStatus remoteTcpClientStore(const uint8_t *inData, uint16_t inLen);
 void uartRecv_thread(void *inContext);
 
 
@@ -20,9 +20,17 @@ void appRestoreDefault_callback(mico_Context_t *inContext)
   inContext->flashContentInRam.appConfig.localServerPort = LOCAL_PORT;
   inContext->flashContentInRam.appConfig.localServerEnable = true;
   inContext->flashContentInRam.appConfig.USART_BaudRate = 115200;
+  inContext->flashContentInRam.appConfig.USART_Parity = UART_PARITY_NONE;
+  inContext->flashContentInRam.appConfig.USART_StopBits = 1;
+  inContext->flashContentInRam.appConfig.USART_FlowControl = false;
   inContext->flashContentInRam.appConfig.remoteServerEnable = true;
   sprintf(inContext->flashContentInRam.appConfig.remoteServerDomain, DEAFULT_REMOTE_SERVER);
   inContext->flashContentInRam.appConfig.remoteServerPort = DEFAULT_REMOTE_SERVER_PORT;
+  inContext->flashContentInRam.appConfig.remoteServerWeight = 1;
+  inContext->flashContentInRam.appConfig.coalesceLatency = DEFAULT_COALESCE_LATENCY;
+  inContext->flashContentInRam.appConfig.coalesceBytes = DEFAULT_COALESCE_BYTES;
+  inContext->flashContentInRam.appConfig.coalesceFlushOnFrame = false;
+  memset(inContext->flashContentInRam.appConfig.backupRemoteServers, 0x0, sizeof(inContext->flashContentInRam.appConfig.backupRemoteServers));
 }
 
 OSStatus MICOStartApplication( mico_Context_t * const inContext )
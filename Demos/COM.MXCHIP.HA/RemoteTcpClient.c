@@ -4,14 +4,80 @@
 #include "HaProtocol.h"
 #include "SocketUtils.h"
 #include "MICONotificationCenter.h"
+#include "MICOConnectionManager.h"
+#include "MICOStoreForward.h"
+#include "MICOSerialScheduler.h"
+#include "TokenBucketUtils.h"
+#include "BufferPoolUtils.h"
 
 #define client_log(M, ...) custom_log("TCP client", M, ##__VA_ARGS__)
 #define client_log_trace() custom_log_trace("TCP client")
 
-#define CLOUD_RETRY  1
+/* Reconnect delay doubles from CLOUD_RETRY_MIN up to CLOUD_RETRY_MAX, with
+   random jitter so that devices do not reconnect in lockstep */
+#define CLOUD_RETRY_MIN             1000
+#define CLOUD_RETRY_MAX             60000
+#define CLOUD_CONNECT_TIMEOUT       5000
+#define CLOUD_STABLE_TIME           30000
+#define CLOUD_KEEPALIVE_PROBES      3
+#define CLOUD_KEEPALIVE_INTERVAL    20
+#define CLOUD_RACE_DELAY            250
+#define CLOUD_DEAD_PEER_TIMEOUT     (10*60*1000)  //Silence before the server is given up, keepalive misses a hung server
 
 static bool _wifiConnected = false;
 static mico_semaphore_t  _wifiConnected_sem = NULL;
+static mico_connection_t _cloudConnection;
+static mico_store_forward_t _cloudStore;
+
+/* Called from the UART side while the remote server is unreachable */
+OSStatus remoteTcpClientStore(const uint8_t *inData, uint16_t inLen)
+{
+  return MICOStoreForwardPush(&_cloudStore, inData, inLen);
+}
+
+static OSStatus _replay_send(const mico_sf_record_t *inRecord, const uint8_t *inData, void *inArg)
+{
+  return SocketSend(*(int *)inArg, inData, inRecord->len);
+}
+
+/* Failover gave up, keep what was queued on the loopback port for it */
+static void _store_pending(int loopBack_fd, uint8_t *inBuffer, uart_backlog_t *inBacklog)
+{
+  fd_set readfds;
+  struct timeval_t t;
+  int len;
+
+  t.tv_sec = 0;
+  t.tv_usec = 0;
+  while(1){
+    FD_ZERO(&readfds);
+    FD_SET(loopBack_fd, &readfds);
+    if(select(1, &readfds, NULL, NULL, &t) <= 0 || !FD_ISSET(loopBack_fd, &readfds))
+      break;
+    len = recv(loopBack_fd, inBuffer, wlanBufferLen, 0);
+    if(len > 0){
+      inBacklog->sent += len;
+      MICOStoreForwardPush(&_cloudStore, inBuffer, len);
+    }
+  }
+}
+
+/* The configured server first, then the backups, the connection manager
+   orders them by weight and by what it learned about each one */
+static void _load_endpoints(mico_connection_config_t *config, application_config_t *appConfig)
+{
+  int i;
+
+  config->endpoints[0].host = appConfig->remoteServerDomain;
+  config->endpoints[0].port = appConfig->remoteServerPort;
+  config->endpoints[0].weight = appConfig->remoteServerWeight;
+  for(i = 0; i < MAX_BACKUP_REMOTE_SERVER_NUM && i + 1 < MICO_CONNECTION_MAX_ENDPOINTS; i++){
+    config->endpoints[i+1].host = appConfig->backupRemoteServers[i].domain;
+    config->endpoints[i+1].port = appConfig->backupRemoteServers[i].port;
+    config->endpoints[i+1].weight = appConfig->backupRemoteServers[i].weight;
+  }
+  config->endpointNum = i + 1;
+}
 
 void clientNotify_WifiStatusHandler(int event, mico_Context_t * const inContext)
 {
@@ -39,25 +105,35 @@ void remoteTcpClient_thread(void *inContext)
   mico_Context_t *Context = inContext;
   struct sockaddr_t addr;
   fd_set readfds;
-  char ipstr[16];
   struct timeval_t t;
+  mico_connection_config_t config;
+  mico_sf_config_t storeConfig;
+  socket_coalesce_config_t coalesceConfig;
+  socket_coalesce_t coalesce;
+  token_bucket_t upBucket;
+  int32_t wait;
+  uint32_t upWait;
+  bool recvPaused;
   int currentRecved = 0;
   int remoteTcpClient_loopBack_fd = -1;
+  int remoteTcpClient_control_fd = -1;
   int remoteTcpClient_fd = -1;
   uint8_t *inDataBuffer = NULL;
   uint8_t *outDataBuffer = NULL;
   
   
+  memset(&coalesce, 0x0, sizeof(coalesce));
+  token_bucket_init(&upBucket, SERIAL_CLIENT_RATE_UP, SERIAL_CLIENT_BURST, mico_get_time());
   mico_rtos_init_semaphore(&_wifiConnected_sem, 1);
   
   /* Regisist notifications */
   err = MICOAddNotification( mico_notify_WIFI_STATUS_CHANGED, (void *)clientNotify_WifiStatusHandler );
   require_noerr( err, exit ); 
   
-  inDataBuffer = malloc(wlanBufferLen);
-  require_action(inDataBuffer, exit, err = kNoMemoryErr);
-  outDataBuffer = malloc(wlanBufferLen);
+  inDataBuffer = buffer_pool_alloc(BUFFER_POOL_SOCKET, wlanBufferLen);
   require_action(inDataBuffer, exit, err = kNoMemoryErr);
+  outDataBuffer = buffer_pool_alloc(BUFFER_POOL_SOCKET, wlanBufferLen);
+  require_action(outDataBuffer, exit, err = kNoMemoryErr);
   
   /*Loopback fd, recv data from other thread */
   remoteTcpClient_loopBack_fd = socket( AF_INET, SOCK_DGRM, IPPROTO_UDP );
@@ -66,39 +142,101 @@ void remoteTcpClient_thread(void *inContext)
   addr.s_port = REMOTE_TCP_CLIENT_LOOPBACK_PORT;
   err = bind( remoteTcpClient_loopBack_fd, &addr, sizeof(addr) );
   require_noerr( err, exit );
+
+  /*Control loopback fd, replies that must not wait behind bulk data */
+  remoteTcpClient_control_fd = socket( AF_INET, SOCK_DGRM, IPPROTO_UDP );
+  require_action(IsValidSocket( remoteTcpClient_control_fd ), exit, err = kNoResourcesErr );
+  addr.s_port = REMOTE_TCP_CLIENT_LOOPBACK_PORT + CONTROL_LOOPBACK_PORT_OFFSET;
+  err = bind( remoteTcpClient_control_fd, &addr, sizeof(addr) );
+  require_noerr( err, exit );
   
-  t.tv_sec = 4;
-  t.tv_usec = 0;
+  storeConfig.ramSize = REMOTE_STORE_RAM_SIZE;
+  storeConfig.overflow = REMOTE_STORE_OVERFLOW;
+  storeConfig.flashSpill = REMOTE_STORE_FLASH_SPILL;
+  err = MICOStoreForwardInit(&_cloudStore, &storeConfig);
+  require_noerr( err, exit );
+
+  coalesceConfig.maxLatency_ms = Context->flashContentInRam.appConfig.coalesceLatency;
+  coalesceConfig.maxBytes = Context->flashContentInRam.appConfig.coalesceBytes;
+  coalesceConfig.maxWrite = wlanBufferLen;
+  coalesceConfig.flushOnFrame = Context->flashContentInRam.appConfig.coalesceFlushOnFrame;
+  if(SocketCoalesceInit(&coalesce, &coalesceConfig) != kNoErr)
+    client_log("Write coalescing disabled");
+
+  memset(&config, 0, sizeof(config));
+  _load_endpoints(&config, &Context->flashContentInRam.appConfig);
+  config.raceDelay_ms = CLOUD_RACE_DELAY;
+  config.connectTimeout_ms = CLOUD_CONNECT_TIMEOUT;
+  config.backoffMin_ms = CLOUD_RETRY_MIN;
+  config.backoffMax_ms = CLOUD_RETRY_MAX;
+  config.stableTime_ms = CLOUD_STABLE_TIME;
+  config.keepaliveProbes = CLOUD_KEEPALIVE_PROBES;
+  config.keepaliveInterval_s = CLOUD_KEEPALIVE_INTERVAL;
+  config.deadPeerTimeout_ms = CLOUD_DEAD_PEER_TIMEOUT;
+  MICOConnectionInit(&_cloudConnection, &config, Context);
   
   while(1) {
     if(remoteTcpClient_fd == -1 ) {
       if(_wifiConnected == false){
+        set_network_state(REMOTE_FAILOVER, 0);
         require_action_quiet(mico_rtos_get_semaphore(&_wifiConnected_sem, 200000) == kNoErr, Continue, err = kTimeoutErr);
       }
-      err = gethostbyname((char *)Context->flashContentInRam.appConfig.remoteServerDomain, (uint8_t *)ipstr, 16);
-      require_noerr(err, ReConnWithDelay);
-      
-      remoteTcpClient_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-      addr.s_ip = inet_addr(ipstr); 
-      addr.s_port = Context->flashContentInRam.appConfig.remoteServerPort;
-      
-      err = connect(remoteTcpClient_fd, &addr, sizeof(addr));
-      require_noerr_quiet(err, ReConnWithDelay);
+      err = MICOConnectionOpen(&_cloudConnection);
+      if(err != kNoErr){
+        /* No server took over, the store keeps UART data from now on */
+        set_network_state(REMOTE_FAILOVER, 0);
+        _store_pending(remoteTcpClient_loopBack_fd, outDataBuffer, &Context->appStatus.remoteBacklog);
+        goto Continue;
+      }
+      remoteTcpClient_fd = _cloudConnection.fd;
+      currentRecved = 0;
       
       set_network_state(REMOTE_CONNECT, 1);
-      client_log("Remote server connected at port: %d, fd: %d",  Context->flashContentInRam.appConfig.remoteServerPort,
-                 remoteTcpClient_fd);
+      set_network_state(REMOTE_FAILOVER, 0);
+      /* Stored data is older than anything arriving on the loopback port */
+      if(MICOStoreForwardReplay(&_cloudStore, _replay_send, &remoteTcpClient_fd) != kNoErr){
+        client_log("Replay of stored data failed, fd: %d", remoteTcpClient_fd);
+        set_network_state(REMOTE_CONNECT, 0);
+        goto ReConnWithDelay;
+      }
+      client_log("Remote server %s connected at port: %d, fd: %d",  _cloudConnection.config.endpoints[_cloudConnection.current].host,
+                 _cloudConnection.config.endpoints[_cloudConnection.current].port, remoteTcpClient_fd);
     }else{
+      upWait = token_bucket_delay(&upBucket, mico_get_time());
+      wait = SocketCoalescePoll(&coalesce, remoteTcpClient_fd);
+      if(upWait && (wait < 0 || upWait < (uint32_t)wait))
+        wait = upWait;
+      /* Leave data in the TCP window while the UART queue is full */
+      recvPaused = MICOSerialSchedulerQueued(remoteTcpClient_fd) + wlanBufferLen > SERIAL_CLIENT_QUEUE_LEN;
+      if(recvPaused && (wait < 0 || wait > UART_BACKLOG_POLL))
+        wait = UART_BACKLOG_POLL;
+      t.tv_sec = (wait < 0) ? 4 : wait / 1000;
+      t.tv_usec = (wait < 0) ? 0 : (wait % 1000) * 1000;
+
       FD_ZERO(&readfds);
-      FD_SET(remoteTcpClient_fd, &readfds);
-      FD_SET(remoteTcpClient_loopBack_fd, &readfds);
+      if(recvPaused == false)
+        FD_SET(remoteTcpClient_fd, &readfds);
+      FD_SET(remoteTcpClient_control_fd, &readfds);
+      if(upWait == 0)
+        FD_SET(remoteTcpClient_loopBack_fd, &readfds);
       
       select(1, &readfds, NULL, NULL, &t);
       
+      /*Control data goes out ahead of anything coalesced or rate limited*/
+      if (FD_ISSET( remoteTcpClient_control_fd, &readfds) ) {
+        len = recv( remoteTcpClient_control_fd, outDataBuffer, wlanBufferLen, 0 );
+        if(len > 0)
+          SocketSend( remoteTcpClient_fd, outDataBuffer, len );
+      }
+      
       /*recv UART data using loopback fd*/
       if (FD_ISSET( remoteTcpClient_loopBack_fd, &readfds) ) {
         len = recv( remoteTcpClient_loopBack_fd, outDataBuffer, wlanBufferLen, 0 );
-        SocketSend( remoteTcpClient_fd, outDataBuffer, len );
+        if(len > 0){
+          token_bucket_consume(&upBucket, len);
+          Context->appStatus.remoteBacklog.sent += len;
+          SocketCoalesceWrite( &coalesce, remoteTcpClient_fd, outDataBuffer, len, true );
+        }
       }
       
       /*recv wlan data using remote client fd*/
@@ -106,28 +244,43 @@ void remoteTcpClient_thread(void *inContext)
         len = recv(remoteTcpClient_fd, inDataBuffer+currentRecved, wlanBufferLen-currentRecved, 0);
         if(len <= 0) {
           client_log("Remote client closed, fd: %d", remoteTcpClient_fd);
+          /* Keep queuing UART data while another server takes over */
+          set_network_state(REMOTE_FAILOVER, 1);
           set_network_state(REMOTE_CONNECT, 0);
           goto ReConnWithDelay;
         }
+        MICOConnectionDataReceived(&_cloudConnection);
         currentRecved += len;
-        haWlanCommandProcess(inDataBuffer, &currentRecved, remoteTcpClient_fd, Context);
+        SocketCoalesceFlush(&coalesce, remoteTcpClient_fd);
+        haWlanCommandProcess(inDataBuffer, &currentRecved, remoteTcpClient_fd, REMOTE_TCP_CLIENT_LOOPBACK_PORT + CONTROL_LOOPBACK_PORT_OFFSET, Context);
+      }
+
+      if(MICOConnectionCheckAlive(&_cloudConnection) != kNoErr){
+        client_log("Remote server silent, fd: %d", remoteTcpClient_fd);
+        /* Keep queuing UART data while another server takes over */
+        set_network_state(REMOTE_FAILOVER, 1);
+        set_network_state(REMOTE_CONNECT, 0);
+        goto ReConnWithDelay;
       }
       
     Continue:    
       continue;
       
     ReConnWithDelay:
-      if(remoteTcpClient_fd != -1){
-        SocketClose(&remoteTcpClient_fd);
-      }
-      sleep(CLOUD_RETRY);
+      SocketCoalesceDiscard(&coalesce);
+      MICOSerialSchedulerClose(remoteTcpClient_fd);
+      MICOConnectionClose(&_cloudConnection);
+      remoteTcpClient_fd = -1;
     }
   }
 exit:
-  if(inDataBuffer) free(inDataBuffer);
-  if(outDataBuffer) free(outDataBuffer);
+  buffer_pool_release(inDataBuffer);
+  buffer_pool_release(outDataBuffer);
+  SocketCoalesceDeinit(&coalesce);
   if(remoteTcpClient_loopBack_fd != -1)
     SocketClose(&remoteTcpClient_loopBack_fd);
+  if(remoteTcpClient_control_fd != -1)
+    SocketClose(&remoteTcpClient_control_fd);
   client_log("Exit: Remote TCP client exit with err = %d", err);
   mico_rtos_delete_thread(NULL);
   return;
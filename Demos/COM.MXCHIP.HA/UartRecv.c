@@ -5,6 +5,7 @@
 #include "haProtocol.h"
 #include "PlatformUart.h"
 #include "MICONotificationCenter.h"
+#include "BufferPoolUtils.h"
 
 #define uart_recv_log(M, ...) custom_log("UART RECV", M, ##__VA_ARGS__)
 #define uart_recv_log_trace() custom_log_trace("UART RECV")
@@ -18,7 +19,7 @@ void uartRecv_thread(void *inContext)
   int recvlen;
   uint8_t *inDataBuffer;
   
-  inDataBuffer = malloc(UartRecvBufferLen);
+  inDataBuffer = buffer_pool_alloc(BUFFER_POOL_UART, UartRecvBufferLen);
   require(inDataBuffer, exit);
   
   while(1) {
@@ -29,7 +30,7 @@ void uartRecv_thread(void *inContext)
   }
   
 exit:
-  if(inDataBuffer) free(inDataBuffer);
+  buffer_pool_release(inDataBuffer);
 }
 
 /* Packet format: BB 00 CMD(2B) Status(2B) datalen(2B) data(x) checksum(2B)
@@ -247,6 +247,7 @@ OSStatus EasyLinkIncommingJsonHTTPMessage( const char *input, mico_Context_t * c
   require_action(new_obj, exit, err = kUnknownErr);
   user_easylink_log("Recv config object=%s", json_object_to_json_string(new_obj));
   mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   json_object_object_foreach(new_obj, key, val) {
     if(!strcmp(key, "Device Name")){
       strncpy(inContext->flashContentInRam.micoSystemConfig.name, json_object_get_string(val), maxNameLen);
@@ -267,10 +268,10 @@ OSStatus EasyLinkIncommingJsonHTTPMessage( const char *input, mico_Context_t * c
     }
   }
   json_object_put(new_obj);
-  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
-
   inContext->flashContentInRam.micoSystemConfig.configured = allConfigured;
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
   mico_UpdateConfiguration(inContext);
+  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
 
 exit:
   return err; 
@@ -32,10 +32,69 @@
 #include "SppProtocol.h"  
 #include "MICOConfigMenu.h"
 #include "StringUtils.h"
+#include "SocketUtils.h"
+#include "MICOSerialScheduler.h"
+#include "BufferPoolUtils.h"
+#include <ctype.h>
 
 #define config_delegate_log(M, ...) custom_log("Config Delegate", M, ##__VA_ARGS__)
 #define config_delegate_log_trace() custom_log_trace("Config Delegate")
 
+#define BACKUP_SERVER_CELL          "Backup Server "
+
+static const char *_parity_names[] = {"None", "Odd", "Even"};
+
+static bool _uart_changed(const application_config_t *inBefore, const application_config_t *inAfter)
+{
+  return inBefore->USART_BaudRate != inAfter->USART_BaudRate
+      || inBefore->USART_Parity != inAfter->USART_Parity
+      || inBefore->USART_StopBits != inAfter->USART_StopBits
+      || inBefore->USART_FlowControl != inAfter->USART_FlowControl;
+}
+
+/* The UART settings and the control prefix take effect without a reset. inBefore is a
+   scratch copy, they are copied over so that only the other settings are
+   compared. */
+static bool _needs_reset(flash_content_t *inBefore, const flash_content_t *inAfter)
+{
+  inBefore->appConfig.USART_BaudRate = inAfter->appConfig.USART_BaudRate;
+  inBefore->appConfig.USART_Parity = inAfter->appConfig.USART_Parity;
+  inBefore->appConfig.USART_StopBits = inAfter->appConfig.USART_StopBits;
+  inBefore->appConfig.USART_FlowControl = inAfter->appConfig.USART_FlowControl;
+  memcpy(inBefore->appConfig.controlPrefix, inAfter->appConfig.controlPrefix, MAX_CONTROL_PREFIX_LEN);
+  inBefore->appConfig.controlPrefixLen = inAfter->appConfig.controlPrefixLen;
+  return memcmp(inBefore, inAfter, sizeof(flash_content_t)) != 0;
+}
+
+/* Backup servers are edited as "host:port:weight", an empty string removes one */
+static void _parse_backup_server(const char *inString, remote_server_t *outServer)
+{
+  int port = DEFAULT_REMOTE_SERVER_PORT;
+  int weight = 1;
+
+  memset(outServer, 0x0, sizeof(remote_server_t));
+  if(inString == NULL || sscanf(inString, "%63[^:]:%d:%d", outServer->domain, &port, &weight) < 1)
+    return;
+  outServer->port = port;
+  outServer->weight = (uint8_t)Min(Max(weight, 0), 255);
+}
+
+/* The control prefix is edited as hex digits such as "1B50", an empty string
+   disables it */
+static void _parse_control_prefix(const char *inString, application_config_t *outConfig)
+{
+  unsigned int byte;
+  int len;
+
+  for(len = 0; inString && len < MAX_CONTROL_PREFIX_LEN; len++){
+    if(!isxdigit((int)inString[2*len]) || !isxdigit((int)inString[2*len+1]))
+      break;
+    sscanf(inString + 2*len, "%2x", &byte);
+    outConfig->controlPrefix[len] = (uint8_t)byte;
+  }
+  outConfig->controlPrefixLen = len;
+}
+
 void ConfigWillStart( mico_Context_t * const inContext )
 {
   config_delegate_log_trace();
@@ -82,9 +141,17 @@ OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext )
   OSStatus err = kNoErr;
   config_delegate_log_trace();
   char name[50], *tempString;
+  char backup[80];
+  char prefix[2*MAX_CONTROL_PREFIX_LEN + 1];
+  int i;
+  uint32_t coalesceWrites, coalesceSegments;
+  mico_serial_scheduler_stats_t schedulerStats;
+  buffer_pool_stats_t poolStats;
   OTA_Versions_t versions;
   char rfVersion[50];
   char *rfVer = NULL, *rfVerTemp = NULL;
+  flash_content_t *config = NULL;
+  current_mico_status_t *status = NULL;
 
   wlan_driver_version( rfVersion, 50 );
   rfVer = strstr(rfVersion, "version ");
@@ -99,11 +166,18 @@ OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext )
     /*You can upload a specific menu*/
   }
 
-  mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  /*Build the menu from a snapshot, so writers are never blocked by JSON allocation*/
+  config = malloc(sizeof(flash_content_t));
+  require_action(config, exit, err = kNoMemoryErr);
+  status = malloc(sizeof(current_mico_status_t));
+  require_action(status, exit, err = kNoMemoryErr);
+  MICOGetConfiguration(inContext, config);
+  MICOGetStatus(inContext, status);
+
   snprintf(name, 50, "%s(%c%c%c%c%c%c)",MODEL, 
-                                        inContext->micoStatus.mac[9],  inContext->micoStatus.mac[10], 
-                                        inContext->micoStatus.mac[12], inContext->micoStatus.mac[13],
-                                        inContext->micoStatus.mac[15], inContext->micoStatus.mac[16]);
+                                        status->mac[9],  status->mac[10], 
+                                        status->mac[12], status->mac[13],
+                                        status->mac[15], status->mac[16]);
 
   versions.fwVersion = FIRMWARE_REVISION;
   versions.hdVersion = HARDWARE_REVISION;
@@ -125,19 +199,19 @@ OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext )
   require_noerr(err, exit);
 
     /*name cell*/
-    err = MICOAddStringCellToSector(sector, "Device Name",    inContext->flashContentInRam.micoSystemConfig.name,               "RW", NULL);
+    err = MICOAddStringCellToSector(sector, "Device Name",    config->micoSystemConfig.name,               "RW", NULL);
     require_noerr(err, exit);
 
     //Bonjour switcher cell
-    err = MICOAddSwitchCellToSector(sector, "Bonjour",        inContext->flashContentInRam.micoSystemConfig.bonjourEnable,      "RW");
+    err = MICOAddSwitchCellToSector(sector, "Bonjour",        config->micoSystemConfig.bonjourEnable,      "RW");
     require_noerr(err, exit);
 
     //RF power save switcher cell
-    err = MICOAddSwitchCellToSector(sector, "RF power save",  inContext->flashContentInRam.micoSystemConfig.rfPowerSaveEnable,  "RW");
+    err = MICOAddSwitchCellToSector(sector, "RF power save",  config->micoSystemConfig.rfPowerSaveEnable,  "RW");
     require_noerr(err, exit);
 
     //MCU power save switcher cell
-    err = MICOAddSwitchCellToSector(sector, "MCU power save", inContext->flashContentInRam.micoSystemConfig.mcuPowerSaveEnable, "RW");
+    err = MICOAddSwitchCellToSector(sector, "MCU power save", config->micoSystemConfig.mcuPowerSaveEnable, "RW");
     require_noerr(err, exit);
 
     /*sub menu*/
@@ -170,15 +244,15 @@ OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext )
       err = MICOAddSector(subMenuSectors,  "WLAN",    subMenuSector);
       require_noerr(err, exit);
       
-        tempString = DataToHexStringWithColons( (uint8_t *)inContext->flashContentInRam.micoSystemConfig.bssid, 6 );
+        tempString = DataToHexStringWithColons( (uint8_t *)config->micoSystemConfig.bssid, 6 );
         err = MICOAddStringCellToSector(subMenuSector, "BSSID",        tempString, "RO", NULL);
         require_noerr(err, exit);
         free(tempString);
 
-        err = MICOAddNumberCellToSector(subMenuSector, "Channel",      inContext->flashContentInRam.micoSystemConfig.channel, "RO", NULL);
+        err = MICOAddNumberCellToSector(subMenuSector, "Channel",      config->micoSystemConfig.channel, "RO", NULL);
         require_noerr(err, exit);
 
-        switch(inContext->flashContentInRam.micoSystemConfig.security){
+        switch(config->micoSystemConfig.security){
           case SECURITY_TYPE_NONE:
             err = MICOAddStringCellToSector(subMenuSector, "Security",   "Open system", "RO", NULL); 
             break;
@@ -206,33 +280,33 @@ OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext )
         }
         require_noerr(err, exit); 
 
-        if(inContext->flashContentInRam.micoSystemConfig.keyLength == maxKeyLen){ /*This is a PMK key, generated by user key in WPA security type*/
+        if(config->micoSystemConfig.keyLength == maxKeyLen){ /*This is a PMK key, generated by user key in WPA security type*/
           tempString = calloc(maxKeyLen+1, 1);
           require_action(tempString, exit, err=kNoMemoryErr);
-          memcpy(tempString, inContext->flashContentInRam.micoSystemConfig.key, maxKeyLen);
+          memcpy(tempString, config->micoSystemConfig.key, maxKeyLen);
           err = MICOAddStringCellToSector(subMenuSector, "PMK",          tempString, "RO", NULL);
           require_noerr(err, exit);
           free(tempString);
         }
         else{
-          err = MICOAddStringCellToSector(subMenuSector, "KEY",          inContext->flashContentInRam.micoSystemConfig.user_key,  "RO", NULL);
+          err = MICOAddStringCellToSector(subMenuSector, "KEY",          config->micoSystemConfig.user_key,  "RO", NULL);
           require_noerr(err, exit);
         }
 
         /*DHCP cell*/
-        err = MICOAddSwitchCellToSector(subMenuSector, "DHCP",        inContext->flashContentInRam.micoSystemConfig.dhcpEnable,   "RO");
+        err = MICOAddSwitchCellToSector(subMenuSector, "DHCP",        config->micoSystemConfig.dhcpEnable,   "RO");
         require_noerr(err, exit);
         /*Local cell*/
-        err = MICOAddStringCellToSector(subMenuSector, "IP address",  inContext->micoStatus.localIp,   "RO", NULL);
+        err = MICOAddStringCellToSector(subMenuSector, "IP address",  status->localIp,   "RO", NULL);
         require_noerr(err, exit);
         /*Netmask cell*/
-        err = MICOAddStringCellToSector(subMenuSector, "Net Mask",    inContext->micoStatus.netMask,   "RO", NULL);
+        err = MICOAddStringCellToSector(subMenuSector, "Net Mask",    status->netMask,   "RO", NULL);
         require_noerr(err, exit);
         /*Gateway cell*/
-        err = MICOAddStringCellToSector(subMenuSector, "Gateway",     inContext->micoStatus.gateWay,   "RO", NULL);
+        err = MICOAddStringCellToSector(subMenuSector, "Gateway",     status->gateWay,   "RO", NULL);
         require_noerr(err, exit);
         /*DNS server cell*/
-        err = MICOAddStringCellToSector(subMenuSector, "DNS Server",  inContext->micoStatus.dnsServer, "RO", NULL);
+        err = MICOAddStringCellToSector(subMenuSector, "DNS Server",  status->dnsServer, "RO", NULL);
         require_noerr(err, exit);
 
   /*Sector 3*/
@@ -241,10 +315,10 @@ OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext )
   err = MICOAddSector(sectors, "WLAN",           sector);
   require_noerr(err, exit);
 
-    err = MICOAddStringCellToSector(sector, "Wi-Fi",        inContext->flashContentInRam.micoSystemConfig.ssid,     "RW", NULL);
+    err = MICOAddStringCellToSector(sector, "Wi-Fi",        config->micoSystemConfig.ssid,     "RW", NULL);
     require_noerr(err, exit);
 
-    err = MICOAddStringCellToSector(sector, "Password",     inContext->flashContentInRam.micoSystemConfig.user_key, "RW", NULL);
+    err = MICOAddStringCellToSector(sector, "Password",     config->micoSystemConfig.user_key, "RW", NULL);
     require_noerr(err, exit);
 
   /*Sector 4*/
@@ -255,17 +329,33 @@ OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext )
 
 
     // SPP protocol remote server connection enable
-    err = MICOAddSwitchCellToSector(sector, "Connect SPP Server",   inContext->flashContentInRam.appConfig.remoteServerEnable,   "RW");
+    err = MICOAddSwitchCellToSector(sector, "Connect SPP Server",   config->appConfig.remoteServerEnable,   "RW");
     require_noerr(err, exit);
 
     //Seerver address cell
-    err = MICOAddStringCellToSector(sector, "SPP Server",           inContext->flashContentInRam.appConfig.remoteServerDomain,   "RW", NULL);
+    err = MICOAddStringCellToSector(sector, "SPP Server",           config->appConfig.remoteServerDomain,   "RW", NULL);
     require_noerr(err, exit);
 
     //Seerver port cell
-    err = MICOAddNumberCellToSector(sector, "SPP Server Port",      inContext->flashContentInRam.appConfig.remoteServerPort,   "RW", NULL);
+    err = MICOAddNumberCellToSector(sector, "SPP Server Port",      config->appConfig.remoteServerPort,   "RW", NULL);
+    require_noerr(err, exit);
+
+    //Seerver weight cell
+    err = MICOAddNumberCellToSector(sector, "SPP Server Weight",    config->appConfig.remoteServerWeight,   "RW", NULL);
     require_noerr(err, exit);
 
+    //Backup server cells
+    for(i = 0; i < MAX_BACKUP_REMOTE_SERVER_NUM; i++){
+      sprintf(name, BACKUP_SERVER_CELL"%d", i + 1);
+      if(config->appConfig.backupRemoteServers[i].domain[0] == 0x0)
+        backup[0] = 0x0;
+      else
+        snprintf(backup, sizeof(backup), "%s:%d:%d", config->appConfig.backupRemoteServers[i].domain,
+                 config->appConfig.backupRemoteServers[i].port, config->appConfig.backupRemoteServers[i].weight);
+      err = MICOAddStringCellToSector(sector, name,                 backup,   "RW", NULL);
+      require_noerr(err, exit);
+    }
+
   /*Sector 5*/
   sector = json_object_new_array();
   require( sector, exit );
@@ -281,14 +371,75 @@ OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext )
     json_object_array_add(selectArray, json_object_new_int(38400));
     json_object_array_add(selectArray, json_object_new_int(57600));
     json_object_array_add(selectArray, json_object_new_int(115200));
-    err = MICOAddNumberCellToSector(sector, "Baurdrate", inContext->flashContentInRam.appConfig.USART_BaudRate, "RW", selectArray);
+    json_object_array_add(selectArray, json_object_new_int(230400));
+    json_object_array_add(selectArray, json_object_new_int(460800));
+    json_object_array_add(selectArray, json_object_new_int(921600));
+    err = MICOAddNumberCellToSector(sector, "Baurdrate", config->appConfig.USART_BaudRate, "RW", selectArray);
+    require_noerr(err, exit);
+
+    selectArray = json_object_new_array();
+    require( selectArray, exit );
+    for(i = 0; i < sizeof(_parity_names)/sizeof(_parity_names[0]); i++)
+      json_object_array_add(selectArray, json_object_new_string(_parity_names[i]));
+    err = MICOAddStringCellToSector(sector, "Parity", (char *)_parity_names[Min(config->appConfig.USART_Parity, UART_PARITY_EVEN)], "RW", selectArray);
+    require_noerr(err, exit);
+
+    selectArray = json_object_new_array();
+    require( selectArray, exit );
+    json_object_array_add(selectArray, json_object_new_int(1));
+    json_object_array_add(selectArray, json_object_new_int(2));
+    err = MICOAddNumberCellToSector(sector, "Stop Bits", config->appConfig.USART_StopBits, "RW", selectArray);
+    require_noerr(err, exit);
+
+    err = MICOAddSwitchCellToSector(sector, "Flow Control", config->appConfig.USART_FlowControl, "RW");
+    require_noerr(err, exit);
+
+    /*UART to TCP write coalescing cells*/
+    err = MICOAddNumberCellToSector(sector, "Coalesce Latency", config->appConfig.coalesceLatency, "RW", NULL);
+    require_noerr(err, exit);
+
+    err = MICOAddNumberCellToSector(sector, "Coalesce Bytes", config->appConfig.coalesceBytes, "RW", NULL);
+    require_noerr(err, exit);
+
+    err = MICOAddSwitchCellToSector(sector, "Flush On Frame", config->appConfig.coalesceFlushOnFrame, "RW");
+    require_noerr(err, exit);
+
+    /*Data that starts with this prefix goes out ahead of bulk data*/
+    prefix[0] = 0x0;
+    for(i = 0; i < config->appConfig.controlPrefixLen && i < MAX_CONTROL_PREFIX_LEN; i++)
+      sprintf(prefix + 2*i, "%02X", config->appConfig.controlPrefix[i]);
+    err = MICOAddStringCellToSector(sector, "Control Prefix", prefix, "RW", NULL);
+    require_noerr(err, exit);
+
+    SocketCoalesceStatistics(&coalesceWrites, &coalesceSegments);
+    err = MICOAddNumberCellToSector(sector, "Segments Saved", coalesceWrites - coalesceSegments, "RO", NULL);
+    require_noerr(err, exit);
+
+    /*TCP to UART scheduling cells*/
+    MICOSerialSchedulerStatistics(&schedulerStats);
+    err = MICOAddNumberCellToSector(sector, "UART Drops", schedulerStats.dropped, "RO", NULL);
+    require_noerr(err, exit);
+
+    err = MICOAddNumberCellToSector(sector, "UART Max Delay", schedulerStats.maxDelay_ms, "RO", NULL);
+    require_noerr(err, exit);
+
+    err = MICOAddNumberCellToSector(sector, "UART Avg Delay", schedulerStats.avgDelay_ms, "RO", NULL);
+    require_noerr(err, exit);
+
+    err = MICOAddNumberCellToSector(sector, "Control Max Delay", schedulerStats.controlMaxDelay_ms, "RO", NULL);
+    require_noerr(err, exit);
+
+    /*Buffers no pool class could take*/
+    buffer_pool_stats(&poolStats);
+    err = MICOAddNumberCellToSector(sector, "Pool Heap Fallbacks", poolStats.heap, "RO", NULL);
     require_noerr(err, exit);
 
   inContext->micoStatus.easylink_report = mainObject;
-  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
   
 exit:
-    return err;
+  if(config) free(config);
+  if(status) free(status);
+  return err;
 
 }
 
@@ -296,12 +447,19 @@ OSStatus ConfigIncommingJsonMessage( const char *input, mico_Context_t * const i
 {
   OSStatus err = kNoErr;
   json_object *new_obj;
+  flash_content_t *before = NULL;
+  bool uartChanged;
+  int index;
   config_delegate_log_trace();
 
+  before = malloc(sizeof(flash_content_t));
+  require_action(before, exit, err = kNoMemoryErr);
   new_obj = json_tokener_parse(input);
   require_action(new_obj, exit, err = kUnknownErr);
   config_delegate_log("Recv config object=%s", json_object_to_json_string(new_obj));
   mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  memcpy(before, &inContext->flashContentInRam, sizeof(flash_content_t));
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   json_object_object_foreach(new_obj, key, val) {
     if(!strcmp(key, "Device Name")){
       strncpy(inContext->flashContentInRam.micoSystemConfig.name, json_object_get_string(val), maxNameLen);
@@ -330,16 +488,49 @@ OSStatus ConfigIncommingJsonMessage( const char *input, mico_Context_t * const i
       strncpy(inContext->flashContentInRam.appConfig.remoteServerDomain, json_object_get_string(val), 64);
     }else if(!strcmp(key, "SPP Server Port")){
       inContext->flashContentInRam.appConfig.remoteServerPort = json_object_get_int(val);
+    }else if(!strcmp(key, "SPP Server Weight")){
+      inContext->flashContentInRam.appConfig.remoteServerWeight = (uint8_t)Min(Max(json_object_get_int(val), 0), 255);
+    }else if(!strncmp(key, BACKUP_SERVER_CELL, strlen(BACKUP_SERVER_CELL))){
+      index = atoi(key + strlen(BACKUP_SERVER_CELL)) - 1;
+      if(index >= 0 && index < MAX_BACKUP_REMOTE_SERVER_NUM)
+        _parse_backup_server(json_object_get_string(val), &inContext->flashContentInRam.appConfig.backupRemoteServers[index]);
     }else if(!strcmp(key, "Baurdrate")){
       inContext->flashContentInRam.appConfig.USART_BaudRate = json_object_get_int(val);
+    }else if(!strcmp(key, "Parity")){
+      for(index = 0; index < sizeof(_parity_names)/sizeof(_parity_names[0]); index++){
+        if(!strcmp(json_object_get_string(val), _parity_names[index]))
+          inContext->flashContentInRam.appConfig.USART_Parity = index;
+      }
+    }else if(!strcmp(key, "Stop Bits")){
+      inContext->flashContentInRam.appConfig.USART_StopBits = (json_object_get_int(val) == 2) ? 2 : 1;
+    }else if(!strcmp(key, "Flow Control")){
+      inContext->flashContentInRam.appConfig.USART_FlowControl = json_object_get_boolean(val);
+    }else if(!strcmp(key, "Coalesce Latency")){
+      inContext->flashContentInRam.appConfig.coalesceLatency = Max(json_object_get_int(val), 0);
+    }else if(!strcmp(key, "Coalesce Bytes")){
+      inContext->flashContentInRam.appConfig.coalesceBytes = Min(Max(json_object_get_int(val), 1), MAX_COALESCE_BYTES);
+    }else if(!strcmp(key, "Flush On Frame")){
+      inContext->flashContentInRam.appConfig.coalesceFlushOnFrame = json_object_get_boolean(val);
+    }else if(!strcmp(key, "Control Prefix")){
+      _parse_control_prefix(json_object_get_string(val), &inContext->flashContentInRam.appConfig);
     }
   }
   json_object_put(new_obj);
-  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
-
   inContext->flashContentInRam.micoSystemConfig.configured = allConfigured;
+  uartChanged = _uart_changed(&before->appConfig, &inContext->flashContentInRam.appConfig);
+  inContext->micoStatus.configNeedsReset = _needs_reset(before, &inContext->flashContentInRam);
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
+
   MICOUpdateConfiguration(inContext);
+  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
+
+  if(uartChanged && inContext->micoStatus.configNeedsReset == false){
+    config_delegate_log("Apply UART settings: %d", inContext->flashContentInRam.appConfig.USART_BaudRate);
+    MICOSerialSchedulerFlush(UART_RECONFIG_FLUSH_TIME);
+    err = PlatformUartReconfigure(inContext);
+  }
 
 exit:
+  if(before) free(before);
   return err; 
 }
\ No newline at end of file
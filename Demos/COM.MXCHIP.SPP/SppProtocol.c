@@ -23,6 +23,7 @@
 #include "MICOAppDefine.h"
 #include "SppProtocol.h"
 #include "PlatformUart.h"
+#include "MICOSerialScheduler.h"
 
 
 
@@ -42,14 +43,82 @@
 
 static int _recved_uart_loopback_fd = -1;
 
+/* Data that starts with the configured prefix is control traffic. The check
+   is made per received chunk, so a control frame must not share a TCP
+   segment or UART packet with bulk data that comes before it. */
+static mico_serial_class_t _classify(const uint8_t *inBuf, int inLen, mico_Context_t * const inContext)
+{
+  application_config_t *config = &inContext->flashContentInRam.appConfig;
+
+  if(config->controlPrefixLen == 0 || config->controlPrefixLen > MAX_CONTROL_PREFIX_LEN || inLen < config->controlPrefixLen)
+    return MICO_SERIAL_BULK;
+  if(memcmp(inBuf, config->controlPrefix, config->controlPrefixLen) != 0)
+    return MICO_SERIAL_BULK;
+  return MICO_SERIAL_CONTROL;
+}
+
+/* On timeout the backlog is dropped as well: datagrams the loopback lost
+   are never counted as sent, and would otherwise hold every later packet */
+static bool _backlogged(uart_backlog_t *inBacklog, int inLen, bool inResync)
+{
+  if((int32_t)(inBacklog->queued - inBacklog->sent) + inLen <= UART_BACKLOG_LIMIT)
+    return false;
+  if(inResync)
+    inBacklog->queued = inBacklog->sent;
+  return true;
+}
+
+static bool _any_backlogged(int inLen, mico_Context_t * const inContext, bool inResync)
+{
+  current_app_status_t *status = &inContext->appStatus;
+  bool behind = false;
+  int i;
+
+  for(i = 0; i < MAX_Local_Client_Num; i++){
+    if(status->loopBack_PortList[i] != 0 && _backlogged(&status->loopBack_Backlog[i], inLen, inResync))
+      behind = true;
+  }
+  if((status->isRemoteConnected == true || status->isRemoteFailingOver == true) && _backlogged(&status->remoteBacklog, inLen, inResync))
+    behind = true;
+  return behind;
+}
+
+/* Hold the UART thread while a socket thread is behind. The RX ring fills
+   up meanwhile and, with flow control on, RTS stops the MCU. */
+static void _wait_for_room(int inLen, mico_Context_t * const inContext)
+{
+  uint32_t waited = 0;
+
+  while(UART_BACKLOG_MAX_WAIT == 0 || waited < UART_BACKLOG_MAX_WAIT){
+    if(_any_backlogged(inLen, inContext, false) == false)
+      return;
+    mico_thread_msleep(UART_BACKLOG_POLL);
+    waited += UART_BACKLOG_POLL;
+  }
+  _any_backlogged(inLen, inContext, true);
+}
+
 OSStatus sppProtocolInit(mico_Context_t * const inContext)
 {
   spp_log_trace();
   OSStatus err = kUnknownErr;
   (void)inContext;
   struct sockaddr_t addr;
+  mico_serial_scheduler_config_t schedulerConfig;
 
   inContext->appStatus.isRemoteConnected = false;
+  inContext->appStatus.isRemoteFailingOver = false;
+  memset(&inContext->appStatus.remoteBacklog, 0x0, sizeof(uart_backlog_t));
+
+  schedulerConfig.uartRate = SERIAL_UART_RATE;
+  schedulerConfig.uartBurst = SERIAL_UART_BURST;
+  schedulerConfig.clientRate = SERIAL_CLIENT_RATE_DOWN;
+  schedulerConfig.clientBurst = SERIAL_CLIENT_BURST;
+  schedulerConfig.quantum = SERIAL_DRR_QUANTUM;
+  schedulerConfig.clientQueueLen = SERIAL_CLIENT_QUEUE_LEN;
+  err = MICOSerialSchedulerInit(&schedulerConfig);
+  if(err != kNoErr)
+    spp_log("Serial scheduler not started, err = %d", err);
 
   _recved_uart_loopback_fd = socket(AF_INET, SOCK_DGRM, IPPROTO_UDP);
   addr.s_ip = IPADDR_LOOPBACK;
@@ -62,11 +131,12 @@ OSStatus sppProtocolInit(mico_Context_t * const inContext)
 OSStatus sppWlanCommandProcess(unsigned char *inBuf, int *inBufLen, int inSocketFd, mico_Context_t * const inContext)
 {
   spp_log_trace();
-  (void)inSocketFd;
-  (void)inContext;
   OSStatus err = kUnknownErr;
 
-  err = PlatformUartSend(inBuf, *inBufLen);
+  /* Queued per client, so one busy client cannot keep the others off the UART */
+  err = MICOSerialSchedulerSend(inSocketFd, _classify(inBuf, *inBufLen, inContext), inBuf, *inBufLen);
+  if(err == kNotInitializedErr)
+    err = PlatformUartSend(inBuf, *inBufLen);
 
   *inBufLen = 0;
   return err;
@@ -78,21 +148,34 @@ OSStatus sppUartCommandProcess(uint8_t *inBuf, int inLen, mico_Context_t * const
   OSStatus err = kNoErr;
   int i;
   struct sockaddr_t addr;
+  uint16_t offset;
 
   addr.s_ip = IPADDR_LOOPBACK;
+  /* Control data has its own loopback port in every socket thread */
+  offset = (_classify(inBuf, inLen, inContext) == MICO_SERIAL_CONTROL) ? CONTROL_LOOPBACK_PORT_OFFSET : 0;
+  /* Only bulk data is accounted, control data bypasses the backlog */
+  if(offset == 0)
+    _wait_for_room(inLen, inContext);
 
   for(i=0; i < MAX_Local_Client_Num; i++) {
     if( inContext->appStatus.loopBack_PortList[i] != 0 ){
-      addr.s_port = inContext->appStatus.loopBack_PortList[i];
+      addr.s_port = inContext->appStatus.loopBack_PortList[i] + offset;
+      if(offset == 0)
+        inContext->appStatus.loopBack_Backlog[i].queued += inLen;
       sendto(_recved_uart_loopback_fd, inBuf, inLen, 0, &addr, sizeof(addr));
     }
   }
 
-  if(inContext->appStatus.isRemoteConnected==true){
+  if(inContext->appStatus.isRemoteConnected==true || inContext->appStatus.isRemoteFailingOver==true){
     addr.s_ip = IPADDR_LOOPBACK;
-    addr.s_port = REMOTE_TCP_CLIENT_LOOPBACK_PORT;
+    addr.s_port = REMOTE_TCP_CLIENT_LOOPBACK_PORT + offset;
+    if(offset == 0)
+      inContext->appStatus.remoteBacklog.queued += inLen;
     sendto(_recved_uart_loopback_fd, inBuf, inLen, 0, &addr, sizeof(addr));
-  }        
+  }else{
+    /* Kept until the remote server is reachable again */
+    remoteTcpClientStore(inBuf, inLen);
+  }
   return err;
 }
 
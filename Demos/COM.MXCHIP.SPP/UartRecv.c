@@ -24,6 +24,7 @@
 #include "SppProtocol.h"
 #include "PlatformUart.h"
 #include "MICONotificationCenter.h"
+#include "BufferPoolUtils.h"
 
 #define uart_recv_log(M, ...) custom_log("UART RECV", M, ##__VA_ARGS__)
 #define uart_recv_log_trace() custom_log_trace("UART RECV")
@@ -37,7 +38,7 @@ void uartRecv_thread(void *inContext)
   int recvlen;
   uint8_t *inDataBuffer;
   
-  inDataBuffer = malloc(UART_ONE_PACKAGE_LENGTH);
+  inDataBuffer = buffer_pool_alloc(BUFFER_POOL_UART, UART_ONE_PACKAGE_LENGTH);
   require(inDataBuffer, exit);
   
   while(1) {
@@ -48,7 +49,7 @@ void uartRecv_thread(void *inContext)
   }
   
 exit:
-  if(inDataBuffer) free(inDataBuffer);
+  buffer_pool_release(inDataBuffer);
 }
 
 /* Packet format: BB 00 CMD(2B) Status(2B) datalen(2B) data(x) checksum(2B)
@@ -24,6 +24,7 @@
 #define __MICORTOS_H__
 
 #include "Common.h"
+#include "TimerWheelUtils.h"
 
 #define MICO_NEVER_TIMEOUT   (0xFFFFFFFF)
 #define MICO_WAIT_FOREVER    (0xFFFFFFFF)
@@ -71,6 +72,36 @@ typedef struct
     void*           arg;
 }mico_timer_t;
 
+typedef OSStatus (*event_handler_t)( void* arg );
+
+typedef struct
+{
+    mico_thread_t thread;
+    mico_queue_t  event_queue;
+} mico_worker_thread_t;
+
+typedef struct
+{
+    event_handler_t       function;
+    void*                 arg;
+    timer_wheel_entry_t   entry;
+    uint32_t              period_ms;    /* 0 for a delayed event that runs once */
+    mico_worker_thread_t* thread;
+} mico_timed_event_t;
+
+/* Timed events share one timing wheel driven by a single RTOS timer, their
+   time is rounded up to this resolution */
+#ifndef MICO_TIMED_EVENT_TICK_MS
+#define MICO_TIMED_EVENT_TICK_MS          (50)
+#endif
+
+/* Shared worker threads, created by MICO before the application starts */
+extern mico_worker_thread_t mico_default_worker_thread;
+extern mico_worker_thread_t mico_network_worker_thread;
+
+#define MICO_DEFAULT_WORKER_THREAD        (&mico_default_worker_thread)
+#define MICO_NETWORKING_WORKER_THREAD     (&mico_network_worker_thread)
+
 /** Creates and starts a new thread
  *
  * @param thread     : Pointer to variable that will receive the thread handle
@@ -137,6 +168,98 @@ OSStatus mico_rtos_thread_join( mico_thread_t* thread );
 OSStatus mico_rtos_thread_force_awake( mico_thread_t* thread );
 
 
+/** Creates a worker thread
+ *
+ * A worker thread runs the events sent to it one after another, in the
+ * order they were queued
+ *
+ * @param worker_thread    : a pointer to the worker thread to be created
+ * @param priority         : thread priority
+ * @param stack_size       : thread's stack size in number of bytes
+ * @param event_queue_size : number of events can be pushed into the queue
+ *
+ * @return    kNoErr        : on success.
+ * @return    kGeneralErr   : if an error occurred
+ */
+OSStatus mico_rtos_create_worker_thread( mico_worker_thread_t* worker_thread, uint8_t priority, uint32_t stack_size, uint32_t event_queue_size );
+
+
+/** Deletes a worker thread
+ *
+ * @param worker_thread : a pointer to the worker thread to be deleted
+ *
+ * @return    kNoErr        : on success.
+ * @return    kGeneralErr   : if an error occurred
+ */
+OSStatus mico_rtos_delete_worker_thread( mico_worker_thread_t* worker_thread );
+
+
+/** Sends an asynchronous event to the associated worker thread
+ *
+ * The event is dropped if the event queue of the worker thread is full
+ *
+ * @param worker_thread : the worker thread in which the event handler will run
+ * @param function      : the event handler function
+ * @param arg           : the argument which will be passed to the event handler
+ *
+ * @return    kNoErr          : on success.
+ * @return    kNoResourcesErr : if the event queue is full
+ */
+OSStatus mico_rtos_send_asynchronous_event( mico_worker_thread_t* worker_thread, event_handler_t function, void* arg );
+
+
+/** Requests a function be called at a regular interval
+ *
+ * The function is called from the worker thread, so it may block, but it
+ * delays every other event of that worker while doing so
+ *
+ * @param event_object  : a pointer to the zero initialised event object, must stay valid until deregistered
+ * @param worker_thread : the worker thread in which the event handler will run
+ * @param function      : the event handler function
+ * @param time_ms       : the time period between function calls in milliseconds
+ * @param arg           : the argument which will be passed to the event handler
+ *
+ * @return    kNoErr        : on success.
+ * @return    kGeneralErr   : if an error occurred
+ */
+OSStatus mico_rtos_register_timed_event( mico_timed_event_t* event_object, mico_worker_thread_t* worker_thread, event_handler_t function, uint32_t time_ms, void* arg );
+
+
+/** Requests a function be called once, after a delay
+ *
+ * Sending an event object that is still pending restarts its delay
+ *
+ * @param event_object  : a pointer to the zero initialised event object, must stay valid until it runs or is deregistered
+ * @param worker_thread : the worker thread in which the event handler will run
+ * @param function      : the event handler function
+ * @param delay_ms      : the delay before the function is called in milliseconds
+ * @param arg           : the argument which will be passed to the event handler
+ *
+ * @return    kNoErr        : on success.
+ * @return    kGeneralErr   : if an error occurred
+ */
+OSStatus mico_rtos_send_delayed_event( mico_timed_event_t* event_object, mico_worker_thread_t* worker_thread, event_handler_t function, uint32_t delay_ms, void* arg );
+
+
+/** Removes a request for a regular or delayed function execution
+ *
+ * @param event_object : the event object used in @ref mico_rtos_register_timed_event
+ *                       or @ref mico_rtos_send_delayed_event
+ *
+ * @return    kNoErr        : on success.
+ * @return    kGeneralErr   : if an error occurred
+ */
+OSStatus mico_rtos_deregister_timed_event( mico_timed_event_t* event_object );
+
+
+/** Creates the shared worker threads
+ *
+ * @return    kNoErr        : on success.
+ * @return    kGeneralErr   : if an error occurred
+ */
+OSStatus mico_rtos_init_default_worker_threads( void );
+
+
 /** Checks if a thread is the current thread
  *
  * Checks if a specified thread is the currently running thread
@@ -0,0 +1,263 @@
+/**
+******************************************************************************
+* @file    MICOWorkerThread.c
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This file provides worker threads and the events run on them.
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/
+
+#include "MICORTOS.h"
+#include "Debug.h"
+
+#define worker_log(M, ...) custom_log("Worker", M, ##__VA_ARGS__)
+#define worker_log_trace() custom_log_trace("Worker")
+
+#ifndef DEFAULT_WORKER_THREAD_STACK_SIZE
+#define DEFAULT_WORKER_THREAD_STACK_SIZE      (0x800)
+#endif
+
+#ifndef DEFAULT_WORKER_THREAD_QUEUE_SIZE
+#define DEFAULT_WORKER_THREAD_QUEUE_SIZE      (16)
+#endif
+
+#ifndef NETWORK_WORKER_THREAD_STACK_SIZE
+#define NETWORK_WORKER_THREAD_STACK_SIZE      (0x500)
+#endif
+
+#ifndef NETWORK_WORKER_THREAD_QUEUE_SIZE
+#define NETWORK_WORKER_THREAD_QUEUE_SIZE      (8)
+#endif
+
+typedef struct
+{
+    event_handler_t function;
+    void*           arg;
+} mico_event_message_t;
+
+mico_worker_thread_t mico_default_worker_thread;
+mico_worker_thread_t mico_network_worker_thread;
+
+/* Every timed event lives in this wheel, protected by timed_event_mutex */
+static timer_wheel_t  timed_event_wheel;
+static mico_mutex_t   timed_event_mutex = NULL;
+static mico_timer_t   timed_event_timer;
+static bool           timed_event_timer_running = false;  //Wanted state, under timed_event_mutex
+static bool           timed_event_timer_active = false;   //Actual state, default worker only
+static volatile bool  timed_event_tick_pending = false;
+static uint32_t       timed_event_tick_time;
+
+static void worker_thread_main( void* arg )
+{
+  mico_worker_thread_t* worker_thread = (mico_worker_thread_t*) arg;
+  mico_event_message_t message;
+
+  while(1){
+    if(mico_rtos_pop_from_queue(&worker_thread->event_queue, &message, MICO_WAIT_FOREVER) == kNoErr)
+      message.function(message.arg);
+  }
+}
+
+OSStatus mico_rtos_create_worker_thread( mico_worker_thread_t* worker_thread, uint8_t priority, uint32_t stack_size, uint32_t event_queue_size )
+{
+  OSStatus err = kNoErr;
+  require_action(worker_thread, exit, err = kParamErr);
+  memset(worker_thread, 0, sizeof(mico_worker_thread_t));
+
+  err = mico_rtos_init_queue(&worker_thread->event_queue, "worker queue", sizeof(mico_event_message_t), event_queue_size);
+  require_noerr(err, exit);
+
+  err = mico_rtos_create_thread(&worker_thread->thread, priority, "worker thread", worker_thread_main, stack_size, (void*)worker_thread);
+  require_noerr_action(err, exit, mico_rtos_deinit_queue(&worker_thread->event_queue));
+
+exit:
+  return err;
+}
+
+OSStatus mico_rtos_delete_worker_thread( mico_worker_thread_t* worker_thread )
+{
+  OSStatus err = kNoErr;
+  require_action(worker_thread, exit, err = kParamErr);
+
+  err = mico_rtos_delete_thread(&worker_thread->thread);
+  require_noerr(err, exit);
+  err = mico_rtos_deinit_queue(&worker_thread->event_queue);
+  require_noerr(err, exit);
+  memset(worker_thread, 0, sizeof(mico_worker_thread_t));
+
+exit:
+  return err;
+}
+
+OSStatus mico_rtos_send_asynchronous_event( mico_worker_thread_t* worker_thread, event_handler_t function, void* arg )
+{
+  OSStatus err = kNoErr;
+  mico_event_message_t message;
+  require_action(worker_thread && function, exit, err = kParamErr);
+  require_action(worker_thread->event_queue, exit, err = kNotInitializedErr);
+
+  message.function = function;
+  message.arg = arg;
+
+  /* Never block the sender, a full queue means the worker is overloaded */
+  err = mico_rtos_push_to_queue(&worker_thread->event_queue, &message, MICO_NO_WAIT);
+  require_noerr_action(err, exit, err = kNoResourcesErr);
+
+exit:
+  return err;
+}
+
+static uint32_t timed_event_ticks( uint32_t time_ms )
+{
+  /* One extra tick, the wheel may be up to a tick ahead of the caller */
+  return time_ms / MICO_TIMED_EVENT_TICK_MS + 1;
+}
+
+/* Runs from timed_event_advance with timed_event_mutex held, only hands the
+   event to its worker */
+static void timed_event_expired( void* arg )
+{
+  mico_timed_event_t* event_object = (mico_timed_event_t*) arg;
+
+  if(event_object->period_ms != 0)
+    timer_wheel_add(&timed_event_wheel, &event_object->entry, timed_event_ticks(event_object->period_ms) - 1);
+
+  if(mico_rtos_send_asynchronous_event(event_object->thread, event_object->function, event_object->arg) != kNoErr)
+    worker_log("Timed event dropped, worker queue is full");
+}
+
+/* Runs on the default worker, the only place the timer is started or
+   stopped, so those commands stay in order and never wait under the mutex */
+static OSStatus timed_event_advance( void* arg )
+{
+  uint32_t elapsed;
+  bool running;
+  (void)arg;
+
+  timed_event_tick_pending = false;
+  mico_rtos_lock_mutex(&timed_event_mutex);
+  elapsed = (mico_get_time() - timed_event_tick_time) / MICO_TIMED_EVENT_TICK_MS;
+  timed_event_tick_time += elapsed * MICO_TIMED_EVENT_TICK_MS;
+  timer_wheel_advance(&timed_event_wheel, elapsed);
+
+  /* Let the MCU sleep while no event is pending */
+  timed_event_timer_running = timed_event_wheel.count != 0;
+  running = timed_event_timer_running;
+  mico_rtos_unlock_mutex(&timed_event_mutex);
+
+  if(running == true && timed_event_timer_active == false)
+    timed_event_timer_active = mico_start_timer(&timed_event_timer) == kNoErr;
+  else if(running == false && timed_event_timer_active == true){
+    mico_stop_timer(&timed_event_timer);
+    timed_event_timer_active = false;
+  }
+  return kNoErr;
+}
+
+/* Runs in the RTOS timer context, must not wait for anything */
+static void timed_event_tick( void* arg )
+{
+  (void)arg;
+
+  if(timed_event_tick_pending == true)
+    return;
+  timed_event_tick_pending = true;
+  if(mico_rtos_send_asynchronous_event(MICO_DEFAULT_WORKER_THREAD, timed_event_advance, NULL) != kNoErr)
+    timed_event_tick_pending = false;
+}
+
+static OSStatus timed_event_start( mico_timed_event_t* event_object, mico_worker_thread_t* worker_thread, event_handler_t function, uint32_t time_ms, void* arg, uint32_t period_ms )
+{
+  OSStatus err = kNoErr;
+  bool start = false;
+  require_action(event_object && worker_thread && function, exit, err = kParamErr);
+  require_action(timed_event_mutex, exit, err = kNotInitializedErr);
+
+  mico_rtos_lock_mutex(&timed_event_mutex);
+  timer_wheel_cancel(&timed_event_wheel, &event_object->entry);
+  timer_wheel_entry_init(&event_object->entry, timed_event_expired, (void*)event_object);
+  event_object->function = function;
+  event_object->arg = arg;
+  event_object->thread = worker_thread;
+  event_object->period_ms = period_ms;
+
+  if(timed_event_timer_running == false){
+    timed_event_tick_time = mico_get_time();
+    timed_event_timer_running = true;
+    start = true;
+  }
+  timer_wheel_add(&timed_event_wheel, &event_object->entry, timed_event_ticks(time_ms));
+  mico_rtos_unlock_mutex(&timed_event_mutex);
+
+  /* The worker starts the timer */
+  if(start == true){
+    err = mico_rtos_send_asynchronous_event(MICO_DEFAULT_WORKER_THREAD, timed_event_advance, NULL);
+    if(err != kNoErr){
+      mico_rtos_lock_mutex(&timed_event_mutex);
+      timer_wheel_cancel(&timed_event_wheel, &event_object->entry);
+      timed_event_timer_running = false;
+      mico_rtos_unlock_mutex(&timed_event_mutex);
+    }
+  }
+
+exit:
+  return err;
+}
+
+OSStatus mico_rtos_register_timed_event( mico_timed_event_t* event_object, mico_worker_thread_t* worker_thread, event_handler_t function, uint32_t time_ms, void* arg )
+{
+  if(time_ms == 0)
+    return kParamErr;
+  return timed_event_start(event_object, worker_thread, function, time_ms, arg, time_ms);
+}
+
+OSStatus mico_rtos_send_delayed_event( mico_timed_event_t* event_object, mico_worker_thread_t* worker_thread, event_handler_t function, uint32_t delay_ms, void* arg )
+{
+  return timed_event_start(event_object, worker_thread, function, delay_ms, arg, 0);
+}
+
+OSStatus mico_rtos_deregister_timed_event( mico_timed_event_t* event_object )
+{
+  OSStatus err = kNoErr;
+  require_action(event_object, exit, err = kParamErr);
+  require_action(timed_event_mutex, exit, err = kNotInitializedErr);
+
+  mico_rtos_lock_mutex(&timed_event_mutex);
+  timer_wheel_cancel(&timed_event_wheel, &event_object->entry);
+  mico_rtos_unlock_mutex(&timed_event_mutex);
+
+exit:
+  return err;
+}
+
+OSStatus mico_rtos_init_default_worker_threads( void )
+{
+  OSStatus err = kNoErr;
+
+  timer_wheel_init(&timed_event_wheel);
+  err = mico_init_timer(&timed_event_timer, MICO_TIMED_EVENT_TICK_MS, timed_event_tick, NULL);
+  require_noerr(err, exit);
+  err = mico_rtos_init_mutex(&timed_event_mutex);
+  require_noerr(err, exit);
+
+  err = mico_rtos_create_worker_thread(MICO_DEFAULT_WORKER_THREAD, MICO_DEFAULT_WORKER_PRIORITY, DEFAULT_WORKER_THREAD_STACK_SIZE, DEFAULT_WORKER_THREAD_QUEUE_SIZE);
+  require_noerr_action(err, exit, worker_log("ERROR: Unable to start the default worker thread."));
+
+  err = mico_rtos_create_worker_thread(MICO_NETWORKING_WORKER_THREAD, MICO_NETWORK_WORKER_PRIORITY, NETWORK_WORKER_THREAD_STACK_SIZE, NETWORK_WORKER_THREAD_QUEUE_SIZE);
+  require_noerr_action(err, exit, worker_log("ERROR: Unable to start the network worker thread."));
+
+exit:
+  return err;
+}
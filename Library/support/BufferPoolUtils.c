@@ -0,0 +1,204 @@
+/**
+******************************************************************************
+* @file    BufferPoolUtils.c
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This file contains function called by buffer pool operation
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/
+
+#include "BufferPoolUtils.h"
+#include "MICO.h"
+
+#define BUFFER_POOL_HEAP    0xFF    /* Class of buffers served from the heap */
+
+/* Kept in front of every buffer, 4 bytes so the data stays word aligned */
+typedef struct
+{
+  uint8_t   cls;
+  uint8_t   user;
+  uint16_t  refs;
+} buffer_pool_header_t;
+
+typedef struct _buffer_pool_free
+{
+  struct _buffer_pool_free* next;
+} buffer_pool_free_t;
+
+static bool                 _ready = false;
+static mico_mutex_t         _mutex;
+static uint8_t*             _memory = NULL;
+static buffer_pool_free_t*  _free[BUFFER_POOL_CLASSES];
+static uint32_t             _quota[BUFFER_POOL_USERS];
+static buffer_pool_stats_t  _stats;
+
+static uint32_t _stride( uint16_t size )
+{
+  return sizeof(buffer_pool_header_t) + ((size + 3) & ~3UL);
+}
+
+static void _lock( void )
+{
+  if( _ready ) mico_rtos_lock_mutex( &_mutex );
+}
+
+static void _unlock( void )
+{
+  if( _ready ) mico_rtos_unlock_mutex( &_mutex );
+}
+
+static uint32_t _charge( buffer_pool_header_t* header )
+{
+  if( header->cls == BUFFER_POOL_HEAP )
+    return 0;
+  return _stats.classes[header->cls].size;
+}
+
+OSStatus buffer_pool_init( const buffer_pool_config_t* config )
+{
+  OSStatus err = kNoErr;
+  uint32_t total = 0;
+  uint8_t* block;
+  uint8_t i, j;
+
+  require_action( _ready == false, exit, err = kAlreadyInitializedErr );
+  memset( &_stats, 0x0, sizeof(_stats) );
+  memcpy( _quota, config->quota, sizeof(_quota) );
+
+  for( i = 0; i < BUFFER_POOL_CLASSES; i++ ){
+    require_action( i == 0 || config->classes[i].count == 0 || config->classes[i].size > config->classes[i - 1].size, exit, err = kParamErr );
+    require_action( config->classes[i].count == 0 || config->classes[i].size >= sizeof(buffer_pool_free_t), exit, err = kParamErr );
+    total += config->classes[i].count * _stride( config->classes[i].size );
+  }
+
+  if( total ){
+    _memory = malloc( total );
+    require_action( _memory, exit, err = kNoMemoryErr );
+  }
+
+  block = _memory;
+  for( i = 0; i < BUFFER_POOL_CLASSES; i++ ){
+    _stats.classes[i].size = config->classes[i].size;
+    _stats.classes[i].count = config->classes[i].count;
+    _stats.classes[i].free = config->classes[i].count;
+    _stats.classes[i].minFree = config->classes[i].count;
+    _free[i] = NULL;
+    for( j = 0; j < config->classes[i].count; j++ ){
+      ((buffer_pool_header_t*)block)->cls = i;
+      ((buffer_pool_free_t*)(block + sizeof(buffer_pool_header_t)))->next = _free[i];
+      _free[i] = (buffer_pool_free_t*)(block + sizeof(buffer_pool_header_t));
+      block += _stride( config->classes[i].size );
+    }
+  }
+
+  err = mico_rtos_init_mutex( &_mutex );
+  require_noerr( err, exit );
+  _ready = true;
+
+exit:
+  return err;
+}
+
+void* buffer_pool_alloc( buffer_pool_user_t user, uint32_t size )
+{
+  buffer_pool_header_t* header = NULL;
+  uint8_t i;
+  bool best = true;
+
+  require( user < BUFFER_POOL_USERS, exit );
+  _lock();
+
+  /* Take the next larger class rather than the heap while one is free. A
+     user over its quota is served from the heap, which leaves the pool to
+     the others but still works as it did before the pool. */
+  for( i = 0; i < BUFFER_POOL_CLASSES; i++ ){
+    if( _stats.classes[i].count == 0 || _stats.classes[i].size < size )
+      continue;
+    if( _quota[user] && _stats.inUse[user] + _stats.classes[i].size > _quota[user] ){
+      _stats.overQuota++;
+      break;
+    }
+    if( _free[i] ){
+      header = (buffer_pool_header_t*)((uint8_t*)_free[i] - sizeof(buffer_pool_header_t));
+      _free[i] = _free[i]->next;
+      if( --_stats.classes[i].free < _stats.classes[i].minFree )
+        _stats.classes[i].minFree = _stats.classes[i].free;
+      break;
+    }
+    if( best )
+      _stats.classes[i].exhausted++;
+    best = false;
+  }
+
+  if( header == NULL ){
+    header = malloc( sizeof(buffer_pool_header_t) + size );
+    if( header == NULL ){
+      _stats.failed++;
+      goto unlock;
+    }
+    header->cls = BUFFER_POOL_HEAP;
+    _stats.heap++;
+  }
+
+  header->user = user;
+  header->refs = 1;
+  _stats.inUse[user] += _charge( header );
+  if( _stats.inUse[user] > _stats.maxInUse[user] )
+    _stats.maxInUse[user] = _stats.inUse[user];
+
+unlock:
+  _unlock();
+exit:
+  return header ? (uint8_t*)header + sizeof(buffer_pool_header_t) : NULL;
+}
+
+void buffer_pool_retain( void* buffer )
+{
+  buffer_pool_header_t* header = (buffer_pool_header_t*)((uint8_t*)buffer - sizeof(buffer_pool_header_t));
+
+  _lock();
+  header->refs++;
+  _unlock();
+}
+
+void buffer_pool_release( void* buffer )
+{
+  buffer_pool_header_t* header;
+
+  if( buffer == NULL )
+    return;
+  header = (buffer_pool_header_t*)((uint8_t*)buffer - sizeof(buffer_pool_header_t));
+
+  _lock();
+  if( --header->refs == 0 ){
+    _stats.inUse[header->user] -= _charge( header );
+    if( header->cls == BUFFER_POOL_HEAP ){
+      free( header );
+    }else{
+      ((buffer_pool_free_t*)buffer)->next = _free[header->cls];
+      _free[header->cls] = (buffer_pool_free_t*)buffer;
+      _stats.classes[header->cls].free++;
+    }
+  }
+  _unlock();
+}
+
+void buffer_pool_stats( buffer_pool_stats_t* stats )
+{
+  _lock();
+  memcpy( stats, &_stats, sizeof(buffer_pool_stats_t) );
+  _unlock();
+}
+
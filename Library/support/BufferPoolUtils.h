@@ -0,0 +1,87 @@
+/**
+******************************************************************************
+* @file    BufferPoolUtils.h
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This header contains function prototypes for a shared pool of
+*          reference counted buffers in a few fixed size classes
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/
+
+#ifndef __BufferPoolUtils_h__
+#define __BufferPoolUtils_h__
+
+#include "Common.h"
+
+#define BUFFER_POOL_CLASSES         4
+
+typedef enum
+{
+  BUFFER_POOL_SOCKET,               /* Socket receive and send buffers of client threads */
+  BUFFER_POOL_UART,
+  BUFFER_POOL_HTTP,                 /* HTTPHeader_t of the HTTP servers and clients, SocketSendv gathering */
+  BUFFER_POOL_MDNS,
+  BUFFER_POOL_QUEUE,                /* Copies held by socket send queues */
+  BUFFER_POOL_USERS,
+} buffer_pool_user_t;
+
+typedef struct
+{
+  uint16_t  size;                   /* Ascending, a class of count 0 is unused */
+  uint8_t   count;
+} buffer_pool_class_t;
+
+typedef struct
+{
+  buffer_pool_class_t classes[BUFFER_POOL_CLASSES];
+  uint32_t            quota[BUFFER_POOL_USERS];   /* Bytes a user may hold, 0 for no limit */
+} buffer_pool_config_t;
+
+typedef struct
+{
+  struct
+  {
+    uint16_t  size;
+    uint8_t   count;
+    uint8_t   free;
+    uint8_t   minFree;
+    uint32_t  exhausted;            /* Allocations that fitted this class best but found it empty */
+  } classes[BUFFER_POOL_CLASSES];
+  uint32_t    heap;                 /* Allocations no class could take, served from the heap */
+  uint32_t    failed;
+  uint32_t    overQuota;            /* Allocations sent to the heap by a quota */
+  uint32_t    inUse[BUFFER_POOL_USERS];     /* Bytes of pool buffers held */
+  uint32_t    maxInUse[BUFFER_POOL_USERS];
+} buffer_pool_stats_t;
+
+/* Allocate every class in one block, called once at boot before the threads
+   that use the pool start. Until then buffers come from the heap. */
+OSStatus buffer_pool_init( const buffer_pool_config_t* config );
+
+/* A buffer of at least size bytes with one reference, from the smallest
+   class that has one free, else from the heap. The heap is also used while
+   user is over its quota, NULL if it is exhausted too. */
+void* buffer_pool_alloc( buffer_pool_user_t user, uint32_t size );
+
+void buffer_pool_retain( void* buffer );
+
+/* Drop a reference, the buffer returns to its class with the last one. Takes
+   NULL, and fits socket_release_t so a buffer can be handed to a send queue. */
+void buffer_pool_release( void* buffer );
+
+void buffer_pool_stats( buffer_pool_stats_t* stats );
+
+#endif // __BufferPoolUtils_h__
+
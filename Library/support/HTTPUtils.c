@@ -28,6 +28,8 @@
 #include <stdarg.h>
 
 #include "StringUtils.h"
+#include "SocketUtils.h"
+#include <ctype.h>
 
 #define kCRLFNewLine     "\r\n"
 #define kCRLFLineEnding  "\r\n\r\n"
@@ -123,6 +125,7 @@ foundHeader:
     require_action_quiet(err != kNotFoundErr, exit, err = kNoErr);
     if( strnicmpx( value, valueSize, kMIMEType_MXCHIP_OTA ) == 0 ){
           http_utils_log("Receive OTA data!");        
+          require_action(inHeader->contentLength <= (inHeader->otaMaxLen ? inHeader->otaMaxLen : UPDATE_FLASH_SIZE), exit, err = kSizeErr);
           err = PlatformFlashInitialize();
           require_noerr(err, exit);
           err = PlatformFlashWrite(&flashStorageAddress, (uint32_t *)inHeader->extraDataPtr, inHeader->extraDataLen);
@@ -437,6 +440,21 @@ void HTTPHeaderClear( HTTPHeader_t *inHeader )
     inHeader->extraDataLen = 0;
 }
 
+void HTTPHeaderNext( HTTPHeader_t *inHeader )
+{
+    // SocketReadHTTPHeader moves extra data to the front of the buffer before it reads from the socket.
+    inHeader->len = 0;
+    if( inHeader->extraDataLen > inHeader->contentLength )
+    {
+        inHeader->extraDataPtr += (size_t) inHeader->contentLength;
+        inHeader->extraDataLen -= (size_t) inHeader->contentLength;
+    }
+    else
+    {
+        inHeader->extraDataLen = 0;
+    }
+}
+
 OSStatus CreateSimpleHTTPOKMessage( uint8_t **outMessage, size_t *outMessageSize )
 {
     OSStatus err = kNoMemoryErr;
@@ -542,6 +560,310 @@ exit:
     return err;
 }
 
+//===========================================================================================================================
+//  SocketSendHTTPResponse / SocketSendHTTPRequest
+//
+//  The start line and header names are constant templates handed to SocketSendv next to the body. Only Content-Length
+//  is formatted, so the body is never copied behind the header and a short message goes out in a single segment.
+//===========================================================================================================================
+
+#define _HTTPStatusLine( CODE, REASON ) \
+    { CODE, "HTTP/1.1 " #CODE " " REASON kCRLFNewLine, sizeof( "HTTP/1.1 " #CODE " " REASON kCRLFNewLine ) - 1 }
+
+static const struct
+{
+    int             status;
+    const char *    line;
+    size_t          len;
+} kHTTPStatusLines[] =
+{
+    _HTTPStatusLine( 200, "OK" ),
+    _HTTPStatusLine( 202, "Accepted" ),
+    _HTTPStatusLine( 403, "Forbidden" ),
+    _HTTPStatusLine( 404, "Not Found" ),
+    _HTTPStatusLine( 405, "Method Not Allowed" ),
+    _HTTPStatusLine( 413, "Request Entity Too Large" ),
+};
+
+static const char kHTTPContentType[]        = "Content-Type: ";
+static const char kHTTPContentLength[]      = "Content-Length: ";
+static const char kHTTPRequestProtocol[]    = "? HTTP/1.1" kCRLFNewLine; // The request line CreateHTTPMessage sends.
+
+#define kHTTPMaxVecs    10
+
+static void _HTTPAddVec( socket_iovec_t *ioVec, int *ioCount, const void *inBase, size_t inLen )
+{
+    ioVec[ *ioCount ].base = (const uint8_t *) inBase;
+    ioVec[ *ioCount ].len  = inLen;
+    ++*ioCount;
+}
+
+// Add the header fields and the body to the start line already in ioVec and send the message.
+static OSStatus _HTTPSendMessage( int inFd, socket_iovec_t *ioVec, int inCount, const char *inContentType,
+                                  const uint8_t *inData, size_t inDataLen )
+{
+    char        length[ 24 ];
+    char *      ptr = length + sizeof( length ) - ( sizeof( kCRLFLineEnding ) - 1 );
+    size_t      n = inDataLen;
+
+    // Digits are written backwards in front of the empty line that ends the header.
+    memcpy( ptr, kCRLFLineEnding, sizeof( kCRLFLineEnding ) - 1 );
+    do { *--ptr = (char)( '0' + n % 10 ); n /= 10; } while( n );
+
+    if( inContentType )
+    {
+        _HTTPAddVec( ioVec, &inCount, kHTTPContentType, sizeof( kHTTPContentType ) - 1 );
+        _HTTPAddVec( ioVec, &inCount, inContentType, strlen( inContentType ) );
+        _HTTPAddVec( ioVec, &inCount, kCRLFNewLine, sizeof( kCRLFNewLine ) - 1 );
+    }
+    _HTTPAddVec( ioVec, &inCount, kHTTPContentLength, sizeof( kHTTPContentLength ) - 1 );
+    _HTTPAddVec( ioVec, &inCount, ptr, (size_t)( length + sizeof( length ) - ptr ) );
+    if( inData ) _HTTPAddVec( ioVec, &inCount, inData, inDataLen );
+    return SocketSendv( inFd, ioVec, inCount );
+}
+
+static OSStatus _HTTPSendResponse( int inFd, int inStatus, const char *inFields, size_t inFieldsLen,
+                                   const char *inContentType, const uint8_t *inData, size_t inDataLen )
+{
+    OSStatus        err = kParamErr;
+    socket_iovec_t  vec[ kHTTPMaxVecs ];
+    int             count = 0;
+    int             i;
+
+    for( i = 0; i < (int)( sizeof( kHTTPStatusLines ) / sizeof( kHTTPStatusLines[ 0 ] ) ); ++i )
+    {
+        if( kHTTPStatusLines[ i ].status == inStatus ) break;
+    }
+    require( i < (int)( sizeof( kHTTPStatusLines ) / sizeof( kHTTPStatusLines[ 0 ] ) ), exit );
+
+    _HTTPAddVec( vec, &count, kHTTPStatusLines[ i ].line, kHTTPStatusLines[ i ].len );
+    if( inFieldsLen ) _HTTPAddVec( vec, &count, inFields, inFieldsLen );
+    err = _HTTPSendMessage( inFd, vec, count, inContentType, inData, inDataLen );
+
+exit:
+    return err;
+}
+
+OSStatus SocketSendHTTPResponse( int inFd, int inStatus, const char *inContentType, const uint8_t *inData, size_t inDataLen )
+{
+    return _HTTPSendResponse( inFd, inStatus, NULL, 0, inContentType, inData, inDataLen );
+}
+
+OSStatus SocketSendHTTPRequest( int inFd, const char *inMethod, const char *inURL, const char *inContentType,
+                                const uint8_t *inData, size_t inDataLen )
+{
+    OSStatus        err = kParamErr;
+    socket_iovec_t  vec[ kHTTPMaxVecs ];
+    int             count = 0;
+
+    require( inMethod, exit );
+    require( inURL, exit );
+
+    _HTTPAddVec( vec, &count, inMethod, strlen( inMethod ) );
+    _HTTPAddVec( vec, &count, " ", 1 );
+    _HTTPAddVec( vec, &count, inURL, strlen( inURL ) );
+    _HTTPAddVec( vec, &count, kHTTPRequestProtocol, sizeof( kHTTPRequestProtocol ) - 1 );
+    err = _HTTPSendMessage( inFd, vec, count, inContentType, inData, inDataLen );
+
+exit:
+    return err;
+}
+
+//===========================================================================================================================
+//  HTTPRouter
+//
+//  Routes are matched on a hash of the lower-cased path computed once at init, so adding a route costs one integer
+//  compare per request rather than another string compare.
+//===========================================================================================================================
+
+static const struct
+{
+    const char *    name;
+    uint8_t         method;
+} kHTTPMethods[] =
+{
+    { "GET",     kHTTPMethodGET },
+    { "POST",    kHTTPMethodPOST },
+    { "HEAD",    kHTTPMethodHEAD },
+    { "PUT",     kHTTPMethodPUT },
+    { "DELETE",  kHTTPMethodDELETE },
+    { "OPTIONS", kHTTPMethodOPTIONS },
+};
+
+static uint32_t _HTTPPathHash( const char *inPath, size_t inLen )
+{
+    uint32_t    hash = 2166136261UL;
+    size_t      i;
+
+    for( i = 0; i < inLen; ++i ) hash = ( hash ^ (uint8_t) tolower( inPath[ i ] ) ) * 16777619UL;
+    return hash;
+}
+
+static uint8_t _HTTPRouterSlot( const HTTPRouter_t *inRouter, uint32_t inHash )
+{
+    return (uint8_t)( ( inHash * inRouter->multiplier ) >> ( 32 - kHTTPRouterSlotBits ) );
+}
+
+static uint8_t _HTTPRouteMethods( const HTTPRoute_t *inRoute )
+{
+    uint8_t methods = inRoute->methods | kHTTPMethodOPTIONS;
+
+    if( methods & kHTTPMethodGET ) methods |= kHTTPMethodHEAD;
+    return methods;
+}
+
+static OSStatus _HTTPSendStatus( int inFd, int inStatus, uint8_t inAllow )
+{
+    char        allow[ 64 ];
+    size_t      len = 0;
+    int         i;
+
+    if( inAllow )
+    {
+        len = snprintf( allow, sizeof( allow ), "Allow:" );
+        for( i = 0; i < (int)( sizeof( kHTTPMethods ) / sizeof( kHTTPMethods[ 0 ] ) ); ++i )
+        {
+            if( inAllow & kHTTPMethods[ i ].method )
+                len += snprintf( allow + len, sizeof( allow ) - len, " %s,", kHTTPMethods[ i ].name );
+        }
+        --len; // Drop the last comma
+        len += snprintf( allow + len, sizeof( allow ) - len, "%s", kCRLFNewLine );
+    }
+    return _HTTPSendResponse( inFd, inStatus, allow, len, NULL, NULL, 0 );
+}
+
+// Hand the body to inBody as it arrives, or drop it when inBody is NULL. The header buffer past the header is reused
+// for each part.
+static OSStatus _HTTPReadBodyParts( int inFd, HTTPHeader_t *inHeader, HTTPRouteBody_t inBody, void *inContext )
+{
+    OSStatus    err = kNoErr;
+    uint8_t *   part = (uint8_t *) inHeader->extraDataPtr;
+    size_t      space = (size_t)( inHeader->buf + sizeof( inHeader->buf ) - inHeader->extraDataPtr );
+    uint64_t    left = inHeader->contentLength;
+    size_t      len;
+    ssize_t     n;
+
+    len = (size_t) Min( (uint64_t) inHeader->extraDataLen, left );
+    if( len > 0 )
+    {
+        if( inBody ) err = inBody( inFd, inHeader, part, len, inContext );
+        require_noerr( err, exit );
+        left -= len;
+    }
+    while( left > 0 )
+    {
+        n = read( inFd, part, (size_t) Min( (uint64_t) space, left ) );
+        require_action( n > 0, exit, err = ( n == 0 ) ? kConnectionErr : kReadErr );
+        if( inBody ) err = inBody( inFd, inHeader, part, (size_t) n, inContext );
+        require_noerr( err, exit );
+        left -= (uint64_t) n;
+    }
+    // Bytes read with the header past the body belong to the next pipelined request, see HTTPHeaderNext.
+    if( inHeader->extraDataLen < inHeader->contentLength ) inHeader->extraDataLen = (size_t) inHeader->contentLength;
+
+exit:
+    return err;
+}
+
+OSStatus HTTPRouterInit( HTTPRouter_t *inRouter, const HTTPRoute_t *inRoutes, uint8_t inCount )
+{
+    OSStatus    err = kParamErr;
+    uint8_t     i;
+    uint8_t     slot;
+
+    require( inRouter, exit );
+    require( inRoutes, exit );
+    require( inCount <= kHTTPRouterMaxRoutes, exit );
+
+    inRouter->routes = inRoutes;
+    inRouter->count  = inCount;
+    for( i = 0; i < inCount; ++i )
+    {
+        inRouter->pathLen[ i ] = strlen( inRoutes[ i ].path );
+        inRouter->hash[ i ]    = _HTTPPathHash( inRoutes[ i ].path, inRouter->pathLen[ i ] );
+    }
+
+    // Try odd multipliers until every route lands in a slot of its own. The table is twice the largest route
+    // count so a few tries are enough; only routes sharing a path never separate.
+    err = kDuplicateErr;
+    for( inRouter->multiplier = 1; inRouter->multiplier < 512; inRouter->multiplier += 2 )
+    {
+        memset( inRouter->slot, 0, sizeof( inRouter->slot ) );
+        for( i = 0; i < inCount; ++i )
+        {
+            slot = _HTTPRouterSlot( inRouter, inRouter->hash[ i ] );
+            if( inRouter->slot[ slot ] ) break;
+            inRouter->slot[ slot ] = i + 1;
+        }
+        if( i == inCount )
+        {
+            err = kNoErr;
+            break;
+        }
+    }
+
+exit:
+    return err;
+}
+
+OSStatus HTTPRouterDispatch( HTTPRouter_t *inRouter, int inFd, HTTPHeader_t *inHeader, void *inContext )
+{
+    OSStatus            err = kNoErr;
+    const HTTPRoute_t * route = NULL;
+    const char *        value;
+    size_t              valueSize;
+    uint32_t            hash;
+    uint8_t             method = 0;
+    uint8_t             i;
+
+    // The slot holds the only route the path can be, it still has to be compared
+    hash = _HTTPPathHash( inHeader->url.pathPtr, inHeader->url.pathLen );
+    i = inRouter->slot[ _HTTPRouterSlot( inRouter, hash ) ];
+    if( i && inRouter->hash[ i - 1 ] == hash && inRouter->pathLen[ i - 1 ] == inHeader->url.pathLen &&
+        strnicmp( inHeader->url.pathPtr, inRouter->routes[ i - 1 ].path, inHeader->url.pathLen ) == 0 )
+        route = &inRouter->routes[ i - 1 ];
+    for( i = 0; i < sizeof( kHTTPMethods ) / sizeof( kHTTPMethods[ 0 ] ) && method == 0; ++i )
+    {
+        if( HTTPHeaderMatchMethod( inHeader, kHTTPMethods[ i ].name ) == kNoErr ) method = kHTTPMethods[ i ].method;
+    }
+
+    if( route == NULL || method == kHTTPMethodOPTIONS || !( _HTTPRouteMethods( route ) & method ) )
+    {
+        // The body is not for us but has to be read to get to the next request.
+        err = _HTTPReadBodyParts( inFd, inHeader, NULL, NULL );
+        require_noerr( err, exit );
+        if( route == NULL )                     err = _HTTPSendStatus( inFd, kStatusNotFound, 0 );
+        else if( method == kHTTPMethodOPTIONS ) err = _HTTPSendStatus( inFd, kStatusOK, _HTTPRouteMethods( route ) );
+        else                                    err = _HTTPSendStatus( inFd, kStatusMethodNotAllowed, _HTTPRouteMethods( route ) );
+        goto exit;
+    }
+
+    if( route->body )
+    {
+        err = _HTTPReadBodyParts( inFd, inHeader, route->body, inContext );
+        require_noerr( err, exit );
+    }
+    else
+    {
+        // OTA bodies go to flash as they are read and do not need to fit. Others keep a byte free so that the
+        // handler can terminate them.
+        if( HTTPGetHeaderField( inHeader->buf, inHeader->len, "Content-Type", NULL, NULL, &value, &valueSize, NULL ) != kNoErr ||
+            strnicmpx( value, valueSize, kMIMEType_MXCHIP_OTA ) != 0 ) value = NULL;
+        if( value == NULL && inHeader->contentLength >= (uint64_t)( inHeader->buf + sizeof( inHeader->buf ) - inHeader->extraDataPtr ) )
+        {
+            _HTTPSendStatus( inFd, kStatusEntityTooLarge, 0 );
+            err = kNoSpaceErr;
+            goto exit;
+        }
+        err = SocketReadHTTPBody( inFd, inHeader );
+        require_noerr( err, exit );
+    }
+    err = route->handler( inFd, inHeader, inContext );
+
+exit:
+    return err;
+}
+
 void PrintHTTPHeader( HTTPHeader_t *inHeader )
 {
     (void)inHeader; // Fix warning when debug=0
@@ -60,6 +60,9 @@
 #define kStatusAccept       202
 #define kStatusOK           200
 #define kStatusForbidden    403      
+#define kStatusNotFound     404
+#define kStatusMethodNotAllowed 405
+#define kStatusEntityTooLarge   413
 
 #define kMIMEType_Binary                "application/octet-stream"
 #define kMIMEType_DMAP                  "application/x-dmap-tagged"
@@ -94,11 +97,49 @@ typedef struct
     uint8_t             channelID;          //! Interleaved binary data channel ID. 0 for other message types.
     uint64_t            contentLength;      //! Number of bytes following the header. May be 0.
     bool             persistent;         //! true=Do not close the connection after this message.
+    uint32_t            otaMaxLen;          //! Largest OTA body written to flash, 0 for the whole update area.
 
     int            firstErr;           //! First error that occurred or kNoErr.
 
 } HTTPHeader_t;
 
+#define kHTTPRouterMaxRoutes    8
+#define kHTTPRouterSlotBits     4           //! Slots of the route hash table, twice the routes so a perfect hash is found fast.
+
+typedef enum
+{
+    kHTTPMethodGET      = 1 << 0,
+    kHTTPMethodHEAD     = 1 << 1,   //! Allowed wherever GET is, the handler sends the header only.
+    kHTTPMethodPOST     = 1 << 2,
+    kHTTPMethodPUT      = 1 << 3,
+    kHTTPMethodDELETE   = 1 << 4,
+    kHTTPMethodOPTIONS  = 1 << 5,   //! Answered by the router.
+} HTTPMethod_t;
+
+//! Called once the request, including any body, was read.
+typedef OSStatus (*HTTPRouteHandler_t)( int inFd, HTTPHeader_t *inHeader, void *inContext );
+
+//! Called with each part of the body as it arrives, for bodies that are not kept in the header buffer.
+typedef OSStatus (*HTTPRouteBody_t)( int inFd, HTTPHeader_t *inHeader, const uint8_t *inData, size_t inLen, void *inContext );
+
+typedef struct
+{
+    const char *        path;               //! Matched against the whole URL path, ignoring case.
+    uint8_t             methods;            //! HTTPMethod_t flags.
+    HTTPRouteHandler_t  handler;
+    HTTPRouteBody_t     body;               //! NULL to read the body into the header buffer before the handler runs.
+} HTTPRoute_t;
+
+typedef struct
+{
+    const HTTPRoute_t * routes;             //! Usually a const table, not copied.
+    uint8_t             count;
+    uint32_t            hash[ kHTTPRouterMaxRoutes ];
+    uint16_t            pathLen[ kHTTPRouterMaxRoutes ];
+    uint32_t            multiplier;         //! Maps the path hash of every route to its own slot.
+    uint8_t             slot[ 1 << kHTTPRouterSlotBits ];   //! Route index + 1, 0 for none.
+} HTTPRouter_t;
+
 void PrintHTTPHeader( HTTPHeader_t *inHeader );
 
 int HTTPScanFHeaderValue( const char *inHeaderPtr, size_t inHeaderLen, const char *inName, const char *inFormat, ... );
@@ -124,6 +165,12 @@ int HTTPGetHeaderField( const char *inHeaderPtr,
 
 void HTTPHeaderClear( HTTPHeader_t *inHeader );
 
+// Reuse the header for the next request on a persistent connection once the
+// body of this one was read. Bytes of pipelined requests that were read with
+// this one are kept and parsed first, extraDataLen is non zero while there
+// are any, so do not wait for the socket to become readable then.
+void HTTPHeaderNext( HTTPHeader_t *inHeader );
+
 int CreateSimpleHTTPOKMessage( uint8_t **outMessage, size_t *outMessageSize );
 
 OSStatus CreateSimpleHTTPMessage      ( const char *contentType, uint8_t *inData, size_t inDataLen, uint8_t **outMessage, size_t *outMessageSize );
@@ -132,5 +179,20 @@ OSStatus CreateSimpleHTTPMessageNoCopy( const char *contentType, size_t inDataLe
 
 OSStatus CreateHTTPMessage( const char *methold, const char *url, const char *contentType, uint8_t *inData, size_t inDataLen, uint8_t **outMessage, size_t *outMessageSize );
 
+// Send a message with a Content-Type field when contentType is not NULL and
+// a Content-Length field, next to the body instead of copying it into one
+// buffer. A NULL inData sends only the header, as the answer to a HEAD.
+OSStatus SocketSendHTTPResponse( int inFd, int inStatus, const char *inContentType, const uint8_t *inData, size_t inDataLen );
+OSStatus SocketSendHTTPRequest ( int inFd, const char *inMethod, const char *inURL, const char *inContentType, const uint8_t *inData, size_t inDataLen );
+
+// Build a perfect hash of the route paths, so that a request costs one lookup
+// however many routes there are. kDuplicateErr if two routes share a path.
+OSStatus HTTPRouterInit( HTTPRouter_t *inRouter, const HTTPRoute_t *inRoutes, uint8_t inCount );
+
+// Find the route of a request whose header was read, read its body and call
+// the handler. Unknown paths get a 404, other methods a 405 and OPTIONS the
+// allowed methods, and the connection stays usable in all three cases.
+OSStatus HTTPRouterDispatch( HTTPRouter_t *inRouter, int inFd, HTTPHeader_t *inHeader, void *inContext );
+
 #endif // __HTTPUtils_h__
 
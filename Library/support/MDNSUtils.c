@@ -26,17 +26,37 @@
 #include "stdlib.h"
 
 #include "MDNSUtils.h"
+#include "BufferPoolUtils.h"
 
 static int mDNS_fd = -1;
 
+/* A name in wire format, lower_wire and hash are used to match incoming
+   names without regard to case */
 typedef struct
 {
-  char* hostname;
-  char* instance_name;
-  char* service_name;
-  char* txt_att;
-  u16	port;
-  char	instance_name_suffix[4]; // This variable should only be modified by the DNS-SD library
+  u8*   wire;
+  u8*   lower_wire;
+  u16   len;
+  u32   hash;
+} mdns_name_key_t;
+
+/* An incoming name, decoded and lower-cased */
+typedef struct
+{
+  u8    wire[MDNS_MAX_NAME_LEN];
+  u16   len;
+  u32   hash;
+} mdns_name_t;
+
+typedef struct
+{
+  u8                in_use;
+  u8                announce_left;  // Announcements still to send
+  mdns_name_key_t   service_name;
+  mdns_name_key_t   instance_name;  // instance.service
+  u8*               txt_att;        // TXT rdata
+  u16               txt_len;
+  u16	              port;
 } dns_sd_service_record_t;
 
 static WiFi_Interface _interface;
@@ -51,10 +71,50 @@ static WiFi_Interface _interface;
 
 #define MFi_SERVICE_QUERY_NAME             "_services._dns-sd._udp.local."
 
+#define MDNS_PORT                          5353
+#define MDNS_SERVICE_TTL                   1500
+#define MDNS_HOST_TTL                      300
+#define MDNS_PACKET_SIZE                   1460
+#define MDNS_ANNOUNCE_COUNT                9
+#define MDNS_MAX_TXT_LEN                   512   // Encoded TXT rdata, leaves room for the longest names in MDNS_PACKET_SIZE
+#define MDNS_MAX_POINTERS                  16    // Compression pointers followed in one name
+
+/* Names compare case-insensitively in ASCII only, RFC 6762 section 16 */
+#define MDNS_TOLOWER(c)                    ( ( (c) >= 'A' && (c) <= 'Z' ) ? (c) + 'a' - 'A' : (c) )
+
+/* RFC 6762 section 6, shared records are answered after a random delay so
+   that the answers of several queries and responders can be aggregated.
+   When the query is truncated its known answers continue in the next
+   packet, which is waited for. */
+#define MDNS_SHARED_DELAY_MIN              20
+#define MDNS_SHARED_DELAY_RANGE            100
+#define MDNS_TRUNCATED_DELAY_MIN           400
+#define MDNS_TRUNCATED_DELAY_RANGE         100
+#define MDNS_MULTICAST_INTERVAL            1000  // A record is multicast at most once a second
+#define MDNS_LEGACY_TTL                    10    // Longest TTL in a legacy unicast reply, RFC 6762 section 6.7
+#define MDNS_ANNOUNCE_INTERVAL             1000
+
+#define MDNS_ANSWER_SERVICES               0
+#define MDNS_ANSWER_ADDRESS                1
+#define MDNS_ANSWER_DETAIL(b)              (2 + (b))
+#define MDNS_ANSWER_NUM                    MDNS_ANSWER_DETAIL(MDNS_MAX_SERVICES)
+
+/* Names written to the message being built, later names point to them */
+#define MDNS_MAX_DICTIONARY                32
+
+#define MDNS_CACHE_SIZE                    16
+#define MDNS_CACHE_MAX_TTL                 86400 // Seconds, longer TTLs are cut
+#define MDNS_CACHE_MAX_TXT                 255
+#define MDNS_CACHE_REFRESHES               4     // At 80, 85, 90 and 95% of the TTL
+#define MDNS_MAX_QUERIES                   8
+#define MDNS_QUERY_INTERVAL_MIN            1000  // Doubled after each continuous query
+#define MDNS_QUERY_INTERVAL_MAX            3600000
+#define MDNS_RESOLVE_TIME                  10000 // One-shot queries give up after this
+
 
 static int _suspend_MFi_bonjour;
-static int _bonjour_announce_time = 0;
-static int _bonjour_announce = 0;
+static u32 _bonjour_announce_next = 0;
+static u32 _random_state = 1;
 
 
 //#define  debug_out 
@@ -65,158 +125,468 @@ static int _bonjour_announce = 0;
 #define _debug_out(format, ...) do {;}while(0)
 //#endif
 
-static dns_sd_service_record_t*   available_services	= NULL;
-static u8	available_service_count;
+static dns_sd_service_record_t    available_services[MDNS_MAX_SERVICES];
+static mdns_name_key_t            _host_name;
+static mdns_name_key_t            _services_query_name;
+
+/* Packets are serialized once, when the services or the address change,
+   and sent from here with only the transaction ID patched. iter marks the
+   end of each packet. */
+typedef struct
+{
+  dns_message_iterator_t  msg;
+  u32                     due;        // mico_get_time() when the pending answer goes out
+  u32                     last_sent;  // Last multicast of these records
+  u32                     truncated_from; // Querier whose truncated query is pending, 0 if none
+  u8                      pending;
+} mdns_answer_t;
+
+typedef struct
+{
+  mdns_answer_t           answers[MDNS_ANSWER_NUM];   // Services PTR list, host A record, then each service's PTR, TXT, SRV and A
+  dns_message_iterator_t  announce[MDNS_MAX_SERVICES];
+  dns_message_iterator_t  goodbye[MDNS_MAX_SERVICES]; // Same records with a TTL of 0
+} mdns_packets_t;
+
+static mdns_packets_t _packets;
+static u32 _packets_ip = 0;
+
+/* A record heard from any responder, data holds the lower-cased owner name
+   followed by the rdata */
+typedef struct
+{
+  u16                     type;       // 0 when the slot is free
+  u8                      refreshes;  // Refresh queries sent so far
+  u8                      wanted;     // Kept fresh for a resolve
+  u32                     hash;       // Of the owner name
+  u32                     received;
+  u32                     ttl;        // ms
+  u16                     name_len;
+  u16                     rdata_len;
+  u8*                     data;
+} mdns_cache_t;
+
+typedef struct
+{
+  mdns_name_key_t         name;
+  u16                     type;       // 0 when the slot is free
+  u8                      continuous;
+  u32                     started;
+  u32                     next_send;
+  u32                     interval;
+} mdns_query_t;
+
+static mdns_cache_t _cache[MDNS_CACHE_SIZE];
+static mdns_query_t _queries[MDNS_MAX_QUERIES];
+static int _cache_enabled = 0;
+
+static struct
+{
+  const u8* wire;
+  u16       offset;
+} _dictionary[MDNS_MAX_DICTIONARY];
+static u8 _dictionary_count = 0;
 
 static int dns_get_next_question( dns_message_iterator_t* iter, dns_question_t* q, dns_name_t* name );
-static int dns_compare_name_to_string( dns_name_t* name, const char* string, const char* fun, const int line );
 static int dns_create_message( dns_message_iterator_t* message, u16 size );
 static void dns_write_header( dns_message_iterator_t* iter, u16 id, u16 flags, u16 question_count, u16 answer_count, u16 authorative_count );
-static void dns_write_record( dns_message_iterator_t* iter, const char* name, u16 record_class, u16 record_type, uint32_t ttl, u8* rdata );
+static void dns_write_record( dns_message_iterator_t* iter, const u8* name, u16 record_class, u16 record_type, uint32_t ttl, const u8* rdata, u16 rdata_len );
 static void mdns_send_message(int fd, dns_message_iterator_t* message );
 static void dns_free_message( dns_message_iterator_t* message );
-static void mdns_process_query(int fd, dns_name_t* name, dns_question_t* question, dns_message_iterator_t* source );
-static void dns_write_record( dns_message_iterator_t* iter, const char* name, u16 record_class, u16 record_type, uint32_t ttl, u8* rdata );
 static void dns_write_uint16( dns_message_iterator_t* iter, u16 data );
 static void dns_write_uint32( dns_message_iterator_t* iter, uint32_t data );
-static void dns_write_bytes( dns_message_iterator_t* iter, u8* data, u16 length );
+static void dns_write_bytes( dns_message_iterator_t* iter, const u8* data, u16 length );
 static u16 dns_read_uint16( dns_message_iterator_t* iter );
-static void dns_skip_name( dns_message_iterator_t* iter );
-static void dns_write_name( dns_message_iterator_t* iter, const char* src );
+static int dns_skip_name( dns_message_iterator_t* iter );
+static void dns_write_name( dns_message_iterator_t* iter, const u8* wire );
+static void _build_packets( u32 ip );
+static void _reply_legacy( int fd, dns_message_iterator_t* query, u32 wanted, struct sockaddr_t* from );
+static void _refresh_packets( void );
+static void _cache_records( dns_message_iterator_t* iter, u16 count );
 
 static mico_mutex_t bonjour_mutex = NULL;
 static mico_thread_t mfi_bonjour_thread_handler;
 static void _bonjour_thread(void *arg);
 
-static char *__strdup(char *src)
+/* "a.b.local." to length prefixed labels, "/." is a dot inside a label.
+   out needs strlen(src) + 2 bytes, returns the length written. */
+static u16 _encode_labels( const char* src, u8* out )
 {
-  int len;
-  char *dst;
+  u8* segment_length_pointer;
+  u8  segment_length;
+  u16 len = 0;
   
-  if (src == NULL)
-    return NULL;
+  while ( *src != 0 )
+  {
+    /* Remember where we need to store the segment length and reset the counter*/
+    segment_length_pointer = &out[len++];
+    segment_length = 0;
   
-  if (src[0] == 0)
-    return NULL;
+    /* Copy bytes until '.' or end of string*/
+    while ( *src != '.' && *src != 0 )
+    {
+      if (*src == '/')
+        src++; // skip '/'
   
-  len = strlen(src) + 1;
-  dst = (char*)malloc(len);
-  if (dst) 
-    memcpy(dst, src, len);
-  return dst;
+      out[len++] = *src++;
+      ++segment_length;
+    }
+
+    /* Store the length of the segment*/
+    *segment_length_pointer = segment_length;
+
+    /* Check if we stopped because of a '.', if so, skip it*/
+    if ( *src == '.' )
+    {
+      ++src;
+    }
+  }
+
+  /* Add the ending null */
+  out[len++] = 0;
+  return len;
+}
+
+static u32 _hash_byte( u32 hash, u8 byte )
+{
+  return ( hash ^ byte ) * 16777619UL;
+}
+
+static void _free_name_key( mdns_name_key_t* key )
+{
+  if ( key->wire )        free( key->wire );
+  if ( key->lower_wire )  free( key->lower_wire );
+  memset( key, 0, sizeof(mdns_name_key_t) );
+}
+
+/* Encode name once, keep a lower-cased copy and its hash for matching */
+static int _make_name_key( mdns_name_key_t* key, const char* name )
+{
+  u8* wire;
+  u16 a = 0;
+
+  memset( key, 0, sizeof(mdns_name_key_t) );
+  if ( name == NULL )
+    return 0;
+  wire = (u8*) malloc( strlen( name ) + 2 );
+  if ( wire == NULL )
+    return 0;
+  key->len = _encode_labels( name, wire );
+  if ( key->len > MDNS_MAX_NAME_LEN )
+  {
+    free( wire );
+    key->len = 0;
+    return 0;
+  }
+  key->wire = wire;
+  key->lower_wire = (u8*) malloc( key->len );
+  if ( key->lower_wire == NULL )
+  {
+    _free_name_key( key );
+    return 0;
+  }
+  key->hash = 2166136261UL;
+  for ( a = 0; a < key->len; ++a )
+  {
+    key->lower_wire[a] = MDNS_TOLOWER( wire[a] );
+    key->hash = _hash_byte( key->hash, key->lower_wire[a] );
+  }
+  return 1;
 }
 
-void process_dns_questions(int fd, dns_message_iterator_t* iter )
+/* Decode the name at ptr, following compression pointers, returns 0 if it
+   is malformed or runs past end. A pointer has to point before itself, so
+   a crafted message cannot make us loop. A name too long for us is left
+   empty. The hash is always that of the lower-cased name. */
+static int _read_name( const u8* packet, const u8* end, const u8* ptr, mdns_name_t* name, int keep_case )
 {
+  const u8* target;
+  u8* out = name->wire;
+  u32 hash = 2166136261UL;
+  u8  label_len;
+  u8  c;
+  int pointers = 0;
+  int a = 0;
+
+  name->len  = 0;
+  while ( 1 )
+  {
+    if ( ptr >= end )
+      return 0;
+    label_len = *ptr;
+    if ( ( label_len & 0xC0 ) == 0xC0 )
+    {
+      if ( ptr + 1 >= end || ++pointers > MDNS_MAX_POINTERS )
+        return 0;
+      target = packet + ( ( ( label_len & 0x3F ) << 8 ) | ptr[1] );
+      if ( target >= ptr || target < packet + sizeof(dns_message_header_t) )
+        return 0;
+      ptr = target;
+      continue;
+    }
+    if ( label_len & 0xC0 )
+      return 0;
+    if ( ptr + 1 + label_len > end )
+      return 0;
+    if ( out + 1 + label_len > name->wire + MDNS_MAX_NAME_LEN )
+      return 1;
+    *out++ = label_len;
+    hash = _hash_byte( hash, label_len );
+    for ( a = 1; a <= label_len; ++a )
+    {
+      c = MDNS_TOLOWER( ptr[a] );
+      *out++ = keep_case ? ptr[a] : c;
+      hash = _hash_byte( hash, c );
+    }
+    if ( label_len == 0 )
+    {
+      name->len  = out - name->wire;
+      name->hash = hash;
+      return 1;
+    }
+    ptr += 1 + label_len;
+  }
+}
+
+static int _name_is( const mdns_name_t* name, const mdns_name_key_t* key )
+{
+  return key->wire != NULL && name->hash == key->hash && name->len == key->len
+      && memcmp( name->wire, key->lower_wire, key->len ) == 0;
+}
+
+/* The services query name or the type of one of our services */
+static int _is_service_owner( const mdns_name_t* name )
+{
+  int b = 0;
+
+  if ( _name_is( name, &_services_query_name ) )
+    return 1;
+  for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+    if ( available_services[b].in_use && _name_is( name, &available_services[b].service_name ) )
+      return 1;
+  }
+  return 0;
+}
+
+static u32 _random( void )
+{
+  _random_state ^= _random_state << 13;
+  _random_state ^= _random_state >> 17;
+  _random_state ^= _random_state << 5;
+  return _random_state;
+}
+
+/* Answers asked for by the question section */
+static u32 _read_questions( dns_message_iterator_t* iter )
+{
+  static mdns_name_t decoded; // Off the thread stack, used with bonjour_mutex held
   dns_name_t name;
   dns_question_t question;
-  dns_message_iterator_t response;
-  net_para_st para;
+  u32 wanted = 0;
   int a = 0;
-  int question_processed;
-  u32 myip;
-  
-  getNetPara(&para, _interface);
-  myip = htonl(inet_addr(para.ip));
-  if(myip == 0) {
-    _debug_out("UDP multicast test: IP error.\r\n");
-    return;
-  }
-  
-  memset( &response, 0, sizeof(dns_message_iterator_t) );
-  
+  int b = 0;
+
   for ( a = 0; a < htons(iter->header->question_count); ++a )
   {
     if (iter->iter > iter->end)
       break;
     if(dns_get_next_question( iter, &question, &name )==0)
       break;
-    question_processed = 0;
-    switch ( question.question_type ){
-    case RR_TYPE_PTR:
-      if ( available_services != NULL ){
-        // Check if its a query for all available services  
-        if ( dns_compare_name_to_string( &name, MFi_SERVICE_QUERY_NAME, __FUNCTION__, __LINE__ ) ){
-          int b = 0;
-          _debug_out("UDP multicast test: Recv a SERVICE QUERY request.\r\n");
-          if(dns_create_message( &response, 512 )) {
-            dns_write_header(&response, iter->header->id, 0x8400, 0, available_service_count, 0 );          
-            for ( b = 0; b < available_service_count; ++b ){
-              dns_write_record( &response, MFi_SERVICE_QUERY_NAME, RR_CLASS_IN, RR_TYPE_PTR, 1500, (u8*) available_services[b].service_name );
-            }
-            mdns_send_message(fd, &response );
-            dns_free_message( &response );
-            question_processed = 1;
-          }
-        }
-        // else check if its one of our records
-        else {
-          int b = 0;
-          for ( b = 0; b < available_service_count; ++b ){
-            if ( dns_compare_name_to_string( &name, available_services[b].service_name, __FUNCTION__, __LINE__ )){
-              // Send the PTR, TXT, SRV and A records
-              _debug_out("UDP multicast test: Recv a SERVICE Detail request.\r\n");
-              if(dns_create_message( &response, 512 )){
-                dns_write_header( &response, iter->header->id, 0x8400, 0, 4, 0 );
-                //dns_write_record( &response, MFi_SERVICE_QUERY_NAME, RR_CLASS_IN, RR_TYPE_PTR, 1500, (u8*) available_services[b].service_name );
-                dns_write_record( &response, available_services[b].service_name, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_PTR, 1500, (u8*) available_services[b].instance_name );
-                dns_write_record( &response, available_services[b].instance_name, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_TXT, 1500, (u8*) available_services[b].txt_att );
-                dns_write_record( &response, available_services[b].instance_name, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_SRV, 1500, (u8*) &available_services[b]);
-                dns_write_record( &response, available_services[b].hostname, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_A, 1500, (u8*) &myip);
-                mdns_send_message(fd, &response );
-                //sleep(1);
-                //mdns_send_message(fd, &response );
-                //sleep(1);
-                //mdns_send_message(fd, &response );
-                //sleep(1);
-                dns_free_message( &response );
-                question_processed = 1;
-              }
-              else{
-                _debug_out("UDP multicast test: Send error.\r\n");
-              }
-            }
-          }
+    if(_read_name( name.start_of_packet, iter->end, name.start_of_name, &decoded, 0 )==0)
+      break;
+    if ( question.question_type == RR_TYPE_PTR || question.question_type == RR_QTYPE_ANY ){
+      // Check if its a query for all available services
+      if ( _name_is( &decoded, &_services_query_name ) ){
+        _debug_out("UDP multicast test: Recv a SERVICE QUERY request.\r\n");
+        wanted |= 1UL << MDNS_ANSWER_SERVICES;
+      }
+      // else check if its one of our records
+      for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+        if ( available_services[b].in_use && _name_is( &decoded, &available_services[b].service_name ) ){
+          _debug_out("UDP multicast test: Recv a SERVICE Detail request.\r\n");
+          wanted |= 1UL << MDNS_ANSWER_DETAIL(b);
         }
       }
+    }
+    if ( question.question_type == RR_TYPE_A || question.question_type == RR_QTYPE_ANY ){
+      if ( _name_is( &decoded, &_host_name ) ){
+        _debug_out("UDP multicast test: Recv RR_TYPE_A.\r\n");
+        wanted |= 1UL << MDNS_ANSWER_ADDRESS;
+      }
+    }
+  }
+  return wanted;
+}
+
+/* Answers whose records are all in the next count records of the message
+   with at least half of our TTL left, RFC 6762 sections 7.1 and 7.4 */
+static u32 _read_known_answers( dns_message_iterator_t* iter, u16 count )
+{
+  static mdns_name_t decoded;
+  static mdns_name_t rdata;
+  dns_name_t name;
+  dns_question_t record;
+  uint32_t ttl;
+  u16 rd_length;
+  u8* next;
+  u32 known = 0;
+  u32 known_services = 0;
+  u32 all_services = 0;
+  int b = 0;
+
+  for ( ; count > 0; --count )
+  {
+    if(dns_get_next_question( iter, &record, &name )==0 || iter->iter + 6 > iter->end)
+      break;
+    ttl  = (uint32_t) dns_read_uint16( iter ) << 16;
+    ttl |= dns_read_uint16( iter );
+    rd_length = dns_read_uint16( iter );
+    next = iter->iter + rd_length;
+    if ( next > iter->end )
       break;
+
+    /* Names are only decoded for records that could be ours, the rdata
+       only once the owner name matched */
+    if ( record.question_type == RR_TYPE_PTR && ttl >= MDNS_SERVICE_TTL / 2
+      && _read_name( name.start_of_packet, iter->end, name.start_of_name, &decoded, 0 )
+      && _is_service_owner( &decoded )
+      && _read_name( name.start_of_packet, next, iter->iter, &rdata, 0 ) ){
+      for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+        if ( available_services[b].in_use == 0 )
+          continue;
+        if ( _name_is( &decoded, &_services_query_name ) && _name_is( &rdata, &available_services[b].service_name ) )
+          known_services |= 1UL << b;
+        if ( _name_is( &decoded, &available_services[b].service_name ) && _name_is( &rdata, &available_services[b].instance_name ) )
+          known |= 1UL << MDNS_ANSWER_DETAIL(b);
+      }
     }
-    if (!question_processed ){
-      _debug_out("UDP multicast test: Recv a mDNS request.\r\n");
-      mdns_process_query(fd, &name, &question, iter);
+    else if ( record.question_type == RR_TYPE_A && ttl >= MDNS_HOST_TTL / 2 && rd_length == 4 ){
+      if ( memcmp( iter->iter, &_packets_ip, 4 ) == 0
+        && _read_name( name.start_of_packet, iter->end, name.start_of_name, &decoded, 0 )
+        && _name_is( &decoded, &_host_name ) )
+        known |= 1UL << MDNS_ANSWER_ADDRESS;
     }
+    iter->iter = next;
+  }
+
+  for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+    if ( available_services[b].in_use )
+      all_services |= 1UL << b;
   }
+  if ( all_services && known_services == all_services )
+    known |= 1UL << MDNS_ANSWER_SERVICES;
+  return known;
 }
 
-static void mdns_process_query(int fd, dns_name_t* name, 
-                               dns_question_t* question, dns_message_iterator_t* source )
+void process_dns_questions(int fd, dns_message_iterator_t* iter, struct sockaddr_t* from )
 {
-  dns_message_iterator_t response;
-  net_para_st para;
-  u32 myip;
-  
-  getNetPara(&para, _interface);
-  myip = htonl(inet_addr(para.ip));
+  mdns_answer_t* answer;
+  u32 wanted, now, delay;
+  int truncated;
+  int a = 0;
   
-  memset( &response, 0, sizeof(dns_message_iterator_t) );
+  if(_packets_ip == 0) {
+    _debug_out("UDP multicast test: IP error.\r\n");
+    return;
+  }
   
-  switch ( question->question_type )
-  {
-  case RR_QTYPE_ANY:
-  case RR_TYPE_A:
-    if ( dns_compare_name_to_string( name, available_services->hostname, __FUNCTION__, __LINE__) ){				
-      _debug_out("UDP multicast test: Recv RR_TYPE_A.\r\n");
-      if(dns_create_message( &response, 256 )){
-        dns_write_header( &response, source->header->id, 0x8400, 0, 1, 0 );
-        dns_write_record( &response, available_services->hostname, RR_CLASS_IN | RR_CACHE_FLUSH, RR_TYPE_A, 300, (u8*)&myip);
-        mdns_send_message(fd, &response );
-        dns_free_message( &response );
-        return;
+  wanted = _read_questions( iter );
+  if ( wanted == 0 ){
+    /* The rest of a truncated query only carries known answers, they
+       suppress what is pending for that querier, RFC 6762 section 7.2 */
+    if ( iter->header->question_count == 0 && from->s_port == MDNS_PORT ){
+      wanted = _read_known_answers( iter, htons(iter->header->answer_count) );
+      for ( a = 0; a < MDNS_ANSWER_NUM; ++a ){
+        answer = &_packets.answers[a];
+        if ( ( wanted & ( 1UL << a ) ) && answer->pending && answer->truncated_from == from->s_ip )
+          answer->pending = 0;
       }
-    }    
-  default:
-    _debug_out("UDP multicast test: Request not support type: %d.---------------------\r\n", question->question_type);
+    }
+    return;
+  }
+
+  /* A legacy resolver that did not send from the mDNS port gets a direct
+     answer, RFC 6762 section 6.7 */
+  if ( from->s_port != MDNS_PORT ){
+    _reply_legacy( fd, iter, wanted, from );
+    return;
+  }
+
+  wanted &= ~_read_known_answers( iter, htons(iter->header->answer_count) );
+  truncated = ( ntohs(iter->header->flags) & DNS_MESSAGE_TRUNCATION ) != 0;
+  now = mico_get_time();
+
+  for ( a = 0; a < MDNS_ANSWER_NUM; ++a ){
+    answer = &_packets.answers[a];
+    if ( ( wanted & ( 1UL << a ) ) == 0 || answer->msg.header == NULL )
+      continue;
+    if ( now - answer->last_sent < MDNS_MULTICAST_INTERVAL )
+      continue;
+    /* Our host address is unique and answered at once */
+    if ( truncated )
+      delay = MDNS_TRUNCATED_DELAY_MIN + _random() % MDNS_TRUNCATED_DELAY_RANGE;
+    else if ( a == MDNS_ANSWER_ADDRESS )
+      delay = 0;
+    else
+      delay = MDNS_SHARED_DELAY_MIN + _random() % MDNS_SHARED_DELAY_RANGE;
+    if ( answer->pending == 0 || (int32_t)( answer->due - ( now + delay ) ) > 0 ){
+      answer->due = now + delay;
+      answer->truncated_from = truncated ? from->s_ip : 0;
+      answer->pending = 1;
+    }
+  }
+}
+
+/* Another responder multicast our records, drop the pending answers it
+   covered, RFC 6762 section 7.4. Once we are querying every record heard
+   is cached as well. */
+static void process_dns_answers( dns_message_iterator_t* iter, struct sockaddr_t* from )
+{
+  dns_message_iterator_t records;
+  dns_name_t name;
+  dns_question_t question;
+  u32 known;
+  int a = 0;
+
+  for ( a = 0; a < htons(iter->header->question_count); ++a ){
+    if(dns_get_next_question( iter, &question, &name )==0)
+      return;
+  }
+  records = *iter;
+  if ( _cache_enabled && from->s_port == MDNS_PORT )
+    _cache_records( &records, htons(iter->header->answer_count) + htons(iter->header->name_server_count)
+                             + htons(iter->header->additional_record_count) );
+  known = _read_known_answers( iter, htons(iter->header->answer_count) );
+  for ( a = 0; a < MDNS_ANSWER_NUM; ++a ){
+    if ( known & ( 1UL << a ) )
+      _packets.answers[a].pending = 0;
+  }
+}
+
+/* Multicast the answers that are due, returns the time until the next one */
+static u32 _send_due_answers( int fd, u32 max_wait )
+{
+  mdns_answer_t* answer;
+  u32 now = mico_get_time();
+  u32 wait = max_wait;
+  int a = 0;
+
+  for ( a = 0; a < MDNS_ANSWER_NUM; ++a ){
+    answer = &_packets.answers[a];
+    if ( answer->pending == 0 )
+      continue;
+    if ( (int32_t)( answer->due - now ) <= 0 ){
+      if ( answer->msg.header ){
+        answer->msg.header->id = 0;
+        mdns_send_message(fd, &answer->msg );
+        answer->last_sent = now;
+      }
+      answer->pending = 0;
+    }
+    else if ( answer->due - now < wait )
+      wait = answer->due - now;
   }
+  return wait;
 }
 
 
@@ -225,8 +595,7 @@ static int dns_get_next_question( dns_message_iterator_t* iter, dns_question_t*
   // Set the name pointers and then skip it
   name->start_of_name   = (u8*) iter->iter;
   name->start_of_packet = (u8*) iter->header;
-  dns_skip_name( iter );
-  if (iter->iter > iter->end)
+  if (dns_skip_name( iter ) == 0 || iter->iter + 4 > iter->end)
     return 0;
   
   // Read the type and class
@@ -235,57 +604,6 @@ static int dns_get_next_question( dns_message_iterator_t* iter, dns_question_t*
   return 1;
 }
 
-static int dns_compare_name_to_string( dns_name_t* name, const char* string, const char* fun, int line )
-{
-  u8 section_length;
-  int finished = 0;
-  int result   = 1;
-  u8* buffer 	  = name->start_of_name;
-  _debug_out("UDP multicast test: CMP called by %s@%d.\r\n", fun, line );
-  char *temp;
-  
-  while ( !finished )
-  {
-    // Check if the name is compressed. If so, find the uncompressed version
-    while ( *buffer & 0xC0 )
-    {
-      u16 offset = ( *buffer++ ) << 8;
-      offset += *buffer;
-      offset &= 0x3FFF;
-      buffer = name->start_of_packet + offset;
-      _debug_out("UDP multicast test: Recv a compressed name.\r\n");
-    }
-    
-    // Compare section
-    section_length = *( buffer++ );
-    temp = malloc(section_length+1);
-    temp[section_length] = 0;
-    memcpy(temp, buffer, section_length );
-    _debug_out("UDP multicast test: Recv a name: %s.\r\n", temp);
-    free(temp);
-    if ( strncmp( (char*) buffer, string, section_length ) )
-    {
-      result	 = 0;
-      finished = 1;
-    }
-    string += section_length + 1;
-    buffer += section_length;
-    
-    // Check if we've finished comparing
-    if ( *buffer == 0 || *string == 0 )
-    {
-      finished = 1;
-      // Check if one of the strings has more data
-      if ( *buffer != 0 || *string != 0 )
-      {
-        result = 0;
-      }
-    }
-  }
-  
-  return result;
-}
-
 static int dns_create_message( dns_message_iterator_t* message, u16 size )
 {
   message->header = (dns_message_header_t*) malloc( size );
@@ -295,6 +613,7 @@ static int dns_create_message( dns_message_iterator_t* message, u16 size )
   }
   
   message->iter = (u8*) message->header + sizeof(dns_message_header_t);
+  message->end  = (u8*) message->header + size;
   return 1;
 }
 
@@ -304,47 +623,6 @@ static void dns_free_message( dns_message_iterator_t* message )
   message->header = NULL;
 }
 
-static void dns_write_string( dns_message_iterator_t* iter, const char* src )
-{
-  u8* segment_length_pointer;
-  u8  segment_length;
-  
-  while ( *src != 0 && *src != 0xC0)
-  {
-    /* Remember where we need to store the segment length and reset the counter*/
-    segment_length_pointer = iter->iter++;
-    segment_length = 0;
-    
-    /* Copy bytes until '.' or end of string*/
-    while ( *src != '.' && *src != 0 && *src != 0xC0)
-    {
-      if (*src == '/')
-        src++; // skip '/'
-      
-      *iter->iter++ = *src++;
-      ++segment_length;
-    }
-    
-    /* Store the length of the segment*/
-    *segment_length_pointer = segment_length;
-    
-    /* Check if we stopped because of a '.', if so, skip it*/
-    if ( *src == '.' )
-    {
-      ++src;
-    }
-    
-  }
-  
-  if (*src == 0xC0) { // compress name
-    *iter->iter++ = *src++;
-    *iter->iter++ = *src++;
-  } else {
-    /* Add the ending null */
-    *iter->iter++ = 0;
-  }
-}
-
 
 static void dns_write_header( dns_message_iterator_t* iter, u16 id, u16 flags, u16 question_count, u16 answer_count, u16 authorative_count )
 {
@@ -354,10 +632,14 @@ static void dns_write_header( dns_message_iterator_t* iter, u16 id, u16 flags, u
   iter->header->question_count	= htons(question_count);
   iter->header->name_server_count = htons(authorative_count);
   iter->header->answer_count		= htons(answer_count);
+  iter->iter = (u8*) iter->header + sizeof(dns_message_header_t);
+
+  /* A new message, nothing to point to yet */
+  _dictionary_count = 0;
 }
 
 
-static void dns_write_record( dns_message_iterator_t* iter, const char* name, u16 record_class, u16 record_type, uint32_t ttl, u8* rdata )
+static void dns_write_record( dns_message_iterator_t* iter, const u8* name, u16 record_class, u16 record_type, uint32_t ttl, const u8* rdata, u16 rdata_len )
 {
   u8* rd_length;
   u8* temp_ptr;
@@ -376,12 +658,12 @@ static void dns_write_record( dns_message_iterator_t* iter, const char* name, u1
   switch ( record_type )
   {
   case RR_TYPE_A:
-    dns_write_bytes( iter, rdata, 4 );
+  case RR_TYPE_TXT:
+    dns_write_bytes( iter, rdata, rdata_len );
     break;
     
   case RR_TYPE_PTR:
-  case RR_TYPE_TXT:
-    dns_write_name( iter, (const char*) rdata );
+    dns_write_name( iter, rdata );
     break;
     
   case RR_TYPE_SRV:
@@ -393,7 +675,7 @@ static void dns_write_record( dns_message_iterator_t* iter, const char* name, u1
     dns_write_uint16( iter, ( (dns_sd_service_record_t*) rdata )->port );
     
     /* Write the hostname*/
-    dns_write_string( iter, ( (dns_sd_service_record_t*) rdata )->hostname );
+    dns_write_name( iter, _host_name.wire );
     break;
   default:
     break;
@@ -410,12 +692,9 @@ static void mdns_send_message(int fd, dns_message_iterator_t* message )
     return;
   
   addr.s_ip = inet_addr("224.0.0.251");
-  addr.s_port = 5353;
+  addr.s_port = MDNS_PORT;
   _debug_out("UDP multicast test: Send a mDNS respond!+++++++++++++++++++++++++++\r\n");
   sendto(fd, message->header, message->iter - (u8*)message->header, 0, &addr, sizeof(addr));
-  addr.s_ip = inet_addr("255.255.255.255");
-  addr.s_port = 5353;
-  sendto(fd, message->header, message->iter - (u8*)message->header, 0, &addr, sizeof(addr));
 }
 
 static void dns_write_uint16( dns_message_iterator_t* iter, u16 data )
@@ -435,7 +714,7 @@ static void dns_write_uint32( dns_message_iterator_t* iter, uint32_t data )
   iter->iter += 4;
 }
 
-static void dns_write_bytes( dns_message_iterator_t* iter, u8* data, u16 length )
+static void dns_write_bytes( dns_message_iterator_t* iter, const u8* data, u16 length )
 {
   int a = 0;
   
@@ -453,9 +732,10 @@ static u16 dns_read_uint16( dns_message_iterator_t* iter )
   return temp;
 }
 
-static void dns_skip_name( dns_message_iterator_t* iter )
+/* Returns 0 if the name runs past the end of the message */
+static int dns_skip_name( dns_message_iterator_t* iter )
 {
-  while ( *iter->iter != 0 )
+  while ( iter->iter < iter->end && *iter->iter != 0 )
   {
     // Check if the name is compressed
     if ( *iter->iter & 0xC0 )
@@ -467,23 +747,330 @@ static void dns_skip_name( dns_message_iterator_t* iter )
     {
       iter->iter += (uint32_t) *iter->iter + 1;
     }
-    if (iter->iter > iter->end)
-      break;
   }
+  if ( iter->iter >= iter->end )
+    return 0;
   // Skip the null u8
   ++iter->iter;
+  return 1;
 }
 
-static void dns_write_name( dns_message_iterator_t* iter, const char* src )
+static u16 _wire_len( const u8* wire )
 {
-  dns_write_string( iter, src );
+  u16 len = 0;
+
+  while ( wire[len] != 0 )
+    len += wire[len] + 1;
+  return len + 1;
 }
 
+/* Write an uncompressed wire name, the longest suffix already in the
+   message is replaced by a pointer to it, RFC 1035 section 4.1.4 */
+static void dns_write_name( dns_message_iterator_t* iter, const u8* wire )
+{
+  u16 offset;
+  u16 len;
+  int a = 0;
 
-void bonjour_service_init(bonjour_init_t init)
+  while ( *wire != 0 )
+  {
+    len = _wire_len( wire );
+    for ( a = 0; a < _dictionary_count; ++a )
+    {
+      if ( _wire_len( _dictionary[a].wire ) == len && memcmp( _dictionary[a].wire, wire, len ) == 0 )
+      {
+        *iter->iter++ = 0xC0 | ( _dictionary[a].offset >> 8 );
+        *iter->iter++ = _dictionary[a].offset & 0xFF;
+        return;
+      }
+    }
+
+    offset = iter->iter - (u8*) iter->header;
+    if ( _dictionary_count < MDNS_MAX_DICTIONARY && offset < 0x3FFF )
+    {
+      _dictionary[_dictionary_count].wire   = wire;
+      _dictionary[_dictionary_count].offset = offset;
+      _dictionary_count++;
+    }
+    dns_write_bytes( iter, wire, *wire + 1 );
+    wire += *wire + 1;
+  }
+  *iter->iter++ = 0;
+}
+
+/* The PTR record is shared and never carries the cache-flush bit, RFC 6762
+   section 10.2 */
+static void _write_service_records( dns_message_iterator_t* iter, dns_sd_service_record_t* service, uint32_t ttl, u32* ip )
+{
+  dns_write_record( iter, service->service_name.wire, RR_CLASS_IN, RR_TYPE_PTR, ttl, service->instance_name.wire, 0 );
+  dns_write_record( iter, service->instance_name.wire, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_TXT, ttl, service->txt_att, service->txt_len );
+  dns_write_record( iter, service->instance_name.wire, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_SRV, ttl, (u8*) service, 0 );
+  dns_write_record( iter, _host_name.wire, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_A, ttl, (u8*) ip, 4 );
+}
+
+/* Copy a message written in a scratch buffer into one of its own size */
+static void _seal_message( dns_message_iterator_t* scratch, dns_message_iterator_t* packet )
+{
+  u16 len = scratch->iter - (u8*) scratch->header;
+
+  packet->header = (dns_message_header_t*) malloc( len );
+  if ( packet->header != NULL )
+  {
+    memcpy( packet->header, scratch->header, len );
+    packet->iter = (u8*) packet->header + len;
+    packet->end  = packet->iter;
+  }
+}
+
+static void _free_packets( void )
+{
+  int a = 0;
+
+  for ( a = 0; a < MDNS_ANSWER_NUM; ++a ){
+    if ( _packets.answers[a].msg.header )
+      dns_free_message( &_packets.answers[a].msg );
+    _packets.answers[a].pending = 0;
+    _packets.answers[a].last_sent = mico_get_time() - MDNS_MULTICAST_INTERVAL;
+  }
+  for ( a = 0; a < MDNS_MAX_SERVICES; ++a ){
+    if ( _packets.announce[a].header )
+      dns_free_message( &_packets.announce[a] );
+    if ( _packets.goodbye[a].header )
+      dns_free_message( &_packets.goodbye[a] );
+  }
+}
+
+/* Each service type is listed once however many instances it has */
+static int _first_of_type( int b )
+{
+  int a = 0;
+
+  for ( a = 0; a < b; ++a ){
+    if ( available_services[a].in_use && available_services[a].service_name.len == available_services[b].service_name.len
+      && memcmp( available_services[a].service_name.lower_wire, available_services[b].service_name.lower_wire, available_services[b].service_name.len ) == 0 )
+      return 0;
+  }
+  return 1;
+}
+
+static uint32_t _cap_ttl( uint32_t ttl, uint32_t max_ttl )
+{
+  return ( max_ttl != 0 && ttl > max_ttl ) ? max_ttl : ttl;
+}
+
+/* Write answer a as a whole message, returns 0 if there is nothing to
+   answer. A legacy unicast reply repeats the query's questions in front of
+   the records and caps their TTLs, RFC 6762 section 6.7, max_ttl 0 keeps
+   the TTLs as they are. */
+static int _write_answer( dns_message_iterator_t* iter, int a, const u8* questions, u16 questions_len, u16 question_count, uint32_t max_ttl )
+{
+  dns_sd_service_record_t* service;
+  u16 types = 0;
+  int b = 0;
+
+  if ( a == MDNS_ANSWER_SERVICES ){
+    for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+      if ( available_services[b].in_use && _first_of_type( b ) )
+        types++;
+    }
+    if ( types == 0 )
+      return 0;
+    dns_write_header( iter, 0x0, 0x8400, question_count, types, 0 );
+    dns_write_bytes( iter, questions, questions_len );
+    for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+      if ( available_services[b].in_use && _first_of_type( b ) )
+        dns_write_record( iter, _services_query_name.wire, RR_CLASS_IN, RR_TYPE_PTR, _cap_ttl( MDNS_SERVICE_TTL, max_ttl ), available_services[b].service_name.wire, 0 );
+    }
+  }
+  else if ( a == MDNS_ANSWER_ADDRESS ){
+    dns_write_header( iter, 0x0, 0x8400, question_count, 1, 0 );
+    dns_write_bytes( iter, questions, questions_len );
+    dns_write_record( iter, _host_name.wire, RR_CLASS_IN | RR_CACHE_FLUSH, RR_TYPE_A, _cap_ttl( MDNS_HOST_TTL, max_ttl ), (u8*) &_packets_ip, 4 );
+  }
+  else{
+    service = &available_services[a - MDNS_ANSWER_DETAIL(0)];
+    if ( service->in_use == 0 )
+      return 0;
+    dns_write_header( iter, 0x0, 0x8400, question_count, 4, 0 );
+    dns_write_bytes( iter, questions, questions_len );
+    _write_service_records( iter, service, _cap_ttl( MDNS_SERVICE_TTL, max_ttl ), &_packets_ip );
+  }
+  return 1;
+}
+
+static void _build_packets( u32 ip )
+{
+  dns_message_iterator_t scratch;
+  int a = 0;
+  int b = 0;
+
+  _free_packets();
+  _packets_ip = ip;
+  if ( _host_name.wire == NULL || dns_create_message( &scratch, MDNS_PACKET_SIZE ) == 0 )
+    return;
+
+  for ( a = 0; a < MDNS_ANSWER_NUM; ++a ){
+    if ( _write_answer( &scratch, a, NULL, 0, 0, 0 ) )
+      _seal_message( &scratch, &_packets.answers[a].msg );
+  }
+
+  for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+    if ( available_services[b].in_use == 0 )
+      continue;
+    dns_write_header( &scratch, 0x0, 0x8400, 0, 4, 0 );
+    _write_service_records( &scratch, &available_services[b], MDNS_SERVICE_TTL, &ip );
+    _seal_message( &scratch, &_packets.announce[b] );
+    dns_write_header( &scratch, 0x0, 0x8400, 0, 4, 0 );
+    _write_service_records( &scratch, &available_services[b], 0, &ip );
+    _seal_message( &scratch, &_packets.goodbye[b] );
+  }
+  dns_free_message( &scratch );
+}
+
+/* A legacy resolver gets one direct reply per answer, with its transaction
+   ID and questions. The questions are copied to the offset they had in the
+   query, so compression pointers between them stay valid. */
+static void _reply_legacy( int fd, dns_message_iterator_t* query, u32 wanted, struct sockaddr_t* from )
+{
+  dns_message_iterator_t questions = *query;
+  dns_message_iterator_t reply;
+  dns_question_t question;
+  dns_name_t name;
+  u8* start = (u8*) query->header + sizeof(dns_message_header_t);
+  u8* end = start;
+  u16 count = 0;
+  int a = 0;
+
+  questions.iter = start;
+  while ( count < htons(query->header->question_count) && dns_get_next_question( &questions, &question, &name ) ){
+    end = questions.iter;
+    count++;
+  }
+  if ( dns_create_message( &reply, MDNS_PACKET_SIZE ) == 0 )
+    return;
+
+  for ( a = 0; a < MDNS_ANSWER_NUM; ++a ){
+    if ( ( wanted & ( 1UL << a ) ) == 0 || _packets.answers[a].msg.header == NULL )
+      continue;
+    /* The records take as much room as in the cached answer */
+    if ( ( end - start ) + ( _packets.answers[a].msg.iter - (u8*) _packets.answers[a].msg.header ) > MDNS_PACKET_SIZE )
+      continue;
+    if ( _write_answer( &reply, a, start, end - start, count, MDNS_LEGACY_TTL ) ){
+      reply.header->id = query->header->id;
+      sendto(fd, reply.header, reply.iter - (u8*) reply.header, 0, from, sizeof(struct sockaddr_t));
+    }
+  }
+  dns_free_message( &reply );
+}
+
+/* Rebuild the packets if the interface got another address, called with
+   bonjour_mutex held */
+static void _refresh_packets( void )
 {
-  int len;
   net_para_st para;
+  u32 myip;
+
+  getNetPara(&para, _interface);
+  myip = htonl(inet_addr(para.ip));
+  if ( myip != _packets_ip )
+    _build_packets( myip );
+}
+
+/* Length of txt_record once encoded by _encode_labels, 0 if a string is
+   longer than 255 bytes or the record longer than MDNS_MAX_TXT_LEN */
+static u16 _txt_len( const char* src )
+{
+  u16 len = 1;
+  u16 segment;
+
+  while ( *src != 0 )
+  {
+    segment = 0;
+    while ( *src != '.' && *src != 0 )
+    {
+      if ( *src == '/' && *++src == 0 )
+        return 0;
+      ++src;
+      ++segment;
+    }
+    if ( segment > 255 )
+      return 0;
+    len += segment + 1;
+    if ( len > MDNS_MAX_TXT_LEN )
+      return 0;
+    if ( *src == '.' )
+      ++src;
+  }
+  return len;
+}
+
+static int _set_txt( dns_sd_service_record_t* service, const char* txt_record )
+{
+  u8* txt;
+
+  if ( txt_record == NULL )
+    txt_record = "";
+  if ( _txt_len( txt_record ) == 0 )
+    return -1;
+  txt = (u8*) malloc( strlen( txt_record ) + 2 );
+  if ( txt == NULL )
+    return -1;
+  if ( service->txt_att )
+    free( service->txt_att );
+  service->txt_att = txt;
+  service->txt_len = _encode_labels( txt_record, txt );
+  return 0;
+}
+
+static void _free_service( dns_sd_service_record_t* service )
+{
+  _free_name_key( &service->service_name );
+  _free_name_key( &service->instance_name );
+  if ( service->txt_att )
+    free( service->txt_att );
+  memset( service, 0, sizeof(dns_sd_service_record_t) );
+}
+
+/* Called with bonjour_mutex held */
+static int _add_service( bonjour_init_t* init )
+{
+  dns_sd_service_record_t* service = NULL;
+  char* instance;
+  int b = 0;
+
+  if ( init->service_name == NULL || init->instance_name == NULL )
+    return -1;
+  for ( b = 0; b < MDNS_MAX_SERVICES && service == NULL; ++b ){
+    if ( available_services[b].in_use == 0 )
+      service = &available_services[b];
+  }
+  if ( service == NULL )
+    return -1;
+  b = service - available_services;
+
+  instance = (char*) malloc( strlen( init->instance_name ) + 1 + strlen( init->service_name ) + 1 );
+  if ( instance == NULL )
+    return -1;
+  sprintf( instance, "%s.%s", init->instance_name, init->service_name );
+  if ( _make_name_key( &service->service_name, init->service_name ) == 0
+    || _make_name_key( &service->instance_name, instance ) == 0
+    || _set_txt( service, init->txt_record ) != 0 ){
+    free( instance );
+    _free_service( service );
+    return -1;
+  }
+  free( instance );
+
+  service->port = init->service_port;
+  service->in_use = 1;
+  service->announce_left = MDNS_ANNOUNCE_COUNT;
+  _bonjour_announce_next = mico_get_time();
+  return b;
+}
+
+void bonjour_service_init(bonjour_init_t init)
+{
+  int b = 0;
 
   _interface = init.interface;
 
@@ -491,40 +1078,505 @@ void bonjour_service_init(bonjour_init_t init)
     mico_rtos_init_mutex( &bonjour_mutex );
 
 
-  //mico_rtos_lock_mutex( &bonjour_mutex );
-  if(available_services) {
-    //suspend_bonjour_service(ENABLE);
-    if(available_services->service_name)  free(available_services->service_name);
-    if(available_services->hostname)  free(available_services->hostname);
-    if(available_services->instance_name)  free(available_services->instance_name);
-    if(available_services->txt_att)  free(available_services->txt_att);
-    free(available_services);
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  _free_packets();
+  for ( b = 0; b < MDNS_MAX_SERVICES; ++b )
+    _free_service( &available_services[b] );
+  _free_name_key( &_host_name );
+  _free_name_key( &_services_query_name );
+
+  _make_name_key( &_services_query_name, MFi_SERVICE_QUERY_NAME );
+  _make_name_key( &_host_name, init.host_name );
+  _add_service( &init );
+
+  /* Seeded from the host name, which carries the MAC address, so that a
+     fleet does not pick the same delays */
+  _random_state = mico_get_time();
+  for(b = 0; init.host_name && init.host_name[b]; b++)
+    _random_state = _hash_byte(_random_state, (u8)init.host_name[b]);
+  _random_state |= 1;
+
+  _packets_ip = 0;
+  _refresh_packets();
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+}
+
+int bonjour_service_add(bonjour_init_t init)
+{
+  int service;
+
+  if(bonjour_mutex == NULL)
+    return -1;
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  service = _add_service( &init );
+  if ( service >= 0 )
+    _build_packets( _packets_ip );
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+  return service;
+}
+
+int bonjour_service_update_txt(int service, char *txt_record)
+{
+  int err = -1;
+
+  if(bonjour_mutex == NULL || service < 0 || service >= MDNS_MAX_SERVICES)
+    return -1;
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  if ( available_services[service].in_use && _set_txt( &available_services[service], txt_record ) == 0 ){
+    _build_packets( _packets_ip );
+    /* Only this service is announced again, RFC 6762 section 8.4 */
+    available_services[service].announce_left = MDNS_ANNOUNCE_COUNT;
+    _bonjour_announce_next = mico_get_time();
+    err = 0;
   }
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+  return err;
+}
 
-  getNetPara(&para, _interface);
+void bonjour_service_remove(int service)
+{
+  if(bonjour_mutex == NULL || service < 0 || service >= MDNS_MAX_SERVICES)
+    return;
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  if ( available_services[service].in_use ){
+    if ( _packets.goodbye[service].header && mDNS_fd != -1 ){
+      mdns_send_message(mDNS_fd, &_packets.goodbye[service] );
+      mico_thread_msleep(20);
+      mdns_send_message(mDNS_fd, &_packets.goodbye[service] );
+    }
+    _free_service( &available_services[service] );
+    _build_packets( _packets_ip );
+  }
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+}
 
-  available_service_count = 1;
-  available_services = (void *)malloc(sizeof(dns_sd_service_record_t) * 1);
-  memset(available_services, 0x0, sizeof(dns_sd_service_record_t) * 1);
+void bonjour_update_address(void)
+{
+  if(bonjour_mutex == NULL)
+    return;
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  _refresh_packets();
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+}
 
-  available_services->service_name = (char*)__strdup(init.service_name);
+/* Querier: continuous queries and a cache of every response we hear */
 
-  available_services->hostname = (char*)__strdup(init.host_name);
+static int _wire_equal_nocase( const u8* a, const u8* b, u16 len )
+{
+  u16 i = 0;
 
-  len = strlen(init.instance_name);
-  available_services->instance_name = (char*)malloc(len+3);//// 0xc00c+\0
-  memcpy(available_services->instance_name, init.instance_name, len);
-  available_services->instance_name[len]= 0xc0;
-  available_services->instance_name[len+1]= 0x0c;
-  available_services->instance_name[len+2]= 0;
-  
-  available_services->txt_att = (char*)__strdup(init.txt_record);
+  for ( i = 0; i < len; ++i ){
+    if ( MDNS_TOLOWER( a[i] ) != MDNS_TOLOWER( b[i] ) )
+      return 0;
+  }
+  return 1;
+}
+
+static int _cache_owner_is( const mdns_cache_t* entry, const mdns_name_key_t* key )
+{
+  return entry->type != 0 && entry->hash == key->hash && entry->name_len == key->len
+      && memcmp( entry->data, key->lower_wire, key->len ) == 0;
+}
 
-  available_services->port = init.service_port;
-  //mico_rtos_unlock_mutex( &bonjour_mutex );
+static u32 _cache_left( const mdns_cache_t* entry, u32 now )
+{
+  return ( now - entry->received < entry->ttl ) ? entry->ttl - ( now - entry->received ) : 0;
 }
 
-void mfi_mdns_handler(int fd, u8* pkt, int pkt_len)
+static void _cache_free( mdns_cache_t* entry )
+{
+  if ( entry->data )
+    free( entry->data );
+  memset( entry, 0, sizeof(mdns_cache_t) );
+}
+
+/* Length prefixed labels or TXT strings to "a.b.", a dot inside a label is
+   written as "/." so that the result reads like the strings we register */
+static void _labels_to_string( const u8* wire, u16 len, char* out, u16 out_len )
+{
+  u16 pos = 0;
+  u16 o = 0;
+  u8  label_len;
+  u8  a = 0;
+
+  if ( out_len == 0 )
+    return;
+  while ( pos < len && wire[pos] != 0 ){
+    label_len = wire[pos++];
+    for ( a = 0; a < label_len && pos < len; ++a, ++pos ){
+      if ( ( wire[pos] == '.' || wire[pos] == '/' ) && o + 1 < out_len )
+        out[o++] = '/';
+      if ( o + 1 < out_len )
+        out[o++] = wire[pos];
+    }
+    if ( o + 1 < out_len )
+      out[o++] = '.';
+  }
+  out[o] = 0;
+}
+
+/* Store one record, RFC 6762 section 10. A record heard again only gets its
+   TTL renewed, a goodbye expires it in a second, and a unique record with the
+   cache-flush bit ages out the other data we hold for that name and type. */
+static void _cache_store( const mdns_name_t* owner, u16 type, u16 record_class, uint32_t ttl, const u8* rdata, u16 rdata_len )
+{
+  mdns_cache_t* entry;
+  mdns_cache_t* slot = NULL;
+  u32 now = mico_get_time();
+  int a = 0;
+
+  if ( ttl > MDNS_CACHE_MAX_TTL )
+    ttl = MDNS_CACHE_MAX_TTL;
+
+  for ( a = 0; a < MDNS_CACHE_SIZE; ++a ){
+    entry = &_cache[a];
+    if ( entry->type != type || entry->hash != owner->hash || entry->name_len != owner->len
+      || memcmp( entry->data, owner->wire, owner->len ) != 0 )
+      continue;
+    if ( entry->rdata_len == rdata_len && memcmp( entry->data + entry->name_len, rdata, rdata_len ) == 0 ){
+      entry->received = now;
+      entry->ttl = ttl ? ttl * 1000 : 1000;
+      entry->refreshes = ttl ? 0 : MDNS_CACHE_REFRESHES;
+      slot = entry;
+    }
+    else if ( ( record_class & RR_CACHE_FLUSH ) && now - entry->received > 1000 && _cache_left( entry, now ) > 1000 ){
+      entry->received = now;
+      entry->ttl = 1000;
+      entry->refreshes = MDNS_CACHE_REFRESHES;
+    }
+  }
+  if ( slot || ttl == 0 )
+    return;
+
+  /* A free slot, else the entry closest to expiry */
+  slot = &_cache[0];
+  for ( a = 0; a < MDNS_CACHE_SIZE; ++a ){
+    if ( _cache[a].type == 0 ){
+      slot = &_cache[a];
+      break;
+    }
+    if ( _cache_left( &_cache[a], now ) < _cache_left( slot, now ) )
+      slot = &_cache[a];
+  }
+  _cache_free( slot );
+  slot->data = (u8*) malloc( owner->len + rdata_len );
+  if ( slot->data == NULL )
+    return;
+  memcpy( slot->data, owner->wire, owner->len );
+  memcpy( slot->data + owner->len, rdata, rdata_len );
+  slot->name_len  = owner->len;
+  slot->rdata_len = rdata_len;
+  slot->hash      = owner->hash;
+  slot->received  = now;
+  slot->ttl       = ttl * 1000;
+  slot->type      = type;
+}
+
+/* Cache the PTR, SRV, TXT and A records of all sections. Names inside the
+   rdata are stored uncompressed and keep their case. */
+static void _cache_records( dns_message_iterator_t* iter, u16 count )
+{
+  static mdns_name_t owner;
+  static mdns_name_t target;
+  static u8 rdata[MDNS_MAX_NAME_LEN + 6];
+  dns_name_t name;
+  dns_question_t record;
+  uint32_t ttl;
+  u16 rd_length;
+  u8* next;
+
+  for ( ; count > 0; --count )
+  {
+    if(dns_get_next_question( iter, &record, &name )==0 || iter->iter + 6 > iter->end)
+      return;
+    ttl  = (uint32_t) dns_read_uint16( iter ) << 16;
+    ttl |= dns_read_uint16( iter );
+    rd_length = dns_read_uint16( iter );
+    next = iter->iter + rd_length;
+    if ( next > iter->end )
+      return;
+
+    if ( _read_name( name.start_of_packet, iter->end, name.start_of_name, &owner, 0 ) && owner.len ){
+      switch ( record.question_type )
+      {
+      case RR_TYPE_PTR:
+        if ( _read_name( name.start_of_packet, next, iter->iter, &target, 1 ) && target.len )
+          _cache_store( &owner, RR_TYPE_PTR, record.question_class, ttl, target.wire, target.len );
+        break;
+      case RR_TYPE_SRV:
+        if ( rd_length > 6 && _read_name( name.start_of_packet, next, iter->iter + 6, &target, 1 ) && target.len ){
+          memcpy( rdata, iter->iter, 6 );
+          memcpy( rdata + 6, target.wire, target.len );
+          _cache_store( &owner, RR_TYPE_SRV, record.question_class, ttl, rdata, 6 + target.len );
+        }
+        break;
+      case RR_TYPE_TXT:
+        if ( rd_length <= MDNS_CACHE_MAX_TXT )
+          _cache_store( &owner, RR_TYPE_TXT, record.question_class, ttl, iter->iter, rd_length );
+        break;
+      case RR_TYPE_A:
+        if ( rd_length == 4 )
+          _cache_store( &owner, RR_TYPE_A, record.question_class, ttl, iter->iter, 4 );
+        break;
+      default:
+        break;
+      }
+    }
+    iter->iter = next;
+  }
+}
+
+static mdns_cache_t* _cache_find( const mdns_name_key_t* owner, u16 type, u32 now )
+{
+  int a = 0;
+
+  for ( a = 0; a < MDNS_CACHE_SIZE; ++a ){
+    if ( _cache[a].type == type && _cache_owner_is( &_cache[a], owner ) && _cache_left( &_cache[a], now ) )
+      return &_cache[a];
+  }
+  return NULL;
+}
+
+static mdns_cache_t* _cache_find_wire( const u8* owner, u16 len, u16 type, u32 now )
+{
+  int a = 0;
+
+  for ( a = 0; a < MDNS_CACHE_SIZE; ++a ){
+    if ( _cache[a].type == type && _cache[a].name_len == len
+      && _wire_equal_nocase( _cache[a].data, owner, len ) && _cache_left( &_cache[a], now ) )
+      return &_cache[a];
+  }
+  return NULL;
+}
+
+/* Start asking for name, a continuous query repeats until it is stopped, a
+   one-shot query gives up once answered or after MDNS_RESOLVE_TIME */
+static int _query_start( const char* name, u16 type, int continuous )
+{
+  mdns_query_t* query = NULL;
+  mdns_name_key_t key;
+  int a = 0;
+
+  if ( _make_name_key( &key, name ) == 0 )
+    return -1;
+
+  for ( a = 0; a < MDNS_MAX_QUERIES; ++a ){
+    if ( _queries[a].type == type && _queries[a].name.hash == key.hash && _queries[a].name.len == key.len
+      && memcmp( _queries[a].name.lower_wire, key.lower_wire, key.len ) == 0 ){
+      _free_name_key( &key );
+      _queries[a].continuous |= continuous;
+      return a;
+    }
+    if ( _queries[a].type == 0 && query == NULL )
+      query = &_queries[a];
+  }
+  if ( query == NULL ){
+    _free_name_key( &key );
+    return -1;
+  }
+  query->name       = key;
+  query->type       = type;
+  query->continuous = continuous;
+  query->started    = mico_get_time();
+  query->next_send  = query->started + MDNS_SHARED_DELAY_MIN + _random() % MDNS_SHARED_DELAY_RANGE;
+  query->interval   = MDNS_QUERY_INTERVAL_MIN;
+  _cache_enabled    = 1;
+  return query - _queries;
+}
+
+static void _query_stop( mdns_query_t* query )
+{
+  _free_name_key( &query->name );
+  memset( query, 0, sizeof(mdns_query_t) );
+}
+
+static void _send_query( int fd, const u8* wire, u16 type, u32 now )
+{
+  dns_message_iterator_t message;
+  u16 answers = 0;
+  int a = 0;
+
+  if ( dns_create_message( &message, MDNS_PACKET_SIZE ) == 0 )
+    return;
+  dns_write_header( &message, 0x0, 0x0, 1, 0, 0 );
+  dns_write_name( &message, wire );
+  dns_write_uint16( &message, type );
+  dns_write_uint16( &message, RR_CLASS_IN );
+
+  /* Known answers with more than half their TTL left, RFC 6762 section 7.1 */
+  if ( type == RR_TYPE_PTR ){
+    for ( a = 0; a < MDNS_CACHE_SIZE; ++a ){
+      if ( _cache[a].type != RR_TYPE_PTR || _cache[a].name_len != _wire_len( wire )
+        || _wire_equal_nocase( _cache[a].data, wire, _cache[a].name_len ) == 0
+        || _cache_left( &_cache[a], now ) < _cache[a].ttl / 2 )
+        continue;
+      if ( message.end - message.iter < MDNS_MAX_NAME_LEN + 12 )
+        break;
+      dns_write_record( &message, wire, RR_CLASS_IN, RR_TYPE_PTR, _cache_left( &_cache[a], now ) / 1000, _cache[a].data + _cache[a].name_len, 0 );
+      answers++;
+    }
+  }
+  message.header->answer_count = htons(answers);
+  mdns_send_message( fd, &message );
+  dns_free_message( &message );
+}
+
+/* Send the queries and cache refreshes that are due, drop expired records,
+   returns the time until the next query */
+static u32 _send_queries( int fd, u32 max_wait )
+{
+  mdns_query_t* query;
+  mdns_cache_t* entry;
+  u32 now = mico_get_time();
+  u32 wait = max_wait;
+  u32 due;
+  int a = 0;
+  int b = 0;
+
+  for ( a = 0; a < MDNS_MAX_QUERIES; ++a ){
+    query = &_queries[a];
+    if ( query->type == 0 )
+      continue;
+    if ( query->continuous == 0
+      && ( now - query->started > MDNS_RESOLVE_TIME || _cache_find( &query->name, query->type, now ) ) ){
+      _query_stop( query );
+      continue;
+    }
+    if ( (int32_t)( query->next_send - now ) <= 0 ){
+      _send_query( fd, query->name.wire, query->type, now );
+      query->next_send = now + query->interval;
+      query->interval = Min( query->interval * 2, MDNS_QUERY_INTERVAL_MAX );
+    }
+    wait = Min( wait, query->next_send - now );
+  }
+
+  /* Records a query is interested in are asked for again at 80, 85, 90 and
+     95% of their TTL, plus up to 2% so that queriers do not collide,
+     RFC 6762 section 5.2 */
+  for ( a = 0; a < MDNS_CACHE_SIZE; ++a ){
+    entry = &_cache[a];
+    if ( entry->type == 0 )
+      continue;
+    if ( _cache_left( entry, now ) == 0 ){
+      _cache_free( entry );
+      continue;
+    }
+    if ( entry->refreshes >= MDNS_CACHE_REFRESHES )
+      continue;
+    for ( b = 0; b < MDNS_MAX_QUERIES; ++b ){
+      if ( _queries[b].type == entry->type && _cache_owner_is( entry, &_queries[b].name ) )
+        break;
+    }
+    if ( b == MDNS_MAX_QUERIES && entry->wanted == 0 )
+      continue;
+    due = entry->received + entry->ttl / 100 * ( 80 + 5 * entry->refreshes ) + entry->ttl / 1000 * ( entry->hash % 20 );
+    if ( (int32_t)( due - now ) <= 0 ){
+      _send_query( fd, entry->data, entry->type, now );
+      entry->refreshes++;
+    }
+    else
+      wait = Min( wait, due - now );
+  }
+  return wait;
+}
+
+int bonjour_browse_start(char *service_name)
+{
+  int query;
+
+  if(bonjour_mutex == NULL || service_name == NULL)
+    return -1;
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  query = _query_start( service_name, RR_TYPE_PTR, 1 );
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+  return query;
+}
+
+void bonjour_browse_stop(int browse)
+{
+  if(bonjour_mutex == NULL || browse < 0 || browse >= MDNS_MAX_QUERIES)
+    return;
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  if ( _queries[browse].type )
+    _query_stop( &_queries[browse] );
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+}
+
+int bonjour_browse_get(char *service_name, int index, char *instance, int len)
+{
+  mdns_name_key_t key;
+  u32 now = mico_get_time();
+  int err = -1;
+  int a = 0;
+
+  if(bonjour_mutex == NULL || service_name == NULL || instance == NULL)
+    return -1;
+  if ( _make_name_key( &key, service_name ) == 0 )
+    return -1;
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  for ( a = 0; a < MDNS_CACHE_SIZE; ++a ){
+    if ( _cache[a].type == RR_TYPE_PTR && _cache_owner_is( &_cache[a], &key ) && _cache_left( &_cache[a], now ) ){
+      if ( index-- == 0 ){
+        _labels_to_string( _cache[a].data + _cache[a].name_len, _cache[a].rdata_len, instance, len );
+        err = 0;
+        break;
+      }
+    }
+  }
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+  _free_name_key( &key );
+  return err;
+}
+
+int bonjour_resolve(char *instance, bonjour_service_info_t *info)
+{
+  mdns_name_key_t key;
+  mdns_cache_t* srv;
+  mdns_cache_t* txt;
+  mdns_cache_t* a = NULL;
+  u32 now = mico_get_time();
+  u8* ip;
+  int err = -1;
+
+  if(bonjour_mutex == NULL || instance == NULL || info == NULL)
+    return -1;
+  if ( _make_name_key( &key, instance ) == 0 )
+    return -1;
+  memset( info, 0, sizeof(bonjour_service_info_t) );
+  mico_rtos_lock_mutex( &bonjour_mutex );
+  srv = _cache_find( &key, RR_TYPE_SRV, now );
+  txt = _cache_find( &key, RR_TYPE_TXT, now );
+  if ( srv ){
+    a = _cache_find_wire( srv->data + srv->name_len + 6, srv->rdata_len - 6, RR_TYPE_A, now );
+    _labels_to_string( srv->data + srv->name_len + 6, srv->rdata_len - 6, info->host_name, sizeof(info->host_name) );
+  }
+
+  /* Whatever is missing is asked for, the caller tries again later */
+  if ( srv == NULL )
+    _query_start( instance, RR_TYPE_SRV, 0 );
+  if ( txt == NULL )
+    _query_start( instance, RR_TYPE_TXT, 0 );
+  if ( srv && a == NULL )
+    _query_start( info->host_name, RR_TYPE_A, 0 );
+
+  if ( srv && a ){
+    srv->wanted = 1;
+    a->wanted = 1;
+    info->service_port = ( srv->data[srv->name_len + 4] << 8 ) | srv->data[srv->name_len + 5];
+    ip = a->data + a->name_len;
+    sprintf( info->ip, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3] );
+    if ( txt ){
+      txt->wanted = 1;
+      _labels_to_string( txt->data + txt->name_len, txt->rdata_len, info->txt_record, sizeof(info->txt_record) );
+    }
+    err = 0;
+  }
+  mico_rtos_unlock_mutex( &bonjour_mutex );
+  _free_name_key( &key );
+  return err;
+}
+
+void mfi_mdns_handler(int fd, u8* pkt, int pkt_len, struct sockaddr_t* from)
 {
 
   dns_message_iterator_t iter;
@@ -533,68 +1585,71 @@ void mfi_mdns_handler(int fd, u8* pkt, int pkt_len)
   iter.iter   = (u8*) iter.header + sizeof(dns_message_header_t);
   iter.end = pkt+pkt_len;
   
+  /* Messages with another opcode or a response code are silently ignored,
+     RFC 6762 section 18 */
+  if ( pkt_len < (int)sizeof(dns_message_header_t)
+    || ( ntohs(iter.header->flags) & ( DNS_MESSAGE_OPCODE | DNS_MESSAGE_RESPONSE_CODE ) ) )
+    return;
+
   // Check if the message is a response (otherwise its a query)
   if ( ntohs(iter.header->flags) & DNS_MESSAGE_IS_A_RESPONSE )
   {
+    process_dns_answers( &iter, from );
   }
   else
   {
-    process_dns_questions(fd, &iter );
+    process_dns_questions(fd, &iter, from );
   }
 }
 
-void mfi_bonjour_send(int fd)
+/* Send the next announcement of every service that has some left, returns
+   0 once all are done */
+int mfi_bonjour_send(int fd)
 {
-  dns_message_iterator_t response;
-  u32 myip;
-  net_para_st para;
-  getNetPara(&para, _interface);
-  myip = htonl(inet_addr(para.ip));
+  u32 now = mico_get_time();
+  int announced = 0;
   int b = 0;
     
-  if(dns_create_message( &response, 512 )) {
-    dns_write_header(&response, 0x0, 0x8400, 0, available_service_count, 0 );          
-    for ( b = 0; b < available_service_count; ++b ){
-      dns_write_record( &response, MFi_SERVICE_QUERY_NAME, RR_CLASS_IN, RR_TYPE_PTR, 1500, (u8*) available_services[b].service_name );
-    }
-    mdns_send_message(fd, &response );
-    dns_free_message( &response );
-  }
-
-  for ( b = 0; b < available_service_count; ++b ){
-      if(dns_create_message( &response, 512 )){
-        dns_write_header( &response, 0x0, 0x8400, 0, 4, 0 );
-        dns_write_record( &response, available_services[b].service_name, RR_CLASS_IN, RR_TYPE_PTR, 1500, (u8*) available_services[b].instance_name );
-        dns_write_record( &response, available_services[b].instance_name, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_TXT, 1500, (u8*) available_services[b].txt_att );
-        dns_write_record( &response, available_services[b].instance_name, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_SRV, 1500, (u8*) &available_services[b]);
-        dns_write_record( &response, available_services[b].hostname, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_A, 1500, (u8*) &myip);
-        mdns_send_message(fd, &response );
-        dns_free_message( &response );
-      }
+  for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+    if ( available_services[b].in_use == 0 || available_services[b].announce_left == 0 )
+      continue;
+    available_services[b].announce_left--;
+    if ( _packets.announce[b].header ){
+      mdns_send_message(fd, &_packets.announce[b] );
+      _packets.answers[MDNS_ANSWER_DETAIL(b)].last_sent = now;
+      announced = 1;
+    }
+  }
+
+  if(announced && _packets.answers[MDNS_ANSWER_SERVICES].msg.header) {
+    _packets.answers[MDNS_ANSWER_SERVICES].msg.header->id = 0;
+    mdns_send_message(fd, &_packets.answers[MDNS_ANSWER_SERVICES].msg );
+    _packets.answers[MDNS_ANSWER_SERVICES].last_sent = now;
   }
+  return announced;
+}
+
+static int _announcing( void )
+{
+  int b = 0;
+
+  for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+    if ( available_services[b].in_use && available_services[b].announce_left )
+      return 1;
+  }
+  return 0;
 }
 
 
 void mfi_bonjour_remove_record(int fd)
 {
-  dns_message_iterator_t response;
-  u32 myip;
-  net_para_st para;
-  getNetPara(&para, _interface);
-  myip = htonl(inet_addr(para.ip));
   int b = 0;
 
-  for ( b = 0; b < available_service_count; ++b ){
-    if(dns_create_message( &response, 512 )){
-      dns_write_header( &response, 0x0, 0x8400, 0, 4, 0 );
-      dns_write_record( &response, available_services[b].service_name, RR_CLASS_IN, RR_TYPE_PTR, 0, (u8*) available_services[b].instance_name );
-      dns_write_record( &response, available_services[b].instance_name, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_TXT, 0, (u8*) available_services[b].txt_att );
-      dns_write_record( &response, available_services[b].instance_name, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_SRV, 0, (u8*) &available_services[b]);
-      dns_write_record( &response, available_services[b].hostname, RR_CACHE_FLUSH|RR_CLASS_IN, RR_TYPE_A, 0, (u8*) &myip);
-      mdns_send_message(fd, &response );
+  for ( b = 0; b < MDNS_MAX_SERVICES; ++b ){
+    if(_packets.goodbye[b].header){
+      mdns_send_message(fd, &_packets.goodbye[b] );
       mico_thread_msleep(20);
-      mdns_send_message(fd, &response );
-      dns_free_message( &response );
+      mdns_send_message(fd, &_packets.goodbye[b] );
     }
   }
 }
@@ -606,14 +1661,20 @@ int start_bonjour_service(void)
 
 void suspend_bonjour_service(FunctionalState state)
 {
+  int b = 0;
+
   mico_rtos_lock_mutex( &bonjour_mutex );
   if(state == ENABLE){
-    _bonjour_announce = 0;
+    for ( b = 0; b < MDNS_MAX_SERVICES; ++b )
+      available_services[b].announce_left = 0;
     mfi_bonjour_remove_record(mDNS_fd);
   }
   else{
-    _bonjour_announce = 1;
-    _bonjour_announce_time = 0;
+    /* The station may have come up with another address */
+    _refresh_packets();
+    for ( b = 0; b < MDNS_MAX_SERVICES; ++b )
+      available_services[b].announce_left = MDNS_ANNOUNCE_COUNT;
+    _bonjour_announce_next = mico_get_time();
   }
   mico_rtos_unlock_mutex( &bonjour_mutex );
 }
@@ -627,33 +1688,36 @@ void _bonjour_thread(void *arg)
   struct sockaddr_t addr;
   socklen_t addrLen;
   u32 opt;
+  u32 wait;
   (void)arg;
   
-  buf = (char*)malloc(1500);
-  
-  t.tv_sec = 1;
-  t.tv_usec = 0;
+  buf = (char*)buffer_pool_alloc(BUFFER_POOL_MDNS, 1500);
+  require(buf, exit);
   
   mDNS_fd = socket(AF_INET, SOCK_DGRM, IPPROTO_UDP);
   opt = 0xE00000FB; //"224.0.0.251"
   setsockopt(mDNS_fd, SOL_SOCKET, IP_ADD_MEMBERSHIP, &opt, 4);
-  addr.s_port = 5353;
+  addr.s_port = MDNS_PORT;
   addr.s_ip = INADDR_ANY;
   bind(mDNS_fd, &addr, sizeof(addr));
 
-  _bonjour_announce = 1;
+  _bonjour_announce_next = mico_get_time();
   
   while(1) {
+    mico_rtos_lock_mutex( &bonjour_mutex );
     /*Send bonjour info when wifi is connected */
-    if(_bonjour_announce){
+    if(_announcing() && (int32_t)(mico_get_time() - _bonjour_announce_next) >= 0){
       mfi_bonjour_send(mDNS_fd);
-     
-        _bonjour_announce_time ++;
-      if(_bonjour_announce_time > 8){
-        _bonjour_announce_time = 0;
-        _bonjour_announce = 0;
-      }
+      _bonjour_announce_next = mico_get_time() + MDNS_ANNOUNCE_INTERVAL;
     }
+    wait = _send_due_answers(mDNS_fd, MDNS_ANNOUNCE_INTERVAL);
+    wait = _send_queries(mDNS_fd, wait);
+    if(_announcing())
+      wait = Min(wait, (u32)Max((int32_t)(_bonjour_announce_next - mico_get_time()), 0));
+    mico_rtos_unlock_mutex( &bonjour_mutex );
+
+    t.tv_sec = wait / 1000;
+    t.tv_usec = (wait % 1000) * 1000;
 
     /*Check status on erery sockets on bonjour query */
     FD_ZERO(&readfds);
@@ -662,13 +1726,15 @@ void _bonjour_thread(void *arg)
     
     /*Read data from udp and send data back */ 
     if (FD_ISSET(mDNS_fd, &readfds)) {
+      addrLen = sizeof(addr);
       con = recvfrom(mDNS_fd, buf, 1500, 0, &addr, &addrLen); 
-        //mico_rtos_lock_mutex( &bonjour_mutex );
-        mfi_mdns_handler(mDNS_fd, (u8 *)buf, con);
-        //mico_rtos_unlock_mutex( &bonjour_mutex );
+        mico_rtos_lock_mutex( &bonjour_mutex );
+        if(con >= (int)sizeof(dns_message_header_t))
+          mfi_mdns_handler(mDNS_fd, (u8 *)buf, con, &addr);
+        mico_rtos_unlock_mutex( &bonjour_mutex );
     }
   }
-}
-
-
 
+exit:
+  mico_rtos_delete_thread(NULL);
+}
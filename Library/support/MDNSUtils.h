@@ -84,6 +84,9 @@ typedef enum
 
 #define RR_CACHE_FLUSH   0x8000
 
+#define MDNS_MAX_SERVICES   8     // Services registered at the same time
+#define MDNS_MAX_NAME_LEN   256   // Longest name in wire format we match against
+
 /**************************************************************************************************************
  * STRUCTURES
  **************************************************************************************************************/
@@ -138,8 +141,45 @@ typedef struct
   WiFi_Interface interface;
 } bonjour_init_t;
 
+/* Forget every service and register init as the first one */
+typedef struct
+{
+  char host_name[64];
+  char ip[16];
+  uint16_t service_port;
+  char txt_record[128];     // Strings separated by '.' like bonjour_init_t takes them
+} bonjour_service_info_t;
+
 void bonjour_service_init(bonjour_init_t init);
 
+/* Register one more service on the same host, returns its handle or -1 */
+int bonjour_service_add(bonjour_init_t init);
+
+/* Replace the TXT record of a service and announce only that service
+   again, the others are not disturbed. Fails if a string is longer than
+   255 bytes or the record longer than 512 once encoded. */
+int bonjour_service_update_txt(int service, char *txt_record);
+
+/* Send goodbyes for a service and forget it */
+void bonjour_service_remove(int service);
+
+/* Keep querying for instances of service_name, "_type._tcp.local.", with
+   the backoff of RFC 6762 section 5.2. Returns a handle or -1. */
+int bonjour_browse_start(char *service_name);
+
+void bonjour_browse_stop(int browse);
+
+/* Copy the index-th instance of service_name we know of to instance,
+   -1 once there are no more */
+int bonjour_browse_get(char *service_name, int index, char *instance, int len);
+
+/* Fill info from the cache, -1 if the SRV or A record is not there yet, the
+   missing records are queried for and the caller tries again later */
+int bonjour_resolve(char *instance, bonjour_service_info_t *info);
+
+/* Rebuild the cached packets if the interface's address changed */
+void bonjour_update_address(void);
+
 int start_bonjour_service(void);
 
 void suspend_bonjour_service(FunctionalState state);
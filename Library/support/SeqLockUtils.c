@@ -0,0 +1,80 @@
+/**
+******************************************************************************
+* @file    SeqLockUtils.c 
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This file contains function called by sequence lock operation
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/ 
+
+#include "SeqLockUtils.h"
+#include "MICORTOS.h"
+#include "Debug.h"
+
+#define seqlock_utils_log(M, ...) custom_log("SeqLockUtils", M, ##__VA_ARGS__)
+#define seqlock_utils_log_trace() custom_log_trace("SeqLockUtils")
+
+/* A reader that keeps seeing a writer in progress has most likely preempted
+   it, so it sleeps and lets the writer finish instead of spinning */
+#define SEQLOCK_SPIN_RETRIES    8
+
+void seqlock_init( seqlock_t* lock )
+{
+  lock->sequence = 0;
+}
+
+void seqlock_write_begin( seqlock_t* lock )
+{
+  lock->sequence++;
+}
+
+void seqlock_write_end( seqlock_t* lock )
+{
+  lock->sequence++;
+}
+
+uint32_t seqlock_read_begin( seqlock_t* lock )
+{
+  uint32_t sequence;
+  int retries = 0;
+
+  while( ( sequence = lock->sequence ) & 1 ){
+    if( ++retries >= SEQLOCK_SPIN_RETRIES ){
+      mico_thread_msleep( 1 );
+      retries = 0;
+    }
+  }
+  return sequence;
+}
+
+bool seqlock_read_retry( seqlock_t* lock, uint32_t start )
+{
+  return ( lock->sequence != start );
+}
+
+void seqlock_read_copy( seqlock_t* lock, void* outData, const volatile void* inData, uint32_t inLen )
+{
+  uint32_t sequence, i;
+  const volatile uint8_t* src = (const volatile uint8_t*)inData;
+  uint8_t* dst = (uint8_t*)outData;
+
+  /* Volatile reads keep the copy ordered between the two sequence reads */
+  do{
+    sequence = seqlock_read_begin( lock );
+    for( i = 0; i < inLen; i++ )
+      dst[i] = src[i];
+  }while( seqlock_read_retry( lock, sequence ) );
+}
+
@@ -0,0 +1,50 @@
+/**
+******************************************************************************
+* @file    SeqLockUtils.h 
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This header contains function prototypes for sequence locks, used
+*          to publish small read-mostly data to readers that never block
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/ 
+
+#ifndef __SeqLockUtils_h__
+#define __SeqLockUtils_h__
+
+#include "Common.h"
+
+/* The sequence is odd while a writer is updating the protected data. Writers
+   must be serialized by the caller, readers retry until they see the same
+   even sequence before and after their copy. */
+typedef struct
+{
+  volatile uint32_t sequence;
+} seqlock_t;
+
+void seqlock_init( seqlock_t* lock );
+
+void seqlock_write_begin( seqlock_t* lock );
+
+void seqlock_write_end( seqlock_t* lock );
+
+uint32_t seqlock_read_begin( seqlock_t* lock );
+
+bool seqlock_read_retry( seqlock_t* lock, uint32_t start );
+
+/* Copy inLen bytes of data protected by lock into outData */
+void seqlock_read_copy( seqlock_t* lock, void* outData, const volatile void* inData, uint32_t inLen );
+
+#endif // __SeqLockUtils_h__
+
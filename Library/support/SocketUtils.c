@@ -22,10 +22,16 @@
 #include "SocketUtils.h"
 #include "Debug.h"
 #include "MICO.h"
+#include "BufferPoolUtils.h"
 
 #define socket_utils_log(M, ...) custom_log("HTTPUtils", M, ##__VA_ARGS__)
 #define socket_utils_log_trace() custom_log_trace("HTTPUtils")
 
+#define kSocketGatherLen  1460    //One TCP segment on Ethernet or Wi-Fi
+
+static uint32_t _coalesce_writes = 0;
+static uint32_t _coalesce_segments = 0;
+
 OSStatus SocketSend( int fd, const uint8_t *inBuf, size_t inBufLen )
 {
     socket_utils_log_trace();
@@ -72,6 +78,55 @@ exit:
     return err;
 }
 
+OSStatus SocketSendv( int fd, const socket_iovec_t *inVec, int inVecCnt )
+{
+    OSStatus err = kParamErr;
+    uint8_t *gather = NULL;
+    size_t total = 0;
+    size_t gathered = 0;
+    size_t offset = 0;
+    size_t len;
+    int i;
+
+    require( fd>=0, exit );
+    require( inVec, exit );
+
+    for( i = 0; i < inVecCnt; i++ )
+        total += inVec[i].len;
+    require( total, exit );
+
+    /* Without the gather buffer every vector is written on its own */
+    i = 0;
+    if( inVecCnt > 1 )
+        gather = buffer_pool_alloc( BUFFER_POOL_HTTP, Min( total, kSocketGatherLen ) );
+    if( gather ){
+        while( i < inVecCnt && gathered < kSocketGatherLen ){
+            len = Min( inVec[i].len - offset, kSocketGatherLen - gathered );
+            memcpy( gather + gathered, inVec[i].base + offset, len );
+            gathered += len;
+            offset += len;
+            if( offset == inVec[i].len ){
+                i++;
+                offset = 0;
+            }
+        }
+        err = SocketSend( fd, gather, gathered );
+        require_noerr( err, exit );
+    }
+
+    for( ; i < inVecCnt; i++, offset = 0 ){
+        if( inVec[i].len == offset )
+            continue;
+        err = SocketSend( fd, inVec[i].base + offset, inVec[i].len - offset );
+        require_noerr( err, exit );
+    }
+    err = kNoErr;
+
+exit:
+    buffer_pool_release( gather );
+    return err;
+}
+
 void SocketClose(int* fd)
 {
     int tempFd = *fd;
@@ -100,3 +155,294 @@ void SocketAccept(int *plocalTcpClientsPool, int maxClientsNum, int newFd)
     plocalTcpClientsPool[minFdIndex] = newFd;  
 }
 
+static void _send_queue_water( socket_send_queue_t *inQueue )
+{
+    /* Many small writes use up the buffers before the bytes reach highWater,
+       so one free buffer left counts as high water too */
+    bool high = inQueue->queued >= inQueue->config.highWater || inQueue->count + 1 >= inQueue->config.maxBuffers;
+    bool low = inQueue->queued <= inQueue->config.lowWater && inQueue->count <= inQueue->config.maxBuffers / 2;
+
+    if( inQueue->config.highWater == 0 )
+        return;
+    if( inQueue->aboveHigh == false && high ){
+        inQueue->aboveHigh = true;
+        if( inQueue->config.waterMark ) inQueue->config.waterMark( inQueue->config.arg, true );
+    }else if( inQueue->aboveHigh == true && low ){
+        inQueue->aboveHigh = false;
+        if( inQueue->config.waterMark ) inQueue->config.waterMark( inQueue->config.arg, false );
+    }
+}
+
+static void _send_queue_remove( socket_send_queue_t *inQueue, uint8_t inIndex )
+{
+    socket_send_ref_t *ref = &inQueue->refs[inIndex];
+
+    inQueue->queued -= ref->len - ref->sent;
+    if( ref->release ) ref->release( ref->ref );
+    inQueue->count--;
+    memmove( ref, ref + 1, (inQueue->count - inIndex) * sizeof(socket_send_ref_t) );
+}
+
+static bool _send_queue_fits( socket_send_queue_t *inQueue, size_t inLen )
+{
+    return inQueue->count < inQueue->config.maxBuffers && inQueue->queued + inLen <= inQueue->config.maxBytes;
+}
+
+OSStatus SocketSendQueueInit( socket_send_queue_t *inQueue, int fd, const socket_send_queue_config_t *inConfig )
+{
+    OSStatus err = kNoErr;
+    int blockMode = 1;
+
+    memset( inQueue, 0x0, sizeof(socket_send_queue_t) );
+    memcpy( &inQueue->config, inConfig, sizeof(socket_send_queue_config_t) );
+    inQueue->fd = fd;
+    require_action( fd>=0 && inConfig->maxBytes && inConfig->maxBuffers, exit, err = kParamErr );
+
+    inQueue->refs = malloc( inConfig->maxBuffers * sizeof(socket_send_ref_t) );
+    require_action( inQueue->refs, exit, err = kNoMemoryErr );
+
+    setsockopt( fd, SOL_SOCKET, SO_BLOCKMODE, &blockMode, sizeof(blockMode) );
+
+exit:
+    return err;
+}
+
+void SocketSendQueueDeinit( socket_send_queue_t *inQueue )
+{
+    while( inQueue->count )
+        _send_queue_remove( inQueue, inQueue->count - 1 );
+    if( inQueue->refs ) free( inQueue->refs );
+    inQueue->refs = NULL;
+}
+
+OSStatus SocketSendQueueFlush( socket_send_queue_t *inQueue )
+{
+    OSStatus err = kNoErr;
+    socket_send_ref_t *ref;
+    ssize_t writeResult;
+    fd_set writeSet;
+    struct timeval_t t;
+
+    while( inQueue->count ){
+        FD_ZERO( &writeSet );
+        FD_SET( inQueue->fd, &writeSet );
+        t.tv_sec = 0;
+        t.tv_usec = 0;
+        if( select( inQueue->fd + 1, NULL, &writeSet, NULL, &t ) <= 0 || !FD_ISSET( inQueue->fd, &writeSet ) )
+            break;
+
+        /* Writable, so a failed write is a failed connection and not a full window */
+        ref = &inQueue->refs[0];
+        writeResult = write( inQueue->fd, (void *)( ref->data + ref->sent ), ref->len - ref->sent );
+        require_action( writeResult > 0, exit, err = kConnectionErr );
+
+        ref->sent += writeResult;
+        inQueue->queued -= writeResult;
+        if( ref->sent == ref->len )
+            _send_queue_remove( inQueue, 0 );
+    }
+
+exit:
+    _send_queue_water( inQueue );
+    return err;
+}
+
+OSStatus SocketSendQueuePush( socket_send_queue_t *inQueue, const uint8_t *inData, size_t inLen, bool inUrgent,
+                              socket_release_t inRelease, void *inRef )
+{
+    OSStatus err = kNoErr;
+    uint32_t start = mico_get_time();
+    uint32_t waited;
+    fd_set writeSet;
+    struct timeval_t t;
+    uint8_t i;
+
+    require_action( inQueue->refs && inData && inLen, exit, err = kParamErr );
+
+    while( _send_queue_fits( inQueue, inLen ) == false ){
+        if( inQueue->config.policy == SOCKET_SLOW_DISCONNECT ){
+            err = kConnectionErr;
+            goto exit;
+        }else if( inQueue->config.policy == SOCKET_SLOW_BLOCK ){
+            waited = mico_get_time() - start;
+            require_action_quiet( waited < inQueue->config.blockTimeout_ms, exit, err = kTimeoutErr );
+            FD_ZERO( &writeSet );
+            FD_SET( inQueue->fd, &writeSet );
+            t.tv_sec = ( inQueue->config.blockTimeout_ms - waited ) / 1000;
+            t.tv_usec = ( ( inQueue->config.blockTimeout_ms - waited ) % 1000 ) * 1000;
+            select( inQueue->fd + 1, NULL, &writeSet, NULL, &t );
+            err = SocketSendQueueFlush( inQueue );
+            require_noerr_quiet( err, exit );
+        }else{
+            /* Data partly written or urgent is never dropped */
+            for( i = 0; i < inQueue->count; i++ )
+                if( inQueue->refs[i].sent == 0 && inQueue->refs[i].urgent == false )
+                    break;
+            if( i == inQueue->count ){
+                inQueue->dropped += inLen;
+                err = kNoSpaceErr;
+                goto exit;
+            }
+            inQueue->dropped += inQueue->refs[i].len;
+            _send_queue_remove( inQueue, i );
+        }
+    }
+
+    /* Urgent data goes behind what was started and behind older urgent data */
+    i = inQueue->count;
+    if( inUrgent ){
+        i = 0;
+        while( i < inQueue->count && ( inQueue->refs[i].urgent || inQueue->refs[i].sent ) )
+            i++;
+    }
+    memmove( &inQueue->refs[i + 1], &inQueue->refs[i], (inQueue->count - i) * sizeof(socket_send_ref_t) );
+    inQueue->refs[i].data = inData;
+    inQueue->refs[i].len = inLen;
+    inQueue->refs[i].sent = 0;
+    inQueue->refs[i].urgent = inUrgent;
+    inQueue->refs[i].release = inRelease;
+    inQueue->refs[i].ref = inRef;
+    inQueue->count++;
+    inQueue->queued += inLen;
+    return SocketSendQueueFlush( inQueue );
+
+exit:
+    if( inRelease ) inRelease( inRef );
+    return err;
+}
+
+OSStatus SocketSendQueueCopy( socket_send_queue_t *inQueue, const uint8_t *inData, size_t inLen, bool inUrgent )
+{
+    OSStatus err = kNoErr;
+    uint8_t *copy;
+
+    require_action( inLen, exit, err = kParamErr );
+    copy = buffer_pool_alloc( BUFFER_POOL_QUEUE, inLen );
+    if( copy == NULL ){
+        inQueue->dropped += inLen;
+        err = kNoMemoryErr;
+        goto exit;
+    }
+    memcpy( copy, inData, inLen );
+    err = SocketSendQueuePush( inQueue, copy, inLen, inUrgent, buffer_pool_release, copy );
+
+exit:
+    return err;
+}
+
+uint32_t SocketSendQueuePending( socket_send_queue_t *inQueue )
+{
+    return inQueue->queued;
+}
+
+OSStatus SocketCoalesceInit( socket_coalesce_t *inCoalesce, const socket_coalesce_config_t *inConfig )
+{
+    OSStatus err = kNoErr;
+
+    memset( inCoalesce, 0x0, sizeof(socket_coalesce_t) );
+    memcpy( &inCoalesce->config, inConfig, sizeof(socket_coalesce_config_t) );
+    require_action( inConfig->maxBytes, exit, err = kParamErr );
+
+    inCoalesce->buffer = malloc( inConfig->maxBytes );
+    require_action( inCoalesce->buffer, exit, err = kNoMemoryErr );
+
+exit:
+    return err;
+}
+
+void SocketCoalesceSetQueue( socket_coalesce_t *inCoalesce, socket_send_queue_t *inQueue )
+{
+    inCoalesce->queue = inQueue;
+}
+
+static OSStatus _coalesce_send( socket_coalesce_t *inCoalesce, int fd, const uint8_t *inBuf, size_t inBufLen )
+{
+    _coalesce_segments++;
+    if( inCoalesce->queue )
+        return SocketSendQueueCopy( inCoalesce->queue, inBuf, inBufLen, false );
+    return SocketSend( fd, inBuf, inBufLen );
+}
+
+void SocketCoalesceDeinit( socket_coalesce_t *inCoalesce )
+{
+    if( inCoalesce->buffer ) free( inCoalesce->buffer );
+    inCoalesce->buffer = NULL;
+    inCoalesce->len = 0;
+}
+
+OSStatus SocketCoalesceFlush( socket_coalesce_t *inCoalesce, int fd )
+{
+    OSStatus err = kNoErr;
+    uint32_t len = inCoalesce->len;
+
+    require_quiet( len, exit );
+    inCoalesce->len = 0;
+    err = _coalesce_send( inCoalesce, fd, inCoalesce->buffer, len );
+
+exit:
+    return err;
+}
+
+OSStatus SocketCoalesceWrite( socket_coalesce_t *inCoalesce, int fd, const uint8_t *inBuf, size_t inBufLen, bool inEndOfFrame )
+{
+    OSStatus err = kNoErr;
+
+    require_quiet( inBufLen, exit );
+    require_action( inBufLen <= ( inCoalesce->config.maxWrite ? inCoalesce->config.maxWrite : inCoalesce->config.maxBytes ), exit, err = kParamErr );
+    _coalesce_writes++;
+
+    if( inCoalesce->buffer == NULL || inCoalesce->config.maxLatency_ms == 0 ){
+        err = _coalesce_send( inCoalesce, fd, inBuf, inBufLen );
+        goto exit;
+    }
+
+    /* Keep the byte order: what is queued goes first */
+    if( inCoalesce->len + inBufLen > inCoalesce->config.maxBytes ){
+        err = SocketCoalesceFlush( inCoalesce, fd );
+        require_noerr_quiet( err, exit );
+    }
+
+    if( inBufLen >= inCoalesce->config.maxBytes ){
+        err = _coalesce_send( inCoalesce, fd, inBuf, inBufLen );
+        goto exit;
+    }
+
+    if( inCoalesce->len == 0 )
+        inCoalesce->firstWrite = mico_get_time();
+    memcpy( inCoalesce->buffer + inCoalesce->len, inBuf, inBufLen );
+    inCoalesce->len += inBufLen;
+
+    if( inCoalesce->len == inCoalesce->config.maxBytes || (inEndOfFrame && inCoalesce->config.flushOnFrame) )
+        err = SocketCoalesceFlush( inCoalesce, fd );
+    else
+        SocketCoalescePoll( inCoalesce, fd );
+
+exit:
+    return err;
+}
+
+int32_t SocketCoalescePoll( socket_coalesce_t *inCoalesce, int fd )
+{
+    uint32_t waited;
+
+    if( inCoalesce->len == 0 )
+        return -1;
+
+    waited = mico_get_time() - inCoalesce->firstWrite;
+    if( waited >= inCoalesce->config.maxLatency_ms ){
+        SocketCoalesceFlush( inCoalesce, fd );
+        return -1;
+    }
+    return (int32_t)(inCoalesce->config.maxLatency_ms - waited);
+}
+
+void SocketCoalesceDiscard( socket_coalesce_t *inCoalesce )
+{
+    inCoalesce->len = 0;
+}
+
+void SocketCoalesceStatistics( uint32_t *outWrites, uint32_t *outSegments )
+{
+    *outWrites = _coalesce_writes;
+    *outSegments = _coalesce_segments;
+}
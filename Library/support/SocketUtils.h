@@ -26,10 +26,138 @@
 
 OSStatus SocketSend( int fd, const uint8_t *inBuf, size_t inBufLen );
 
+typedef struct
+{
+  const uint8_t*  base;
+  size_t          len;          //Vectors of 0 bytes are skipped
+} socket_iovec_t;
+
+/* Send the vectors in order. Up to one TCP segment of them is gathered into
+   a single write so that a header and the start of its body share a
+   segment, the rest of a larger body is written from where it lies */
+OSStatus SocketSendv( int fd, const socket_iovec_t *inVec, int inVecCnt );
+
 void SocketClose(int* fd);
 
 void SocketAccept(int *plocalTcpClientsPool, int maxClientsNum, int newFd);
 
+/* Non-blocking send queue: a connection queues references to the buffers it
+   sends, they are written as far as the socket takes them and released once
+   written, so a slow client does not stall the thread that feeds it */
+typedef enum
+{
+  SOCKET_SLOW_DROP_OLDEST,      //Drop the oldest bulk data not yet started to make room
+  SOCKET_SLOW_DISCONNECT,       //kConnectionErr, the caller closes the connection
+  SOCKET_SLOW_BLOCK,            //Wait up to blockTimeout_ms for room
+} socket_slow_policy_t;
+
+typedef void (*socket_release_t)( void *inRef );
+
+/* Called with true once highWater bytes are queued or only one buffer is
+   free, and with false once they drained to lowWater and half the buffers */
+typedef void (*socket_water_t)( void *inArg, bool inAboveHigh );
+
+typedef struct
+{
+  uint32_t              maxBytes;       //Bytes queued before the policy applies
+  uint8_t               maxBuffers;
+  uint32_t              highWater;      //0 for no callbacks
+  uint32_t              lowWater;
+  socket_slow_policy_t  policy;
+  uint32_t              blockTimeout_ms;
+  socket_water_t        waterMark;
+  void*                 arg;
+} socket_send_queue_config_t;
+
+typedef struct
+{
+  const uint8_t*    data;
+  uint32_t          len;
+  uint32_t          sent;
+  bool              urgent;
+  socket_release_t  release;            //NULL if the buffer needs no release
+  void*             ref;
+} socket_send_ref_t;
+
+typedef struct
+{
+  socket_send_queue_config_t config;
+  int                 fd;
+  socket_send_ref_t*  refs;
+  uint8_t             count;
+  uint32_t            queued;           //Bytes not yet written
+  bool                aboveHigh;
+  uint32_t            dropped;          //Bytes dropped for SOCKET_SLOW_DROP_OLDEST or a full pool
+} socket_send_queue_t;
+
+/* Puts fd in non-blocking mode, every write to it has to go through the queue
+   from then on */
+OSStatus SocketSendQueueInit( socket_send_queue_t *inQueue, int fd, const socket_send_queue_config_t *inConfig );
+
+/* Release what is still queued, the socket is not closed */
+void SocketSendQueueDeinit( socket_send_queue_t *inQueue );
+
+/* Queue inLen bytes at inData and write what the socket takes right away.
+   inRelease(inRef) is called once they were written or dropped, or by
+   SocketSendQueueDeinit. Urgent data goes ahead of bulk data not yet
+   started, kNoSpaceErr if the policy dropped the data itself. */
+OSStatus SocketSendQueuePush( socket_send_queue_t *inQueue, const uint8_t *inData, size_t inLen, bool inUrgent,
+                              socket_release_t inRelease, void *inRef );
+
+/* Queue a copy of inData */
+OSStatus SocketSendQueueCopy( socket_send_queue_t *inQueue, const uint8_t *inData, size_t inLen, bool inUrgent );
+
+/* Write what the socket takes without blocking, kConnectionErr if the
+   connection failed */
+OSStatus SocketSendQueueFlush( socket_send_queue_t *inQueue );
+
+/* Bytes not yet written, add the socket to the write set of select while
+   this is not 0 */
+uint32_t SocketSendQueuePending( socket_send_queue_t *inQueue );
+
+/* Write coalescing: small writes are gathered into one segment, which is sent
+   once maxBytes are queued, the oldest byte waited maxLatency_ms, or a write
+   ends a frame while flushOnFrame is set */
+typedef struct
+{
+  uint32_t  maxLatency_ms;      //0 sends every write at once
+  uint32_t  maxBytes;
+  uint32_t  maxWrite;           //Largest single write accepted, 0 for maxBytes
+  bool      flushOnFrame;
+} socket_coalesce_config_t;
+
+typedef struct
+{
+  socket_coalesce_config_t config;
+  uint8_t*  buffer;
+  uint32_t  len;
+  uint32_t  firstWrite;         //mico_get_time() of the oldest queued byte
+  socket_send_queue_t* queue;   //Set by SocketCoalesceSetQueue
+} socket_coalesce_t;
+
+OSStatus SocketCoalesceInit( socket_coalesce_t *inCoalesce, const socket_coalesce_config_t *inConfig );
+
+/* Hand segments to inQueue instead of sending them from the calling thread */
+void SocketCoalesceSetQueue( socket_coalesce_t *inCoalesce, socket_send_queue_t *inQueue );
+
+void SocketCoalesceDeinit( socket_coalesce_t *inCoalesce );
+
+/* Writes longer than maxWrite are rejected with kParamErr */
+OSStatus SocketCoalesceWrite( socket_coalesce_t *inCoalesce, int fd, const uint8_t *inBuf, size_t inBufLen, bool inEndOfFrame );
+
+OSStatus SocketCoalesceFlush( socket_coalesce_t *inCoalesce, int fd );
+
+/* Flush once the latency bound is reached. Returns the ms until the next
+   flush is due, to be used as select timeout, or -1 if nothing is queued. */
+int32_t SocketCoalescePoll( socket_coalesce_t *inCoalesce, int fd );
+
+/* Drop queued data after the connection was lost */
+void SocketCoalesceDiscard( socket_coalesce_t *inCoalesce );
+
+/* Writes handed to the coalescing stage and segments actually sent, summed
+   over every connection since boot */
+void SocketCoalesceStatistics( uint32_t *outWrites, uint32_t *outSegments );
+
 #endif // __SocketUtils_h__
 
 
@@ -0,0 +1,156 @@
+/**
+******************************************************************************
+* @file    TimerWheelUtils.c
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This file contains function called by timing wheel operation
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/
+
+#include "TimerWheelUtils.h"
+
+#define SLOT_MASK           (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SPAN(level)   (1UL << (TIMER_WHEEL_LEVEL_BITS * ((level) + 1)))
+#define LEVEL_INDEX(expires, level)  (((expires) >> (TIMER_WHEEL_LEVEL_BITS * (level))) & SLOT_MASK)
+
+static void _link( timer_wheel_entry_t** head, timer_wheel_entry_t* entry )
+{
+  entry->next = *head;
+  if( entry->next != NULL )
+    entry->next->pprev = &entry->next;
+  *head = entry;
+  entry->pprev = head;
+}
+
+static void _unlink( timer_wheel_entry_t* entry )
+{
+  *entry->pprev = entry->next;
+  if( entry->next != NULL )
+    entry->next->pprev = entry->pprev;
+  entry->next = NULL;
+  entry->pprev = NULL;
+}
+
+/* Put entry in the lowest level whose span still covers its expiry */
+static void _insert( timer_wheel_t* wheel, timer_wheel_entry_t* entry )
+{
+  uint32_t delta = entry->expires - wheel->current;
+  int level;
+
+  if( (int32_t)delta < 0 ){
+    _link( &wheel->slots[0][wheel->current & SLOT_MASK], entry );
+    return;
+  }
+
+  for( level = 0; level < TIMER_WHEEL_LEVELS - 1; level++ ){
+    if( delta < LEVEL_SPAN(level) )
+      break;
+  }
+  _link( &wheel->slots[level][LEVEL_INDEX(entry->expires, level)], entry );
+}
+
+/* Move the entries of one upper level slot down, returns the slot index so
+   that the caller knows when the next level has to cascade as well */
+static uint32_t _cascade( timer_wheel_t* wheel, int level )
+{
+  uint32_t index = LEVEL_INDEX(wheel->current, level);
+  timer_wheel_entry_t* list = wheel->slots[level][index];
+  timer_wheel_entry_t* entry;
+
+  wheel->slots[level][index] = NULL;
+  while( list != NULL ){
+    entry = list;
+    list = list->next;
+    entry->next = NULL;
+    _insert( wheel, entry );
+  }
+  return index;
+}
+
+void timer_wheel_init( timer_wheel_t* wheel )
+{
+  memset( wheel, 0, sizeof(timer_wheel_t) );
+}
+
+void timer_wheel_entry_init( timer_wheel_entry_t* entry, timer_wheel_handler_t handler, void* arg )
+{
+  memset( entry, 0, sizeof(timer_wheel_entry_t) );
+  entry->handler = handler;
+  entry->arg = arg;
+}
+
+void timer_wheel_add( timer_wheel_t* wheel, timer_wheel_entry_t* entry, uint32_t ticks )
+{
+  if( entry->pprev != NULL )
+    _unlink( entry );
+  else
+    wheel->count++;
+
+  if( ticks == 0 )
+    ticks = 1;
+  if( ticks > TIMER_WHEEL_MAX_TICKS )
+    ticks = TIMER_WHEEL_MAX_TICKS;
+
+  entry->expires = wheel->current + ticks - 1;
+  _insert( wheel, entry );
+}
+
+void timer_wheel_cancel( timer_wheel_t* wheel, timer_wheel_entry_t* entry )
+{
+  if( entry->pprev == NULL )
+    return;
+  _unlink( entry );
+  wheel->count--;
+}
+
+bool timer_wheel_is_pending( timer_wheel_entry_t* entry )
+{
+  return ( entry->pprev != NULL );
+}
+
+void timer_wheel_advance( timer_wheel_t* wheel, uint32_t ticks )
+{
+  timer_wheel_entry_t* expired;
+  timer_wheel_entry_t* entry;
+  uint32_t index;
+  int level;
+
+  while( ticks-- ){
+    /* Nothing can expire, skip the remaining ticks at once */
+    if( wheel->count == 0 ){
+      wheel->current += ticks + 1;
+      return;
+    }
+
+    index = wheel->current & SLOT_MASK;
+    for( level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++ )
+      index = _cascade( wheel, level );
+
+    /* Detach the slot first, handlers may reschedule into it */
+    expired = wheel->slots[0][wheel->current & SLOT_MASK];
+    wheel->slots[0][wheel->current & SLOT_MASK] = NULL;
+    if( expired != NULL )
+      expired->pprev = &expired;
+    wheel->current++;
+
+    while( expired != NULL ){
+      entry = expired;
+      _unlink( entry );
+      wheel->count--;
+      entry->handler( entry->arg );
+    }
+  }
+}
+
@@ -0,0 +1,71 @@
+/**
+******************************************************************************
+* @file    TimerWheelUtils.h
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This header contains function prototypes for a hierarchical timing
+*          wheel, used to run many software timers from one periodic tick
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/
+
+#ifndef __TimerWheelUtils_h__
+#define __TimerWheelUtils_h__
+
+#include "Common.h"
+
+#define TIMER_WHEEL_LEVEL_BITS      5
+#define TIMER_WHEEL_LEVELS          4
+#define TIMER_WHEEL_SLOTS           (1 << TIMER_WHEEL_LEVEL_BITS)
+
+/* Longer timeouts are clamped, they fire after this many ticks */
+#define TIMER_WHEEL_MAX_TICKS       ((1UL << (TIMER_WHEEL_LEVEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef void (*timer_wheel_handler_t)( void* arg );
+
+typedef struct _timer_wheel_entry
+{
+  struct _timer_wheel_entry*  next;
+  struct _timer_wheel_entry** pprev;    /* NULL while the entry is not pending */
+  uint32_t                    expires;
+  timer_wheel_handler_t       handler;
+  void*                       arg;
+} timer_wheel_entry_t;
+
+/* Adding, cancelling and expiring entries are all O(1), an entry is moved
+   at most once per level on its way down to the first level. The wheel is
+   not locked, callers that share one must serialize access to it. */
+typedef struct
+{
+  uint32_t              current;        /* Next tick to be processed */
+  uint32_t              count;          /* Pending entries */
+  timer_wheel_entry_t*  slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+void timer_wheel_init( timer_wheel_t* wheel );
+
+void timer_wheel_entry_init( timer_wheel_entry_t* entry, timer_wheel_handler_t handler, void* arg );
+
+/* Schedule entry to expire after ticks, a pending entry is rescheduled */
+void timer_wheel_add( timer_wheel_t* wheel, timer_wheel_entry_t* entry, uint32_t ticks );
+
+void timer_wheel_cancel( timer_wheel_t* wheel, timer_wheel_entry_t* entry );
+
+bool timer_wheel_is_pending( timer_wheel_entry_t* entry );
+
+/* Process ticks, handlers are called from here and may add or cancel entries */
+void timer_wheel_advance( timer_wheel_t* wheel, uint32_t ticks );
+
+#endif // __TimerWheelUtils_h__
+
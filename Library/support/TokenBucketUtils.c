@@ -0,0 +1,66 @@
+/**
+******************************************************************************
+* @file    TokenBucketUtils.c
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This file contains function called by token bucket operation
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/
+
+#include "TokenBucketUtils.h"
+
+static void _refill( token_bucket_t* bucket, uint32_t now )
+{
+  uint32_t elapsed = now - bucket->last;
+  uint32_t add;
+
+  /* Whole tokens only, the remainder of elapsed is kept for the next refill */
+  add = (uint32_t)(((uint64_t)elapsed * bucket->rate) / 1000);
+  if( add == 0 )
+    return;
+  bucket->last += (uint32_t)(((uint64_t)add * 1000) / bucket->rate);
+  if( bucket->tokens + (int64_t)add >= (int64_t)bucket->burst ){
+    bucket->tokens = bucket->burst;
+    bucket->last = now;
+  }else
+    bucket->tokens += add;
+}
+
+void token_bucket_init( token_bucket_t* bucket, uint32_t rate, uint32_t burst, uint32_t now )
+{
+  bucket->rate = rate;
+  bucket->burst = burst;
+  bucket->tokens = burst;
+  bucket->last = now;
+}
+
+uint32_t token_bucket_delay( token_bucket_t* bucket, uint32_t now )
+{
+  if( bucket->rate == 0 )
+    return 0;
+
+  _refill( bucket, now );
+  if( bucket->tokens > 0 )
+    return 0;
+  return (uint32_t)((((uint64_t)(1 - bucket->tokens)) * 1000 + bucket->rate - 1) / bucket->rate);
+}
+
+void token_bucket_consume( token_bucket_t* bucket, uint32_t bytes )
+{
+  if( bucket->rate == 0 )
+    return;
+  bucket->tokens -= (int32_t)Min( bytes, 0x7FFFFFFFUL );
+}
+
@@ -0,0 +1,49 @@
+/**
+******************************************************************************
+* @file    TokenBucketUtils.h
+* @author  William Xu
+* @version V1.0.0
+* @date    05-May-2014
+* @brief   This header contains function prototypes for token bucket rate
+*          limiting
+******************************************************************************
+* @attention
+*
+* THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+* WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+* TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+* DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+* FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+* CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+*
+* <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+******************************************************************************
+*/
+
+#ifndef __TokenBucketUtils_h__
+#define __TokenBucketUtils_h__
+
+#include "Common.h"
+
+/* Tokens are bytes. A bucket may go into debt by one write, so a write larger
+   than the burst is still let through once the bucket has refilled, and the
+   debt delays the writes after it. The bucket is not locked, callers that
+   share one must serialize access to it. */
+typedef struct
+{
+  uint32_t  rate;               /* Bytes per second, 0 for no limit */
+  uint32_t  burst;              /* Bytes that may be sent back to back */
+  int32_t   tokens;
+  uint32_t  last;               /* Time of the last refill, ms */
+} token_bucket_t;
+
+void token_bucket_init( token_bucket_t* bucket, uint32_t rate, uint32_t burst, uint32_t now );
+
+/* ms until a write may proceed, 0 if it may proceed now */
+uint32_t token_bucket_delay( token_bucket_t* bucket, uint32_t now );
+
+/* Charge bytes written, call once token_bucket_delay returned 0 */
+void token_bucket_consume( token_bucket_t* bucket, uint32_t bytes );
+
+#endif // __TokenBucketUtils_h__
+
@@ -28,6 +28,7 @@
 #include "StringUtils.h"
 #include "HTTPUtils.h"
 #include "SocketUtils.h"
+#include "BufferPoolUtils.h"
 
 #include "EasyLink.h"
   
@@ -44,7 +45,6 @@ static OSStatus _FTCRespondInComingMessage(int fd, HTTPHeader_t* inHeader, mico_
 static mico_timer_t _Led_EL_timer;
 static bool _FTCClientConnected = false;
 
-static uint8_t *httpResponse = NULL;
 static HTTPHeader_t *httpHeader = NULL;
 
 static bool EasylinkFailed = false;
@@ -94,12 +94,14 @@ void EasyLinkNotify_WiFIParaChangedHandler(apinfo_adv_t *ap_info, char *key, int
   easylink_log_trace();
   require(inContext, exit);
   mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   memcpy(inContext->flashContentInRam.micoSystemConfig.ssid, ap_info->ssid, maxSsidLen);
   memcpy(inContext->flashContentInRam.micoSystemConfig.bssid, ap_info->bssid, 6);
   inContext->flashContentInRam.micoSystemConfig.channel = ap_info->channel;
   inContext->flashContentInRam.micoSystemConfig.security = ap_info->security;
   memcpy(inContext->flashContentInRam.micoSystemConfig.key, key, maxKeyLen);
   inContext->flashContentInRam.micoSystemConfig.keyLength = key_len;
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
   mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
 exit:
   return;
@@ -109,10 +111,7 @@ void EasyLinkNotify_DHCPCompleteHandler(net_para_st *pnet, mico_Context_t * cons
 {
   easylink_log_trace();
   require(inContext, exit);
-  strcpy((char *)inContext->micoStatus.localIp, pnet->ip);
-  strcpy((char *)inContext->micoStatus.netMask, pnet->mask);
-  strcpy((char *)inContext->micoStatus.gateWay, pnet->gate);
-  strcpy((char *)inContext->micoStatus.dnsServer, pnet->dns);
+  MICOSetNetStatus(inContext, pnet->ip, pnet->mask, pnet->gate, pnet->dns);
 exit:
   return;
 }
@@ -126,9 +125,11 @@ void EasyLinkNotify_EasyLinkCompleteHandler(network_InitTypeDef_st *nwkpara, mic
   require_action(nwkpara, exit, err = kTimeoutErr);
   
   mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   memcpy(inContext->flashContentInRam.micoSystemConfig.ssid, nwkpara->wifi_ssid, maxSsidLen);
   memcpy(inContext->flashContentInRam.micoSystemConfig.user_key, nwkpara->wifi_key, maxKeyLen);
   inContext->flashContentInRam.micoSystemConfig.user_keyLength = strlen(nwkpara->wifi_key);
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
   mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
   easylink_log("Get SSID: %s, Key: %s", inContext->flashContentInRam.micoSystemConfig.ssid, inContext->flashContentInRam.micoSystemConfig.user_key);
   return;
@@ -144,7 +145,9 @@ exit:
   /*so roll back to previous settings  (if it has) and reboot*/
   mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
   if(inContext->flashContentInRam.micoSystemConfig.configured != unConfigured){
+    seqlock_write_begin(&inContext->flashContentInRam_seqlock);
     inContext->flashContentInRam.micoSystemConfig.configured = allConfigured;
+    seqlock_write_end(&inContext->flashContentInRam_seqlock);
     MICOUpdateConfiguration(inContext);
     PlatformSoftReboot();
   }
@@ -180,6 +183,7 @@ void EasyLinkNotify_EasyLinkGetExtraDataHandler(int datalen, char* data, mico_Co
   ipInfoCount = (datalen - index)/sizeof(uint32_t);
   require_action(ipInfoCount >= 1, exit, err = kParamErr);
   mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   inContext->flashContentInRam.micoSystemConfig.easylinkServerIP = *(uint32_t *)(ipInfo);
 
   if(ipInfoCount == 1){
@@ -193,14 +197,15 @@ void EasyLinkNotify_EasyLinkGetExtraDataHandler(int datalen, char* data, mico_Co
     inet_ntoa(inContext->flashContentInRam.micoSystemConfig.netMask, *(uint32_t *)(ipInfo+2));
     inet_ntoa(inContext->flashContentInRam.micoSystemConfig.gateWay, *(uint32_t *)(ipInfo+3));
     inet_ntoa(inContext->flashContentInRam.micoSystemConfig.dnsServer, *(uint32_t *)(ipInfo+4));
-    strcpy((char *)inContext->micoStatus.localIp, inContext->flashContentInRam.micoSystemConfig.localIp);
-    strcpy((char *)inContext->micoStatus.netMask, inContext->flashContentInRam.micoSystemConfig.netMask);
-    strcpy((char *)inContext->micoStatus.gateWay, inContext->flashContentInRam.micoSystemConfig.gateWay);
-    strcpy((char *)inContext->micoStatus.dnsServer, inContext->flashContentInRam.micoSystemConfig.dnsServer);
+    MICOSetNetStatus(inContext, inContext->flashContentInRam.micoSystemConfig.localIp,
+                                inContext->flashContentInRam.micoSystemConfig.netMask,
+                                inContext->flashContentInRam.micoSystemConfig.gateWay,
+                                inContext->flashContentInRam.micoSystemConfig.dnsServer);
     inet_ntoa( address, inContext->flashContentInRam.micoSystemConfig.easylinkServerIP);
     easylink_log("Get auth info: %s, EasyLink server ip address: %s, local IP info:%s %s %s %s ", data, address, inContext->flashContentInRam.micoSystemConfig.localIp,\
     inContext->flashContentInRam.micoSystemConfig.netMask, inContext->flashContentInRam.micoSystemConfig.gateWay,inContext->flashContentInRam.micoSystemConfig.dnsServer);
   }
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
   mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
 
   require_noerr(ConfigELRecvAuthData(data, inContext), exit);
@@ -359,8 +364,6 @@ OSStatus _connectFTCServer( mico_Context_t * const inContext, int *fd)
   OSStatus err;
   struct sockaddr_t addr;
   const char *json_str;
-  
-  size_t httpResponseLen = 0;
 
   *fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   addr.s_ip = inContext->flashContentInRam.micoSystemConfig.easylinkServerIP; 
@@ -378,14 +381,8 @@ OSStatus _connectFTCServer( mico_Context_t * const inContext, int *fd)
   require( json_str, exit );
 
   easylink_log("Send config object=%s\n", json_str);
-  err =  CreateHTTPMessage( "POST", kEasyLinkURLAuth, kMIMEType_JSON, (uint8_t *)json_str, strlen(json_str), &httpResponse, &httpResponseLen );
-  require_noerr( err, exit );
-  require( httpResponse, exit );
-
+  err = SocketSendHTTPRequest( *fd, "POST", kEasyLinkURLAuth, kMIMEType_JSON, (const uint8_t *)json_str, strlen(json_str) );
   json_object_put(inContext->micoStatus.easylink_report);
-
-  err = SocketSend( *fd, httpResponse, httpResponseLen );
-  free(httpResponse);
   require_noerr( err, exit );
   easylink_log("Current configuration sent");
 
@@ -407,7 +404,8 @@ void _cleanEasyLinkResource( mico_Context_t * const inContext )
 
   mico_rtos_deinit_semaphore(&inContext->micoStatus.easylink_sem);
   inContext->micoStatus.easylink_sem = NULL;
-  if(httpHeader) free(httpHeader);
+  buffer_pool_release(httpHeader);
+  httpHeader = NULL;
   mico_stop_timer(&_Led_EL_timer);
 }
 
@@ -445,7 +443,9 @@ void easylink_thread(void *inContext)
       
   }else{
     mico_rtos_lock_mutex(&Context->flashContentInRam_mutex);
+    seqlock_write_begin(&Context->flashContentInRam_seqlock);
     Context->flashContentInRam.micoSystemConfig.easyLinkEnable = true;
+    seqlock_write_end(&Context->flashContentInRam_seqlock);
     MICOUpdateConfiguration(Context);
     mico_rtos_unlock_mutex(&Context->flashContentInRam_mutex);
     _easylinkConnectWiFi_fast(Context);
@@ -454,9 +454,10 @@ void easylink_thread(void *inContext)
   err = mico_rtos_get_semaphore(&Context->micoStatus.easylink_sem, ConnectFTC_Timeout);
   require_noerr(err, reboot);
 
-  httpHeader = malloc( sizeof( HTTPHeader_t ) );
+  httpHeader = buffer_pool_alloc( BUFFER_POOL_HTTP, sizeof( HTTPHeader_t ) );
   require_action( httpHeader, threadexit, err = kNoMemoryErr );
   HTTPHeaderClear( httpHeader );
+  httpHeader->otaMaxLen = MICO_OTA_MAX_LEN;
   
   t.tv_sec = 100;
   t.tv_usec = 0;
@@ -529,7 +530,9 @@ threadexit:
   /*Roll back to previous settings (if it has) and reboot*/
   mico_rtos_lock_mutex(&Context->flashContentInRam_mutex);
   if(Context->flashContentInRam.micoSystemConfig.configured != unConfigured){
+    seqlock_write_begin(&Context->flashContentInRam_seqlock);
     Context->flashContentInRam.micoSystemConfig.configured = allConfigured;
+    seqlock_write_end(&Context->flashContentInRam_seqlock);
     MICOUpdateConfiguration( Context );
     PlatformSoftReboot();
   }
@@ -576,12 +579,14 @@ OSStatus _FTCRespondInComingMessage(int fd, HTTPHeader_t* inHeader, mico_Context
         }else if(strnicmpx( value, valueSize, kMIMEType_MXCHIP_OTA ) == 0){
           easylink_log("Receive OTA data!");
           mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+          seqlock_write_begin(&inContext->flashContentInRam_seqlock);
           memset(&inContext->flashContentInRam.bootTable, 0, sizeof(boot_table_t));
           inContext->flashContentInRam.bootTable.length = inHeader->contentLength;
           inContext->flashContentInRam.bootTable.start_address = UPDATE_START_ADDRESS;
           inContext->flashContentInRam.bootTable.type = 'A';
           inContext->flashContentInRam.bootTable.upgrade_type = 'U';
           inContext->flashContentInRam.micoSystemConfig.easyLinkEnable = false;
+          seqlock_write_end(&inContext->flashContentInRam_seqlock);
           MICOUpdateConfiguration(inContext);
           mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
           SocketClose(&fd);
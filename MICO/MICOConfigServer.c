@@ -25,6 +25,7 @@
 #include "Platform.h"
 #include "PlatformFlash.h"  
 #include "HTTPUtils.h"
+#include "BufferPoolUtils.h"
 
 
 #define config_log(M, ...) custom_log("CONFIG SERVER", M, ##__VA_ARGS__)
@@ -34,17 +35,36 @@
 #define kCONFIGURLWrite   "/config-write"
 #define kCONFIGURLOTA     "/OTA"
 
+#define kCONFIGIdleTimeout      15    //Seconds a persistent connection may stay idle
+#define kCONFIGMaxRequests      100   //Requests served on one connection before it is closed
+
 extern OSStatus ConfigIncommingJsonMessage( const char *input, mico_Context_t * const inContext );
 extern OSStatus ConfigCreateReportJsonMessage( mico_Context_t * const inContext );
 
 static void localConfiglistener_thread(void *inContext);
 static void localConfig_thread(void *inFd);
 static mico_Context_t *Context;
-static OSStatus _LocalConfigRespondInComingMessage(int fd, HTTPHeader_t* inHeader, mico_Context_t * const inContext);
+static OSStatus _LocalConfigRead(int fd, HTTPHeader_t* inHeader, void *inContext);
+static OSStatus _LocalConfigWrite(int fd, HTTPHeader_t* inHeader, void *inContext);
+static OSStatus _LocalConfigOTA(int fd, HTTPHeader_t* inHeader, void *inContext);
+
+static const HTTPRoute_t _configRoutes[] = {
+  { kCONFIGURLRead,   kHTTPMethodGET | kHTTPMethodPOST,  _LocalConfigRead,   NULL },
+  { kCONFIGURLWrite,  kHTTPMethodPOST,                   _LocalConfigWrite,  NULL },
+  { kCONFIGURLOTA,    kHTTPMethodPOST,                   _LocalConfigOTA,    NULL },
+};
+static HTTPRouter_t _configRouter;
 
 OSStatus MICOStartConfigServer ( mico_Context_t * const inContext )
 {
-  return mico_rtos_create_thread(NULL, MICO_APPLICATION_PRIORITY, "Config Server", localConfiglistener_thread, 0x500, (void*)inContext );
+  OSStatus err = kNoErr;
+
+  err = HTTPRouterInit( &_configRouter, _configRoutes, sizeof(_configRoutes) / sizeof(_configRoutes[0]) );
+  require_noerr( err, exit );
+  err = mico_rtos_create_thread(NULL, MICO_APPLICATION_PRIORITY, "Config Server", localConfiglistener_thread, 0x500, (void*)inContext );
+
+exit:
+  return err;
 }
 
 void localConfiglistener_thread(void *inContext)
@@ -103,143 +123,156 @@ void localConfig_thread(void *inFd)
   fd_set readfds;
   struct timeval_t t;
   HTTPHeader_t *httpHeader = NULL;
+  int requests = 0;
 
   config_log_trace();
-  httpHeader = malloc( sizeof( HTTPHeader_t ) );
+  httpHeader = buffer_pool_alloc( BUFFER_POOL_HTTP, sizeof( HTTPHeader_t ) );
   require_action( httpHeader, exit, err = kNoMemoryErr );
   HTTPHeaderClear( httpHeader );
-
-  t.tv_sec = 60;
-  t.tv_usec = 0;
+  httpHeader->otaMaxLen = MICO_OTA_MAX_LEN;
 
   while(1){
-    FD_ZERO(&readfds);
-    FD_SET(clientFd, &readfds);
+    // Pipelined requests already in the buffer are served before waiting for more
+    if( httpHeader->extraDataLen == 0 ){
+      FD_ZERO(&readfds);
+      FD_SET(clientFd, &readfds);
+      t.tv_sec = kCONFIGIdleTimeout;
+      t.tv_usec = 0;
+
+      err = select(1, &readfds, NULL, NULL, &t);
+      require_action( err > 0 && FD_ISSET(clientFd, &readfds), exit, err = kTimeoutErr );
+    }
 
-    err = select(1, &readfds, NULL, NULL, &t);
-  
-    if(FD_ISSET(clientFd, &readfds)){
-      err = SocketReadHTTPHeader( clientFd, httpHeader );
-
-      switch ( err )
-      {
-        case kNoErr:
-          // Read the rest of the HTTP body if necessary
-          err = SocketReadHTTPBody( clientFd, httpHeader );
-          require_noerr(err, exit);
-
-          // Call the HTTPServer owner back with the acquired HTTP header
-          err = _LocalConfigRespondInComingMessage( clientFd, httpHeader, Context );
-          require_noerr( err, exit );
-          // Reuse HTTPHeader
-          HTTPHeaderClear( httpHeader );
-        break;
-
-        case EWOULDBLOCK:
-            // NO-OP, keep reading
-        break;
-
-        case kNoSpaceErr:
-          config_log("ERROR: Cannot fit HTTPHeader.");
-          goto exit;
-        break;
-
-        case kConnectionErr:
-          // NOTE: kConnectionErr from SocketReadHTTPHeader means it's closed
-          config_log("ERROR: Connection closed.");
-          goto exit;
-           //goto Reconn;
-        break;
-        default:
-          config_log("ERROR: HTTP Header parse internal error: %d", err);
-          goto exit;
-      }
+    err = SocketReadHTTPHeader( clientFd, httpHeader );
+
+    switch ( err )
+    {
+      case kNoErr:
+        // Read the body as the route wants it and call its handler, requests
+        // are served one after the other so responses keep the request order
+        err = HTTPRouterDispatch( &_configRouter, clientFd, httpHeader, Context );
+        require_noerr( err, exit );
+        require_action_quiet( httpHeader->persistent && ++requests < kCONFIGMaxRequests, exit, err = kConnectionErr );
+        // Reuse HTTPHeader, keeping the start of the next request
+        HTTPHeaderNext( httpHeader );
+      break;
+
+      case EWOULDBLOCK:
+          // NO-OP, keep reading
+      break;
+
+      case kNoSpaceErr:
+        config_log("ERROR: Cannot fit HTTPHeader.");
+        goto exit;
+      break;
+
+      case kConnectionErr:
+        // NOTE: kConnectionErr from SocketReadHTTPHeader means it's closed
+        config_log("ERROR: Connection closed.");
+        goto exit;
+         //goto Reconn;
+      break;
+      default:
+        config_log("ERROR: HTTP Header parse internal error: %d", err);
+        goto exit;
     }
   }
 
 exit:
   config_log("Exit: Client exit with err = %d", err);
   SocketClose(&clientFd);
-  if(httpHeader) free(httpHeader);
+  buffer_pool_release(httpHeader);
   mico_rtos_delete_thread(NULL);
   return;
 }
 
 
-OSStatus _LocalConfigRespondInComingMessage(int fd, HTTPHeader_t* inHeader, mico_Context_t * const inContext)
+static OSStatus _LocalConfigRead(int fd, HTTPHeader_t* inHeader, void *inContext)
 {
+  mico_Context_t *context = inContext;
   OSStatus err = kUnknownErr;
   const char *  json_str;
-  uint8_t *httpResponse = NULL;
-  size_t httpResponseLen = 0;
 
   config_log_trace();
+  err = ConfigCreateReportJsonMessage( context );
+  require_noerr( err, exit );
 
+  json_str = json_object_to_json_string(context->micoStatus.easylink_report);
+  require( json_str, exit );
+  config_log("Send config object=%s", json_str);
+  err = SocketSendHTTPResponse( fd, kStatusOK, kMIMEType_JSON,
+                                HTTPHeaderMatchMethod( inHeader, "HEAD" ) == kNoErr ? NULL : (const uint8_t *)json_str,
+                                strlen(json_str) );
+  require_noerr( err, exit );
+  config_log("Current configuration sent");
 
-  if(HTTPHeaderMatchURL( inHeader, kCONFIGURLRead ) == kNoErr){
-    err = ConfigCreateReportJsonMessage( inContext );
-    require_noerr( err, exit );
+exit:
+  json_object_put(context->micoStatus.easylink_report);
+  return err;
+}
 
-    json_str = json_object_to_json_string(inContext->micoStatus.easylink_report);
-    require( json_str, exit );
-    config_log("Send config object=%s", json_str);
-    //err =  CreateSimpleHTTPMessage( kMIMEType_JSON, (uint8_t *)json_str, strlen(json_str), &httpResponse, &httpResponseLen );
-    err =  CreateSimpleHTTPMessageNoCopy( kMIMEType_JSON, strlen(json_str), &httpResponse, &httpResponseLen );
-    require_noerr( err, exit );
-    require( httpResponse, exit );
-    err = SocketSend( fd, httpResponse, httpResponseLen );
+static OSStatus _LocalConfigWrite(int fd, HTTPHeader_t* inHeader, void *inContext)
+{
+  mico_Context_t *context = inContext;
+  OSStatus err = kUnknownErr;
+  char *body;
+  char end;
+
+  config_log_trace();
+  if(inHeader->contentLength > 0){
+    config_log("Recv new configuration, apply and reset");
+    context->micoStatus.configNeedsReset = true;
+    // The body is not terminated, a pipelined request may follow it
+    body = (char *)inHeader->extraDataPtr;
+    end = body[inHeader->contentLength];
+    body[inHeader->contentLength] = 0;
+    err = ConfigIncommingJsonMessage( body, context);
+    body[inHeader->contentLength] = end;
     require_noerr( err, exit );
-    err = SocketSend( fd, (uint8_t *)json_str, strlen(json_str) );
+    err = SocketSendHTTPResponse( fd, kStatusOK, NULL, NULL, 0 );
     require_noerr( err, exit );
-    config_log("Current configuration sent");
+    if(context->micoStatus.configNeedsReset == false){
+      config_log("New configuration applied without reset");
+      goto exit;
+    }
     SocketClose(&fd);
     err = kConnectionErr;
-    goto exit;
-  }
-  else if(HTTPHeaderMatchURL( inHeader, kCONFIGURLWrite ) == kNoErr){
-    if(inHeader->contentLength > 0){
-      config_log("Recv new configuration, apply and reset");
-      err = ConfigIncommingJsonMessage( inHeader->extraDataPtr, inContext);
-      require_noerr( err, exit );
-      err =  CreateSimpleHTTPOKMessage( &httpResponse, &httpResponseLen );
-      require_noerr( err, exit );
-      require( httpResponse, exit );
-      err = SocketSend( fd, httpResponse, httpResponseLen );
-      SocketClose(&fd);
-      inContext->micoStatus.sys_state = eState_Software_Reset;
-      require(inContext->micoStatus.sys_state_change_sem, exit);
-      mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
-    }
-    goto exit;
+    context->micoStatus.sys_state = eState_Software_Reset;
+    require(context->micoStatus.sys_state_change_sem, exit);
+    mico_rtos_set_semaphore(&context->micoStatus.sys_state_change_sem);
   }
-  else if(HTTPHeaderMatchURL( inHeader, kCONFIGURLOTA ) == kNoErr){
-    if(inHeader->contentLength > 0){
-      config_log("Receive OTA data!");
-      mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
-      memset(&inContext->flashContentInRam.bootTable, 0, sizeof(boot_table_t));
-      inContext->flashContentInRam.bootTable.length = inHeader->contentLength;
-      inContext->flashContentInRam.bootTable.start_address = UPDATE_START_ADDRESS;
-      inContext->flashContentInRam.bootTable.type = 'A';
-      inContext->flashContentInRam.bootTable.upgrade_type = 'U';
-      MICOUpdateConfiguration(inContext);
-      mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
-      SocketClose(&fd);
-      inContext->micoStatus.sys_state = eState_Software_Reset;
-      require(inContext->micoStatus.sys_state_change_sem, exit);
-      mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
-    }
-    goto exit;
-  }
-  else{
-    return kNotFoundErr;
-  };
-
- exit:
-  if(httpResponse) free(httpResponse);
-  json_object_put(inContext->micoStatus.easylink_report);
 
+exit:
   return err;
+}
 
+static OSStatus _LocalConfigOTA(int fd, HTTPHeader_t* inHeader, void *inContext)
+{
+  mico_Context_t *context = inContext;
+  OSStatus err = kUnknownErr;
+
+  config_log_trace();
+  if(inHeader->contentLength > 0){
+    config_log("Receive OTA data!");
+    mico_rtos_lock_mutex(&context->flashContentInRam_mutex);
+    seqlock_write_begin(&context->flashContentInRam_seqlock);
+    memset(&context->flashContentInRam.bootTable, 0, sizeof(boot_table_t));
+    context->flashContentInRam.bootTable.length = inHeader->contentLength;
+    context->flashContentInRam.bootTable.start_address = UPDATE_START_ADDRESS;
+    context->flashContentInRam.bootTable.type = 'A';
+    context->flashContentInRam.bootTable.upgrade_type = 'U';
+    seqlock_write_end(&context->flashContentInRam_seqlock);
+    MICOUpdateConfiguration(context);
+    mico_rtos_unlock_mutex(&context->flashContentInRam_mutex);
+    SocketClose(&fd);
+    err = kConnectionErr;
+    context->micoStatus.sys_state = eState_Software_Reset;
+    require(context->micoStatus.sys_state_change_sem, exit);
+    mico_rtos_set_semaphore(&context->micoStatus.sys_state_change_sem);
+  }
+
+exit:
+  return err;
 }
 
 
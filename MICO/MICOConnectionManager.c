@@ -0,0 +1,431 @@
+/**
+  ******************************************************************************
+  * @file    MICOConnectionManager.c
+  * @author  William Xu
+  * @version V1.0.0
+  * @date    05-May-2014
+  * @brief   This file provides a TCP client connection with reconnect backoff
+  *          and dead peer detection.
+  ******************************************************************************
+  * @attention
+  *
+  * THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+  * WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+  * TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+  * DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+  * FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+  * CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+  *
+  * <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+  ******************************************************************************
+  */
+
+#include "MICO.h"
+#include "MICOConnectionManager.h"
+#include "MICODNSResolver.h"
+#include "MICONotificationCenter.h"
+#include "SocketUtils.h"
+
+#define conn_log(M, ...) custom_log("Connection", M, ##__VA_ARGS__)
+#define conn_log_trace() custom_log_trace("Connection")
+
+#define CONNECTION_DNS_TIMEOUT      10000
+#define CONNECTION_DNS_POLL         50      //Race loop wake up while answers are outstanding
+#define CONNECTION_UNKNOWN_RTT      500     //Assumed connect time of an endpoint never reached
+#define CONNECTION_MAX_PENALTY      8
+#define CONNECTION_WEIGHT_SCALE     16
+
+typedef enum {
+  RACE_RESOLVING,
+  RACE_RESOLVED,
+  RACE_UNRESOLVED,
+  RACE_STARTED,
+  RACE_DONE,
+} _race_state_t;
+
+typedef struct _race_candidate_t {
+  int                     endpoint;
+  int                     fd;
+  uint32_t                started;
+  uint32_t                ip;
+  volatile _race_state_t  state;        //Set by the DNS callback while resolving
+} _race_candidate_t;
+
+static void _set_state(mico_connection_t *inConnection, mico_connection_state_t inState)
+{
+  if(inConnection->state == inState)
+    return;
+  inConnection->state = inState;
+  sendNotifyConnectionStateChanged(inConnection, inState);
+}
+
+/* xorshift, seeded per device so that a fleet does not retry in lockstep */
+static uint32_t _random(mico_connection_t *inConnection)
+{
+  uint32_t x = inConnection->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  inConnection->random = x;
+  return x;
+}
+
+/* Exponential backoff with equal jitter, the delay is in [backoff/2, backoff] */
+static void _schedule_retry(mico_connection_t *inConnection)
+{
+  uint32_t half;
+
+  if(inConnection->backoff_ms == 0)
+    inConnection->backoff_ms = inConnection->config.backoffMin_ms;
+  else
+    inConnection->backoff_ms = Min(inConnection->backoff_ms * 2, inConnection->config.backoffMax_ms);
+
+  half = inConnection->backoff_ms / 2;
+  inConnection->nextAttempt = mico_get_time() + half + (half ? _random(inConnection) % (half + 1) : 0);
+  inConnection->failures++;
+  _set_state(inConnection, MICO_CONNECTION_BACKOFF);
+}
+
+/* Lower is better: smoothed connect time, inflated by recent failures and
+   divided by the configured weight */
+static uint32_t _endpoint_score(mico_connection_t *inConnection, int inIndex)
+{
+  mico_endpoint_stats_t *stats = &inConnection->stats[inIndex];
+  uint32_t rtt = stats->rtt_ms ? stats->rtt_ms : CONNECTION_UNKNOWN_RTT;
+
+  return rtt * (Min(stats->failures, CONNECTION_MAX_PENALTY) + 1) * CONNECTION_WEIGHT_SCALE / inConnection->config.endpoints[inIndex].weight;
+}
+
+/* Usable endpoints, best first */
+static int _order_endpoints(mico_connection_t *inConnection, int *outOrder)
+{
+  mico_connection_endpoint_t *endpoint;
+  int num = 0, i, j, index;
+
+  for(i = 0; i < inConnection->config.endpointNum && i < MICO_CONNECTION_MAX_ENDPOINTS; i++){
+    endpoint = &inConnection->config.endpoints[i];
+    if(endpoint->host == NULL || endpoint->host[0] == 0x0 || endpoint->weight == 0)
+      continue;
+    for(j = num; j > 0 && _endpoint_score(inConnection, outOrder[j-1]) > _endpoint_score(inConnection, i); j--)
+      outOrder[j] = outOrder[j-1];
+    outOrder[j] = i;
+    num++;
+  }
+
+  for(i = 0; i < num; i++){
+    index = outOrder[i];
+    conn_log("Candidate %s:%d, rtt %d ms, failures %d", inConnection->config.endpoints[index].host,
+             inConnection->config.endpoints[index].port, inConnection->stats[index].rtt_ms, inConnection->stats[index].failures);
+  }
+  return num;
+}
+
+/* Runs on the network worker, or at once for a cached answer */
+static void _race_resolved(const char *inHostname, OSStatus inErr, uint32_t inIp, void *inArg)
+{
+  _race_candidate_t *candidate = inArg;
+
+  if(inErr != kNoErr){
+    conn_log("Resolve %s failed, err = %d", inHostname, inErr);
+    candidate->state = RACE_UNRESOLVED;
+    return;
+  }
+  candidate->ip = inIp;
+  candidate->state = RACE_RESOLVED;
+}
+
+/* The best endpoint with an answer, one still resolving is passed over */
+static _race_candidate_t *_race_next(_race_candidate_t *inRace, int inNum, bool *outResolving)
+{
+  int i;
+
+  *outResolving = false;
+  for(i = 0; i < inNum; i++){
+    if(inRace[i].state == RACE_RESOLVED)
+      return &inRace[i];
+    if(inRace[i].state == RACE_RESOLVING)
+      *outResolving = true;
+  }
+  return NULL;
+}
+
+/* Start a non-blocking connect to a resolved endpoint */
+static OSStatus _race_start(mico_connection_t *inConnection, _race_candidate_t *inCandidate)
+{
+  OSStatus err = kNoErr;
+  mico_connection_endpoint_t *endpoint = &inConnection->config.endpoints[inCandidate->endpoint];
+  struct sockaddr_t addr;
+  int blockMode = 1;
+
+  inCandidate->state = RACE_DONE;
+  memset(&addr, 0, sizeof(addr));
+  addr.s_ip = inCandidate->ip;
+  addr.s_port = endpoint->port;
+
+  inCandidate->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  require_action(IsValidSocket( inCandidate->fd ), exit, err = kNoResourcesErr);
+
+  setsockopt(inCandidate->fd, SOL_SOCKET, SO_BLOCKMODE, &blockMode, sizeof(blockMode));
+  connect(inCandidate->fd, &addr, sizeof(struct sockaddr_t));
+  inCandidate->started = mico_get_time();
+  inCandidate->state = RACE_STARTED;
+
+exit:
+  if(err != kNoErr){
+    conn_log("Connect to %s:%d failed, err = %d", endpoint->host, endpoint->port, err);
+    inConnection->stats[inCandidate->endpoint].failures++;
+    if(inCandidate->fd != -1)
+      SocketClose(&inCandidate->fd);
+  }
+  return err;
+}
+
+/* A started connect has completed, kNoErr if it succeeded */
+static OSStatus _race_check(mico_connection_t *inConnection, _race_candidate_t *inCandidate)
+{
+  mico_connection_endpoint_t *endpoint = &inConnection->config.endpoints[inCandidate->endpoint];
+  int sockErr = 0;
+  socklen_t sockErrLen = sizeof(sockErr);
+
+  getsockopt(inCandidate->fd, SOL_SOCKET, SO_ERROR, &sockErr, &sockErrLen);
+  if(sockErr == 0)
+    return kNoErr;
+
+  conn_log("Connect to %s:%d failed, err = %d", endpoint->host, endpoint->port, sockErr);
+  inConnection->stats[inCandidate->endpoint].failures++;
+  SocketClose(&inCandidate->fd);
+  return kConnectionErr;
+}
+
+static void _race_won(mico_connection_t *inConnection, _race_candidate_t *inCandidate)
+{
+  mico_endpoint_stats_t *stats = &inConnection->stats[inCandidate->endpoint];
+  uint32_t rtt = mico_get_time() - inCandidate->started;
+  int blockMode = 0;
+
+  setsockopt(inCandidate->fd, SOL_SOCKET, SO_BLOCKMODE, &blockMode, sizeof(blockMode));
+  inConnection->fd = inCandidate->fd;
+  inCandidate->fd = -1;
+  inConnection->current = inCandidate->endpoint;
+
+  /* Same smoothing as the TCP round trip estimator, gain 1/8 */
+  stats->rtt_ms = stats->rtt_ms ? (stats->rtt_ms * 7 + rtt) / 8 : rtt;
+  if(stats->rtt_ms == 0)
+    stats->rtt_ms = 1;
+  stats->failures = 0;
+
+  conn_log("Connected to %s:%d in %d ms", inConnection->config.endpoints[inCandidate->endpoint].host,
+           inConnection->config.endpoints[inCandidate->endpoint].port, rtt);
+}
+
+void MICOConnectionInit( mico_connection_t *inConnection, const mico_connection_config_t *inConfig, mico_Context_t * const inContext )
+{
+  current_mico_status_t *status;
+  uint32_t seed = 2166136261UL;
+  int i;
+
+  memset(inConnection, 0, sizeof(mico_connection_t));
+  memcpy(&inConnection->config, inConfig, sizeof(mico_connection_config_t));
+  inConnection->fd = -1;
+  inConnection->current = -1;
+  inConnection->state = MICO_CONNECTION_IDLE;
+
+  status = malloc(sizeof(current_mico_status_t));
+  if(status){
+    MICOGetStatus(inContext, status);
+    for(i = 0; status->mac[i]; i++)
+      seed = (seed ^ (uint8_t)status->mac[i]) * 16777619UL;
+    free(status);
+  }
+  inConnection->random = (seed ^ mico_get_time()) | 1;
+
+  if(inConfig->keepaliveProbes > 0)
+    set_tcp_keepalive(inConfig->keepaliveProbes, inConfig->keepaliveInterval_s);
+}
+
+OSStatus MICOConnectionOpen( mico_connection_t *inConnection )
+{
+  OSStatus err = kNoErr;
+  _race_candidate_t race[MICO_CONNECTION_MAX_ENDPOINTS];
+  _race_candidate_t *next;
+  int order[MICO_CONNECTION_MAX_ENDPOINTS];
+  int num, pending = 0, winner = -1, i;
+  uint32_t now, nextStart, deadline = 0, dnsDeadline;
+  int32_t wait;
+  bool resolving;
+  fd_set writefds;
+  struct timeval_t t;
+
+  if(inConnection->state == MICO_CONNECTION_BACKOFF){
+    wait = (int32_t)(inConnection->nextAttempt - mico_get_time());
+    if(wait > 0)
+      mico_thread_msleep(wait);
+  }
+  _set_state(inConnection, MICO_CONNECTION_CONNECTING);
+  inConnection->current = -1;
+
+  num = _order_endpoints(inConnection, order);
+  for(i = 0; i < num; i++){
+    race[i].endpoint = order[i];
+    race[i].fd = -1;
+    race[i].state = RACE_RESOLVING;
+  }
+  require_action(num > 0, exit, err = kNotFoundErr);
+
+  /* Every name is looked up at once, a slow one must not hold up the others */
+  for(i = 0; i < num; i++){
+    if(MICODNSResolve(inConnection->config.endpoints[race[i].endpoint].host, _race_resolved, &race[i]) != kNoErr)
+      race[i].state = RACE_UNRESOLVED;
+  }
+
+  nextStart = mico_get_time();
+  dnsDeadline = nextStart + CONNECTION_DNS_TIMEOUT;
+  while(winner < 0){
+    now = mico_get_time();
+    next = _race_next(race, num, &resolving);
+    if(resolving && (int32_t)(now - dnsDeadline) >= 0){
+      for(i = 0; i < num; i++){
+        if(race[i].state == RACE_RESOLVING && MICODNSCancel(_race_resolved, &race[i]) == kNoErr){
+          conn_log("Resolve %s timed out", inConnection->config.endpoints[race[i].endpoint].host);
+          race[i].state = RACE_UNRESOLVED;
+        }
+      }
+      continue;
+    }
+
+    /* The next endpoint joins once the current favourite had its head start,
+       or at once when nothing else is in flight */
+    if(next && ((int32_t)(now - nextStart) >= 0 || pending == 0)){
+      if(_race_start(inConnection, next) == kNoErr){
+        pending++;
+        deadline = next->started + inConnection->config.connectTimeout_ms;
+      }
+      nextStart = mico_get_time() + inConnection->config.raceDelay_ms;
+      continue;
+    }
+    if(pending == 0 && resolving == false)
+      break;
+
+    /* Every connect in flight timed out, the endpoints resolved later still get their turn */
+    if(pending > 0 && (int32_t)(now - deadline) >= 0){
+      if(next == NULL && resolving == false)
+        break;
+      for(i = 0; i < num; i++){
+        if(race[i].fd == -1)
+          continue;
+        inConnection->stats[race[i].endpoint].failures++;
+        SocketClose(&race[i].fd);
+      }
+      pending = 0;
+      continue;
+    }
+
+    wait = CONNECTION_DNS_POLL;
+    if(pending > 0)
+      wait = (int32_t)(deadline - now);
+    if(next)
+      wait = Min(wait, (int32_t)(nextStart - now));
+    if(resolving)
+      wait = Min(wait, CONNECTION_DNS_POLL);
+
+    if(pending == 0){
+      mico_thread_msleep(wait);
+      continue;
+    }
+    t.tv_sec = wait / 1000;
+    t.tv_usec = (wait % 1000) * 1000;
+
+    FD_ZERO(&writefds);
+    for(i = 0; i < num; i++)
+      if(race[i].fd != -1)
+        FD_SET(race[i].fd, &writefds);
+    if(select(1, NULL, &writefds, NULL, &t) <= 0)
+      continue;
+
+    for(i = 0; i < num && winner < 0; i++){
+      if(race[i].fd == -1 || !FD_ISSET(race[i].fd, &writefds))
+        continue;
+      if(_race_check(inConnection, &race[i]) == kNoErr)
+        winner = i;
+      else
+        pending--;
+    }
+  }
+
+  require_action_quiet(winner >= 0, exit, err = kTimeoutErr);
+  _race_won(inConnection, &race[winner]);
+
+  inConnection->connectedTime = mico_get_time();
+  inConnection->lastRecv = inConnection->connectedTime;
+  inConnection->lastHeartbeat = inConnection->connectedTime;
+  _set_state(inConnection, MICO_CONNECTION_CONNECTED);
+
+exit:
+  /* Losers are closed, only those that never answered count as failed */
+  for(i = 0; i < num; i++){
+    if(race[i].state == RACE_RESOLVING)
+      MICODNSCancel(_race_resolved, &race[i]);
+    if(race[i].state == RACE_UNRESOLVED)
+      inConnection->stats[race[i].endpoint].failures++;
+    if(race[i].fd == -1)
+      continue;
+    if(winner < 0)
+      inConnection->stats[race[i].endpoint].failures++;
+    SocketClose(&race[i].fd);
+  }
+
+  if(err != kNoErr){
+    conn_log("No endpoint reachable, err = %d, retry %d", err, inConnection->failures + 1);
+    _schedule_retry(inConnection);
+  }
+  return err;
+}
+
+void MICOConnectionClose( mico_connection_t *inConnection )
+{
+  if(inConnection->fd != -1)
+    SocketClose(&inConnection->fd);
+
+  if(inConnection->state == MICO_CONNECTION_CONNECTED){
+    /* A connection that is dropped right after it was accepted still backs off */
+    if(mico_get_time() - inConnection->connectedTime >= inConnection->config.stableTime_ms){
+      inConnection->backoff_ms = 0;
+      inConnection->failures = 0;
+    }
+    if(inConnection->current >= 0)
+      inConnection->stats[inConnection->current].failures++;
+  }
+  inConnection->current = -1;
+  _schedule_retry(inConnection);
+}
+
+void MICOConnectionDataReceived( mico_connection_t *inConnection )
+{
+  inConnection->lastRecv = mico_get_time();
+}
+
+OSStatus MICOConnectionCheckAlive( mico_connection_t *inConnection )
+{
+  OSStatus err = kNoErr;
+  uint32_t now = mico_get_time();
+
+  require_action(inConnection->state == MICO_CONNECTION_CONNECTED, exit, err = kStateErr);
+  require_quiet(inConnection->config.deadPeerTimeout_ms, exit);
+
+  if(now - inConnection->lastRecv >= inConnection->config.deadPeerTimeout_ms){
+    conn_log("Peer %s silent for %d ms", inConnection->config.endpoints[inConnection->current].host, now - inConnection->lastRecv);
+    err = kTimeoutErr;
+    goto exit;
+  }
+
+  if(inConnection->config.heartbeat &&
+     now - inConnection->lastRecv >= inConnection->config.heartbeatInterval_ms &&
+     now - inConnection->lastHeartbeat >= inConnection->config.heartbeatInterval_ms){
+    inConnection->lastHeartbeat = now;
+    err = inConnection->config.heartbeat(inConnection);
+  }
+
+exit:
+  return err;
+}
+
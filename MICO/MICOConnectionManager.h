@@ -0,0 +1,105 @@
+/**
+  ******************************************************************************
+  * @file    MICOConnectionManager.h
+  * @author  William Xu
+  * @version V1.0.0
+  * @date    05-May-2014
+  * @brief   This file provides a TCP client connection with reconnect backoff
+  *          and dead peer detection.
+  ******************************************************************************
+  * @attention
+  *
+  * THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+  * WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+  * TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+  * DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+  * FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+  * CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+  *
+  * <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+  ******************************************************************************
+  */
+
+#ifndef __MICOCONNECTIONMANAGER_H__
+#define __MICOCONNECTIONMANAGER_H__
+
+#include "Common.h"
+#include "MICODefine.h"
+
+typedef enum {
+  MICO_CONNECTION_IDLE,
+  MICO_CONNECTION_CONNECTING,
+  MICO_CONNECTION_CONNECTED,
+  MICO_CONNECTION_BACKOFF,          //Waiting before the next attempt
+} mico_connection_state_t;
+
+#define MICO_CONNECTION_MAX_ENDPOINTS   4
+
+struct _mico_connection;
+
+/* Send an application level heartbeat, the peer is expected to answer */
+typedef OSStatus (*mico_connection_heartbeat_t)( struct _mico_connection *inConnection );
+
+typedef struct _mico_connection_endpoint {
+  const char                  *host;                //Host name or dotted IP address, empty if unused
+  uint16_t                    port;
+  uint8_t                     weight;               //Relative preference, 0 disables the endpoint
+} mico_connection_endpoint_t;
+
+typedef struct _mico_connection_config {
+  mico_connection_endpoint_t  endpoints[MICO_CONNECTION_MAX_ENDPOINTS];
+  int                         endpointNum;
+  uint32_t                    raceDelay_ms;         //Head start of a better endpoint before the next one is tried
+  uint32_t                    connectTimeout_ms;
+  uint32_t                    backoffMin_ms;
+  uint32_t                    backoffMax_ms;
+  uint32_t                    stableTime_ms;        //Backoff is reset once a connection lasted this long
+  int                         keepaliveProbes;      //TCP keepalive, 0 to leave the stack default
+  int                         keepaliveInterval_s;
+  mico_connection_heartbeat_t heartbeat;            //NULL if the protocol has no heartbeat
+  uint32_t                    heartbeatInterval_ms; //Idle time before a heartbeat is sent
+  uint32_t                    deadPeerTimeout_ms;   //Idle time before the peer is declared dead, 0 for never
+} mico_connection_config_t;
+
+/* What is learned about an endpoint, used to order the next race */
+typedef struct _mico_endpoint_stats {
+  uint32_t                    rtt_ms;               //Smoothed connect time, 0 if never connected
+  uint32_t                    failures;             //Consecutive failures
+} mico_endpoint_stats_t;
+
+typedef struct _mico_connection {
+  mico_connection_config_t    config;
+  mico_connection_state_t     state;
+  int                         fd;
+  int                         current;              //Index of the connected endpoint, -1 if none
+  mico_endpoint_stats_t       stats[MICO_CONNECTION_MAX_ENDPOINTS];
+  uint32_t                    backoff_ms;
+  uint32_t                    nextAttempt;
+  uint32_t                    connectedTime;
+  uint32_t                    lastRecv;
+  uint32_t                    lastHeartbeat;
+  uint32_t                    failures;
+  uint32_t                    random;
+} mico_connection_t;
+
+void     MICOConnectionInit             ( mico_connection_t *inConnection, const mico_connection_config_t *inConfig, mico_Context_t * const inContext );
+
+/* Wait out the backoff, then race connects to the endpoints. The preferred
+   endpoint starts first, every raceDelay_ms without an answer the next one
+   joins, and the first to complete wins. All names are resolved at once, an
+   endpoint whose answer has not arrived yet is passed over. */
+OSStatus MICOConnectionOpen             ( mico_connection_t *inConnection );
+
+/* Close the socket and schedule the next attempt. The endpoint that dropped
+   the connection is counted as failed, so the next race prefers the others. */
+void     MICOConnectionClose            ( mico_connection_t *inConnection );
+
+/* Record traffic from the peer */
+void     MICOConnectionDataReceived     ( mico_connection_t *inConnection );
+
+/* Send a heartbeat when due, kTimeoutErr if the peer was silent for
+   deadPeerTimeout_ms. Works without a heartbeat for peers that talk often. */
+OSStatus MICOConnectionCheckAlive       ( mico_connection_t *inConnection );
+
+#endif
+
@@ -0,0 +1,376 @@
+/**
+  ******************************************************************************
+  * @file    MICODNSResolver.c
+  * @author  William Xu
+  * @version V1.0.0
+  * @date    05-May-2014
+  * @brief   This file provides the asynchronous host name resolver and its
+  *          shared cache.
+  ******************************************************************************
+  * @attention
+  *
+  * THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+  * WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+  * TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+  * DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+  * FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+  * CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+  *
+  * <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+  ******************************************************************************
+  */
+
+#include "MICO.h"
+#include "MICODNSResolver.h"
+#include "MICONotificationCenter.h"
+
+#define dns_log(M, ...) custom_log("DNS", M, ##__VA_ARGS__)
+#define dns_log_trace() custom_log_trace("DNS")
+
+#ifndef MICO_DNS_CACHE_SIZE
+#define MICO_DNS_CACHE_SIZE             4
+#endif
+
+#ifndef MICO_DNS_MAX_WAITERS
+#define MICO_DNS_MAX_WAITERS            4
+#endif
+
+/* gethostbyname does not report the record TTL, every answer is kept this long */
+#ifndef MICO_DNS_DEFAULT_TTL
+#define MICO_DNS_DEFAULT_TTL            (300*1000)
+#endif
+
+/* An expired answer is still served for this long if the resolver fails */
+#ifndef MICO_DNS_MAX_STALE
+#define MICO_DNS_MAX_STALE              (24*3600*1000UL)
+#endif
+
+#define MICO_DNS_CANCEL_POLL            10
+
+typedef enum {
+  DNS_ENTRY_EMPTY,
+  DNS_ENTRY_RESOLVING,
+  DNS_ENTRY_VALID,
+} dns_entry_state_t;
+
+typedef struct {
+  mico_dns_callback_t callback;
+  void                *arg;
+} dns_waiter_t;
+
+typedef struct {
+  dns_entry_state_t   state;
+  char                hostname[MICO_DNS_MAX_HOSTNAME_LEN];
+  uint32_t            ip;
+  bool                hasAnswer;      /* ip holds a previous answer, maybe stale */
+  uint32_t            updated;
+  uint32_t            lastUsed;
+  dns_waiter_t        waiters[MICO_DNS_MAX_WAITERS];
+} dns_entry_t;
+
+typedef struct {
+  OSStatus            err;
+  uint32_t            ip;
+  mico_semaphore_t    sem;
+} dns_sync_result_t;
+
+static dns_entry_t    _dns_cache[MICO_DNS_CACHE_SIZE];
+static mico_mutex_t   _dns_mutex = NULL;
+/* Waiters of the lookup being delivered and the one called now, only the
+   network worker delivers so one set is enough */
+static dns_waiter_t   _dns_delivering[MICO_DNS_MAX_WAITERS];
+static dns_waiter_t   _dns_running;
+
+static bool _is_fresh(dns_entry_t *entry, uint32_t now)
+{
+  return entry->hasAnswer && (now - entry->updated) < MICO_DNS_DEFAULT_TTL;
+}
+
+static bool _is_usable_stale(dns_entry_t *entry, uint32_t now)
+{
+  return entry->hasAnswer && (now - entry->updated) < MICO_DNS_DEFAULT_TTL + MICO_DNS_MAX_STALE;
+}
+
+/* Dotted decimal addresses never need a lookup */
+static bool _is_ip_literal(const char *inHostname)
+{
+  const char *p;
+  int dots = 0;
+
+  for(p = inHostname; *p; p++){
+    if(*p == '.')
+      dots++;
+    else if(*p < '0' || *p > '9')
+      return false;
+  }
+  return dots == 3;
+}
+
+static dns_entry_t *_find_entry(const char *inHostname)
+{
+  int i;
+
+  for(i = 0; i < MICO_DNS_CACHE_SIZE; i++){
+    if(_dns_cache[i].state != DNS_ENTRY_EMPTY && strncmp(_dns_cache[i].hostname, inHostname, MICO_DNS_MAX_HOSTNAME_LEN) == 0)
+      return &_dns_cache[i];
+  }
+  return NULL;
+}
+
+/* Take an empty entry, or the least recently used one that is not resolving */
+static dns_entry_t *_alloc_entry(const char *inHostname)
+{
+  dns_entry_t *victim = NULL;
+  int i;
+
+  for(i = 0; i < MICO_DNS_CACHE_SIZE; i++){
+    if(_dns_cache[i].state == DNS_ENTRY_EMPTY){
+      victim = &_dns_cache[i];
+      break;
+    }
+    if(_dns_cache[i].state == DNS_ENTRY_VALID && (victim == NULL || (int32_t)(_dns_cache[i].lastUsed - victim->lastUsed) < 0))
+      victim = &_dns_cache[i];
+  }
+  require(victim, exit);
+
+  memset(victim, 0, sizeof(dns_entry_t));
+  strncpy(victim->hostname, inHostname, MICO_DNS_MAX_HOSTNAME_LEN - 1);
+  victim->state = DNS_ENTRY_VALID;
+
+exit:
+  return victim;
+}
+
+static OSStatus _add_waiter(dns_entry_t *entry, mico_dns_callback_t inCallback, void *inArg)
+{
+  int i;
+
+  for(i = 0; i < MICO_DNS_MAX_WAITERS; i++){
+    if(entry->waiters[i].callback == NULL){
+      entry->waiters[i].callback = inCallback;
+      entry->waiters[i].arg = inArg;
+      return kNoErr;
+    }
+  }
+  return kNoResourcesErr;
+}
+
+/* Runs on the network worker, the only place where the blocking lookup is done */
+static OSStatus _resolve_event_handler(void *arg)
+{
+  dns_entry_t *entry = arg;
+  char hostname[MICO_DNS_MAX_HOSTNAME_LEN];
+  char ipstr[16];
+  dns_waiter_t waiter;
+  OSStatus err;
+  uint32_t ip = 0;
+  int i;
+
+  mico_rtos_lock_mutex(&_dns_mutex);
+  strncpy(hostname, entry->hostname, MICO_DNS_MAX_HOSTNAME_LEN);
+  mico_rtos_unlock_mutex(&_dns_mutex);
+
+  err = gethostbyname(hostname, (uint8_t *)ipstr, 16);
+  if(err == kNoErr)
+    ip = inet_addr(ipstr);
+
+  mico_rtos_lock_mutex(&_dns_mutex);
+  if(err == kNoErr){
+    entry->ip = ip;
+    entry->hasAnswer = true;
+    entry->updated = mico_get_time();
+  }else if(_is_usable_stale(entry, mico_get_time())){
+    dns_log("Resolve %s failed, serve stale answer", hostname);
+    ip = entry->ip;
+    err = kNoErr;
+  }else{
+    dns_log("Resolve %s failed, err = %d", hostname, err);
+    err = kNotFoundErr;
+  }
+  entry->state = (entry->hasAnswer == true)? DNS_ENTRY_VALID : DNS_ENTRY_EMPTY;
+
+  memcpy(_dns_delivering, entry->waiters, sizeof(_dns_delivering));
+  memset(entry->waiters, 0, sizeof(entry->waiters));
+
+  /* Callbacks run unlocked so that they can resolve again or cancel */
+  for(i = 0; i < MICO_DNS_MAX_WAITERS; i++){
+    if(_dns_delivering[i].callback == NULL)
+      continue;
+    waiter = _dns_delivering[i];
+    _dns_delivering[i].callback = NULL;
+    _dns_running = waiter;
+    mico_rtos_unlock_mutex(&_dns_mutex);
+    waiter.callback(hostname, err, ip, waiter.arg);
+    mico_rtos_lock_mutex(&_dns_mutex);
+    _dns_running.callback = NULL;
+  }
+  mico_rtos_unlock_mutex(&_dns_mutex);
+  return kNoErr;
+}
+
+void dnsNotify_ResolveCompletedHandler(uint8_t *hostname, uint32_t ip, mico_Context_t * const inContext)
+{
+  dns_entry_t *entry;
+  (void)inContext;
+
+  if(hostname == NULL || ip == 0)
+    return;
+
+  /* Same byte order as sockaddr_t.s_ip, refresh answers other lookups got */
+  mico_rtos_lock_mutex(&_dns_mutex);
+  entry = _find_entry((char *)hostname);
+  if(entry){
+    entry->ip = ip;
+    entry->hasAnswer = true;
+    entry->updated = mico_get_time();
+  }
+  mico_rtos_unlock_mutex(&_dns_mutex);
+}
+
+OSStatus MICOInitDNSResolver( void )
+{
+  OSStatus err = kNoErr;
+
+  memset(_dns_cache, 0, sizeof(_dns_cache));
+  err = mico_rtos_init_mutex(&_dns_mutex);
+  require_noerr(err, exit);
+
+  err = MICOAddNotification( mico_notify_DNS_RESOLVE_COMPLETED, (void *)dnsNotify_ResolveCompletedHandler );
+  require_noerr(err, exit);
+
+exit:
+  return err;
+}
+
+OSStatus MICODNSResolve( const char *inHostname, mico_dns_callback_t inCallback, void *inArg )
+{
+  OSStatus err = kNoErr;
+  dns_entry_t *entry;
+  uint32_t now = mico_get_time();
+  uint32_t ip;
+
+  require_action(inHostname && inCallback, exit, err = kParamErr);
+  require_action(strlen(inHostname) < MICO_DNS_MAX_HOSTNAME_LEN, exit, err = kSizeErr);
+  require_action(_dns_mutex, exit, err = kNotInitializedErr);
+
+  if(_is_ip_literal(inHostname) == true){
+    inCallback(inHostname, kNoErr, inet_addr((char *)inHostname), inArg);
+    goto exit;
+  }
+
+  mico_rtos_lock_mutex(&_dns_mutex);
+  entry = _find_entry(inHostname);
+  if(entry && entry->state == DNS_ENTRY_VALID && _is_fresh(entry, now)){
+    entry->lastUsed = now;
+    ip = entry->ip;
+    mico_rtos_unlock_mutex(&_dns_mutex);
+    inCallback(inHostname, kNoErr, ip, inArg);
+    goto exit;
+  }
+
+  if(entry == NULL){
+    entry = _alloc_entry(inHostname);
+    require_action(entry, unlock, err = kNoResourcesErr);
+  }
+  entry->lastUsed = now;
+
+  err = _add_waiter(entry, inCallback, inArg);
+  require_noerr(err, unlock);
+
+  /* Coalesce with the lookup already in flight */
+  if(entry->state == DNS_ENTRY_RESOLVING)
+    goto unlock;
+
+  entry->state = DNS_ENTRY_RESOLVING;
+  err = mico_rtos_send_asynchronous_event(MICO_NETWORKING_WORKER_THREAD, _resolve_event_handler, entry);
+  if(err != kNoErr){
+    entry->state = (entry->hasAnswer == true)? DNS_ENTRY_VALID : DNS_ENTRY_EMPTY;
+    memset(entry->waiters, 0, sizeof(entry->waiters));
+  }
+
+unlock:
+  mico_rtos_unlock_mutex(&_dns_mutex);
+exit:
+  return err;
+}
+
+OSStatus MICODNSCancel( mico_dns_callback_t inCallback, void *inArg )
+{
+  OSStatus err = kNotFoundErr;
+  int i, j;
+
+  require_action(_dns_mutex, exit, err = kNotInitializedErr);
+
+  mico_rtos_lock_mutex(&_dns_mutex);
+  for(i = 0; i < MICO_DNS_CACHE_SIZE; i++){
+    for(j = 0; j < MICO_DNS_MAX_WAITERS; j++){
+      if(_dns_cache[i].waiters[j].callback == inCallback && _dns_cache[i].waiters[j].arg == inArg){
+        _dns_cache[i].waiters[j].callback = NULL;
+        err = kNoErr;
+      }
+    }
+  }
+  for(j = 0; j < MICO_DNS_MAX_WAITERS; j++){
+    if(_dns_delivering[j].callback == inCallback && _dns_delivering[j].arg == inArg){
+      _dns_delivering[j].callback = NULL;
+      err = kNoErr;
+    }
+  }
+
+  /* The callback may be running, it is done once the worker takes the lock
+     back. A callback cancelling itself must not wait for itself. */
+  if(mico_rtos_is_current_thread(&MICO_NETWORKING_WORKER_THREAD->thread) == false){
+    while(_dns_running.callback == inCallback && _dns_running.arg == inArg){
+      mico_rtos_unlock_mutex(&_dns_mutex);
+      mico_thread_msleep(MICO_DNS_CANCEL_POLL);
+      mico_rtos_lock_mutex(&_dns_mutex);
+    }
+  }
+  mico_rtos_unlock_mutex(&_dns_mutex);
+
+exit:
+  return err;
+}
+
+static void _sync_resolve_callback(const char *inHostname, OSStatus inErr, uint32_t inIp, void *inArg)
+{
+  dns_sync_result_t *result = inArg;
+  (void)inHostname;
+
+  result->err = inErr;
+  result->ip = inIp;
+  if(result->sem)
+    mico_rtos_set_semaphore(&result->sem);
+}
+
+OSStatus MICODNSGetHostByName( const char *inHostname, uint32_t *outIp, uint32_t inTimeout_ms )
+{
+  OSStatus err = kNoErr;
+  dns_sync_result_t result;
+
+  result.err = kInProgressErr;
+  result.ip = 0;
+  result.sem = NULL;
+  require_action(outIp, exit, err = kParamErr);
+
+  err = mico_rtos_init_semaphore(&result.sem, 1);
+  require_noerr(err, exit);
+
+  err = MICODNSResolve(inHostname, _sync_resolve_callback, &result);
+  require_noerr(err, exit);
+
+  if(result.err == kInProgressErr && mico_rtos_get_semaphore(&result.sem, inTimeout_ms) != kNoErr){
+    /* Waits for a callback already running, after this it can no longer
+       touch result */
+    MICODNSCancel(_sync_resolve_callback, &result);
+  }
+
+  err = (result.err == kInProgressErr)? kTimeoutErr : result.err;
+  require_noerr(err, exit);
+  *outIp = result.ip;
+
+exit:
+  if(result.sem) mico_rtos_deinit_semaphore(&result.sem);
+  return err;
+}
+
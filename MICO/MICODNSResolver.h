@@ -0,0 +1,50 @@
+/**
+  ******************************************************************************
+  * @file    MICODNSResolver.h
+  * @author  William Xu
+  * @version V1.0.0
+  * @date    05-May-2014
+  * @brief   This file provides the asynchronous host name resolver and its
+  *          shared cache.
+  ******************************************************************************
+  * @attention
+  *
+  * THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+  * WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+  * TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+  * DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+  * FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+  * CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+  *
+  * <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+  ******************************************************************************
+  */
+
+#ifndef __MICODNSRESOLVER_H__
+#define __MICODNSRESOLVER_H__
+
+#include "Common.h"
+#include "MICODefine.h"
+
+#define MICO_DNS_MAX_HOSTNAME_LEN       64
+
+/* Called with the result of MICODNSResolve, inIp is in host byte order as
+   returned by inet_addr. May call MICODNSResolve or MICODNSCancel. */
+typedef void (*mico_dns_callback_t)( const char *inHostname, OSStatus inErr, uint32_t inIp, void *inArg );
+
+OSStatus MICOInitDNSResolver    ( void );
+
+/* Resolve inHostname and call inCallback once. A fresh cache entry is
+   returned before this function returns, otherwise the lookup runs on the
+   network worker and is shared with every other caller of the same name. */
+OSStatus MICODNSResolve         ( const char *inHostname, mico_dns_callback_t inCallback, void *inArg );
+
+/* Remove a callback that has not been called yet, waits for it to return if
+   it is running on the network worker */
+OSStatus MICODNSCancel          ( mico_dns_callback_t inCallback, void *inArg );
+
+/* Blocking form of MICODNSResolve, for thread based clients */
+OSStatus MICODNSGetHostByName   ( const char *inHostname, uint32_t *outIp, uint32_t inTimeout_ms );
+
+#endif
+
@@ -29,6 +29,7 @@
 #include "MICO.h"
 #include "external/JSON-C/json.h"
 #include "MICOAppDefine.h"
+#include "SeqLockUtils.h"
 
 #define CONFIG_MODE_EASYLINK
 #define CONFIG_MODE_EASYLINK_WITH_SOFTAP
@@ -37,6 +38,13 @@
 #define BONJOUR_SERVICE         "_easylink._tcp.local."
 #define CONFIG_SERVICE_PORT     8000
 
+/*Buffers of the socket, UART, HTTP and mDNS paths come from a pool that is
+  allocated at boot, so that connections coming and going do not fragment
+  the heap. Classes are { size, count }, quotas are bytes per user in the
+  order of buffer_pool_user_t, 0 for no limit*/
+#define BUFFER_POOL_CLASSES_CONFIG  { { 128, 8 }, { 1024, 6 }, { 1536, 1 }, { 2304, 1 } }
+#define BUFFER_POOL_QUOTA_CONFIG    { 4096, 0, 0, 0, 2048 }
+
 #define BUNDLE_SEED_ID          "C6P64J2MZX"  //ISSC Temp
 #define EA_PROTOCOL             "com.issc.datapath"
 #define LED_WAC_TRIGGER_INTERVAL 500 
@@ -47,6 +55,14 @@
 #define EasyLink_TimeOut          20  //20 seconds
 #define ConnectFTC_Timeout        20000  //20 seconds
 
+/*Largest OTA image, the store-and-forward log takes the last update sector
+  when the application spills to flash*/
+#if REMOTE_STORE_FLASH_SPILL
+#define MICO_OTA_MAX_LEN          STORE_FORWARD_OTA_MAX_LEN
+#else
+#define MICO_OTA_MAX_LEN          UPDATE_FLASH_SIZE
+#endif
+
 
 #define maxSsidLen          32
 #define maxKeyLen           64
@@ -153,17 +169,22 @@ typedef struct _current_mico_status_t {
   mico_semaphore_t      easylink_sem;
   json_object           *easylink_report;
   int                   easylinkClient_fd;
+  /*Set by ConfigIncommingJsonMessage, false if the new configuration already took effect*/
+  bool                  configNeedsReset;
 } current_mico_status_t;
 
 
 typedef struct _mico_Context_t
 {
-  /*Flash content*/
+  /*Flash content, writers hold flashContentInRam_mutex and publish their
+    changes through flashContentInRam_seqlock, readers use MICOGetConfiguration*/
   flash_content_t           flashContentInRam;
   mico_mutex_t              flashContentInRam_mutex;
+  seqlock_t                 flashContentInRam_seqlock;
 
-  /*Running status*/
+  /*Running status, IP addresses are published through micoStatus_seqlock*/
   current_mico_status_t     micoStatus;
+  seqlock_t                 micoStatus_seqlock;
   current_app_status_t      appStatus;
 } mico_Context_t;
 
@@ -221,10 +242,17 @@ OSStatus MICOStartBonjourService        ( WiFi_Interface interface, mico_Context
 OSStatus MICOStartConfigServer          ( mico_Context_t * const inContext );
 OSStatus MICOStartApplication           ( mico_Context_t * const inContext );
 
+/* MICORestoreDefault takes flashContentInRam_mutex itself, callers of
+   MICOUpdateConfiguration must already hold it */
 OSStatus MICORestoreDefault             ( mico_Context_t * const inContext );
 OSStatus MICOReadConfiguration          ( mico_Context_t * const inContext );
 OSStatus MICOUpdateConfiguration        ( mico_Context_t * const inContext );
 
+/* Lock-free snapshots for readers, never hold flashContentInRam_mutex to read */
+void     MICOGetConfiguration           ( mico_Context_t * const inContext, flash_content_t *outConfig );
+void     MICOGetStatus                  ( mico_Context_t * const inContext, current_mico_status_t *outStatus );
+void     MICOSetNetStatus               ( mico_Context_t * const inContext, const char *inIp, const char *inMask, const char *inGateway, const char *inDns );
+
 
 
 
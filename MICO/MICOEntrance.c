@@ -26,15 +26,19 @@
 
 #include "MICONotificationCenter.h"
 #include "MICOSystemMonitor.h"
+#include "MICODNSResolver.h"
 #include "EasyLink/EasyLink.h"
 
 #include "StringUtils.h"
+#include "BufferPoolUtils.h"
 
 static mico_Context_t *context;
 static mico_timer_t _watchdog_reload_timer;
 
 static mico_system_monitor_t mico_monitor;
 
+static const buffer_pool_config_t _buffer_pool_config = { BUFFER_POOL_CLASSES_CONFIG, BUFFER_POOL_QUOTA_CONFIG };
+
 #define mico_log(M, ...) custom_log("MICO", M, ##__VA_ARGS__)
 #define mico_log_trace() custom_log_trace("MICO")
 
@@ -52,29 +56,48 @@ void micoNotify_ReadAppInfoHandler(char *str, int len, mico_Context_t * const in
 }   
 
 
-void PlatformEasyLinkButtonClickedCallback(void)
+static OSStatus _easylink_clicked_event(void *arg)
 {
-  mico_log_trace();
+  (void)arg;
+  mico_rtos_lock_mutex(&context->flashContentInRam_mutex);
   if(context->flashContentInRam.micoSystemConfig.configured == allConfigured){
+    seqlock_write_begin(&context->flashContentInRam_seqlock);
     context->flashContentInRam.micoSystemConfig.configured = wLanUnConfigured;
+    seqlock_write_end(&context->flashContentInRam_seqlock);
     MICOUpdateConfiguration(context);
   }
+  mico_rtos_unlock_mutex(&context->flashContentInRam_mutex);
   context->micoStatus.sys_state = eState_Software_Reset;
   require(context->micoStatus.sys_state_change_sem, exit);
   mico_rtos_set_semaphore(&context->micoStatus.sys_state_change_sem);
 exit: 
-  return;
+  return kNoErr;
 }
 
-void PlatformEasyLinkButtonLongPressedCallback(void)
+static OSStatus _easylink_long_pressed_event(void *arg)
 {
-  mico_log_trace();
+  (void)arg;
   MICORestoreDefault(context);
   context->micoStatus.sys_state = eState_Software_Reset;
   require(context->micoStatus.sys_state_change_sem, exit);
   mico_rtos_set_semaphore(&context->micoStatus.sys_state_change_sem);
 exit: 
-  return;
+  return kNoErr;
+}
+
+/* Called from the button interrupt and timer, the flash update is left to the worker */
+void PlatformEasyLinkButtonClickedCallback(void)
+{
+  mico_log_trace();
+  if(mico_rtos_send_asynchronous_event(MICO_DEFAULT_WORKER_THREAD, _easylink_clicked_event, NULL) != kNoErr)
+    mico_log("EasyLink button ignored, worker busy");
+}
+
+void PlatformEasyLinkButtonLongPressedCallback(void)
+{
+  mico_log_trace();
+  if(mico_rtos_send_asynchronous_event(MICO_DEFAULT_WORKER_THREAD, _easylink_long_pressed_event, NULL) != kNoErr)
+    mico_log("Restore default ignored, worker busy");
 }
 
  void PlatformStandbyButtonClickedCallback(void)
@@ -108,12 +131,7 @@ void micoNotify_DHCPCompleteHandler(net_para_st *pnet, mico_Context_t * const in
 {
   mico_log_trace();
   require(inContext, exit);
-  mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
-  strcpy((char *)inContext->micoStatus.localIp, pnet->ip);
-  strcpy((char *)inContext->micoStatus.netMask, pnet->mask);
-  strcpy((char *)inContext->micoStatus.gateWay, pnet->gate);
-  strcpy((char *)inContext->micoStatus.dnsServer, pnet->dns);
-  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
+  MICOSetNetStatus(inContext, pnet->ip, pnet->mask, pnet->gate, pnet->dns);
 exit:
   return;
 }
@@ -124,6 +142,7 @@ void micoNotify_WiFIParaChangedHandler(apinfo_adv_t *ap_info, char *key, int key
   bool _needsUpdate = false;
   require(inContext, exit);
   mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   if(strncmp(inContext->flashContentInRam.micoSystemConfig.ssid, ap_info->ssid, maxSsidLen)!=0){
     strncpy(inContext->flashContentInRam.micoSystemConfig.ssid, ap_info->ssid, maxSsidLen);
     _needsUpdate = true;
@@ -153,6 +172,7 @@ void micoNotify_WiFIParaChangedHandler(apinfo_adv_t *ap_info, char *key, int key
     inContext->flashContentInRam.micoSystemConfig.keyLength = key_len;
     _needsUpdate = true;
   }
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
 
   if(_needsUpdate== true)  
     MICOUpdateConfiguration(inContext);
@@ -166,26 +186,26 @@ void _ConnectToAP( mico_Context_t * const inContext)
 {
   mico_log_trace();
   network_InitTypeDef_adv_st wNetConfig;
-  mico_log("connect to %s.....", inContext->flashContentInRam.micoSystemConfig.ssid);
+  flash_content_t config;
+
+  MICOGetConfiguration(inContext, &config);
+  mico_log("connect to %s.....", config.micoSystemConfig.ssid);
   memset(&wNetConfig, 0x0, sizeof(network_InitTypeDef_adv_st));
   
-  mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
-  strncpy((char*)wNetConfig.ap_info.ssid, inContext->flashContentInRam.micoSystemConfig.ssid, maxSsidLen);
-  memcpy(wNetConfig.ap_info.bssid, inContext->flashContentInRam.micoSystemConfig.bssid, 6);
-  wNetConfig.ap_info.channel = inContext->flashContentInRam.micoSystemConfig.channel;
-  wNetConfig.ap_info.security = inContext->flashContentInRam.micoSystemConfig.security;
-  memcpy(wNetConfig.key, inContext->flashContentInRam.micoSystemConfig.key, inContext->flashContentInRam.micoSystemConfig.keyLength);
-  wNetConfig.key_len = inContext->flashContentInRam.micoSystemConfig.keyLength;
-  if(inContext->flashContentInRam.micoSystemConfig.dhcpEnable == true)
+  strncpy((char*)wNetConfig.ap_info.ssid, config.micoSystemConfig.ssid, maxSsidLen);
+  memcpy(wNetConfig.ap_info.bssid, config.micoSystemConfig.bssid, 6);
+  wNetConfig.ap_info.channel = config.micoSystemConfig.channel;
+  wNetConfig.ap_info.security = config.micoSystemConfig.security;
+  memcpy(wNetConfig.key, config.micoSystemConfig.key, config.micoSystemConfig.keyLength);
+  wNetConfig.key_len = config.micoSystemConfig.keyLength;
+  if(config.micoSystemConfig.dhcpEnable == true)
     wNetConfig.dhcpMode = DHCP_Client;
   else
     wNetConfig.dhcpMode = DHCP_Disable;
-  strncpy((char*)wNetConfig.local_ip_addr, inContext->flashContentInRam.micoSystemConfig.localIp, maxIpLen);
-  strncpy((char*)wNetConfig.net_mask, inContext->flashContentInRam.micoSystemConfig.netMask, maxIpLen);
-  strncpy((char*)wNetConfig.gateway_ip_addr, inContext->flashContentInRam.micoSystemConfig.gateWay, maxIpLen);
-  strncpy((char*)wNetConfig.dnsServer_ip_addr, inContext->flashContentInRam.micoSystemConfig.dnsServer, maxIpLen);
-
-  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
+  strncpy((char*)wNetConfig.local_ip_addr, config.micoSystemConfig.localIp, maxIpLen);
+  strncpy((char*)wNetConfig.net_mask, config.micoSystemConfig.netMask, maxIpLen);
+  strncpy((char*)wNetConfig.gateway_ip_addr, config.micoSystemConfig.gateWay, maxIpLen);
+  strncpy((char*)wNetConfig.dnsServer_ip_addr, config.micoSystemConfig.dnsServer, maxIpLen);
 
   wNetConfig.wifi_retry_interval = 100;
   StartAdvNetwork(&wNetConfig);
@@ -208,14 +228,26 @@ int application_start(void)
   require_action( context, exit, err = kNoMemoryErr );
   memset(context, 0x0, sizeof(mico_Context_t));
   mico_rtos_init_mutex(&context->flashContentInRam_mutex);
+  seqlock_init(&context->flashContentInRam_seqlock);
+  seqlock_init(&context->micoStatus_seqlock);
   mico_rtos_init_semaphore(&context->micoStatus.sys_state_change_sem, 1); 
 
   MICOReadConfiguration( context );
 
+  /*Before any thread that takes socket or UART buffers*/
+  err = buffer_pool_init( &_buffer_pool_config );
+  require_noerr( err, exit );
+
+  err = mico_rtos_init_default_worker_threads();
+  require_noerr( err, exit );
+
   err = MICOInitNotificationCenter  ( context );
 
   err = MICOAddNotification( mico_notify_READ_APP_INFO, (void *)micoNotify_ReadAppInfoHandler );
   require_noerr( err, exit );  
+
+  err = MICOInitDNSResolver( );
+  require_noerr( err, exit );
   
   /*wlan driver and tcpip init*/
   mxchipInit();
@@ -254,7 +286,8 @@ int application_start(void)
     err = MICOAddNotification( mico_notify_WIFI_STATUS_CHANGED, (void *)micoNotify_WifiStatusHandler );
     require_noerr( err, exit ); 
     
-    err = MICOAddNotification( mico_notify_WiFI_PARA_CHANGED, (void *)micoNotify_WiFIParaChangedHandler );
+    /* Writes flash, keep it off the Wi-Fi driver thread */
+    err = MICOAddNotificationWithPriority( mico_notify_WiFI_PARA_CHANGED, (void *)micoNotify_WiFIParaChangedHandler, MICO_NOTIFY_DEFAULT_PRIORITY, MICO_NOTIFY_DEFERRED );
     require_noerr( err, exit ); 
 
     err = MICOAddNotification( mico_notify_DHCP_COMPLETED, (void *)micoNotify_DHCPCompleteHandler );
@@ -22,15 +22,68 @@
 
 
 #include "MICONotificationCenter.h"
-
-typedef struct _Notify_list{
-  void  *function;
-  struct _Notify_list *next;
-} _Notify_list_t;
+#include "SeqLockUtils.h"
+
+#define notify_log(M, ...) custom_log("Notify", M, ##__VA_ARGS__)
+#define notify_log_trace() custom_log_trace("Notify")
+
+#define MICO_NOTIFY_TYPE_MAX        20
+
+typedef struct _notify_subscriber {
+  void                    *function;
+  uint8_t                 priority;
+  mico_notify_delivery_t  delivery;
+} _notify_subscriber_t;
+
+typedef struct _notify_subscribers {
+  uint8_t               count;
+  _notify_subscriber_t  subscriber[MICO_NOTIFY_MAX_SUBSCRIBERS];
+} _notify_subscribers_t;
+
+/* Arguments of a notification. Deferred messages keep a private copy of the
+   data that the pointers refer to, right after the message itself */
+typedef struct _notify_message {
+  mico_notify_types_t   type;
+  void                  *function;
+  union {
+    ScanResult                *pApList;
+    WiFiEvent                 status;
+    struct {
+      apinfo_adv_t            *ap_info;
+      char                    *key;
+      int                     key_len;
+    } para;
+    net_para_st               *pnet;
+    network_InitTypeDef_st    *nwkpara;
+    struct {
+      int                     datalen;
+      char                    *data;
+    } extra;
+    int                       fd;
+    struct {
+      uint8_t                 *hostname;
+      uint32_t                ip;
+    } dns;
+    struct {
+      char                    *str;
+      int                     len;
+    } info;
+    struct {
+      void                    *connection;
+      int                     state;
+    } conn;
+  } arg;
+} _notify_message_t;
 
 static mico_Context_t * _Context;
 
-_Notify_list_t* Notify_list[20] = {NULL};
+/* Subscriber tables are rewritten under _notify_mutex and published through
+   _notify_lock, so driver callbacks never block on a registration */
+static _notify_subscribers_t  _notify_table[MICO_NOTIFY_TYPE_MAX];
+static seqlock_t              _notify_lock;
+static mico_mutex_t           _notify_mutex = NULL;
+
+static uint32_t               _notify_dropped = 0;
 
 /* MICO system defined notifications */
 typedef void (*mico_notify_WIFI_SCAN_COMPLETE_function)           ( ScanResult *pApList, mico_Context_t * inContext );
@@ -43,137 +96,253 @@ typedef void (*mico_notify_TCP_CLIENT_CONNECTED_function)         ( int fd, mico
 typedef void (*mico_notify_DNS_RESOLVE_COMPLETED_function)        ( uint8_t *hostname, uint32_t ip, mico_Context_t * inContext );
 typedef void (*mico_notify_READ_APP_INFO_function)                ( char *str, int len, mico_Context_t * inContext );
 typedef void (*mico_notify_SYS_WILL_POWER_OFF_function)           ( mico_Context_t * inContext );
+typedef void (*mico_notify_CONNECTION_STATE_CHANGED_function)     ( void *connection, int state, mico_Context_t * inContext );
 
 /* User defined notifications */
 
-void ApListCallback(ScanResult *pApList)
+static void _invoke(_notify_message_t *msg)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_WIFI_SCAN_COMPLETED];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_WIFI_SCAN_COMPLETE_function)(temp->function))(pApList, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
+  switch(msg->type){
+    case mico_notify_WIFI_SCAN_COMPLETED:
+      ((mico_notify_WIFI_SCAN_COMPLETE_function)(msg->function))(msg->arg.pApList, _Context);
+      break;
+    case mico_notify_WIFI_STATUS_CHANGED:
+      ((mico_notify_WIFI_STATUS_CHANGED_function)(msg->function))(msg->arg.status, _Context);
+      break;
+    case mico_notify_WiFI_PARA_CHANGED:
+      ((mico_notify_WiFI_PARA_CHANGED_function)(msg->function))(msg->arg.para.ap_info, msg->arg.para.key, msg->arg.para.key_len, _Context);
+      break;
+    case mico_notify_DHCP_COMPLETED:
+      ((mico_notify_DHCP_COMPLETE_function)(msg->function))(msg->arg.pnet, _Context);
+      break;
+    case mico_notify_EASYLINK_COMPLETED:
+      ((mico_notify_EASYLINK_COMPLETE_function)(msg->function))(msg->arg.nwkpara, _Context);
+      break;
+    case mico_notify_EASYLINK_GET_EXTRA_DATA:
+      ((mico_notify_EASYLINK_GET_EXTRA_DATA_function)(msg->function))(msg->arg.extra.datalen, msg->arg.extra.data, _Context);
+      break;
+    case mico_notify_TCP_CLIENT_CONNECTED:
+      ((mico_notify_TCP_CLIENT_CONNECTED_function)(msg->function))(msg->arg.fd, _Context);
+      break;
+    case mico_notify_DNS_RESOLVE_COMPLETED:
+      ((mico_notify_DNS_RESOLVE_COMPLETED_function)(msg->function))(msg->arg.dns.hostname, msg->arg.dns.ip, _Context);
+      break;
+    case mico_notify_READ_APP_INFO:
+      ((mico_notify_READ_APP_INFO_function)(msg->function))(msg->arg.info.str, msg->arg.info.len, _Context);
+      break;
+    case mico_notify_SYS_WILL_POWER_OFF:
+      ((mico_notify_SYS_WILL_POWER_OFF_function)(msg->function))(_Context);
+      break;
+    case mico_notify_CONNECTION_STATE_CHANGED:
+      ((mico_notify_CONNECTION_STATE_CHANGED_function)(msg->function))(msg->arg.conn.connection, msg->arg.conn.state, _Context);
+      break;
+    default:
+      break;
   }
 }
 
-void WifiStatusHandler(WiFiEvent status)
+/* Copy a notification and everything it points to, the driver owns the
+   original arguments only until the callback returns */
+static _notify_message_t *_copy_message(_notify_message_t *msg)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_WIFI_STATUS_CHANGED];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_WIFI_STATUS_CHANGED_function)(temp->function))(status, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
+  _notify_message_t *copy;
+  uint32_t payloadLen = 0;
+  uint8_t *payload;
+
+  switch(msg->type){
+    case mico_notify_WIFI_SCAN_COMPLETED:
+      payloadLen = sizeof(ScanResult) + msg->arg.pApList->ApNum * sizeof(ApList_str);
+      break;
+    case mico_notify_WiFI_PARA_CHANGED:
+      payloadLen = sizeof(apinfo_adv_t) + msg->arg.para.key_len + 1;
+      break;
+    case mico_notify_DHCP_COMPLETED:
+      payloadLen = sizeof(net_para_st);
+      break;
+    case mico_notify_EASYLINK_COMPLETED:
+      if(msg->arg.nwkpara) payloadLen = sizeof(network_InitTypeDef_st);
+      break;
+    case mico_notify_EASYLINK_GET_EXTRA_DATA:
+      payloadLen = msg->arg.extra.datalen + 1;
+      break;
+    case mico_notify_DNS_RESOLVE_COMPLETED:
+      payloadLen = strlen((char *)msg->arg.dns.hostname) + 1;
+      break;
+    default:
+      break;
+  }
+
+  copy = malloc(sizeof(_notify_message_t) + payloadLen);
+  require(copy, exit);
+  memcpy(copy, msg, sizeof(_notify_message_t));
+  payload = (uint8_t *)(copy + 1);
+
+  switch(msg->type){
+    case mico_notify_WIFI_SCAN_COMPLETED:
+      copy->arg.pApList = (ScanResult *)payload;
+      copy->arg.pApList->ApNum = msg->arg.pApList->ApNum;
+      copy->arg.pApList->ApList = (ApList_str *)(payload + sizeof(ScanResult));
+      memcpy(copy->arg.pApList->ApList, msg->arg.pApList->ApList, msg->arg.pApList->ApNum * sizeof(ApList_str));
+      break;
+    case mico_notify_WiFI_PARA_CHANGED:
+      copy->arg.para.ap_info = (apinfo_adv_t *)payload;
+      memcpy(copy->arg.para.ap_info, msg->arg.para.ap_info, sizeof(apinfo_adv_t));
+      copy->arg.para.key = (char *)(payload + sizeof(apinfo_adv_t));
+      memcpy(copy->arg.para.key, msg->arg.para.key, msg->arg.para.key_len);
+      copy->arg.para.key[msg->arg.para.key_len] = 0x0;
+      break;
+    case mico_notify_DHCP_COMPLETED:
+      copy->arg.pnet = (net_para_st *)payload;
+      memcpy(copy->arg.pnet, msg->arg.pnet, sizeof(net_para_st));
+      break;
+    case mico_notify_EASYLINK_COMPLETED:
+      if(msg->arg.nwkpara){
+        copy->arg.nwkpara = (network_InitTypeDef_st *)payload;
+        memcpy(copy->arg.nwkpara, msg->arg.nwkpara, sizeof(network_InitTypeDef_st));
+      }
+      break;
+    case mico_notify_EASYLINK_GET_EXTRA_DATA:
+      copy->arg.extra.data = (char *)payload;
+      memcpy(copy->arg.extra.data, msg->arg.extra.data, msg->arg.extra.datalen);
+      copy->arg.extra.data[msg->arg.extra.datalen] = 0x0;
+      break;
+    case mico_notify_DNS_RESOLVE_COMPLETED:
+      copy->arg.dns.hostname = payload;
+      strcpy((char *)copy->arg.dns.hostname, (char *)msg->arg.dns.hostname);
+      break;
+    default:
+      break;
   }
+
+exit:
+  return copy;
 }
 
-void connected_ap_info(apinfo_adv_t *ap_info, char *key, int key_len)
+static OSStatus _notify_deferred_event(void *arg)
+{
+  _notify_message_t *msg = arg;
+
+  _invoke(msg);
+  free(msg);
+  return kNoErr;
+}
+
+/* Deliver a notification to every subscriber of its type, in priority order */
+static void _post(_notify_message_t *msg)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_WiFI_PARA_CHANGED];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_WiFI_PARA_CHANGED_function)(temp->function))(ap_info, key, key_len, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
+  _notify_subscribers_t subscribers;
+  _notify_message_t *copy;
+  int i;
+
+  seqlock_read_copy(&_notify_lock, &subscribers, &_notify_table[msg->type], sizeof(_notify_subscribers_t));
+
+  for(i = 0; i < subscribers.count; i++){
+    msg->function = subscribers.subscriber[i].function;
+    if(subscribers.subscriber[i].delivery == MICO_NOTIFY_INLINE){
+      _invoke(msg);
+      continue;
+    }
+
+    copy = _copy_message(msg);
+    if(copy == NULL || mico_rtos_send_asynchronous_event(MICO_DEFAULT_WORKER_THREAD, _notify_deferred_event, copy) != kNoErr){
+      _notify_dropped++;
+      notify_log("Notification %d dropped, %d in total", msg->type, _notify_dropped);
+      if(copy) free(copy);
+    }
   }
 }
 
+void ApListCallback(ScanResult *pApList)
+{
+  _notify_message_t msg;
+  msg.type = mico_notify_WIFI_SCAN_COMPLETED;
+  msg.arg.pApList = pApList;
+  _post(&msg);
+}
+
+void WifiStatusHandler(WiFiEvent status)
+{
+  _notify_message_t msg;
+  msg.type = mico_notify_WIFI_STATUS_CHANGED;
+  msg.arg.status = status;
+  _post(&msg);
+}
+
+void connected_ap_info(apinfo_adv_t *ap_info, char *key, int key_len)
+{
+  _notify_message_t msg;
+  msg.type = mico_notify_WiFI_PARA_CHANGED;
+  msg.arg.para.ap_info = ap_info;
+  msg.arg.para.key = key;
+  msg.arg.para.key_len = key_len;
+  _post(&msg);
+}
+
 void NetCallback(net_para_st *pnet)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_DHCP_COMPLETED];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_DHCP_COMPLETE_function)(temp->function))(pnet, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
-  }
+  _notify_message_t msg;
+  msg.type = mico_notify_DHCP_COMPLETED;
+  msg.arg.pnet = pnet;
+  _post(&msg);
 }
 
 void RptConfigmodeRslt(network_InitTypeDef_st *nwkpara)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_EASYLINK_COMPLETED];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_EASYLINK_COMPLETE_function)(temp->function))(nwkpara, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
-  }
+  _notify_message_t msg;
+  msg.type = mico_notify_EASYLINK_COMPLETED;
+  msg.arg.nwkpara = nwkpara;
+  _post(&msg);
 }
 
 void easylink_user_data_result(int datalen, char*data)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_EASYLINK_GET_EXTRA_DATA];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_EASYLINK_GET_EXTRA_DATA_function)(temp->function))(datalen, data, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
-  }  
+  _notify_message_t msg;
+  msg.type = mico_notify_EASYLINK_GET_EXTRA_DATA;
+  msg.arg.extra.datalen = datalen;
+  msg.arg.extra.data = data;
+  _post(&msg);
 }
 
 void socket_connected(int fd)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_TCP_CLIENT_CONNECTED];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_TCP_CLIENT_CONNECTED_function)(temp->function))(fd, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
-  }    
+  _notify_message_t msg;
+  msg.type = mico_notify_TCP_CLIENT_CONNECTED;
+  msg.arg.fd = fd;
+  _post(&msg);
 }
 
 void dns_ip_set(uint8_t *hostname, uint32_t ip)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_DNS_RESOLVE_COMPLETED];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_DNS_RESOLVE_COMPLETED_function)(temp->function))(hostname, ip, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
-  }    
+  _notify_message_t msg;
+  msg.type = mico_notify_DNS_RESOLVE_COMPLETED;
+  msg.arg.dns.hostname = hostname;
+  msg.arg.dns.ip = ip;
+  _post(&msg);
 }
 
 
 void system_version(char *str, int len){
-  _Notify_list_t *temp =  Notify_list[mico_notify_READ_APP_INFO];
-  if(Notify_list[mico_notify_READ_APP_INFO] == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_READ_APP_INFO_function)(temp->function))(str, len, _Context);
-      temp = temp->next;
-    }while(temp!=NULL);
-  }
+  _notify_message_t msg;
+  msg.type = mico_notify_READ_APP_INFO;
+  msg.arg.info.str = str;
+  msg.arg.info.len = len;
+  _post(&msg);
 }
 
 void sendNotifySYSWillPowerOff(void)
 {
-  _Notify_list_t *temp =  Notify_list[mico_notify_SYS_WILL_POWER_OFF];
-  if(temp == NULL)
-    return;
-  else{
-    do{
-      ((mico_notify_SYS_WILL_POWER_OFF_function)(temp->function))(_Context);
-      temp = temp->next;
-    }while(temp!=NULL);
-  }    
+  _notify_message_t msg;
+  msg.type = mico_notify_SYS_WILL_POWER_OFF;
+  _post(&msg);
+}
+
+void sendNotifyConnectionStateChanged(void *connection, int state)
+{
+  _notify_message_t msg;
+  msg.type = mico_notify_CONNECTION_STATE_CHANGED;
+  msg.arg.conn.connection = connection;
+  msg.arg.conn.state = state;
+  _post(&msg);
 }
 
 
@@ -182,31 +351,56 @@ OSStatus MICOInitNotificationCenter  ( void * const inContext )
   OSStatus err = kNoErr;
   require_action(inContext, exit, err = kParamErr);
   _Context = inContext;
+
+  seqlock_init(&_notify_lock);
+  err = mico_rtos_init_mutex(&_notify_mutex);
+  require_noerr(err, exit);
 exit:
   return err;
 }
 
 OSStatus MICOAddNotification( mico_notify_types_t notify_type, void *functionAddress )
+{
+  return MICOAddNotificationWithPriority(notify_type, functionAddress, MICO_NOTIFY_DEFAULT_PRIORITY, MICO_NOTIFY_INLINE);
+}
+
+OSStatus MICOAddNotificationWithPriority( mico_notify_types_t notify_type, void *functionAddress, uint8_t priority, mico_notify_delivery_t delivery )
 {
   OSStatus err = kNoErr;
-  _Notify_list_t *temp =  Notify_list[notify_type];
-  _Notify_list_t *notify = (_Notify_list_t *)malloc(sizeof(_Notify_list_t));
-  require_action(notify, exit, err = kNoMemoryErr);
-  notify->function = functionAddress;
-  notify->next = NULL;
-  if(Notify_list[notify_type] == NULL){
-    Notify_list[notify_type] = notify;
-    notify->next = NULL;
-  }else{
-    if(temp->function == functionAddress)
-        return kNoErr;   //Nodify already exist
-    while(temp->next!=NULL){
-      temp = temp->next;
-      if(temp->function == functionAddress)
-        return kNoErr;   //Nodify already exist
-    }
-    temp->next = notify;
+  _notify_subscribers_t *subscribers;
+  int i, insert;
+
+  require_action(notify_type < MICO_NOTIFY_TYPE_MAX && functionAddress, exit, err = kParamErr);
+  require_action(_notify_mutex, exit, err = kNotInitializedErr);
+  /* The caller reads the result back from the buffer, so it cannot wait */
+  require_action(!(notify_type == mico_notify_READ_APP_INFO && delivery == MICO_NOTIFY_DEFERRED), exit, err = kUnsupportedErr);
+
+  mico_rtos_lock_mutex(&_notify_mutex);
+  subscribers = &_notify_table[notify_type];
+
+  for(i = 0; i < subscribers->count; i++){
+    if(subscribers->subscriber[i].function == functionAddress)
+      goto unlock;   //Nodify already exist
   }
+  require_action(subscribers->count < MICO_NOTIFY_MAX_SUBSCRIBERS, unlock, err = kNoResourcesErr);
+
+  /* Keep registration order among subscribers of the same priority */
+  for(insert = subscribers->count; insert > 0; insert--){
+    if(subscribers->subscriber[insert-1].priority <= priority)
+      break;
+  }
+
+  seqlock_write_begin(&_notify_lock);
+  for(i = subscribers->count; i > insert; i--)
+    subscribers->subscriber[i] = subscribers->subscriber[i-1];
+  subscribers->subscriber[insert].function = functionAddress;
+  subscribers->subscriber[insert].priority = priority;
+  subscribers->subscriber[insert].delivery = delivery;
+  subscribers->count++;
+  seqlock_write_end(&_notify_lock);
+
+unlock:
+  mico_rtos_unlock_mutex(&_notify_mutex);
 exit:
   return err;
 }
@@ -214,25 +408,30 @@ exit:
 OSStatus MICORemoveNotification( mico_notify_types_t notify_type, void *functionAddress )
 {
   OSStatus err = kNoErr;
-  _Notify_list_t *temp2;
-  _Notify_list_t *temp = Notify_list[notify_type];
-  require_action(Notify_list[notify_type], exit, err = kDeletedErr);
-  do{
-    if(temp->function == functionAddress){
-      if(temp == Notify_list[notify_type]){  //first element
-        Notify_list[notify_type] = Notify_list[notify_type]->next;
-        free(temp);
-      }else{
-        temp2->next = temp->next;
-        free(temp);
-      }
-       break;
-    }
-    require_action(temp->next!=NULL, exit, err = kNotFoundErr);
-    temp2 = temp;
-    temp = temp->next;
-  }while(temp->next!=NULL);
+  _notify_subscribers_t *subscribers;
+  int i;
+
+  require_action(notify_type < MICO_NOTIFY_TYPE_MAX, exit, err = kParamErr);
+  require_action(_notify_mutex, exit, err = kNotInitializedErr);
+
+  mico_rtos_lock_mutex(&_notify_mutex);
+  subscribers = &_notify_table[notify_type];
+  require_action(subscribers->count, unlock, err = kDeletedErr);
+
+  for(i = 0; i < subscribers->count; i++){
+    if(subscribers->subscriber[i].function == functionAddress)
+      break;
+  }
+  require_action(i < subscribers->count, unlock, err = kNotFoundErr);
+
+  seqlock_write_begin(&_notify_lock);
+  for(; i < subscribers->count - 1; i++)
+    subscribers->subscriber[i] = subscribers->subscriber[i+1];
+  subscribers->count--;
+  seqlock_write_end(&_notify_lock);
 
+unlock:
+  mico_rtos_unlock_mutex(&_notify_mutex);
 exit:
   return err;
 }
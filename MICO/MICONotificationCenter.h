@@ -49,17 +49,33 @@ typedef enum{
   mico_notify_DNS_RESOLVE_COMPLETED,        //void (*function)(char *str, int len, mico_Context_t * const inContext);
   mico_notify_READ_APP_INFO,                //void (*function)(int fd, mico_Context_t * const inContext);
   mico_notify_SYS_WILL_POWER_OFF,           //void (*function)(mico_Context_t * const inContext);
+  mico_notify_CONNECTION_STATE_CHANGED,     //void (*function)(mico_connection_t *connection, mico_connection_state_t state, mico_Context_t * const inContext);
   
   /* User defined notifications */
 
 } mico_notify_types_t;
 
+/* How a subscriber is called: inline on the raising driver thread, or later
+   from the default worker thread with a private copy of the data */
+typedef enum{
+  MICO_NOTIFY_INLINE,
+  MICO_NOTIFY_DEFERRED,
+} mico_notify_delivery_t;
+
+#define MICO_NOTIFY_MAX_SUBSCRIBERS       8
+#define MICO_NOTIFY_DEFAULT_PRIORITY      5   //Subscribers with lower value are called first
+
 OSStatus MICOInitNotificationCenter   ( void * const inContext );
 
 OSStatus MICOAddNotification          ( mico_notify_types_t notify_type, void *functionAddress );
 
+OSStatus MICOAddNotificationWithPriority ( mico_notify_types_t notify_type, void *functionAddress, uint8_t priority, mico_notify_delivery_t delivery );
+
 OSStatus MICORemoveNotification       ( mico_notify_types_t notify_type, void *functionAddress );
 
+/* Raised by MICO components, not by the Wi-Fi driver */
+void sendNotifyConnectionStateChanged ( void *connection, int state );
+
 
 #endif
 
@@ -41,6 +41,8 @@ OSStatus MICORestoreDefault(mico_Context_t *inContext)
   paraEndAddress = PARA_END_ADDRESS;
 
   /*wlan configration is not need to change to a default state, use easylink to do that*/
+  mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   sprintf(inContext->flashContentInRam.micoSystemConfig.name, DEFAULT_NAME);
   inContext->flashContentInRam.micoSystemConfig.configured = unConfigured;
   inContext->flashContentInRam.micoSystemConfig.rfPowerSaveEnable = false;
@@ -53,6 +55,7 @@ OSStatus MICORestoreDefault(mico_Context_t *inContext)
   inContext->flashContentInRam.appConfig.configDataVer = CONFIGURATION_VERSION;
   inContext->flashContentInRam.appConfig.localServerPort = LOCAL_PORT;
   appRestoreDefault_callback(inContext);
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
 
   err = PlatformFlashInitialize();
   require_noerr(err, exit);
@@ -64,6 +67,7 @@ OSStatus MICORestoreDefault(mico_Context_t *inContext)
   require_noerr(err, exit);
 
 exit:
+  mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
   return err;
 }
 
@@ -83,10 +87,10 @@ OSStatus MICOReadConfiguration(mico_Context_t *inContext)
   }
 
   if(inContext->flashContentInRam.micoSystemConfig.dhcpEnable == DHCP_Disable){
-    strcpy((char *)inContext->micoStatus.localIp, inContext->flashContentInRam.micoSystemConfig.localIp);
-    strcpy((char *)inContext->micoStatus.netMask, inContext->flashContentInRam.micoSystemConfig.netMask);
-    strcpy((char *)inContext->micoStatus.gateWay, inContext->flashContentInRam.micoSystemConfig.gateWay);
-    strcpy((char *)inContext->micoStatus.dnsServer, inContext->flashContentInRam.micoSystemConfig.dnsServer);
+    MICOSetNetStatus(inContext, inContext->flashContentInRam.micoSystemConfig.localIp,
+                                inContext->flashContentInRam.micoSystemConfig.netMask,
+                                inContext->flashContentInRam.micoSystemConfig.gateWay,
+                                inContext->flashContentInRam.micoSystemConfig.dnsServer);
   }
 
 exit: 
@@ -101,7 +105,9 @@ OSStatus MICOUpdateConfiguration(mico_Context_t *inContext)
   paraStartAddress = PARA_START_ADDRESS;
   paraEndAddress = PARA_END_ADDRESS;
 
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   inContext->flashContentInRam.micoSystemConfig.seed = ++seedNum;
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
   err = PlatformFlashInitialize();
   require_noerr(err, exit);
   err = PlatformFlashErase(paraStartAddress, paraEndAddress);
@@ -116,3 +122,25 @@ exit:
 }
 
 
+void MICOGetConfiguration(mico_Context_t * const inContext, flash_content_t *outConfig)
+{
+  seqlock_read_copy(&inContext->flashContentInRam_seqlock, outConfig, &inContext->flashContentInRam, sizeof(flash_content_t));
+}
+
+void MICOGetStatus(mico_Context_t * const inContext, current_mico_status_t *outStatus)
+{
+  seqlock_read_copy(&inContext->micoStatus_seqlock, outStatus, &inContext->micoStatus, sizeof(current_mico_status_t));
+}
+
+/* IP addresses are only written from the DHCP notification and at start up,
+   so writers need no serialization of their own */
+void MICOSetNetStatus(mico_Context_t * const inContext, const char *inIp, const char *inMask, const char *inGateway, const char *inDns)
+{
+  seqlock_write_begin(&inContext->micoStatus_seqlock);
+  strncpy(inContext->micoStatus.localIp, inIp, maxIpLen);
+  strncpy(inContext->micoStatus.netMask, inMask, maxIpLen);
+  strncpy(inContext->micoStatus.gateWay, inGateway, maxIpLen);
+  strncpy(inContext->micoStatus.dnsServer, inDns, maxIpLen);
+  seqlock_write_end(&inContext->micoStatus_seqlock);
+}
+
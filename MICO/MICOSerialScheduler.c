@@ -0,0 +1,376 @@
+/**
+  ******************************************************************************
+  * @file    MICOSerialScheduler.c
+  * @author  William Xu
+  * @version V1.0.0
+  * @date    05-May-2014
+  * @brief   This file provides a fair scheduler for data written to the UART
+  *          by several network clients.
+  ******************************************************************************
+  * @attention
+  *
+  * THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+  * WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+  * TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+  * DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+  * FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+  * CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+  *
+  * <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+  ******************************************************************************
+  */
+
+#include "MICO.h"
+#include "MICODefine.h"
+#include "MICOSerialScheduler.h"
+#include "PlatformUart.h"
+#include "TokenBucketUtils.h"
+
+#define scheduler_log(M, ...) custom_log("Serial Scheduler", M, ##__VA_ARGS__)
+#define scheduler_log_trace() custom_log_trace("Serial Scheduler")
+
+#define SCHEDULER_MIN_QUANTUM       64
+#define SCHEDULER_STACK_SIZE        0x300
+#define SCHEDULER_FLUSH_POLL        10
+
+typedef struct _serial_chunk_t {
+  struct _serial_chunk_t  *next;
+  uint32_t                queued;       //mico_get_time() when the chunk was queued
+  uint32_t                len;
+  mico_serial_class_t     trafficClass;
+  uint8_t                 data[1];
+} _serial_chunk_t;
+
+typedef struct _serial_lane_t {
+  _serial_chunk_t         *head;
+  _serial_chunk_t         *tail;
+  uint32_t                queuedBytes;
+} _serial_lane_t;
+
+typedef struct _serial_client_t {
+  bool                    inUse;
+  bool                    closing;      //Released once the queues are empty
+  int                     id;
+  _serial_lane_t          lanes[MICO_SERIAL_CLASS_NUM];
+  uint32_t                deficit;      //Bulk lane only
+  token_bucket_t          bucket;
+} _serial_client_t;
+
+static mico_serial_scheduler_config_t _config;
+static _serial_client_t _clients[MICO_SERIAL_MAX_CLIENTS];
+static token_bucket_t   _uart_bucket;
+static mico_mutex_t     _mutex = NULL;
+static mico_semaphore_t _wakeup = NULL;
+static int              _current = 0;       //Client visited by the bulk round robin
+static bool             _topped = false;    //_current already got its quantum on this visit
+static int              _control_next = 0;  //Client looked at first for control data
+static bool             _writing = false;   //A dequeued chunk is on its way to the UART
+static uint32_t         _queued_total[MICO_SERIAL_CLASS_NUM];
+static mico_serial_scheduler_stats_t _stats;
+static uint32_t         _delay_total[MICO_SERIAL_CLASS_NUM];
+static uint32_t         _delay_count[MICO_SERIAL_CLASS_NUM];
+
+static void _next_client(void)
+{
+  _current = (_current + 1) % MICO_SERIAL_MAX_CLIENTS;
+  _topped = false;
+}
+
+static _serial_client_t *_find_client(int inClient)
+{
+  int i;
+
+  for(i = 0; i < MICO_SERIAL_MAX_CLIENTS; i++){
+    if(_clients[i].inUse && _clients[i].closing == false && _clients[i].id == inClient)
+      return &_clients[i];
+  }
+  return NULL;
+}
+
+static _serial_chunk_t *_pop(_serial_client_t *inClient, mico_serial_class_t inClass)
+{
+  _serial_lane_t *lane = &inClient->lanes[inClass];
+  _serial_chunk_t *chunk = lane->head;
+
+  lane->head = chunk->next;
+  if(lane->head == NULL)
+    lane->tail = NULL;
+  lane->queuedBytes -= chunk->len;
+  _queued_total[inClass] -= chunk->len;
+
+  token_bucket_consume(&inClient->bucket, chunk->len);
+  token_bucket_consume(&_uart_bucket, chunk->len);
+
+  if(inClient->closing && inClient->lanes[MICO_SERIAL_CONTROL].head == NULL && inClient->lanes[MICO_SERIAL_BULK].head == NULL)
+    inClient->inUse = false;
+  return chunk;
+}
+
+/* Control data is taken round robin from every client regardless of its
+   rate, so it only ever waits for the chunk being written. */
+static _serial_chunk_t *_dequeue_control(void)
+{
+  _serial_client_t *client;
+  int i, index;
+
+  for(i = 0; i < MICO_SERIAL_MAX_CLIENTS; i++){
+    index = (_control_next + i) % MICO_SERIAL_MAX_CLIENTS;
+    client = &_clients[index];
+    if(client->inUse && client->lanes[MICO_SERIAL_CONTROL].head){
+      _control_next = (index + 1) % MICO_SERIAL_MAX_CLIENTS;
+      return _pop(client, MICO_SERIAL_CONTROL);
+    }
+  }
+  return NULL;
+}
+
+/* Deficit round robin, a client keeps the UART while its deficit covers the
+   next chunk. Returns NULL and the time to wait when nothing may be sent. */
+static _serial_chunk_t *_dequeue(uint32_t *outWait)
+{
+  _serial_client_t *client;
+  _serial_lane_t *lane;
+  _serial_chunk_t *chunk;
+  uint32_t now = mico_get_time();
+  uint32_t delay;
+  bool eligible = false;
+  int visited = 0;
+
+  *outWait = MICO_WAIT_FOREVER;
+  if(_queued_total[MICO_SERIAL_CONTROL] == 0 && _queued_total[MICO_SERIAL_BULK] == 0)
+    return NULL;
+
+  delay = token_bucket_delay(&_uart_bucket, now);
+  if(delay){
+    *outWait = delay;
+    return NULL;
+  }
+
+  if(_queued_total[MICO_SERIAL_CONTROL])
+    return _dequeue_control();
+
+  while(1){
+    client = &_clients[_current];
+    lane = &client->lanes[MICO_SERIAL_BULK];
+
+    if(client->inUse && lane->head){
+      delay = token_bucket_delay(&client->bucket, now);
+      if(delay){
+        *outWait = Min(*outWait, delay);
+      }else{
+        eligible = true;
+        if(_topped == false){
+          client->deficit += _config.quantum;
+          _topped = true;
+        }
+        if(lane->head->len <= client->deficit){
+          client->deficit -= lane->head->len;
+          if(lane->head->next == NULL){
+            client->deficit = 0;
+            _next_client();
+          }
+          chunk = _pop(client, MICO_SERIAL_BULK);
+          return chunk;
+        }
+      }
+    }else if(client->inUse){
+      client->deficit = 0;
+    }
+
+    _next_client();
+    /* A full pass where every queued client was rate limited */
+    if(++visited % MICO_SERIAL_MAX_CLIENTS == 0 && eligible == false)
+      return NULL;
+  }
+}
+
+static void _scheduler_thread(void *inArg)
+{
+  _serial_chunk_t *chunk;
+  uint32_t wait, delay;
+  (void)inArg;
+
+  while(1){
+    mico_rtos_lock_mutex(&_mutex);
+    chunk = _dequeue(&wait);
+    _writing = (chunk != NULL);
+    mico_rtos_unlock_mutex(&_mutex);
+
+    if(chunk == NULL){
+      mico_rtos_get_semaphore(&_wakeup, wait);
+      continue;
+    }
+
+    PlatformUartSend(chunk->data, chunk->len);
+
+    delay = mico_get_time() - chunk->queued;
+    mico_rtos_lock_mutex(&_mutex);
+    _writing = false;
+    _stats.sent += chunk->len;
+    if(chunk->trafficClass == MICO_SERIAL_CONTROL)
+      _stats.controlMaxDelay_ms = Max(_stats.controlMaxDelay_ms, delay);
+    else
+      _stats.maxDelay_ms = Max(_stats.maxDelay_ms, delay);
+    _delay_total[chunk->trafficClass] += delay;
+    _delay_count[chunk->trafficClass]++;
+    mico_rtos_unlock_mutex(&_mutex);
+    free(chunk);
+  }
+}
+
+OSStatus MICOSerialSchedulerInit( const mico_serial_scheduler_config_t *inConfig )
+{
+  OSStatus err = kNoErr;
+  scheduler_log_trace();
+
+  require_action(_mutex == NULL, exit, err = kAlreadyInitializedErr);
+
+  memcpy(&_config, inConfig, sizeof(mico_serial_scheduler_config_t));
+  _config.quantum = Max(_config.quantum, SCHEDULER_MIN_QUANTUM);
+  memset(_clients, 0x0, sizeof(_clients));
+  memset(&_stats, 0x0, sizeof(_stats));
+  memset(_queued_total, 0x0, sizeof(_queued_total));
+  memset(_delay_total, 0x0, sizeof(_delay_total));
+  memset(_delay_count, 0x0, sizeof(_delay_count));
+  token_bucket_init(&_uart_bucket, _config.uartRate, _config.uartBurst, mico_get_time());
+
+  err = mico_rtos_init_semaphore(&_wakeup, 1);
+  require_noerr(err, exit);
+  err = mico_rtos_init_mutex(&_mutex);
+  require_noerr(err, exit);
+
+  err = mico_rtos_create_thread(NULL, MICO_APPLICATION_PRIORITY, "Serial Scheduler", _scheduler_thread, SCHEDULER_STACK_SIZE, NULL);
+  require_noerr_action(err, exit, scheduler_log("ERROR: Unable to start the serial scheduler thread."));
+
+exit:
+  return err;
+}
+
+OSStatus MICOSerialSchedulerSend( int inClient, mico_serial_class_t inClass, const uint8_t *inData, uint32_t inLen )
+{
+  OSStatus err = kNoErr;
+  _serial_client_t *client = NULL;
+  _serial_lane_t *lane;
+  _serial_chunk_t *chunk;
+  int i;
+
+  require_action(_mutex, exit, err = kNotInitializedErr);
+  require_action(inClass < MICO_SERIAL_CLASS_NUM, exit, err = kParamErr);
+  require_quiet(inLen, exit);
+
+  mico_rtos_lock_mutex(&_mutex);
+  client = _find_client(inClient);
+  for(i = 0; client == NULL && i < MICO_SERIAL_MAX_CLIENTS; i++){
+    if(_clients[i].inUse == false)
+      client = &_clients[i];
+  }
+  require_action(client, unlock, err = kNoResourcesErr);
+
+  if(client->inUse == false){
+    memset(client, 0x0, sizeof(_serial_client_t));
+    client->inUse = true;
+    client->id = inClient;
+    token_bucket_init(&client->bucket, _config.clientRate, _config.clientBurst, mico_get_time());
+  }
+
+  lane = &client->lanes[inClass];
+  if(lane->queuedBytes + inLen > _config.clientQueueLen){
+    _stats.dropped += inLen;
+    err = kNoSpaceErr;
+    goto unlock;
+  }
+
+  chunk = malloc(sizeof(_serial_chunk_t) + inLen);
+  require_action(chunk, unlock, err = kNoMemoryErr);
+  chunk->next = NULL;
+  chunk->queued = mico_get_time();
+  chunk->len = inLen;
+  chunk->trafficClass = inClass;
+  memcpy(chunk->data, inData, inLen);
+
+  if(lane->tail)
+    lane->tail->next = chunk;
+  else
+    lane->head = chunk;
+  lane->tail = chunk;
+  lane->queuedBytes += inLen;
+  _queued_total[inClass] += inLen;
+
+unlock:
+  mico_rtos_unlock_mutex(&_mutex);
+  if(err == kNoErr)
+    mico_rtos_set_semaphore(&_wakeup);
+exit:
+  return err;
+}
+
+void MICOSerialSchedulerClose( int inClient )
+{
+  _serial_client_t *client;
+
+  if(_mutex == NULL)
+    return;
+
+  mico_rtos_lock_mutex(&_mutex);
+  client = _find_client(inClient);
+  if(client){
+    if(client->lanes[MICO_SERIAL_CONTROL].head || client->lanes[MICO_SERIAL_BULK].head)
+      client->closing = true;
+    else
+      client->inUse = false;
+  }
+  mico_rtos_unlock_mutex(&_mutex);
+}
+
+OSStatus MICOSerialSchedulerFlush( uint32_t inTimeout )
+{
+  OSStatus err = kNoErr;
+  uint32_t start = mico_get_time();
+  bool empty;
+
+  require_action(_mutex, exit, err = kNotInitializedErr);
+
+  while(1){
+    mico_rtos_lock_mutex(&_mutex);
+    empty = _queued_total[MICO_SERIAL_CONTROL] == 0 && _queued_total[MICO_SERIAL_BULK] == 0 && _writing == false;
+    mico_rtos_unlock_mutex(&_mutex);
+    if(empty)
+      break;
+    require_action(mico_get_time() - start < inTimeout, exit, err = kTimeoutErr);
+    mico_thread_msleep(SCHEDULER_FLUSH_POLL);
+  }
+
+exit:
+  return err;
+}
+
+uint32_t MICOSerialSchedulerQueued( int inClient )
+{
+  _serial_client_t *client;
+  uint32_t queued = 0;
+
+  if(_mutex == NULL)
+    return 0;
+
+  mico_rtos_lock_mutex(&_mutex);
+  client = _find_client(inClient);
+  if(client)
+    queued = Max(client->lanes[MICO_SERIAL_CONTROL].queuedBytes, client->lanes[MICO_SERIAL_BULK].queuedBytes);
+  mico_rtos_unlock_mutex(&_mutex);
+  return queued;
+}
+
+void MICOSerialSchedulerStatistics( mico_serial_scheduler_stats_t *outStats )
+{
+  if(_mutex == NULL){
+    memset(outStats, 0x0, sizeof(mico_serial_scheduler_stats_t));
+    return;
+  }
+
+  mico_rtos_lock_mutex(&_mutex);
+  memcpy(outStats, &_stats, sizeof(mico_serial_scheduler_stats_t));
+  outStats->avgDelay_ms = _delay_count[MICO_SERIAL_BULK] ? _delay_total[MICO_SERIAL_BULK] / _delay_count[MICO_SERIAL_BULK] : 0;
+  outStats->controlAvgDelay_ms = _delay_count[MICO_SERIAL_CONTROL] ? _delay_total[MICO_SERIAL_CONTROL] / _delay_count[MICO_SERIAL_CONTROL] : 0;
+  mico_rtos_unlock_mutex(&_mutex);
+}
+
@@ -0,0 +1,80 @@
+/**
+  ******************************************************************************
+  * @file    MICOSerialScheduler.h
+  * @author  William Xu
+  * @version V1.0.0
+  * @date    05-May-2014
+  * @brief   This file provides a fair scheduler for data written to the UART
+  *          by several network clients.
+  ******************************************************************************
+  * @attention
+  *
+  * THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+  * WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+  * TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+  * DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+  * FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+  * CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+  *
+  * <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+  ******************************************************************************
+  */
+
+#ifndef __MICOSERIALSCHEDULER_H__
+#define __MICOSERIALSCHEDULER_H__
+
+#include "Common.h"
+
+#define MICO_SERIAL_MAX_CLIENTS     10
+#define MICO_SERIAL_LOCAL_CLIENT    (-1)  //Writes made by the module itself
+
+typedef enum {
+  MICO_SERIAL_CONTROL,              //Served before any bulk data, not shaped per client
+  MICO_SERIAL_BULK,
+  MICO_SERIAL_CLASS_NUM,
+} mico_serial_class_t;
+
+typedef struct _mico_serial_scheduler_config {
+  uint32_t    uartRate;             //Bytes per second for the UART as a whole, 0 for no limit
+  uint32_t    uartBurst;
+  uint32_t    clientRate;           //Bytes per second for each client, 0 for no limit
+  uint32_t    clientBurst;
+  uint32_t    quantum;              //Bytes a client may send per round
+  uint32_t    clientQueueLen;       //Bytes queued per client and class before writes are dropped
+} mico_serial_scheduler_config_t;
+
+typedef struct _mico_serial_scheduler_stats {
+  uint32_t    sent;                 //Bytes written to the UART
+  uint32_t    dropped;              //Bytes refused because a client queue was full
+  uint32_t    maxDelay_ms;          //Longest time a bulk write was queued
+  uint32_t    avgDelay_ms;
+  uint32_t    controlMaxDelay_ms;
+  uint32_t    controlAvgDelay_ms;
+} mico_serial_scheduler_stats_t;
+
+/* Start the thread that owns the UART transmit side */
+OSStatus MICOSerialSchedulerInit        ( const mico_serial_scheduler_config_t *inConfig );
+
+/* Queue data from inClient, any id that is unique among the live clients,
+   kNoSpaceErr if its queue is full. Control data of all clients goes first,
+   bulk data is served round robin with a deficit so that large writes do
+   not get a larger share. */
+OSStatus MICOSerialSchedulerSend        ( int inClient, mico_serial_class_t inClass, const uint8_t *inData, uint32_t inLen );
+
+/* Forget inClient once what it queued was written, its id may be reused by
+   a new client right away */
+void     MICOSerialSchedulerClose       ( int inClient );
+
+/* Bytes in the fuller of inClient's queues, a client can stop reading its
+   socket while this is close to clientQueueLen instead of having writes
+   dropped */
+uint32_t MICOSerialSchedulerQueued      ( int inClient );
+
+/* Wait until everything queued was written, kTimeoutErr if the clients keep
+   the queues busy for longer than inTimeout ms */
+OSStatus MICOSerialSchedulerFlush       ( uint32_t inTimeout );
+
+void     MICOSerialSchedulerStatistics  ( mico_serial_scheduler_stats_t *outStats );
+
+#endif
+
@@ -0,0 +1,327 @@
+/**
+  ******************************************************************************
+  * @file    MICOStoreForward.c
+  * @author  William Xu
+  * @version V1.0.0
+  * @date    05-May-2014
+  * @brief   This file provides a bounded store-and-forward queue that keeps
+  *          data while a link is down and replays it in order afterwards.
+  ******************************************************************************
+  * @attention
+  *
+  * THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+  * WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+  * TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+  * DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+  * FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+  * CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+  *
+  * <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+  ******************************************************************************
+  */
+
+#include "MICO.h"
+#include "MICOStoreForward.h"
+#include "PlatformFlash.h"
+
+#define sf_log(M, ...) custom_log("StoreForward", M, ##__VA_ARGS__)
+#define sf_log_trace() custom_log_trace("StoreForward")
+
+/* Flash log record: state word, header, data padded to a word. A record is
+   written with the state left erased and validated last, so a record torn by
+   a reset is never replayed. Replayed records are cleared to 0 in place, the
+   sector is only erased once every record has been replayed. */
+#define SF_FLASH_ERASED             0xFFFFFFFFUL
+#define SF_FLASH_VALID              0x53460001UL
+#define SF_FLASH_CONSUMED           0x00000000UL
+#define SF_FLASH_RECORD_LEN(len)    (4 + sizeof(mico_sf_record_t) + (((len) + 3) & ~3UL))
+#define SF_FLASH_LOG_END            (STORE_FORWARD_END_ADDRESS + 1)
+
+#define SF_RAM_RECORD_LEN(len)      (sizeof(mico_sf_record_t) + (len))
+
+static bool _flash_log_owned = false;
+
+static void _ram_read(mico_store_forward_t *inQueue, uint32_t inOffset, void *outData, uint32_t inLen)
+{
+  uint32_t first;
+
+  inOffset %= inQueue->config.ramSize;
+  first = Min(inLen, inQueue->config.ramSize - inOffset);
+  memcpy(outData, inQueue->buffer + inOffset, first);
+  memcpy((uint8_t *)outData + first, inQueue->buffer, inLen - first);
+}
+
+static void _ram_write(mico_store_forward_t *inQueue, uint32_t inOffset, const void *inData, uint32_t inLen)
+{
+  uint32_t first;
+
+  inOffset %= inQueue->config.ramSize;
+  first = Min(inLen, inQueue->config.ramSize - inOffset);
+  memcpy(inQueue->buffer + inOffset, inData, first);
+  memcpy(inQueue->buffer, (const uint8_t *)inData + first, inLen - first);
+}
+
+static void _ram_drop(mico_store_forward_t *inQueue)
+{
+  mico_sf_record_t record;
+
+  _ram_read(inQueue, inQueue->head, &record, sizeof(record));
+  inQueue->head = (inQueue->head + SF_RAM_RECORD_LEN(record.len)) % inQueue->config.ramSize;
+  inQueue->used -= SF_RAM_RECORD_LEN(record.len);
+  inQueue->count--;
+}
+
+static void _flash_reset(mico_store_forward_t *inQueue)
+{
+  OSStatus err;
+
+  if(inQueue->flashWrite == STORE_FORWARD_START_ADDRESS)
+    return;
+
+  /* Stalls the CPU for the duration of a sector erase */
+  PlatformFlashInitialize();
+  err = PlatformFlashErase(STORE_FORWARD_START_ADDRESS, STORE_FORWARD_END_ADDRESS);
+  PlatformFlashFinalize();
+
+  inQueue->flashRead = STORE_FORWARD_START_ADDRESS;
+  inQueue->flashWrite = (err == kNoErr) ? STORE_FORWARD_START_ADDRESS : SF_FLASH_LOG_END;
+  if(err != kNoErr)
+    sf_log("Erase flash log failed, err = %d", err);
+}
+
+/* Find the records left by a previous run. Anything that does not parse ends
+   the log, it is not appended to again until it has been drained. */
+static void _flash_scan(mico_store_forward_t *inQueue)
+{
+  uint32_t addr = STORE_FORWARD_START_ADDRESS;
+  uint32_t state;
+  mico_sf_record_t *record;
+  bool clean = true;
+
+  inQueue->flashRead = addr;
+  while(addr + SF_FLASH_RECORD_LEN(0) <= SF_FLASH_LOG_END){
+    state = *(uint32_t *)addr;
+    record = (mico_sf_record_t *)(addr + 4);
+    if(state == SF_FLASH_ERASED){
+      clean = (*(uint32_t *)record == SF_FLASH_ERASED);
+      break;
+    }
+    if((state != SF_FLASH_VALID && state != SF_FLASH_CONSUMED) || record->len == 0 ||
+       record->len > MICO_SF_MAX_RECORD_LEN || addr + SF_FLASH_RECORD_LEN(record->len) > SF_FLASH_LOG_END){
+      clean = false;
+      break;
+    }
+    if(state == SF_FLASH_VALID){
+      if(inQueue->flashCount == 0)
+        inQueue->flashRead = addr;
+      inQueue->flashCount++;
+      inQueue->nextSeq = record->seq + 1;
+    }
+    addr += SF_FLASH_RECORD_LEN(record->len);
+  }
+  inQueue->flashWrite = clean ? addr : SF_FLASH_LOG_END;
+
+  if(inQueue->flashCount == 0)
+    _flash_reset(inQueue);
+  else
+    sf_log("%d records recovered from flash", inQueue->flashCount);
+}
+
+/* Move the oldest RAM record to the end of the flash log */
+static OSStatus _flash_spill(mico_store_forward_t *inQueue)
+{
+  OSStatus err = kNoErr;
+  mico_sf_record_t record;
+  uint32_t addr, data, first;
+  uint32_t state = SF_FLASH_VALID;
+
+  _ram_read(inQueue, inQueue->head, &record, sizeof(record));
+  require_action_quiet(inQueue->flashWrite + SF_FLASH_RECORD_LEN(record.len) <= SF_FLASH_LOG_END, exit, err = kNoSpaceErr);
+
+  data = (inQueue->head + sizeof(record)) % inQueue->config.ramSize;
+  first = Min(record.len, inQueue->config.ramSize - data);
+
+  PlatformFlashInitialize();
+  addr = inQueue->flashWrite + 4;
+  err = PlatformFlashWrite(&addr, (uint32_t *)&record, sizeof(record));
+  require_noerr(err, finalize);
+  err = PlatformFlashWrite(&addr, (uint32_t *)(inQueue->buffer + data), first);
+  require_noerr(err, finalize);
+  if(first < record.len){
+    err = PlatformFlashWrite(&addr, (uint32_t *)inQueue->buffer, record.len - first);
+    require_noerr(err, finalize);
+  }
+  addr = inQueue->flashWrite;
+  err = PlatformFlashWrite(&addr, &state, sizeof(state));
+
+finalize:
+  PlatformFlashFinalize();
+  if(err != kNoErr){
+    /* Stop appending behind a torn record */
+    inQueue->flashWrite = SF_FLASH_LOG_END;
+    goto exit;
+  }
+
+  if(inQueue->flashCount == 0)
+    inQueue->flashRead = inQueue->flashWrite;
+  inQueue->flashWrite += SF_FLASH_RECORD_LEN(record.len);
+  inQueue->flashCount++;
+  inQueue->spilled++;
+  _ram_drop(inQueue);
+
+exit:
+  return err;
+}
+
+static void _flash_consume(mico_store_forward_t *inQueue)
+{
+  mico_sf_record_t *record = (mico_sf_record_t *)(inQueue->flashRead + 4);
+  uint32_t addr = inQueue->flashRead;
+  uint32_t state = SF_FLASH_CONSUMED;
+
+  PlatformFlashInitialize();
+  PlatformFlashWrite(&addr, &state, sizeof(state));
+  PlatformFlashFinalize();
+
+  inQueue->flashRead += SF_FLASH_RECORD_LEN(record->len);
+  inQueue->flashCount--;
+  if(inQueue->flashCount == 0)
+    _flash_reset(inQueue);
+}
+
+OSStatus MICOStoreForwardInit( mico_store_forward_t *inQueue, const mico_sf_config_t *inConfig )
+{
+  OSStatus err = kNoErr;
+
+  memset(inQueue, 0x0, sizeof(mico_store_forward_t));
+  memcpy(&inQueue->config, inConfig, sizeof(mico_sf_config_t));
+  require_action(inConfig->ramSize > sizeof(mico_sf_record_t), exit, err = kParamErr);
+
+  err = mico_rtos_init_mutex(&inQueue->mutex);
+  require_noerr(err, exit);
+
+  inQueue->buffer = malloc(inConfig->ramSize);
+  require_action(inQueue->buffer, exit, err = kNoMemoryErr);
+  inQueue->scratch = malloc(SF_RAM_RECORD_LEN(MICO_SF_MAX_RECORD_LEN));
+  require_action(inQueue->scratch, exit, err = kNoMemoryErr);
+
+  if(inConfig->flashSpill){
+    if(_flash_log_owned){
+      sf_log("Flash log is owned by another queue, RAM only");
+    }else{
+      _flash_log_owned = true;
+      inQueue->flashOwner = true;
+      _flash_scan(inQueue);
+    }
+  }
+
+exit:
+  if(err != kNoErr){
+    if(inQueue->buffer) free(inQueue->buffer);
+    if(inQueue->scratch) free(inQueue->scratch);
+    inQueue->buffer = NULL;
+    inQueue->scratch = NULL;
+  }
+  return err;
+}
+
+OSStatus MICOStoreForwardPush( mico_store_forward_t *inQueue, const uint8_t *inData, uint16_t inLen )
+{
+  OSStatus err = kNoErr;
+  mico_sf_record_t record;
+
+  require_action(inQueue->buffer, exit, err = kNotInitializedErr);
+  require_action(inLen > 0 && inLen <= MICO_SF_MAX_RECORD_LEN && SF_RAM_RECORD_LEN(inLen) <= inQueue->config.ramSize, exit, err = kSizeErr);
+
+  mico_rtos_lock_mutex(&inQueue->mutex);
+  while(inQueue->used + SF_RAM_RECORD_LEN(inLen) > inQueue->config.ramSize){
+    if(inQueue->flashOwner && _flash_spill(inQueue) == kNoErr)
+      continue;
+    if(inQueue->config.overflow == MICO_SF_DROP_NEWEST){
+      /* Still takes a sequence number, the gap shows up on replay */
+      inQueue->nextSeq++;
+      inQueue->dropped++;
+      err = kNoSpaceErr;
+      goto unlock;
+    }
+    _ram_drop(inQueue);
+    inQueue->dropped++;
+  }
+
+  record.seq = inQueue->nextSeq++;
+  record.timestamp = mico_get_time();
+  record.len = inLen;
+  record.reserved = 0;
+  _ram_write(inQueue, inQueue->head + inQueue->used, &record, sizeof(record));
+  _ram_write(inQueue, inQueue->head + inQueue->used + sizeof(record), inData, inLen);
+  inQueue->used += SF_RAM_RECORD_LEN(inLen);
+  inQueue->count++;
+  inQueue->stored++;
+
+unlock:
+  mico_rtos_unlock_mutex(&inQueue->mutex);
+exit:
+  return err;
+}
+
+OSStatus MICOStoreForwardReplay( mico_store_forward_t *inQueue, mico_sf_send_t inSend, void *inArg )
+{
+  OSStatus err = kNoErr;
+  mico_sf_record_t *record = (mico_sf_record_t *)inQueue->scratch;
+  mico_sf_record_t head;
+  uint32_t seq;
+  bool fromFlash;
+
+  require_action(inQueue->buffer, exit, err = kNotInitializedErr);
+
+  while(1){
+    /* Flash holds the older records, RAM the newer ones */
+    mico_rtos_lock_mutex(&inQueue->mutex);
+    if(inQueue->flashCount > 0){
+      fromFlash = true;
+      memcpy(inQueue->scratch, (void *)(inQueue->flashRead + 4), SF_RAM_RECORD_LEN(((mico_sf_record_t *)(inQueue->flashRead + 4))->len));
+    }else if(inQueue->count > 0){
+      fromFlash = false;
+      _ram_read(inQueue, inQueue->head, inQueue->scratch, sizeof(mico_sf_record_t));
+      _ram_read(inQueue, inQueue->head + sizeof(mico_sf_record_t), inQueue->scratch + sizeof(mico_sf_record_t), record->len);
+    }else{
+      mico_rtos_unlock_mutex(&inQueue->mutex);
+      break;
+    }
+    mico_rtos_unlock_mutex(&inQueue->mutex);
+
+    seq = record->seq;
+    if(inQueue->replayed > 0 && seq != inQueue->lastReplayed + 1)
+      sf_log("%d records lost before seq %d", seq - inQueue->lastReplayed - 1, seq);
+
+    err = inSend(record, inQueue->scratch + sizeof(mico_sf_record_t), inArg);
+    require_noerr_quiet(err, exit);
+
+    /* A RAM record may have been evicted while it was being sent */
+    mico_rtos_lock_mutex(&inQueue->mutex);
+    if(fromFlash){
+      _flash_consume(inQueue);
+    }else if(inQueue->count > 0){
+      _ram_read(inQueue, inQueue->head, &head, sizeof(head));
+      if(head.seq == seq)
+        _ram_drop(inQueue);
+    }
+    inQueue->lastReplayed = seq;
+    inQueue->replayed++;
+    mico_rtos_unlock_mutex(&inQueue->mutex);
+  }
+
+exit:
+  return err;
+}
+
+uint32_t MICOStoreForwardCount( mico_store_forward_t *inQueue )
+{
+  uint32_t count;
+
+  mico_rtos_lock_mutex(&inQueue->mutex);
+  count = inQueue->count + inQueue->flashCount;
+  mico_rtos_unlock_mutex(&inQueue->mutex);
+  return count;
+}
+
@@ -0,0 +1,85 @@
+/**
+  ******************************************************************************
+  * @file    MICOStoreForward.h
+  * @author  William Xu
+  * @version V1.0.0
+  * @date    05-May-2014
+  * @brief   This file provides a bounded store-and-forward queue that keeps
+  *          data while a link is down and replays it in order afterwards.
+  ******************************************************************************
+  * @attention
+  *
+  * THE PRESENT FIRMWARE WHICH IS FOR GUIDANCE ONLY AIMS AT PROVIDING CUSTOMERS
+  * WITH CODING INFORMATION REGARDING THEIR PRODUCTS IN ORDER FOR THEM TO SAVE
+  * TIME. AS A RESULT, MXCHIP Inc. SHALL NOT BE HELD LIABLE FOR ANY
+  * DIRECT, INDIRECT OR CONSEQUENTIAL DAMAGES WITH RESPECT TO ANY CLAIMS ARISING
+  * FROM THE CONTENT OF SUCH FIRMWARE AND/OR THE USE MADE BY CUSTOMERS OF THE
+  * CODING INFORMATION CONTAINED HEREIN IN CONNECTION WITH THEIR PRODUCTS.
+  *
+  * <h2><center>&copy; COPYRIGHT 2014 MXCHIP Inc.</center></h2>
+  ******************************************************************************
+  */
+
+#ifndef __MICOSTOREFORWARD_H__
+#define __MICOSTOREFORWARD_H__
+
+#include "Common.h"
+#include "MICORTOS.h"
+
+#define MICO_SF_MAX_RECORD_LEN      1024
+
+typedef enum {
+  MICO_SF_DROP_OLDEST,              //Evict the oldest record held in RAM
+  MICO_SF_DROP_NEWEST,              //Refuse the record being stored
+} mico_sf_overflow_t;
+
+typedef struct _mico_sf_record {
+  uint32_t            seq;          //Consecutive, a gap on replay means records were dropped
+  uint32_t            timestamp;    //mico_get_time() when the record was stored
+  uint16_t            len;
+  uint16_t            reserved;
+} mico_sf_record_t;
+
+typedef struct _mico_sf_config {
+  uint32_t            ramSize;      //Bytes of RAM, each record also takes a header
+  mico_sf_overflow_t  overflow;
+  bool                flashSpill;   //Move the oldest records to the flash log before the policy applies
+} mico_sf_config_t;
+
+/* Send one replayed record, anything but kNoErr stops the replay and the
+   record is kept for the next one */
+typedef OSStatus (*mico_sf_send_t)( const mico_sf_record_t *inRecord, const uint8_t *inData, void *inArg );
+
+typedef struct _mico_store_forward {
+  mico_sf_config_t    config;
+  mico_mutex_t        mutex;
+  uint8_t             *buffer;      //RAM ring of header + data records
+  uint32_t            head;
+  uint32_t            used;
+  uint32_t            count;
+  uint8_t             *scratch;     //One record, handed to the send callback outside the lock
+  bool                flashOwner;
+  uint32_t            flashRead;    //Oldest valid record in the flash log
+  uint32_t            flashWrite;   //End of the log
+  uint32_t            flashCount;
+  uint32_t            nextSeq;
+  uint32_t            lastReplayed;
+  uint32_t            stored;
+  uint32_t            replayed;
+  uint32_t            dropped;
+  uint32_t            spilled;
+} mico_store_forward_t;
+
+/* Records left in the flash log by a previous run are picked up again, only
+   one queue in the system can own the flash log */
+OSStatus MICOStoreForwardInit   ( mico_store_forward_t *inQueue, const mico_sf_config_t *inConfig );
+
+OSStatus MICOStoreForwardPush   ( mico_store_forward_t *inQueue, const uint8_t *inData, uint16_t inLen );
+
+/* Send every stored record oldest first, from the thread that owns the link */
+OSStatus MICOStoreForwardReplay ( mico_store_forward_t *inQueue, mico_sf_send_t inSend, void *inArg );
+
+uint32_t MICOStoreForwardCount  ( mico_store_forward_t *inQueue );
+
+#endif
+
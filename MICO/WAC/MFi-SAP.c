@@ -11,8 +11,10 @@
 #include "MICO.h"
 #include "MICODefine.h"
 #include "Platform.h"
+#include "PlatformFlash.h"
 #include "MFi-SAP.h"
 #include "HTTPUtils.h"
+#include "BufferPoolUtils.h"
 #include "WACLogging.h"
 #include "MFiSAPServer.h"
 #include "WACTLV.h"
@@ -45,12 +47,8 @@ extern uint8_t App_Available;
 #define http_server_log(M, ...) custom_log("HTTPServer", M, ##__VA_ARGS__)
 #define http_server_log_trace() custom_log_trace("HTTPServer")
 
-static OSStatus _WACServerEngine( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext );
-static OSStatus _HandleState_WaitingForAuthSetupMessage     ( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext);
 static OSStatus _HandleState_HandleAuthSetupMessage         ( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext );
-static OSStatus _HandleState_WaitingForConfigMessage        ( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext );
 static OSStatus _HandleState_HandleConfigMessage            ( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext );
-static OSStatus _HandleState_WaitingForConfiguredMessage    ( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext );
 static OSStatus _HandleState_HandleConfiguredMessage        ( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext );
 
 // WAC HTTP messages
@@ -58,6 +56,17 @@ static OSStatus _HandleState_HandleConfiguredMessage        ( HTTPHeader_t* inHe
 #define kWACURLConfig        "/config"
 #define kWACURLConfigured    "/configured"
 
+static OSStatus _WACAuthSetupRoute  ( int inFd, HTTPHeader_t* inHeader, void *inContext );
+static OSStatus _WACConfigRoute     ( int inFd, HTTPHeader_t* inHeader, void *inContext );
+static OSStatus _WACConfiguredRoute ( int inFd, HTTPHeader_t* inHeader, void *inContext );
+
+static const HTTPRoute_t _wacRoutes[] = {
+    { kWACURLAuth,          kHTTPMethodPOST,    _WACAuthSetupRoute,     NULL },
+    { kWACURLConfig,        kHTTPMethodPOST,    _WACConfigRoute,        NULL },
+    { kWACURLConfigured,    kHTTPMethodPOST,    _WACConfiguredRoute,    NULL },
+};
+static HTTPRouter_t _wacRouter;
+
 char *destinationSSID = NULL;
 char *destinationPSK  = NULL;
 char *accessoryName   = NULL;
@@ -159,8 +168,11 @@ void http_server_thread(void *inContext)
 
   HTTPHeader_t *httpHeader = NULL;
   
-  httpHeader = malloc( sizeof( HTTPHeader_t ) );
+  httpHeader = buffer_pool_alloc( BUFFER_POOL_HTTP, sizeof( HTTPHeader_t ) );
   HTTPHeaderClear( httpHeader );
+  httpHeader->otaMaxLen = MICO_OTA_MAX_LEN;
+  err = HTTPRouterInit( &_wacRouter, _wacRoutes, sizeof( _wacRoutes ) / sizeof( _wacRoutes[0] ) );
+  check_noerr( err );
   
   t.tv_sec = 5;
   t.tv_usec = 0;
@@ -212,12 +224,9 @@ void http_server_thread(void *inContext)
           switch ( err )
           {
             case kNoErr:
-                // Read the rest of the HTTP body if necessary
-                err = SocketReadHTTPBody( connected_socket, httpHeader );
-                require_noerr( err, exit );
                 PrintHTTPHeader(httpHeader);
-                // Call the HTTPServer owner back with the acquired HTTP header
-                err = _WACServerEngine( httpHeader, &client_state, Context );
+                // Read the body and call the handler of the URL
+                err = HTTPRouterDispatch( &_wacRouter, connected_socket, httpHeader, Context );
                 require_noerr( err, exit );
                 // Reuse HTTPHeader
                 HTTPHeaderClear( httpHeader );
@@ -274,66 +283,54 @@ exit:
   }
 }
 
-OSStatus _WACServerEngine(HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext )
+// A message for another step of the exchange closes the connection, any
+// message after the exchange is ignored
+static OSStatus _WACOutOfOrder( const char *inURL )
 {
-    OSStatus    err     = kNoErr;
-
-        switch ( *inState )
-        {
-            case eState_WaitingForAuthSetupMessage:
-                err = _HandleState_WaitingForAuthSetupMessage( inHeader, inState, inContext );
-                require_noerr( err, exit );
-                err = _HandleState_HandleAuthSetupMessage( inHeader, inState, inContext );
-                require_noerr( err, exit );
-            break;
-
-            case eState_WaitingForConfigMessage:
-                err = _HandleState_WaitingForConfigMessage( inHeader, inState, inContext );
-                require_noerr( err, exit );
-                err = _HandleState_HandleConfigMessage( inHeader, inState, inContext );
-                require_noerr( err, exit );
-            break;
-
-            case eState_WaitingForConfiguredMessage:
-                 err = _HandleState_WaitingForConfiguredMessage( inHeader, inState, inContext);
-                 require_noerr( err, exit );
-                 err = _HandleState_HandleConfiguredMessage( inHeader, inState, inContext );
-                 require_noerr( err, exit );
-            break;
-
-            //case eState_Complete:
-            //     err = _HandleState_Complete( inContext, &state );
-            //     require_noerr( err, exit );
-            //wac_log("COMPLETE");
-            //break;
-
-            default:
-                wac_log("STATE ERROR");
-                //err = kStateErr;
-                err = kNoErr;
-                //require( 0, exit );
-        }
-
-exit:
-    return err;
+    if( client_state == eState_WaitingForAuthSetupMessage || client_state == eState_WaitingForConfigMessage ||
+        client_state == eState_WaitingForConfiguredMessage )
+    {
+        wac_log("ERROR: %s received out of order", inURL);
+        return kOrderErr;
+    }
+    wac_log("STATE ERROR");
+    return kNoErr;
 }
 
+static OSStatus _WACAuthSetupRoute( int inFd, HTTPHeader_t* inHeader, void *inContext )
+{
+    wac_log_trace();
+    (void)inFd;
 
+    if( client_state != eState_WaitingForAuthSetupMessage )
+        return _WACOutOfOrder( kWACURLAuth );
+    wac_log("%s received", kWACURLAuth);
+    client_state = eState_HandleAuthSetupMessage;
+    return _HandleState_HandleAuthSetupMessage( inHeader, &client_state, inContext );
+}
 
-static OSStatus _HandleState_WaitingForAuthSetupMessage( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext )
+static OSStatus _WACConfigRoute( int inFd, HTTPHeader_t* inHeader, void *inContext )
 {
     wac_log_trace();
-    OSStatus err = kUnknownErr;
+    (void)inFd;
 
-    // Check that the HTTP URL is the auth setup URL
-    err = HTTPHeaderMatchURL( inHeader, kWACURLAuth );
-    require_noerr_action( err, exit, wac_log("ERROR: received different URL. Expecting: %s ", kWACURLAuth); err = kOrderErr );
+    if( client_state != eState_WaitingForConfigMessage )
+        return _WACOutOfOrder( kWACURLConfig );
+    wac_log("%s received", kWACURLConfig);
+    client_state = eState_HandleConfigMessage;
+    return _HandleState_HandleConfigMessage( inHeader, &client_state, inContext );
+}
 
-    wac_log("%s received", kWACURLAuth);
-    *inState = eState_HandleAuthSetupMessage;
+static OSStatus _WACConfiguredRoute( int inFd, HTTPHeader_t* inHeader, void *inContext )
+{
+    wac_log_trace();
+    (void)inFd;
 
-exit:
-    return err;
+    if( client_state != eState_WaitingForConfiguredMessage )
+        return _WACOutOfOrder( kWACURLConfigured );
+    wac_log("%s received", kWACURLConfigured);
+    client_state = eState_HandleConfiguredMessage;
+    return _HandleState_HandleConfiguredMessage( inHeader, &client_state, inContext );
 }
 
 static OSStatus _HandleState_HandleAuthSetupMessage( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext )
@@ -341,10 +338,6 @@ static OSStatus _HandleState_HandleAuthSetupMessage( HTTPHeader_t* inHeader, _WA
     wac_log_trace();
     OSStatus err = kUnknownErr;
     Boolean mfiSAPComplete;
-    ssize_t sentNum;
-
-    uint8_t *httpResponse = NULL;
-    size_t httpResponseLen = 0;
 
     uint8_t *mfiSAPResponseDataPtr = NULL;
     size_t mfiSAPResponseDataLen = 0;
@@ -364,38 +357,15 @@ static OSStatus _HandleState_HandleAuthSetupMessage( HTTPHeader_t* inHeader, _WA
     require_noerr_action( err, exit, wac_log("ERROR: MFi-SAP Exchange: %d", err) );
     require( mfiSAPComplete, exit );
 
-    err =  CreateSimpleHTTPMessage( kMIMEType_Binary, mfiSAPResponseDataPtr, mfiSAPResponseDataLen, &httpResponse, &httpResponseLen );
+    err = SocketSendHTTPResponse( connected_socket, kStatusOK, kMIMEType_Binary, mfiSAPResponseDataPtr, mfiSAPResponseDataLen );
     require_noerr( err, exit );
-    require( httpResponse, exit );
-
-    sentNum = send( connected_socket, httpResponse, httpResponseLen,0 );
-    require( sentNum==(ssize_t)httpResponseLen, exit );
-    wac_log("Auth response sent, len= %d", sentNum);
+    wac_log("Auth response sent, len= %d", (int)mfiSAPResponseDataLen);
 
     *inState = eState_WaitingForConfigMessage;
-    return err;
 
 
 exit:
     if ( mfiSAPResponseDataPtr ) free( mfiSAPResponseDataPtr );
-    if ( httpResponse ) free( httpResponse );
-    return err;
-}
-
-static OSStatus _HandleState_WaitingForConfigMessage( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext )
-{
-    wac_log_trace();
-    OSStatus err = kNoErr;
-
-    // Check that the HTTP URL is the config URL
-    err = HTTPHeaderMatchURL( inHeader, kWACURLConfig );
-    require_noerr_action( err, exit, wac_log("ERROR: received different URL. Expecting: %s", kWACURLConfig); err = kOrderErr );
-
-    wac_log("%s received", kWACURLConfig);
-
-    *inState = eState_HandleConfigMessage;
-
-exit:
     return err;
 }
 
@@ -404,12 +374,6 @@ static OSStatus _HandleState_HandleConfigMessage( HTTPHeader_t* inHeader, _WACSt
     wac_log_trace();
     OSStatus err = kParamErr;
 
-    uint8_t *httpResponse = NULL;
-    size_t httpResponseLen = 0;
-
-
-    ssize_t sentNum;
-
     // Remove the WAC bonjour service
     // err = RemoveWACBonjourService( inContext );
     // require_noerr( err, exit );
@@ -463,26 +427,23 @@ static OSStatus _HandleState_HandleConfigMessage( HTTPHeader_t* inHeader, _WACSt
                               eaTLVResponseLen,         // Length of data to encrypt
                               encryptedConfigData );    // Encrypted data destination pointer
 
-        err = CreateSimpleHTTPMessage( kMIMEType_TLV8,      // MIME type of message
-                                       encryptedConfigData, // encrypted data to send
-                                       eaTLVResponseLen,    // length of data to send
-                                       &httpResponse,       // pointer to http response
-                                       &httpResponseLen );  // length of http response
+        wac_log("Sending EA /config response");
+        err = SocketSendHTTPResponse( connected_socket,    // socket of the client
+                                      kStatusOK,           // status of the response
+                                      kMIMEType_TLV8,      // MIME type of message
+                                      encryptedConfigData, // encrypted data to send
+                                      eaTLVResponseLen );  // length of data to send
 
         free( encryptedConfigData );
         free( eaTLVResponse );
-        wac_log("Sending EA /config response");
     }
     else
     {
-        err = CreateSimpleHTTPOKMessage( &httpResponse, &httpResponseLen );
         wac_log("Sending simple (non-EA) /config response");
+        err = SocketSendHTTPResponse( connected_socket, kStatusOK, NULL, NULL, 0 );
     }
     require_noerr( err, exit );
-
-    sentNum = send( connected_socket, httpResponse, httpResponseLen,0 );
-    require( sentNum==(ssize_t)httpResponseLen, exit );
-    wac_log("Config response sent, len= %d", sentNum);
+    wac_log("Config response sent");
 
     *inState = eState_WaitingTCPFINMessage;
 
@@ -495,51 +456,23 @@ static OSStatus _HandleState_HandleConfigMessage( HTTPHeader_t* inHeader, _WACSt
 
 exit:
     //if ( inContext->httpServer ) free( inContext->httpServer );
-    // malloc'd by CreateSimpleHTTPOKMessage()
-    if ( httpResponse ) free( httpResponse );
 
     return err;
 }
 
-static OSStatus _HandleState_WaitingForConfiguredMessage( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext )
-{
-    wac_log_trace();
-    OSStatus err = kNoErr;
-
-    require( inHeader, exit );
-
-    // Check that the HTTP URL is the configured URL
-    err = HTTPHeaderMatchURL( inHeader, kWACURLConfigured );
-    require_noerr_action( err, exit, wac_log("ERROR: received different URL. Expecting: %s", kWACURLConfigured); err = kOrderErr );
-
-    wac_log("%s received", kWACURLConfigured);
-
-    *inState = eState_HandleConfiguredMessage;
-
-exit:
-    return err;
-}
-
 static OSStatus _HandleState_HandleConfiguredMessage( HTTPHeader_t* inHeader, _WACState_t *inState, mico_Context_t * const inContext )
 {
     wac_log_trace();
     OSStatus err = kUnknownErr;
-    ssize_t sentNum;
-
-    uint8_t *httpResponse = NULL;
-    size_t httpResponseLen = 0;
 
     require( inHeader, exit );
 
     // Remove the WAC bonjour service
     suspend_bonjour_service(ENABLE);
 
-    err = CreateSimpleHTTPOKMessage( &httpResponse, &httpResponseLen );
+    err = SocketSendHTTPResponse( connected_socket, kStatusOK, NULL, NULL, 0 );
     require_noerr( err, exit );
-
-    sentNum = send( connected_socket, httpResponse, httpResponseLen,0 );
-    require( sentNum==(ssize_t)httpResponseLen, exit );
-    wac_log("Config response sent, len= %d", sentNum);
+    wac_log("Config response sent");
 
     //err = HTTPServerShutdownSocket( inContext->httpServer );
     //require_noerr( err, exit );
@@ -551,15 +484,17 @@ static OSStatus _HandleState_HandleConfiguredMessage( HTTPHeader_t* inHeader, _W
 
     *inState = eState_Complete;
 
+    mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+    seqlock_write_begin(&inContext->flashContentInRam_seqlock);
     inContext->flashContentInRam.micoSystemConfig.configured = allConfigured;
+    seqlock_write_end(&inContext->flashContentInRam_seqlock);
     MICOUpdateConfiguration(inContext);
+    mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
     inContext->micoStatus.sys_state = eState_Software_Reset;
     require(inContext->micoStatus.sys_state_change_sem, exit);
     mico_rtos_set_semaphore(&inContext->micoStatus.sys_state_change_sem);
 
 exit:
-    // malloc'd by CreateSimpleHTTPOKMessage()
-    if ( httpResponse ) free( httpResponse );
     return err;
 }
 
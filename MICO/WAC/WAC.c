@@ -169,12 +169,14 @@ void WACNotify_WiFIParaChangedHandler(apinfo_adv_t *ap_info, char *key, int key_
   wac_log_trace();
   require(inContext, exit);
   mico_rtos_lock_mutex(&inContext->flashContentInRam_mutex);
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   memcpy(inContext->flashContentInRam.micoSystemConfig.ssid, ap_info->ssid, maxSsidLen);
   memcpy(inContext->flashContentInRam.micoSystemConfig.bssid, ap_info->bssid, 6);
   inContext->flashContentInRam.micoSystemConfig.channel = ap_info->channel;
   inContext->flashContentInRam.micoSystemConfig.security = ap_info->security;
   memcpy(inContext->flashContentInRam.micoSystemConfig.key, key, maxKeyLen);
   inContext->flashContentInRam.micoSystemConfig.keyLength = key_len;
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
   mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
 exit:
   return;
@@ -388,9 +390,12 @@ OSStatus applyNewConfiguration(char* destinationSSID, char *destinationPSK, char
   WAC_NetConfig.dhcpMode = DHCP_Client;
   WAC_NetConfig.wifi_retry_interval = 100;
 
+  seqlock_write_begin(&inContext->flashContentInRam_seqlock);
   memcpy(inContext->flashContentInRam.micoSystemConfig.name, accessoryName, maxNameLen);
   inContext->flashContentInRam.micoSystemConfig.name[maxNameLen-1] = 0x0;
   inContext->flashContentInRam.micoSystemConfig.dhcpEnable = true;
+  inContext->flashContentInRam.micoSystemConfig.seed ++;
+  seqlock_write_end(&inContext->flashContentInRam_seqlock);
 
   mico_rtos_unlock_mutex(&inContext->flashContentInRam_mutex);
   
@@ -399,7 +404,6 @@ OSStatus applyNewConfiguration(char* destinationSSID, char *destinationPSK, char
   uap_stop();
   msleep(200);
   StartAdvNetwork(&WAC_NetConfig);
-  inContext->flashContentInRam.micoSystemConfig.seed ++;
   _mfi_bonjour_init(App_Available, Station, inContext);
   return kNoErr;
 
@@ -75,6 +75,13 @@
 #define BACKUP_PARA_END_ADDRESS     (uint32_t)0x0800BFFF
 #define BACKUP_PARA_FLASH_SIZE      (BACKUP_PARA_END_ADDRESS - BACKUP_PARA_START_ADDRESS + 1)
 
+/* Optional store-and-forward log, shares the last sector of the update area.
+   OTA images must stay below STORE_FORWARD_START_ADDRESS while it is used. */
+#define STORE_FORWARD_START_ADDRESS (uint32_t)0x080A0000
+#define STORE_FORWARD_END_ADDRESS   (uint32_t)0x080BFFFF
+#define STORE_FORWARD_FLASH_SIZE    (STORE_FORWARD_END_ADDRESS - STORE_FORWARD_START_ADDRESS + 1)
+#define STORE_FORWARD_OTA_MAX_LEN   (STORE_FORWARD_START_ADDRESS - UPDATE_START_ADDRESS)
+
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 //---------------------------------------------------------------------------------------------------------------------------
@@ -26,13 +26,34 @@
 #include "Platform.h"
 #include "RingBufferUtils.h"
 
+#define UART_WAKEUP_IDLE_PERIOD   1000
+
+/* With flow control, RTS tells the peer to stop once the RX ring is this
+   full and to resume once it drained. The headroom above the high water
+   mark absorbs what the peer sends before it reacts. */
+#define UART_RX_HIGH_WATER        (UART_RX_BUF_SIZE * 3 / 4)
+#define UART_RX_LOW_WATER         (UART_RX_BUF_SIZE / 4)
+
+/* Time given to the reader to empty the RX ring before a reconfiguration,
+   whatever is left after that is dropped */
+#define UART_RECONFIG_DRAIN_TIME  500
+
+/* Time a send may take on top of its bytes at the line rate, with flow
+   control this is how long the peer may hold CTS before the send is aborted */
+#define UART_TX_MARGIN            500
+#define UART_TX_CTS_MARGIN        1000
+
 uint32_t rx_size = 0;
 static  mico_semaphore_t tx_complete, rx_complete; 
 
 static  mico_semaphore_t wakeup; 
-static mico_thread_t uart_wakeup_thread_handler;
-static void uart_wakeup_thread(void *arg);
+static mico_timed_event_t uart_wakeup_event;
+static OSStatus uart_wakeup_event_handler(void *arg);
 static mico_mutex_t _uart_send_mutex = NULL;
+static bool _flow_control = false;
+static uint32_t _baud_rate = 115200;
+static volatile bool _rx_throttled = false;
+static volatile bool _reconfiguring = false;
 
 uint8_t rx_data[UART_RX_BUF_SIZE];
 ring_buffer_t rx_buffer;
@@ -40,12 +61,71 @@ ring_buffer_t rx_buffer;
 static uint8_t platform_uart_receive_bytes(void* data, uint32_t size);
 void _Rx_irq_handler(void *arg);
 
+/* RTS is active low, high asks the peer to stop sending */
+static void _rx_throttle(bool inThrottle)
+{
+  _rx_throttled = inThrottle;
+  if(inThrottle)
+    GPIO_SetBits(USARTx_RTS_GPIO_PORT, USARTx_RTS_PIN);
+  else
+    GPIO_ResetBits(USARTx_RTS_GPIO_PORT, USARTx_RTS_PIN);
+}
+
+/* Program the USART and the flow control pins from the application's
+   configuration, the RX DMA stream is left alone */
+static void _usart_setup(mico_Context_t * const inContext)
+{
+  GPIO_InitTypeDef GPIO_InitStructure;
+  USART_InitTypeDef USART_InitStructure;
+  application_config_t *config = &inContext->flashContentInRam.appConfig;
+
+  /* CTS is handled by the USART, RTS follows the RX ring level since the
+     DMA keeps the data register empty and the USART would never raise it */
+  _flow_control = config->USART_FlowControl;
+  if(_flow_control){
+    GPIO_CLK_INIT(USARTx_CTS_GPIO_CLK, ENABLE);
+    GPIO_CLK_INIT(USARTx_RTS_GPIO_CLK, ENABLE);
+    GPIO_PinAFConfig(USARTx_CTS_GPIO_PORT, USARTx_CTS_SOURCE, USARTx_CTS_AF);
+    GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+    GPIO_InitStructure.GPIO_Pin = USARTx_CTS_PIN;
+    GPIO_Init(USARTx_CTS_GPIO_PORT, &GPIO_InitStructure);
+
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_OUT;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+    GPIO_InitStructure.GPIO_Pin = USARTx_RTS_PIN;
+    GPIO_Init(USARTx_RTS_GPIO_PORT, &GPIO_InitStructure);
+    _rx_throttle(false);
+  }
+
+  USART_DeInit(USARTx);
+  USART_InitStructure.USART_BaudRate = config->USART_BaudRate;
+  if(config->USART_BaudRate != 0)
+    _baud_rate = config->USART_BaudRate;
+  /* The parity bit takes the place of the 9th data bit */
+  USART_InitStructure.USART_WordLength = (config->USART_Parity == UART_PARITY_NONE) ? USART_WordLength_8b : USART_WordLength_9b;
+  USART_InitStructure.USART_StopBits = (config->USART_StopBits == 2) ? USART_StopBits_2 : USART_StopBits_1;
+  if(config->USART_Parity == UART_PARITY_ODD)
+    USART_InitStructure.USART_Parity = USART_Parity_Odd;
+  else if(config->USART_Parity == UART_PARITY_EVEN)
+    USART_InitStructure.USART_Parity = USART_Parity_Even;
+  else
+    USART_InitStructure.USART_Parity = USART_Parity_No;
+  USART_InitStructure.USART_HardwareFlowControl = _flow_control ? USART_HardwareFlowControl_CTS : USART_HardwareFlowControl_None;
+  USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
+  USART_Init(USARTx, &USART_InitStructure);
+
+  USART_Cmd(USARTx, ENABLE);
+  USART_DMACmd(USARTx, USART_DMAReq_Rx | USART_DMAReq_Tx, ENABLE);
+}
+
 
 
 OSStatus PlatformUartInitialize( mico_Context_t * const inContext )
 {
   GPIO_InitTypeDef GPIO_InitStructure;
-  USART_InitTypeDef USART_InitStructure;
   NVIC_InitTypeDef NVIC_InitStructure;
   DMA_InitTypeDef  DMA_InitStructure;
   
@@ -99,20 +179,10 @@ OSStatus PlatformUartInitialize( mico_Context_t * const inContext )
   if(inContext->flashContentInRam.micoSystemConfig.mcuPowerSaveEnable){
     gpio_irq_enable(USARTx_RX_GPIO_PORT, USARTx_IRQ_PIN, IRQ_TRIGGER_FALLING_EDGE, _Rx_irq_handler, 0);
     mico_rtos_init_semaphore(&wakeup, 1);
-    mico_rtos_create_thread(&uart_wakeup_thread_handler, MICO_APPLICATION_PRIORITY, "UART_WAKEUP", uart_wakeup_thread, 0x500, inContext );
+    mico_rtos_register_timed_event(&uart_wakeup_event, MICO_DEFAULT_WORKER_THREAD, uart_wakeup_event_handler, UART_WAKEUP_IDLE_PERIOD, inContext );
   }
   
-  USART_DeInit(USARTx);
-  USART_InitStructure.USART_BaudRate = inContext->flashContentInRam.appConfig.USART_BaudRate;
-  USART_InitStructure.USART_WordLength = USART_WordLength_8b;
-  USART_InitStructure.USART_StopBits = USART_StopBits_1 ;
-  USART_InitStructure.USART_Parity = USART_Parity_No;
-  USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
-  USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
-  USART_Init(USARTx, &USART_InitStructure);
-  
-  USART_Cmd(USARTx, ENABLE);
-  USART_DMACmd(USARTx, USART_DMAReq_Rx | USART_DMAReq_Tx, ENABLE);
+  _usart_setup(inContext);
   
   
   DMA_DeInit( UART_RX_DMA_Stream );
@@ -141,6 +211,45 @@ OSStatus PlatformUartInitialize( mico_Context_t * const inContext )
   return kNoErr;
 }
 
+OSStatus PlatformUartReconfigure( mico_Context_t * const inContext )
+{
+  OSStatus err = kNoErr;
+  bool wasFlowControl = _flow_control;
+  uint32_t start;
+
+  require_action(_uart_send_mutex, exit, err = kNotInitializedErr);
+  /* Waits for the write in progress and keeps new ones off the line */
+  mico_rtos_lock_mutex(&_uart_send_mutex);
+  mico_mcu_powersave_config(false);
+
+  /* The ring restarts from its beginning, let the reader empty it first */
+  _reconfiguring = true;
+  if(_flow_control)
+    _rx_throttle(true);
+  start = mico_get_time();
+  while(ring_buffer_used_space( &rx_buffer ) != 0 && mico_get_time() - start < UART_RECONFIG_DRAIN_TIME)
+    mico_thread_msleep(10);
+
+  USART_ITConfig( USARTx, USART_IT_RXNE, DISABLE );
+  UART_RX_DMA_Stream->CR &= ~DMA_SxCR_EN;
+  while( ( UART_RX_DMA_Stream->CR & DMA_SxCR_EN ) != 0 );
+  rx_buffer.head = 0;
+  rx_buffer.tail = 0;
+
+  _usart_setup(inContext);
+  platform_uart_receive_bytes( rx_buffer.buffer, rx_buffer.size);
+
+  _reconfiguring = false;
+  if(wasFlowControl || _flow_control)
+    _rx_throttle(false);
+
+  mico_mcu_powersave_config(true);
+  mico_rtos_unlock_mutex(&_uart_send_mutex);
+
+exit:
+  return err;
+}
+
 void _Rx_irq_handler(void *arg)
 {
   (void)arg;
@@ -158,6 +267,7 @@ OSStatus PlatformUartSend(uint8_t *inSendBuf, uint32_t inBufLen)
 {
   DMA_InitTypeDef  DMA_InitStructure;
   OSStatus err = kNoErr;
+  uint32_t timeout;
   
   require_action(_uart_send_mutex, exit, err  = kNotInitializedErr);  
   mico_rtos_lock_mutex(&_uart_send_mutex);
@@ -195,8 +305,19 @@ OSStatus PlatformUartSend(uint8_t *inSendBuf, uint32_t inBufLen)
   /* Enable the DMA TX Stream, USART will start sending the command code (2bytes) */
   DMA_Cmd(UART_TX_DMA_Stream, ENABLE);
   
-  mico_rtos_get_semaphore(&tx_complete, 500);
-  while( ( USARTx->SR & USART_SR_TC )== 0 );
+  /* 12 bits a byte covers parity and two stop bits */
+  timeout = inBufLen * 12 * 1000 / _baud_rate + (_flow_control ? UART_TX_CTS_MARGIN : UART_TX_MARGIN);
+  if(mico_rtos_get_semaphore(&tx_complete, timeout) == kNoErr){
+    while( ( USARTx->SR & USART_SR_TC )== 0 );
+  }else{
+    /* Stopping the stream raises TCIF, keep it from releasing the next send */
+    DMA_ITConfig(UART_TX_DMA_Stream, DMA_IT_TC, DISABLE );
+    DMA_Cmd(UART_TX_DMA_Stream, DISABLE);
+    while( ( UART_TX_DMA_Stream->CR & DMA_SxCR_EN ) != 0 );
+    UART_TX_DMA->HIFCR |= UART_TX_DMA_TCIF;
+    mico_rtos_get_semaphore(&tx_complete, MICO_NO_WAIT);
+    err = kTimeoutErr;
+  }
   
   mico_mcu_powersave_config(true);
   mico_rtos_unlock_mutex(&_uart_send_mutex);
@@ -239,6 +360,9 @@ OSStatus PlatformUartRecv(uint8_t *inRecvBuf, uint32_t inBufLen, uint32_t inTime
       inRecvBuf = ( (uint8_t*) inRecvBuf + bytes_available );
       ring_buffer_consume( &rx_buffer, bytes_available );
     } while ( transfer_size != 0 );
+
+    if ( _rx_throttled && !_reconfiguring && ring_buffer_used_space( &rx_buffer ) <= UART_RX_LOW_WATER )
+      _rx_throttle(false);
   }
   
   if ( inBufLen != 0 ) {
@@ -289,6 +413,9 @@ void USARTx_IRQHandler( void )
   
   // Update tail
   rx_buffer.tail = rx_buffer.size - UART_RX_DMA_Stream->NDTR;
+
+  if ( _flow_control && !_rx_throttled && ring_buffer_used_space( &rx_buffer ) >= UART_RX_HIGH_WATER )
+    _rx_throttle(true);
   
   // Notify thread if sufficient data are available
   if ( ( rx_size > 0 ) && ( ring_buffer_used_space( &rx_buffer ) >= rx_size ))
@@ -301,17 +428,17 @@ void USARTx_IRQHandler( void )
   #endif  
 }
 
-static void uart_wakeup_thread(void *arg)
+/* Re-arm the wakeup pin and allow powersave once RX has been quiet for a whole period */
+static OSStatus uart_wakeup_event_handler(void *arg)
 {
   mico_Context_t *inContext = arg;
 
-  while(1){
-    if(mico_rtos_get_semaphore(&wakeup, 1000) != kNoErr){
-      gpio_irq_enable(USARTx_RX_GPIO_PORT, USARTx_IRQ_PIN, IRQ_TRIGGER_FALLING_EDGE, _Rx_irq_handler, 0);
-      if(inContext->flashContentInRam.micoSystemConfig.mcuPowerSaveEnable == true)
-        mico_mcu_powersave_config(true);
-    }
+  if(mico_rtos_get_semaphore(&wakeup, MICO_NO_WAIT) != kNoErr){
+    gpio_irq_enable(USARTx_RX_GPIO_PORT, USARTx_IRQ_PIN, IRQ_TRIGGER_FALLING_EDGE, _Rx_irq_handler, 0);
+    if(inContext->flashContentInRam.micoSystemConfig.mcuPowerSaveEnable == true)
+      mico_mcu_powersave_config(true);
   }
+  return kNoErr;
 }
 
 size_t PlatformUartRecvedDataLen(void)
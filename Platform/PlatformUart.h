@@ -28,17 +28,33 @@
 #include "Common.h"
 #include "MICODefine.h"
 
+/* Values of the application's USART_Parity setting */
+typedef enum {
+  UART_PARITY_NONE,
+  UART_PARITY_ODD,
+  UART_PARITY_EVEN,
+} uart_parity_t;
+
 //---------------------------------------------------------------------------------------------------------------------------
 /*! @function   PlatformUartInitialize
     @abstract   Performs any platform-specific initialization needed. 
 */
 OSStatus PlatformUartInitialize( mico_Context_t * const inContext );
 
+//---------------------------------------------------------------------------------------------------------------------------
+/*! @function   PlatformUartReconfigure
+    @abstract   Apply the baud rate, framing and flow control settings without a reset.
+    @note       The write in progress is finished first, received data that is not read
+                within a short time is dropped.
+*/
+OSStatus PlatformUartReconfigure( mico_Context_t * const inContext );
+
 //---------------------------------------------------------------------------------------------------------------------------
 /*! @function   PlatformUartSend
     @abstract   Send data from UART interface 
     @param      inSendBuf: start address of data
     @param      inBufLen:  data length
+    @result     kTimeoutErr if the bytes did not go out in time, e.g. the peer held CTS
 */
 OSStatus PlatformUartSend(uint8_t *inSendBuf, uint32_t inBufLen);
 